@@ -0,0 +1,115 @@
+/**
+ * A resettable arena (bump) allocator for temporaries which all become
+ * garbage at the same time, e.g. at the end of each iteration of a receive or
+ * publish loop.
+ *
+ * Memory is handed out from a list of blocks. Resetting the arena makes all
+ * of the blocks available again without freeing them so, once the arena has
+ * grown to fit the largest iteration, no further heap allocations are made.
+ */
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qth_client.h"
+
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t capacity;
+	size_t used;
+	alignas(max_align_t) char data[];
+} arena_block_t;
+
+struct arena {
+	size_t block_size;
+	
+	// All blocks (in the order they were allocated) and the one currently
+	// being allocated from (earlier blocks are full)
+	arena_block_t *first;
+	arena_block_t *current;
+};
+
+
+/**
+ * Create an empty arena which allocates memory in blocks of (at least)
+ * 'block_size' bytes. Must be freed with arena_free.
+ */
+arena_t *arena_new(size_t block_size) {
+	arena_t *arena = calloc(1, sizeof(arena_t));
+	arena->block_size = block_size;
+	return arena;
+}
+
+
+/**
+ * Allocate 'size' bytes (suitably aligned for any type) which remain valid
+ * until the arena is next reset or freed.
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+	size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	
+	// Use the first block (from the current one onward) with enough space
+	arena_block_t *block = arena->current;
+	while (block && block->capacity - block->used < size) {
+		block = block->next;
+	}
+	
+	if (!block) {
+		size_t capacity = size > arena->block_size ? size : arena->block_size;
+		block = malloc(sizeof(arena_block_t) + capacity);
+		block->next = NULL;
+		block->capacity = capacity;
+		block->used = 0;
+		
+		// Append to the list
+		arena_block_t **last = &arena->first;
+		while (*last) {
+			last = &(*last)->next;
+		}
+		*last = block;
+	}
+	
+	// NB: Blocks skipped over are left partly unused until the next reset
+	arena->current = block;
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+
+/**
+ * Copy 'len' bytes of a string into the arena, adding a null terminator.
+ */
+char *arena_copyn(arena_t *arena, const char *str, size_t len) {
+	char *out = arena_alloc(arena, len + 1);
+	memcpy(out, str, len);
+	out[len] = '\0';
+	return out;
+}
+
+
+/**
+ * Discard everything allocated from the arena, keeping its blocks for reuse.
+ */
+void arena_reset(arena_t *arena) {
+	for (arena_block_t *block = arena->first; block; block = block->next) {
+		block->used = 0;
+	}
+	arena->current = arena->first;
+}
+
+
+/**
+ * Free an arena and everything allocated from it.
+ */
+void arena_free(arena_t *arena) {
+	arena_block_t *block = arena->first;
+	while (block) {
+		arena_block_t *next = block->next;
+		free(block);
+		block = next;
+	}
+	free(arena);
+}
@@ -0,0 +1,165 @@
+/**
+ * Offline benchmark of formatting received values, as 'watch' does, with
+ * different numbers of --format-threads.
+ *
+ * Usage: bench_format [PAYLOADS]
+ *
+ * PAYLOADS is a file of captured values, one per line (e.g. the output of
+ * 'qth watch -v -c 1000 TOPIC'). If not given, a set of large synthetic
+ * values is used. Each value is parsed and pretty-printed (the parse being
+ * done by the receiving thread and the formatting by the pool, just as in
+ * watch) and the throughput is reported for each number of threads, 0 being
+ * formatting inline without a pool.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+#include "qth_client.h"
+
+// The number of values formatted for each number of threads
+#define BENCH_NUM_VALUES 20000
+
+// The numbers of threads tried
+static const int bench_threads[] = {0, 1, 2, 4, 8};
+
+
+/**
+ * Generate a synthetic value: an array of 'n' objects of a few fields each.
+ */
+static char *bench_synthetic_value(int n, int seed) {
+	size_t len = 64 + n * 96;
+	char *out = malloc(len);
+	size_t pos = snprintf(out, len, "[");
+	for (int i = 0; i < n; i++) {
+		pos += snprintf(out + pos, len - pos,
+		                "%s{\"id\": %d, \"name\": \"sensor-%d\", "
+		                "\"value\": %.3f, \"ok\": %s}",
+		                i ? ", " : "", i, seed + i, (seed * 31 + i) * 0.125,
+		                (i % 3) ? "true" : "false");
+	}
+	snprintf(out + pos, len - pos, "]");
+	return out;
+}
+
+
+/**
+ * Read one value per (non-empty) line of a file.
+ */
+static char **bench_read_payloads(const char *filename, int *num_payloads) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	
+	int capacity = 64;
+	char **payloads = malloc(sizeof(char *) * capacity);
+	*num_payloads = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_size, f)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (*num_payloads == capacity) {
+			capacity *= 2;
+			payloads = realloc(payloads, sizeof(char *) * capacity);
+		}
+		payloads[(*num_payloads)++] = alloced_copyn(line, len);
+	}
+	free(line);
+	fclose(f);
+	return payloads;
+}
+
+
+int main(int argc, char *argv[]) {
+	char **payloads;
+	int num_payloads;
+	if (argc > 1) {
+		payloads = bench_read_payloads(argv[1], &num_payloads);
+	} else {
+		num_payloads = 64;
+		payloads = malloc(sizeof(char *) * num_payloads);
+		for (int i = 0; i < num_payloads; i++) {
+			payloads[i] = bench_synthetic_value(50 + (i % 8) * 25, i);
+		}
+	}
+	if (num_payloads == 0) {
+		fprintf(stderr, "No payloads to format.\n");
+		return 1;
+	}
+	
+	size_t total_bytes = 0;
+	for (int i = 0; i < BENCH_NUM_VALUES; i++) {
+		total_bytes += strlen(payloads[i % num_payloads]);
+	}
+	
+	printf("%d values (%.1f MB) of %d distinct payloads\n",
+	       BENCH_NUM_VALUES, total_bytes / 1e6, num_payloads);
+	printf("threads  values/s     MB/s\n");
+	for (size_t t = 0; t < sizeof(bench_threads) / sizeof(bench_threads[0]); t++) {
+		int num_threads = bench_threads[t];
+		format_pool_t *pool = NULL;
+		if (num_threads > 0) {
+			pool = format_pool_new(num_threads, JSON_FORMAT_PRETTY, NULL);
+		}
+		
+		uint64_t start_ns = monotonic_ns();
+		for (int i = 0; i < BENCH_NUM_VALUES; i++) {
+			const char *payload = payloads[i % num_payloads];
+			json_object *value;
+			char *err = json_parse(payload, -1, &value);
+			if (err) {
+				fprintf(stderr, "Invalid payload: %s\n", err);
+				return 1;
+			}
+			
+			char *topic;
+			char *out;
+			if (!pool) {
+				out = json_object_to_format(value, JSON_FORMAT_PRETTY);
+				free(out);
+				json_object_put(value);
+				continue;
+			}
+			if (format_pool_full(pool) && format_pool_next(pool, true, &topic, &out)) {
+				free(topic);
+				free(out);
+			}
+			format_pool_submit(pool, "bench", value, payload, strlen(payload));
+			while (format_pool_next(pool, false, &topic, &out)) {
+				free(topic);
+				free(out);
+			}
+		}
+		if (pool) {
+			char *topic;
+			char *out;
+			while (format_pool_next(pool, true, &topic, &out)) {
+				free(topic);
+				free(out);
+			}
+			format_pool_free(pool);
+		}
+		double seconds = (monotonic_ns() - start_ns) / 1e9;
+		
+		printf("%7d  %8.0f  %7.1f\n", num_threads,
+		       BENCH_NUM_VALUES / seconds, total_bytes / seconds / 1e6);
+	}
+	
+	for (int i = 0; i < num_payloads; i++) {
+		free(payloads[i]);
+	}
+	free(payloads);
+	return 0;
+}
@@ -0,0 +1,319 @@
+/**
+ * Benchmark of MQTT 5 (with topic aliases) against MQTT 3.1.1: the bytes sent
+ * over the network and the latency of delivering values to a watcher.
+ *
+ * Usage: bench_mqtt5 [URL]
+ *
+ * URL is that of the broker to use (default tcp://localhost:1883). If no
+ * broker can be reached, the benchmark is skipped.
+ *
+ * For each protocol, a publisher and a watcher are connected through a TCP
+ * proxy run by the benchmark itself, which counts the bytes passed in each
+ * direction. The publisher then sends values to a few topics in turn, each
+ * being received by the watcher before the next is sent, and the bytes per
+ * value and the time from publishing to receipt are reported.
+ */
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The number of values published (after one to each topic to warm up)
+#define BENCH_NUM_VALUES 5000
+
+// The number of topics the values are spread over. NB: Mosquitto only allows
+// 10 topic aliases per client by default.
+#define BENCH_NUM_TOPICS 8
+
+// How long to wait for each value to arrive (ms)
+#define BENCH_TIMEOUT 5000
+
+// A proxy between the clients and the broker
+typedef struct {
+	int listen_fd;
+	int port;
+	
+	// The broker's address
+	const char *host;
+	const char *broker_port;
+	
+	// Bytes passed from the clients to the broker and back
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+} bench_proxy_t;
+
+// A proxied connection
+typedef struct {
+	bench_proxy_t *proxy;
+	int client_fd;
+} bench_proxy_conn_t;
+
+
+/**
+ * Connect to the broker, returning a socket or -1 on failure.
+ */
+static int bench_connect_broker(const char *host, const char *port) {
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addrs;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *addr = addrs; addr && fd < 0; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	return fd;
+}
+
+
+/**
+ * Forward a client's connection to the broker (and back), counting the bytes,
+ * until either side closes it.
+ */
+static void *bench_proxy_conn_thread(void *conn_void) {
+	bench_proxy_conn_t *conn = conn_void;
+	bench_proxy_t *proxy = conn->proxy;
+	int fds[2] = {conn->client_fd,
+	              bench_connect_broker(proxy->host, proxy->broker_port)};
+	uint64_t *counts[2] = {&proxy->bytes_up, &proxy->bytes_down};
+	free(conn);
+	
+	bool closed = fds[1] < 0;
+	while (!closed) {
+		struct pollfd pfds[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+		if (poll(pfds, 2, -1) < 0) {
+			break;
+		}
+		for (int i = 0; i < 2 && !closed; i++) {
+			if (pfds[i].revents) {
+				char buf[16 * 1024];
+				ssize_t len = read(fds[i], buf, sizeof(buf));
+				closed = len <= 0 || write(fds[!i], buf, len) != len;
+				if (!closed) {
+					__atomic_add_fetch(counts[i], len, __ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+	
+	close(fds[0]);
+	if (fds[1] >= 0) {
+		close(fds[1]);
+	}
+	return NULL;
+}
+
+
+/**
+ * Accept connections to the proxy, forever.
+ */
+static void *bench_proxy_thread(void *proxy_void) {
+	bench_proxy_t *proxy = proxy_void;
+	while (true) {
+		int fd = accept(proxy->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		bench_proxy_conn_t *conn = malloc(sizeof(bench_proxy_conn_t));
+		conn->proxy = proxy;
+		conn->client_fd = fd;
+		pthread_t thread;
+		pthread_create(&thread, NULL, bench_proxy_conn_thread, conn);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+
+/**
+ * Start a proxy to the broker on a free local port. Returns false on failure.
+ */
+static bool bench_proxy_start(bench_proxy_t *proxy) {
+	proxy->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t addr_len = sizeof(addr);
+	if (bind(proxy->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(proxy->listen_fd, 8) != 0 ||
+	    getsockname(proxy->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+		perror("proxy");
+		return false;
+	}
+	proxy->port = ntohs(addr.sin_port);
+	
+	pthread_t thread;
+	pthread_create(&thread, NULL, bench_proxy_thread, proxy);
+	pthread_detach(thread);
+	return true;
+}
+
+
+static int compare_uint64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * Publish each value and wait for it to be received, recording the latency
+ * of each in 'latencies' (ns). Returns false on failure.
+ */
+static bool bench_values(MQTTClient *publisher, MQTTClient *watcher,
+                         char topics[][64], int num_values, uint64_t *latencies) {
+	for (int i = 0; i < num_values; i++) {
+		const char *topic = topics[i % BENCH_NUM_TOPICS];
+		char payload[32];
+		int payload_len = snprintf(payload, sizeof(payload), "%.1f",
+		                           15 + (i % 100) * 0.1);
+		
+		uint64_t start_ns = monotonic_ns();
+		if (qth_publish(publisher, topic, payload_len, payload, 0, false, NULL) !=
+		    MQTTCLIENT_SUCCESS) {
+			fprintf(stderr, "Error: Couldn't publish.\n");
+			return false;
+		}
+		
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		if (qth_receive(watcher, &rx_topic, &rx_topic_len, &message,
+		                BENCH_TIMEOUT) != MQTTCLIENT_SUCCESS || !message) {
+			fprintf(stderr, "Error: Value not received.\n");
+			return false;
+		}
+		bool ok = strcmp(rx_topic, topic) == 0;
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+		if (!ok) {
+			fprintf(stderr, "Error: Value received on the wrong topic.\n");
+			return false;
+		}
+		
+		if (latencies) {
+			latencies[i] = monotonic_ns() - start_ns;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Run the benchmark with one protocol version. Returns 0 on success, 1 on
+ * failure or -1 if the broker couldn't be reached.
+ */
+static int bench_protocol(bench_proxy_t *proxy, bool mqtt5) {
+	char url[64];
+	snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", proxy->port);
+	
+	// Topics of a typical length for Qth
+	char topics[BENCH_NUM_TOPICS][64];
+	for (int i = 0; i < BENCH_NUM_TOPICS; i++) {
+		snprintf(topics[i], sizeof(topics[i]),
+		         "bench/qth-mqtt5/house/room-%d/sensors/temperature", i);
+	}
+	
+	MQTTClient publisher;
+	MQTTClient watcher;
+	char *err = qth_connect(&watcher, url, "qth-bench-mqtt5-watcher", 10, NULL,
+	                        mqtt5, false);
+	if (err) {
+		free(err);
+		return -1;
+	}
+	err = qth_connect(&publisher, url, "qth-bench-mqtt5-publisher", 10, NULL,
+	                  mqtt5, false);
+	if (err) {
+		free(err);
+		qth_disconnect(&watcher, true, 1000);
+		return -1;
+	}
+	
+	int return_code = 1;
+	uint64_t *latencies = malloc(sizeof(uint64_t) * BENCH_NUM_VALUES);
+	if (qth_subscribe(watcher, "bench/qth-mqtt5/#", 0, 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Couldn't subscribe.\n");
+	} else if (bench_values(publisher, watcher, topics, BENCH_NUM_TOPICS, NULL)) {
+		// Count only once every topic has been published to (and so given an
+		// alias)
+		uint64_t bytes_up = __atomic_load_n(&proxy->bytes_up, __ATOMIC_RELAXED);
+		uint64_t bytes_down = __atomic_load_n(&proxy->bytes_down, __ATOMIC_RELAXED);
+		if (bench_values(publisher, watcher, topics, BENCH_NUM_VALUES, latencies)) {
+			bytes_up = __atomic_load_n(&proxy->bytes_up, __ATOMIC_RELAXED) - bytes_up;
+			bytes_down = __atomic_load_n(&proxy->bytes_down, __ATOMIC_RELAXED) - bytes_down;
+			
+			qsort(latencies, BENCH_NUM_VALUES, sizeof(uint64_t), compare_uint64);
+			uint64_t total_ns = 0;
+			for (int i = 0; i < BENCH_NUM_VALUES; i++) {
+				total_ns += latencies[i];
+			}
+			printf("%-8s  %10.1f  %12.1f  %7.1f  %6.1f  %6.1f\n",
+			       mqtt5 ? "5" : "3.1.1",
+			       (double)bytes_up / BENCH_NUM_VALUES,
+			       (double)bytes_down / BENCH_NUM_VALUES,
+			       total_ns / 1e3 / BENCH_NUM_VALUES,
+			       latencies[BENCH_NUM_VALUES / 2] / 1e3,
+			       latencies[BENCH_NUM_VALUES * 99 / 100] / 1e3);
+			return_code = 0;
+		}
+	}
+	
+	free(latencies);
+	qth_disconnect(&publisher, true, 1000);
+	qth_disconnect(&watcher, true, 1000);
+	return return_code;
+}
+
+
+int main(int argc, char *argv[]) {
+	const char *url = argc > 1 ? argv[1] : "tcp://localhost:1883";
+	
+	// Split 'tcp://HOST:PORT'
+	bench_proxy_t proxy = {0};
+	const char *host = strstr(url, "://") ? strstr(url, "://") + 3 : url;
+	const char *colon = strrchr(host, ':');
+	char *host_copy = alloced_copyn(host, colon ? (size_t)(colon - host) : strlen(host));
+	proxy.host = host_copy;
+	proxy.broker_port = colon ? colon + 1 : "1883";
+	if (!bench_proxy_start(&proxy)) {
+		return 1;
+	}
+	
+	printf("%d values to %d topics, QoS 0, via %s\n",
+	       BENCH_NUM_VALUES, BENCH_NUM_TOPICS, url);
+	printf("protocol  up B/value  down B/value  mean us  p50 us  p99 us\n");
+	for (int mqtt5 = 0; mqtt5 <= 1; mqtt5++) {
+		int result = bench_protocol(&proxy, mqtt5);
+		if (result < 0) {
+			printf("Skipped: couldn't connect to a broker at %s.\n", url);
+			break;
+		} else if (result > 0) {
+			free(host_copy);
+			return 1;
+		}
+	}
+	
+	free(host_copy);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Microbenchmark of matching topics against many topic filters, comparing the
+ * topic trie with testing each filter in turn using topic_matches_filter.
+ *
+ * Usage: bench_topic_trie
+ *
+ * A fixed pseudo-random mix of literal, '+' and '#' filters is matched
+ * against a set of topics. Both methods must find the same number of
+ * matches.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qth_client.h"
+
+// The number of filters added (some of which are duplicates)
+#define BENCH_NUM_FILTERS 10000
+
+// The number of topics matched against the filters
+#define BENCH_NUM_TOPICS 20000
+
+// The longest filter or topic generated (including the null terminator)
+#define BENCH_MAX_LEN 64
+
+
+/**
+ * Generate a filter: mostly literal topics, with some using '+' or '#'.
+ */
+static void bench_filter(char *out) {
+	switch (rand() % 10) {
+		case 0:
+			snprintf(out, BENCH_MAX_LEN, "home/+/dev%d/state", rand() % 500);
+			break;
+		case 1:
+			snprintf(out, BENCH_MAX_LEN, "home/room%d/#", rand() % 200);
+			break;
+		default:
+			snprintf(out, BENCH_MAX_LEN, "home/room%d/dev%d/state",
+			         rand() % 200, rand() % 500);
+			break;
+	}
+}
+
+
+int main(void) {
+	static char filters[BENCH_NUM_FILTERS][BENCH_MAX_LEN];
+	static char topics[BENCH_NUM_TOPICS][BENCH_MAX_LEN];
+	srand(1);
+	for (int i = 0; i < BENCH_NUM_FILTERS; i++) {
+		bench_filter(filters[i]);
+	}
+	for (int i = 0; i < BENCH_NUM_TOPICS; i++) {
+		snprintf(topics[i], BENCH_MAX_LEN, "home/room%d/dev%d/state",
+		         rand() % 200, rand() % 500);
+	}
+	
+	// The trie holds each distinct filter once so the linear scan is given
+	// the same (deduplicated) filters
+	topic_trie_t *trie = topic_trie_new();
+	for (int i = 0; i < BENCH_NUM_FILTERS; i++) {
+		topic_trie_add(trie, filters[i], (void *)(uintptr_t)(i + 1));
+	}
+	size_t num_distinct = 0;
+	static const char *distinct[BENCH_NUM_FILTERS];
+	strmap_t *seen = strmap_new();
+	for (int i = 0; i < BENCH_NUM_FILTERS; i++) {
+		if (!strmap_get(seen, filters[i])) {
+			strmap_set(seen, filters[i], filters[i]);
+			distinct[num_distinct++] = filters[i];
+		}
+	}
+	strmap_free(seen, NULL);
+	
+	uint64_t start_ns = monotonic_ns();
+	size_t trie_matches = 0;
+	for (int i = 0; i < BENCH_NUM_TOPICS; i++) {
+		trie_matches += topic_trie_match(trie, topics[i], NULL, NULL);
+	}
+	double trie_us = (monotonic_ns() - start_ns) / 1e3 / BENCH_NUM_TOPICS;
+	
+	start_ns = monotonic_ns();
+	size_t linear_matches = 0;
+	for (int i = 0; i < BENCH_NUM_TOPICS; i++) {
+		for (size_t j = 0; j < num_distinct; j++) {
+			linear_matches += topic_matches_filter(distinct[j], topics[i]);
+		}
+	}
+	double linear_us = (monotonic_ns() - start_ns) / 1e3 / BENCH_NUM_TOPICS;
+	
+	printf("%zu distinct filters, %d topics\n", num_distinct, BENCH_NUM_TOPICS);
+	printf("method  matches   us/topic\n");
+	printf("trie    %7zu  %9.2f\n", trie_matches, trie_us);
+	printf("linear  %7zu  %9.2f\n", linear_matches, linear_us);
+	
+	topic_trie_free(trie, NULL);
+	if (trie_matches != linear_matches) {
+		fprintf(stderr, "FAIL: the trie and linear scan disagree\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * Implementation of the call command: sends an event and waits for the
+ * corresponding reply on another topic.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+/**
+ * Implements the 'call' command: subscribes to the reply topic, sends the
+ * request event and then prints the first reply received. If 'correlate' is
+ * given, only replies for which it evaluates to the same value as for the
+ * request are accepted. The timeout covers both sending the request and
+ * waiting for the reply.
+ */
+int cmd_call(MQTTClient *client,
+             const char *topic,
+             const char *reply_topic,
+             char *value,
+             json_format_t json_format,
+             bool force,
+             expr_t *correlate,
+             expr_t *select,
+             int timeout,
+             int meta_timeout) {
+	// Verify that the type is as expected
+	if (!force && verify_topic(client, topic, "EVENT", false, meta_timeout)) {
+		return 1;
+	}
+	
+	// Find the value replies must correlate with
+	json_object *request = NULL;
+	json_object *request_id = NULL;
+	if (correlate) {
+		char *err = json_parse(value, -1, &request);
+		if (err) {
+			fprintf(stderr, "Error: VALUE must be valid JSON: %s\n", err);
+			free(err);
+			return 1;
+		}
+		request_id = expr_eval(correlate, request);
+		if (json_object_is_type(request_id, json_type_null)) {
+			fprintf(stderr, "Error: VALUE has no correlation value.\n");
+			json_object_put(request);
+			return 1;
+		}
+	}
+	
+	// Subscribe to the reply topic *before* sending the request so that the
+	// reply can't be missed (the subscription is acknowledged before
+	// qth_subscribe returns). Our own request is never a reply, even when the
+	// reply topic matches the request topic.
+	if (qth_subscribe(client, reply_topic, qth_qos(QOS_CLASS_WATCH),
+	                  QTH_SUBSCRIBE_NO_LOCAL) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to '%s'.\n", reply_topic);
+		if (request) {
+			json_object_put(request);
+		}
+		return 1;
+	}
+	
+	uint64_t deadline_ns = monotonic_ns() + ((uint64_t)timeout * 1000000ull);
+	
+	int return_code = 0;
+	char *err = qth_send_event(client, topic, value, timeout > 0 ? timeout : INT_MAX);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return_code = 1;
+	}
+	
+	// Wait for the reply
+	bool replied = false;
+	while (return_code == 0 && !replied) {
+		uint64_t now = monotonic_ns();
+		if (timeout > 0 && now >= deadline_ns) {
+			fprintf(stderr, "Error: Timeout (no reply received).\n");
+			return_code = 1;
+			break;
+		}
+		unsigned long wait_time = 1000;
+		if (timeout > 0) {
+			wait_time = (deadline_ns - now + 999999) / 1000000;
+		}
+		
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		if (qth_receive(client, &rx_topic, &rx_topic_len, &message,
+		                wait_time) != MQTTCLIENT_SUCCESS) {
+			fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+			return_code = 1;
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		
+		// Ignore anything which isn't a (valid JSON) reply. NB: The reply topic
+		// may contain wildcards.
+		json_object *reply;
+		char *json_err = NULL;
+		if (!topic_matches_filter(reply_topic, rx_topic) ||
+		    message->payloadlen == 0 ||
+		    (json_err = json_parse(message->payload, message->payloadlen, &reply))) {
+			free(json_err);
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+			continue;
+		}
+		
+		// Ignore replies to other requests
+		if (!correlate || json_object_equal(expr_eval(correlate, reply), request_id)) {
+			char *out;
+			if (select) {
+				out = json_object_to_format(expr_eval(select, reply), json_format);
+			} else if (json_format == JSON_FORMAT_VERBATIM) {
+				out = alloced_copyn(message->payload, message->payloadlen);
+			} else {
+				out = json_object_to_format(reply, json_format);
+			}
+			printf("%s\n", out);
+			free(out);
+			replied = true;
+		}
+		
+		json_object_put(reply);
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	if (qth_unsubscribe(client, reply_topic) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not unsubscribe from '%s'.\n", reply_topic);
+	}
+	
+	if (request) {
+		json_object_put(request);
+	}
+	
+	return return_code;
+}
@@ -0,0 +1,569 @@
+/**
+ * Implementation of the export command: serves the latest values of numeric
+ * and boolean properties over HTTP in the OpenMetrics text format.
+ *
+ * Every property has pre-rendered sample lines which are kept in a single
+ * render buffer. When a value changes only that property's lines are
+ * re-rendered and, if their length is unchanged, patched into the buffer in
+ * place. The buffer is only re-assembled (from the pre-rendered lines) when
+ * a line's length changes or a property is added. Scrapes simply copy the
+ * buffer.
+ */
+
+#include <alloca.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+
+// Upper bounds (seconds) of the message handling time histogram buckets
+static const double handling_bounds[] = {
+	0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+	0.01, 0.05, 0.1, 0.5, 1.0,
+};
+#define NUM_HANDLING_BOUNDS (sizeof(handling_bounds) / sizeof(handling_bounds[0]))
+
+#define VALUE_HEADER \
+	"# TYPE qth_property_value gauge\n" \
+	"# HELP qth_property_value Latest value of a numeric or boolean Qth property.\n"
+#define MESSAGES_HEADER \
+	"# TYPE qth_property_messages counter\n" \
+	"# HELP qth_property_messages Number of messages received for a Qth property.\n"
+
+// A single pre-rendered sample line
+typedef struct {
+	char *str;
+	size_t len;
+	
+	// Offset of this line in the render buffer
+	size_t offset;
+} export_line_t;
+
+// State associated with each exported property
+typedef struct {
+	// The topic name, escaped for use as a label value
+	char *label;
+	
+	// The value line is empty if the property has no numeric value.
+	export_line_t value_line;
+	export_line_t messages_line;
+	
+	uint64_t messages;
+} export_topic_t;
+
+typedef struct {
+	// Protects all of the following
+	pthread_mutex_t lock;
+	
+	strmap_t *topics_by_name;
+	export_topic_t **topics;
+	size_t num_topics;
+	
+	// The rendered value and message count sections
+	char *buf;
+	size_t buf_len;
+	size_t buf_size;
+	
+	// If true, a line has changed length and the buffer must be re-assembled
+	bool layout_dirty;
+	
+	// Message handling time histogram (the final bucket is +Inf)
+	uint64_t handling_buckets[NUM_HANDLING_BOUNDS + 1];
+	uint64_t handling_count;
+	double handling_sum;
+	
+	int listen_fd;
+} export_state_t;
+
+
+/**
+ * Append a string to a (malloced) buffer, growing it as required.
+ */
+static void buf_append(char **buf, size_t *len, size_t *size,
+                       const char *str, size_t str_len) {
+	if (*len + str_len > *size) {
+		*size = (*len + str_len) * 2;
+		*buf = realloc(*buf, *size);
+	}
+	memcpy(*buf + *len, str, str_len);
+	*len += str_len;
+}
+
+
+/**
+ * Return a copy of a topic name escaped for use as an OpenMetrics label value.
+ */
+static char *escape_label(const char *str) {
+	char *out = malloc((strlen(str) * 2) + 1);
+	char *c = out;
+	for (; *str; str++) {
+		switch (*str) {
+			case '\\': *(c++) = '\\'; *(c++) = '\\'; break;
+			case '"': *(c++) = '\\'; *(c++) = '"'; break;
+			case '\n': *(c++) = '\\'; *(c++) = 'n'; break;
+			default: *(c++) = *str; break;
+		}
+	}
+	*c = '\0';
+	return out;
+}
+
+
+/**
+ * Replace the contents of a sample line. If the length is unchanged, the
+ * render buffer is patched in place, otherwise the buffer is marked for
+ * re-assembly.
+ */
+static void export_set_line(export_state_t *state, export_line_t *line,
+                            const char *str, size_t len) {
+	if (len == line->len && memcmp(line->str, str, len) == 0) {
+		return;
+	}
+	
+	if (len != line->len) {
+		line->str = realloc(line->str, len + 1);
+		line->len = len;
+		state->layout_dirty = true;
+	} else if (!state->layout_dirty) {
+		memcpy(state->buf + line->offset, str, len);
+	}
+	memcpy(line->str, str, len);
+	line->str[len] = '\0';
+}
+
+
+/**
+ * Re-assemble the render buffer from the pre-rendered lines.
+ */
+static void export_layout(export_state_t *state) {
+	state->buf_len = 0;
+	buf_append(&state->buf, &state->buf_len, &state->buf_size,
+	           VALUE_HEADER, strlen(VALUE_HEADER));
+	for (size_t i = 0; i < state->num_topics; i++) {
+		export_line_t *line = &state->topics[i]->value_line;
+		line->offset = state->buf_len;
+		buf_append(&state->buf, &state->buf_len, &state->buf_size,
+		           line->str, line->len);
+	}
+	
+	buf_append(&state->buf, &state->buf_len, &state->buf_size,
+	           MESSAGES_HEADER, strlen(MESSAGES_HEADER));
+	for (size_t i = 0; i < state->num_topics; i++) {
+		export_line_t *line = &state->topics[i]->messages_line;
+		line->offset = state->buf_len;
+		buf_append(&state->buf, &state->buf_len, &state->buf_size,
+		           line->str, line->len);
+	}
+	
+	state->layout_dirty = false;
+}
+
+
+/**
+ * Add a new property to be exported (with no value). The state lock must be
+ * held.
+ */
+static export_topic_t *export_add_topic(export_state_t *state, const char *topic) {
+	export_topic_t *t = calloc(1, sizeof(export_topic_t));
+	t->label = escape_label(topic);
+	
+	char line[64 + strlen(t->label)];
+	int len = sprintf(line, "qth_property_messages_total{topic=\"%s\"} 0\n", t->label);
+	export_set_line(state, &t->messages_line, line, len);
+	t->value_line.str = alloced_copy("");
+	
+	strmap_set(state->topics_by_name, topic, t);
+	state->topics = realloc(state->topics, sizeof(export_topic_t *) * (state->num_topics + 1));
+	state->topics[state->num_topics++] = t;
+	state->layout_dirty = true;
+	
+	return t;
+}
+
+
+/**
+ * Update the exported state of a property upon receiving a message. The
+ * state lock must be held.
+ */
+static void export_update_topic(export_state_t *state, export_topic_t *t,
+                                const char *payload, int payload_len) {
+	t->messages++;
+	char line[96 + strlen(t->label)];
+	int len = sprintf(line, "qth_property_messages_total{topic=\"%s\"} %llu\n",
+	                  t->label, (unsigned long long)t->messages);
+	export_set_line(state, &t->messages_line, line, len);
+	
+	// Non-numeric values (and deleted properties) are not exported
+	json_object *obj = NULL;
+	if (payload_len > 0) {
+		char *err = json_parse(payload, payload_len, &obj);
+		if (err) {
+			free(err);
+			obj = NULL;
+		}
+	}
+	switch (obj ? json_object_get_type(obj) : json_type_null) {
+		case json_type_int:
+			len = sprintf(line, "qth_property_value{topic=\"%s\"} %lld\n",
+			              t->label, (long long)json_object_get_int64(obj));
+			break;
+		
+		case json_type_double:
+			len = sprintf(line, "qth_property_value{topic=\"%s\"} %.15g\n",
+			              t->label, json_object_get_double(obj));
+			break;
+		
+		case json_type_boolean:
+			len = sprintf(line, "qth_property_value{topic=\"%s\"} %d\n",
+			              t->label, json_object_get_boolean(obj) ? 1 : 0);
+			break;
+		
+		default:
+			len = 0;
+			break;
+	}
+	export_set_line(state, &t->value_line, line, len);
+	
+	if (obj) {
+		json_object_put(obj);
+	}
+}
+
+
+/**
+ * Render a complete OpenMetrics exposition into a (malloced) buffer.
+ */
+static void export_render(export_state_t *state, char **out, size_t *out_len,
+                          size_t *out_size) {
+	pthread_mutex_lock(&state->lock);
+	
+	if (state->layout_dirty) {
+		export_layout(state);
+	}
+	*out_len = 0;
+	buf_append(out, out_len, out_size, state->buf, state->buf_len);
+	
+	// The histogram is small and so is simply rendered afresh
+	char line[128];
+	const char *header =
+		"# TYPE qth_message_handling_seconds histogram\n"
+		"# HELP qth_message_handling_seconds Time taken to handle a received message, during which later messages wait.\n";
+	buf_append(out, out_len, out_size, header, strlen(header));
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i <= NUM_HANDLING_BOUNDS; i++) {
+		cumulative += state->handling_buckets[i];
+		int len;
+		if (i < NUM_HANDLING_BOUNDS) {
+			len = sprintf(line, "qth_message_handling_seconds_bucket{le=\"%g\"} %llu\n",
+			              handling_bounds[i], (unsigned long long)cumulative);
+		} else {
+			len = sprintf(line, "qth_message_handling_seconds_bucket{le=\"+Inf\"} %llu\n",
+			              (unsigned long long)cumulative);
+		}
+		buf_append(out, out_len, out_size, line, len);
+	}
+	int len = sprintf(line, "qth_message_handling_seconds_count %llu\n"
+	                        "qth_message_handling_seconds_sum %.9g\n"
+	                        "# EOF\n",
+	                  (unsigned long long)state->handling_count,
+	                  state->handling_sum);
+	buf_append(out, out_len, out_size, line, len);
+	
+	pthread_mutex_unlock(&state->lock);
+}
+
+
+/**
+ * Write a whole buffer to a socket. Returns false on failure.
+ */
+static bool send_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+
+/**
+ * Thread which serves HTTP requests for the metrics.
+ */
+static void *export_http_thread(void *arg) {
+	export_state_t *state = arg;
+	
+	char *body = NULL;
+	size_t body_len = 0;
+	size_t body_size = 0;
+	
+	while (true) {
+		int fd = accept(state->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "Error: Couldn't accept HTTP connection.\n");
+			break;
+		}
+		
+		// Don't let a slow client hold up other scrapes for long
+		struct timeval tv = {1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		
+		// Read the request headers
+		char request[4096];
+		size_t request_len = 0;
+		while (request_len < sizeof(request) - 1) {
+			ssize_t got = recv(fd, request + request_len,
+			                   sizeof(request) - 1 - request_len, 0);
+			if (got <= 0) {
+				break;
+			}
+			request_len += got;
+			request[request_len] = '\0';
+			if (strstr(request, "\r\n\r\n")) {
+				break;
+			}
+		}
+		request[request_len] = '\0';
+		
+		char header[256];
+		if (strncmp(request, "GET /metrics ", 13) == 0 ||
+		    strncmp(request, "GET / ", 6) == 0) {
+			export_render(state, &body, &body_len, &body_size);
+			int header_len = sprintf(header,
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n"
+				"\r\n", body_len);
+			if (send_all(fd, header, header_len)) {
+				send_all(fd, body, body_len);
+			}
+		} else {
+			const char *not_found =
+				"HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n"
+				"\r\n";
+			send_all(fd, not_found, strlen(not_found));
+		}
+		
+		close(fd);
+	}
+	
+	free(body);
+	return NULL;
+}
+
+
+/**
+ * Open a listening TCP socket on an address of the form '[HOST:]PORT'.
+ * Returns the socket or -1 on error (printing a message to stderr).
+ */
+static int export_listen(const char *address) {
+	char *address_copy = alloced_copy(address);
+	char *host = NULL;
+	char *port = strrchr(address_copy, ':');
+	if (port) {
+		*(port++) = '\0';
+		host = address_copy;
+		
+		// Strip brackets from IPv6 addresses (e.g. '[::1]:9650')
+		size_t host_len = strlen(host);
+		if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+			host[host_len - 1] = '\0';
+			host++;
+		}
+	} else {
+		port = address_copy;
+	}
+	
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo *addrs;
+	int gai_err = getaddrinfo(host, port, &hints, &addrs);
+	free(address_copy);
+	if (gai_err != 0) {
+		fprintf(stderr, "Error: Invalid listen address '%s': %s\n",
+		        address, gai_strerror(gai_err));
+		return -1;
+	}
+	
+	int fd = -1;
+	for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+	
+	if (fd < 0) {
+		fprintf(stderr, "Error: Couldn't listen on '%s': %s\n",
+		        address, strerror(errno));
+	}
+	return fd;
+}
+
+
+/**
+ * Implements the 'export' command.
+ */
+int cmd_export(MQTTClient *client,
+               char **paths,
+               int num_paths,
+               const char *listen_address) {
+	// Export everything if no paths are given
+	char *root_path = "";
+	if (num_paths == 0) {
+		paths = &root_path;
+		num_paths = 1;
+	}
+	
+	// Subscribe to the directory listings within every path. Properties are
+	// subscribed to as they're discovered in these listings.
+	char *ls_topics[num_paths];
+	int qos[num_paths];
+	for (int i = 0; i < num_paths; i++) {
+		size_t path_len = strlen(paths[i]);
+		if (path_len > 0 && paths[i][path_len - 1] != '/') {
+			fprintf(stderr, "Error: Path '%s' is not a valid directory name "
+			                "(must end in '/' or be empty).\n", paths[i]);
+			return 1;
+		}
+		ls_topics[i] = alloca(8 + path_len + 1 + 1);
+		sprintf(ls_topics[i], "meta/ls/%s#", paths[i]);
+		qos[i] = qth_qos(QOS_CLASS_META);
+	}
+	
+	export_state_t state;
+	memset(&state, 0, sizeof(state));
+	pthread_mutex_init(&state.lock, NULL);
+	state.topics_by_name = strmap_new();
+	state.layout_dirty = true;
+	
+	state.listen_fd = export_listen(listen_address);
+	if (state.listen_fd < 0) {
+		strmap_free(state.topics_by_name, NULL);
+		return 1;
+	}
+	
+	if (qth_subscribe_many(client, num_paths, ls_topics, qos, 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to directory listings.\n");
+		close(state.listen_fd);
+		strmap_free(state.topics_by_name, NULL);
+		return 1;
+	}
+	
+	pthread_t http_thread;
+	pthread_create(&http_thread, NULL, export_http_thread, &state);
+	pthread_detach(http_thread);
+	
+	int return_code = 0;
+	while (return_code == 0) {
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+		                           &message, 1000);
+		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+			return_code = 1;
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		uint64_t received = monotonic_ns();
+		
+		if (strncmp(rx_topic, "meta/ls/", 8) == 0) {
+			// Directory listing: subscribe to any new properties
+			char **topics;
+			char *err = qth_listing_get_topics(rx_topic + 8, message->payload,
+			                                   message->payloadlen, "PROPERTY",
+			                                   &topics);
+			if (err) {
+				fprintf(stderr, "Warning: Ignoring listing '%s': %s\n", rx_topic, err);
+				free(err);
+			} else {
+				for (char **topic = topics; *topic; topic++) {
+					pthread_mutex_lock(&state.lock);
+					bool is_new = strmap_get(state.topics_by_name, *topic) == NULL;
+					if (is_new) {
+						export_add_topic(&state, *topic);
+					}
+					pthread_mutex_unlock(&state.lock);
+					
+					if (is_new &&
+					    qth_subscribe(client, *topic, qth_qos(QOS_CLASS_WATCH), 0) != MQTTCLIENT_SUCCESS) {
+						fprintf(stderr, "Error: Could not subscribe to '%s'.\n", *topic);
+						return_code = 1;
+						break;
+					}
+				}
+				free_string_array(topics);
+			}
+		} else {
+			// Property value
+			pthread_mutex_lock(&state.lock);
+			export_topic_t *t = strmap_get(state.topics_by_name, rx_topic);
+			if (t) {
+				export_update_topic(&state, t, message->payload, message->payloadlen);
+			}
+			pthread_mutex_unlock(&state.lock);
+		}
+		
+		// Record how long the message took to handle. NB: Paho doesn't record
+		// when a message arrived so the time it spent queued can't be measured
+		// but any messages arriving meanwhile (e.g. while subscribing to the
+		// properties in a listing) are delayed by this long.
+		double handling = (monotonic_ns() - received) / 1e9;
+		size_t bucket = 0;
+		while (bucket < NUM_HANDLING_BOUNDS && handling > handling_bounds[bucket]) {
+			bucket++;
+		}
+		pthread_mutex_lock(&state.lock);
+		state.handling_buckets[bucket]++;
+		state.handling_count++;
+		state.handling_sum += handling;
+		pthread_mutex_unlock(&state.lock);
+		
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	// NB: The HTTP thread is left running until the process exits and so the
+	// state is intentionally not freed.
+	qth_unsubscribe_many(client, num_paths, ls_topics);
+	return return_code;
+}
@@ -0,0 +1,472 @@
+/**
+ * Implementation of the 'find' subcommand.
+ *
+ * The tree of directory listings below the given path is fetched a level at
+ * a time (subscribing to many listings at once rather than one directory
+ * after another as 'ls -R' does). Each topic is tested against the criteria
+ * as its parent's listing arrives and matches are printed immediately, its
+ * listed behaviours being reduced to a bitmask so that '--behaviour' is a
+ * single mask test. Subtrees which no topic matching the '--path' glob or an
+ * anchored '--regex' can be within are never fetched.
+ */
+
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The maximum number of directory listings subscribed to at once
+#define FIND_MAX_OUTSTANDING 64
+
+// Behaviour bits. The first FIND_NUM_LISTED_BEHAVIOURS entries of
+// find_behaviours are those which may appear in a listing while the rest
+// (combinations of these) are only accepted by --behaviour.
+#define FIND_BEHAVIOUR_DIRECTORY    (1u << 0)
+#define FIND_BEHAVIOUR_PROPERTY_1_N (1u << 1)
+#define FIND_BEHAVIOUR_PROPERTY_N_1 (1u << 2)
+#define FIND_BEHAVIOUR_EVENT_1_N    (1u << 3)
+#define FIND_BEHAVIOUR_EVENT_N_1    (1u << 4)
+#define FIND_BEHAVIOUR_OTHER        (1u << 5)
+#define FIND_BEHAVIOUR_ANY          ((1u << 6) - 1)
+#define FIND_NUM_LISTED_BEHAVIOURS  5
+
+static const struct {
+	const char *name;
+	unsigned bits;
+} find_behaviours[] = {
+	{"DIRECTORY", FIND_BEHAVIOUR_DIRECTORY},
+	{"PROPERTY-1:N", FIND_BEHAVIOUR_PROPERTY_1_N},
+	{"PROPERTY-N:1", FIND_BEHAVIOUR_PROPERTY_N_1},
+	{"EVENT-1:N", FIND_BEHAVIOUR_EVENT_1_N},
+	{"EVENT-N:1", FIND_BEHAVIOUR_EVENT_N_1},
+	{"PROPERTY", FIND_BEHAVIOUR_PROPERTY_1_N | FIND_BEHAVIOUR_PROPERTY_N_1},
+	{"EVENT", FIND_BEHAVIOUR_EVENT_1_N | FIND_BEHAVIOUR_EVENT_N_1},
+};
+
+// A directory whose listing is yet to be fetched
+typedef struct {
+	char *path;  // e.g. 'foo/bar/' ('' for the root)
+	char *ls_topic;  // e.g. 'meta/ls/foo/bar/'
+	bool is_root;  // The directory being searched (rather than a subdirectory)
+} find_pending_t;
+
+// The compiled find criteria
+typedef struct {
+	const find_opts_t *opts;
+	unsigned behaviours;
+	regex_t regex;
+	regex_t description;
+	
+	// Literal prefixes which every matching topic must start with (or NULL)
+	char *path_prefix;
+	char *regex_prefix;
+} find_query_t;
+
+
+/**
+ * The behaviour bit for a behaviour named in a directory listing.
+ */
+static unsigned find_behaviour_bit(const char *behaviour) {
+	for (size_t i = 0; i < FIND_NUM_LISTED_BEHAVIOURS; i++) {
+		if (strcmp(find_behaviours[i].name, behaviour) == 0) {
+			return find_behaviours[i].bits;
+		}
+	}
+	return FIND_BEHAVIOUR_OTHER;
+}
+
+
+/**
+ * Return the longest literal prefix of a glob (to be freed by the caller).
+ */
+static char *find_glob_prefix(const char *glob) {
+	return alloced_copyn(glob, strcspn(glob, "*?[\\"));
+}
+
+
+/**
+ * Return the literal prefix of a regex anchored with '^' (to be freed by the
+ * caller) or NULL if it is not anchored (or uses alternation).
+ */
+static char *find_regex_prefix(const char *regex) {
+	if (regex[0] != '^' || strchr(regex, '|')) {
+		return NULL;
+	}
+	regex++;
+	
+	size_t len = strcspn(regex, ".[]()*+?{}\\^$");
+	if (len > 0 && regex[len] != '\0' && strchr("*?{", regex[len])) {
+		// The last literal character is optional
+		len--;
+	}
+	return alloced_copyn(regex, len);
+}
+
+
+/**
+ * Compile the find options. Returns an error message (to be freed by the
+ * caller) or NULL on success, in which case the query must be freed with
+ * find_query_free.
+ */
+static char *find_query_compile(const find_opts_t *opts, find_query_t *query) {
+	memset(query, 0, sizeof(find_query_t));
+	query->opts = opts;
+	
+	query->behaviours = FIND_BEHAVIOUR_ANY;
+	if (opts->behaviour) {
+		query->behaviours = 0;
+		for (size_t i = 0; i < sizeof(find_behaviours) / sizeof(find_behaviours[0]); i++) {
+			if (strcmp(find_behaviours[i].name, opts->behaviour) == 0) {
+				query->behaviours = find_behaviours[i].bits;
+			}
+		}
+		if (!query->behaviours) {
+			return alloced_cat("Unknown behaviour: ", opts->behaviour);
+		}
+	}
+	
+	if (opts->regex && regcomp(&query->regex, opts->regex,
+	                           REG_EXTENDED | REG_NOSUB) != 0) {
+		return alloced_cat("Invalid regular expression: ", opts->regex);
+	}
+	if (opts->description && regcomp(&query->description, opts->description,
+	                                 REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
+		if (opts->regex) {
+			regfree(&query->regex);
+		}
+		return alloced_cat("Invalid regular expression: ", opts->description);
+	}
+	
+	query->path_prefix = opts->path ? find_glob_prefix(opts->path) : NULL;
+	query->regex_prefix = opts->regex ? find_regex_prefix(opts->regex) : NULL;
+	return NULL;
+}
+
+
+static void find_query_free(find_query_t *query) {
+	if (query->opts->regex) {
+		regfree(&query->regex);
+	}
+	if (query->opts->description) {
+		regfree(&query->description);
+	}
+	free(query->path_prefix);
+	free(query->regex_prefix);
+}
+
+
+/**
+ * Could any topic within the directory 'path' (ending in '/') match?
+ */
+static bool find_may_match_within(const find_query_t *query, const char *path) {
+	size_t path_len = strlen(path);
+	const char *prefixes[2] = {query->path_prefix, query->regex_prefix};
+	for (int i = 0; i < 2; i++) {
+		if (prefixes[i]) {
+			size_t prefix_len = strlen(prefixes[i]);
+			size_t len = prefix_len < path_len ? prefix_len : path_len;
+			if (strncmp(prefixes[i], path, len) != 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Test a topic against the query. Returns the behaviour bits of the topic
+ * which match (or 0 if it doesn't match).
+ */
+static unsigned find_match(const find_query_t *query, const char *path,
+                           const char *name, unsigned behaviours,
+                           json_object *entries) {
+	unsigned matched = behaviours & query->behaviours;
+	if (!matched) {
+		return 0;
+	}
+	
+	const find_opts_t *opts = query->opts;
+	if (opts->name && fnmatch(opts->name, name, 0) != 0) {
+		return 0;
+	}
+	if (opts->path && fnmatch(opts->path, path, 0) != 0) {
+		return 0;
+	}
+	if (opts->regex && regexec(&query->regex, path, 0, NULL, 0) != 0) {
+		return 0;
+	}
+	
+	if (opts->description) {
+		bool found = false;
+		int num_entries = json_object_array_length(entries);
+		for (int i = 0; i < num_entries && !found; i++) {
+			json_object *description;
+			if (json_object_object_get_ex(json_object_array_get_idx(entries, i),
+			                              "description", &description)) {
+				found = regexec(&query->description,
+				                json_object_get_string(description),
+				                0, NULL, 0) == 0;
+			}
+		}
+		if (!found) {
+			return 0;
+		}
+	}
+	
+	return matched;
+}
+
+
+/**
+ * Print a matching topic (in the same formats as ls), showing only the
+ * behaviours which matched.
+ */
+static void find_print(const char *path, unsigned matched, json_object *entries,
+                       ls_format_t ls_format) {
+	if (ls_format == LS_FORMAT_SHORT) {
+		if (matched & FIND_BEHAVIOUR_DIRECTORY) {
+			printf("%s/\n", path);
+		}
+		if (matched & ~FIND_BEHAVIOUR_DIRECTORY) {
+			printf("%s\n", path);
+		}
+		return;
+	}
+	
+	json_object *behaviours_arr = json_object_new_array();
+	int num_entries = json_object_array_length(entries);
+	for (int i = 0; i < num_entries; i++) {
+		json_object *behaviour_obj;
+		json_object_object_get_ex(json_object_array_get_idx(entries, i),
+		                          "behaviour", &behaviour_obj);
+		const char *behaviour = json_object_get_string(behaviour_obj);
+		if (!(find_behaviour_bit(behaviour) & matched)) {
+			continue;
+		}
+		
+		if (ls_format == LS_FORMAT_LONG) {
+			printf("%s\t%s%s\n", behaviour, path,
+			       strcmp(behaviour, "DIRECTORY") == 0 ? "/" : "");
+		} else {
+			json_object_array_add(behaviours_arr, json_object_new_string(behaviour));
+		}
+	}
+	
+	if (ls_format == LS_FORMAT_NDJSON) {
+		json_object *record = json_object_new_object();
+		json_object_object_add(record, "path", json_object_new_string(path));
+		json_object_object_add(record, "behaviours", json_object_get(behaviours_arr));
+		printf("%s\n", json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN));
+		json_object_put(record);
+	}
+	json_object_put(behaviours_arr);
+}
+
+
+/**
+ * Test the entries of a directory listing, printing any which match and
+ * appending the subdirectories which need to be fetched to 'queue'. Returns
+ * an error message (to be freed by the caller) or NULL on success.
+ */
+static char *find_listing(const find_query_t *query, const find_pending_t *pending,
+                          const char *payload, int payload_len,
+                          ls_format_t ls_format,
+                          find_pending_t **queue, size_t *queue_len,
+                          size_t *queue_size) {
+	json_object *obj;
+	char *err = json_parse(payload, payload_len, &obj);
+	if (err) {
+		char *err_out = alloced_cat("Couldn't parse directory listing: ", err);
+		free(err);
+		return err_out;
+	}
+	if (!qth_is_directory_listing(obj)) {
+		json_object_put(obj);
+		return alloced_copy("Malformed directory listing.");
+	}
+	
+	size_t path_len = strlen(pending->path);
+	json_object_object_foreach(obj, name, entries) {
+		unsigned behaviours = 0;
+		const char **behaviour_names = qth_subdirectory_get_behaviours(obj, name);
+		for (const char **p = behaviour_names; *p; p++) {
+			behaviours |= find_behaviour_bit(*p);
+		}
+		free(behaviour_names);
+		
+		char *path = malloc(path_len + strlen(name) + 1 + 1);
+		strcpy(path, pending->path);
+		strcpy(path + path_len, name);
+		
+		unsigned matched = find_match(query, path, name, behaviours, entries);
+		if (matched) {
+			find_print(path, matched, entries, ls_format);
+		}
+		
+		// Descend into subdirectories (unless nothing within can match)
+		strcat(path, "/");
+		if ((behaviours & FIND_BEHAVIOUR_DIRECTORY) &&
+		    find_may_match_within(query, path)) {
+			if (*queue_len == *queue_size) {
+				*queue_size *= 2;
+				*queue = realloc(*queue, sizeof(find_pending_t) * *queue_size);
+			}
+			find_pending_t *sub = &(*queue)[(*queue_len)++];
+			sub->path = path;
+			sub->ls_topic = alloced_cat("meta/ls/", path);
+			sub->is_root = false;
+		} else {
+			free(path);
+		}
+	}
+	
+	json_object_put(obj);
+	return NULL;
+}
+
+
+/**
+ * Implements the 'find' command.
+ */
+int cmd_find(MQTTClient *client,
+             const char *path,
+             const find_opts_t *find_opts,
+             ls_format_t ls_format,
+             int meta_timeout) {
+	size_t path_len = strlen(path);
+	if (path_len > 0 && path[path_len - 1] != '/') {
+		fprintf(stderr, "Error: Path is not a valid directory name "
+		                "(must end in '/' or be empty).\n");
+		return 1;
+	}
+	
+	find_query_t query;
+	char *err = find_query_compile(find_opts, &query);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	// The directories still to be fetched, in breadth-first order. Entries
+	// before 'queue_head' have been fetched (or given up on).
+	size_t queue_size = 16;
+	size_t queue_len = 0;
+	size_t queue_head = 0;
+	find_pending_t *queue = malloc(sizeof(find_pending_t) * queue_size);
+	queue[queue_len].path = alloced_copy(path);
+	queue[queue_len].ls_topic = alloced_cat("meta/ls/", path);
+	queue[queue_len].is_root = true;
+	queue_len++;
+	
+	int return_code = 0;
+	while (queue_head < queue_len && return_code == 0) {
+		// Subscribe to the next batch of listings
+		size_t batch_len = queue_len - queue_head;
+		if (batch_len > FIND_MAX_OUTSTANDING) {
+			batch_len = FIND_MAX_OUTSTANDING;
+		}
+		char *topics[batch_len];
+		int qos[batch_len];
+		strmap_t *outstanding = strmap_new();
+		for (size_t i = 0; i < batch_len; i++) {
+			topics[i] = queue[queue_head + i].ls_topic;
+			qos[i] = qth_qos(QOS_CLASS_META);
+			strmap_set(outstanding, topics[i], (void *)(uintptr_t)(queue_head + i + 1));
+		}
+		size_t batch_start = queue_head;
+		queue_head += batch_len;
+		
+		if (qth_subscribe_many(client, batch_len, topics, qos, 0) != MQTTCLIENT_SUCCESS) {
+			fprintf(stderr, "Error: Could not subscribe to directory listings.\n");
+			strmap_free(outstanding, NULL);
+			return_code = 1;
+			break;
+		}
+		
+		// Process the listings as they arrive (which may add to the queue)
+		size_t num_received = 0;
+		while (num_received < batch_len) {
+			char *rx_topic = NULL;
+			int rx_topic_len = 0;
+			MQTTClient_message *message = NULL;
+			int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+			                           &message, meta_timeout);
+			if (mqtt_err != MQTTCLIENT_SUCCESS) {
+				fprintf(stderr, "Error: MQTT error while fetching directory listings.\n");
+				return_code = 1;
+				break;
+			} else if (rx_topic == NULL) {
+				// Timeout: report the listings which never arrived
+				for (size_t i = batch_start; i < batch_start + batch_len; i++) {
+					if (strmap_get(outstanding, queue[i].ls_topic)) {
+						if (queue[i].is_root) {
+							fprintf(stderr, "Error: Directory not found.\n");
+							return_code = 1;
+						} else {
+							fprintf(stderr, "Warning: Timeout while fetching "
+							                "directory listing of '%s'.\n",
+							        queue[i].path);
+						}
+					}
+				}
+				break;
+			}
+			
+			// NB: The index is stored plus one so that zero means 'not
+			// outstanding' (i.e. already received or from an earlier batch)
+			size_t index = (uintptr_t)strmap_get(outstanding, rx_topic);
+			if (index && message->payloadlen > 0) {
+				strmap_set(outstanding, rx_topic, NULL);
+				num_received++;
+				
+				// NB: 'pending' is copied since the queue may be reallocated
+				find_pending_t pending = queue[index - 1];
+				char *err = find_listing(&query, &pending,
+				                         message->payload, message->payloadlen,
+				                         ls_format, &queue, &queue_len, &queue_size);
+				if (err) {
+					fprintf(stderr, "Warning: Ignoring listing of '%s': %s\n",
+					        pending.path, err);
+					free(err);
+				}
+			}
+			
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+		}
+		
+		qth_unsubscribe_many(client, batch_len, topics);
+		strmap_free(outstanding, NULL);
+		
+		// Discard the fetched directories, reclaiming their space once they
+		// make up half of the queue
+		for (size_t i = batch_start; i < queue_head; i++) {
+			free(queue[i].path);
+			free(queue[i].ls_topic);
+		}
+		if (queue_head > queue_len / 2) {
+			memmove(queue, queue + queue_head,
+			        sizeof(find_pending_t) * (queue_len - queue_head));
+			queue_len -= queue_head;
+			queue_head = 0;
+		}
+	}
+	
+	for (size_t i = queue_head; i < queue_len; i++) {
+		free(queue[i].path);
+		free(queue[i].ls_topic);
+	}
+	free(queue);
+	find_query_free(&query);
+	return return_code;
+}
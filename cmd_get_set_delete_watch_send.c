@@ -2,73 +2,23 @@
  * Implementation of the get, set, delete, watch and send commands.
  */
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <termios.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "json.h"
 #include "MQTTClient.h"
 
 #include "qth_client.h"
 
-/**
- * Read a line from stdin, discarding the newline character. The returned
- * string should be freed by the caller. If the stream is closed, returns NULL.
- * While reading, keeps the MQTTClient alive.
- */
-char *getline_and_keepalive(void) {
-	size_t len = 64 * 1024;  // Should be enough for anybody...
-	char *out = malloc(len);
-	out[0] = 0;
-	
-	bool data_ready = false;
-	while (!data_ready) {
-		// Watch stdin
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(0, &rfds);
-		
-		// Timing out after 1ms (to allow frequent calls to MQTTClient_yield).
-		struct timeval tv;
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000;
-		
-		int select_retval = select(1, &rfds, NULL, NULL, &tv);
-		if (select_retval == -1) {
-			// Some error occurred
-			free(out);
-			return NULL;
-		} else if (select_retval == 0) {
-			// Timeout
-			MQTTClient_yield();
-		} else {
-			// Read ready!
-			data_ready = true;
-		}
-	}
-	
-	// We rely on receiving a whole line in one go otherwise the MQTT will not be
-	// kept alive.
-	char *c = fgets(out, len-1, stdin);
-	if (c == NULL) {
-		// EOF
-		free(out);
-		return NULL;
-	} else {
-		// Trim off trailing newline
-		size_t nl_pos = strlen(c) - 1;
-		if (c[nl_pos] == '\n') {
-			c[nl_pos] = '\0';
-		}
-		
-		return out;
-	}
-}
-
-
 int cmd_set_delete_or_send(MQTTClient *client, const char *topic,
-                           const char *value, bool is_registering,
+                           const char *value, const char *value_file,
+                           bool is_registering,
                            bool is_property, bool strict, bool force,
                            int count, int timeout, int meta_timeout) {
 	// Verify that the type is as expected
@@ -84,38 +34,77 @@ int cmd_set_delete_or_send(MQTTClient *client, const char *topic,
 		}
 	}
 	
+	// Map the file to be sent (if any) and validate it in place. The mapping is
+	// then published directly, without being copied or null-terminated.
+	const char *file_data = NULL;
+	size_t file_len = 0;
+	bool file_blank = true;
+	if (value_file) {
+		char *err = map_file(value_file, &file_data, &file_len);
+		if (!err && file_len > MQTT_MAX_PAYLOAD_LEN) {
+			err = alloced_copy("File is too large to send in an MQTT message.");
+		}
+		
+		// An empty file, or one of only whitespace, is sent as 'null' (just as
+		// an empty line read from stdin is)
+		for (size_t i = 0; !err && i < file_len && file_blank; i++) {
+			char c = file_data[i];
+			file_blank = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+		}
+		if (!err && !file_blank) {
+			char *json_err = json_check(file_data, file_len);
+			if (json_err) {
+				err = alloced_cat("File must contain valid JSON: ", json_err);
+				free(json_err);
+			}
+		}
+		if (err) {
+			fprintf(stderr, "Error: %s\n", err);
+			free(err);
+			unmap_file(file_data, file_len);
+			return 1;
+		}
+	}
+	
+	// Values read from stdin (if no value is given)
+	json_reader_t *reader = NULL;
+	if (!value && !value_file) {
+		reader = json_reader_new(0);
+	}
+	
 	// Set the value accordingly
+	int return_code = 0;
 	while (true) {
 		// Get the value to be sent
-		char *value_to_send = value ? alloced_copy(value) : NULL;
-		if (!value_to_send) {
-			value_to_send = getline_and_keepalive();
-			if (!value_to_send) {
-				// Stop at end of file
-				break;
-			}
-			
-			// Replace empty lines with 'null'.
-			if (value_to_send[0] == '\0') {
-				free(value_to_send);
-				value_to_send = alloced_copy("null");
-			}
-			char *err = json_validate(value_to_send, -1);
+		const char *value_to_send;
+		size_t value_len;
+		if (value_file) {
+			value_to_send = file_blank ? "null" : file_data;
+			value_len = file_blank ? strlen("null") : file_len;
+		} else if (value) {
+			value_to_send = value;
+			value_len = strlen(value);
+		} else {
+			char *err = json_reader_next(reader, &value_to_send, &value_len);
 			if (err) {
-				free(value_to_send);
 				fprintf(stderr, "Error: Value must be valid JSON: %s\n", err);
 				free(err);
-				return 1;
+				return_code = 1;
+				break;
+			} else if (!value_to_send) {
+				// Stop at end of file
+				break;
 			}
 		}
 		
 		// Send the value
-		char *err = qth_set_delete_or_send(client, topic, value_to_send, is_property, timeout);
-		free(value_to_send);
+		char *err = qth_set_delete_or_sendn(client, topic, value_to_send, value_len,
+		                                    is_property, timeout);
 		if (err) {
 			fprintf(stderr, "Error: %s\n", err);
 			free(err);
-			return 1;
+			return_code = 1;
+			break;
 		}
 		
 		// Repeat?
@@ -126,19 +115,24 @@ int cmd_set_delete_or_send(MQTTClient *client, const char *topic,
 		}
 	}
 	
-	return 0;
+	if (reader) {
+		json_reader_free(reader);
+	}
+	unmap_file(file_data, file_len);
+	return return_code;
 }
 
 int cmd_set(MQTTClient *client,
             const char *topic,
             const char *value,
+            const char *value_file,
             bool is_registering,
             bool strict,
             bool force,
             int count,
             int timeout,
             int meta_timeout) {
-	return cmd_set_delete_or_send(client, topic, value,
+	return cmd_set_delete_or_send(client, topic, value, value_file,
 	                              is_registering, true, strict, force,
 	                              count, timeout, meta_timeout);
 }
@@ -150,7 +144,7 @@ int cmd_delete(MQTTClient *client,
                bool force,
                int timeout,
                int meta_timeout) {
-	return cmd_set_delete_or_send(client, topic, "",
+	return cmd_set_delete_or_send(client, topic, "", NULL,
 	                              is_registering, true, strict, force,
 	                              1, timeout, meta_timeout);
 }
@@ -158,22 +152,253 @@ int cmd_delete(MQTTClient *client,
 int cmd_send(MQTTClient *client,
              const char *topic,
              const char *value,
+             const char *value_file,
              bool is_registering,
              bool strict,
              bool force,
              int count,
              int timeout,
              int meta_timeout) {
-	return cmd_set_delete_or_send(client, topic, value,
+	return cmd_set_delete_or_send(client, topic, value, value_file,
 	                              is_registering, false, strict, force,
 	                              count, timeout, meta_timeout);
 }
 
 
+// Per-topic state used by --changes-only and --coalesce
+typedef struct {
+	// Hashes of the last value received (raw payload and canonical value)
+	bool have_hash;
+	uint64_t raw_hash;
+	uint64_t value_hash;
+	
+	// When a value for this topic was last output
+	bool have_output;
+	uint64_t last_output_ns;
+	
+	// The latest value not yet output due to coalescing (if has_pending)
+	bool has_pending;
+	json_object *pending;
+	char *pending_raw;
+	int pending_raw_len;
+} watch_topic_state_t;
+
+static void watch_topic_state_free(void *state_void) {
+	watch_topic_state_t *state = state_void;
+	if (state->has_pending) {
+		json_object_put(state->pending);
+		free(state->pending_raw);
+	}
+	free(state);
+}
+
+// Where watched values are sent: an --exec hook, a --queue (which writes
+// values using the writer) or directly to the writer. With --format-threads,
+// values are formatted by the pool before being sent on.
+typedef struct {
+	format_pool_t *pool;
+	exec_hook_t *hook;
+	output_queue_t *queue;
+	output_writer_t *writer;
+} watch_sink_t;
+
+// Set by a signal handler when a watch with buffered output should stop (so
+// that the output can be written out and any statistics reported)
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal_handler(int signum) {
+	watch_stop = 1;
+	
+	// A second signal terminates immediately (e.g. if stdout is blocked)
+	signal(signum, SIG_DFL);
+}
+
+// The range of delays between attempts to reconnect a durable watch (ms)
+#define WATCH_RECONNECT_MIN_DELAY 100
+#define WATCH_RECONNECT_MAX_DELAY 10000
+
+// Statistics on how a durable watch recovered from losing its connection
+typedef struct {
+	int num_reconnects;
+	int num_sessions_lost;
+	uint64_t total_outage_ns;
+	uint64_t longest_outage_ns;
+	
+	// Values the broker flagged as possibly already delivered
+	uint64_t num_redelivered;
+} watch_recovery_t;
+
+/**
+ * Re-establish a lost connection, retrying with (jittered) exponential backoff.
+ * Returns true once reconnected or false if the watch was stopped first.
+ */
+static bool watch_reconnect(MQTTClient *client, watch_recovery_t *recovery) {
+	fprintf(stderr, "Warning: Connection lost, reconnecting...\n");
+	
+	uint64_t start_ns = monotonic_ns();
+	int delay = WATCH_RECONNECT_MIN_DELAY;
+	while (!watch_stop) {
+		bool session_present;
+		if (qth_reconnect(client, &session_present) == MQTTCLIENT_SUCCESS) {
+			uint64_t outage_ns = monotonic_ns() - start_ns;
+			recovery->num_reconnects++;
+			recovery->total_outage_ns += outage_ns;
+			if (outage_ns > recovery->longest_outage_ns) {
+				recovery->longest_outage_ns = outage_ns;
+			}
+			if (session_present) {
+				fprintf(stderr, "Warning: Reconnected after %.1f s, session resumed.\n",
+				        outage_ns / 1e9);
+			} else {
+				recovery->num_sessions_lost++;
+				fprintf(stderr,
+				        "Warning: Reconnected after %.1f s but the broker had lost "
+				        "the session: values sent meanwhile may have been missed.\n",
+				        outage_ns / 1e9);
+			}
+			return true;
+		}
+		
+		// NB: Interrupted by signals (so that the watch can be stopped)
+		int sleep_ms = delay / 2 + rand() % (delay / 2 + 1);
+		struct timespec ts = {sleep_ms / 1000, (sleep_ms % 1000) * 1000000l};
+		nanosleep(&ts, NULL);
+		delay = delay * 2 < WATCH_RECONNECT_MAX_DELAY ? delay * 2 : WATCH_RECONNECT_MAX_DELAY;
+	}
+	return false;
+}
+
+/**
+ * Send a formatted value (received on 'topic') to the sink, taking ownership of
+ * it. Returns an error message (to be freed by the caller) or NULL on success.
+ */
+static char *watch_emit(const char *topic, char *out, watch_sink_t *sink) {
+	if (sink->hook) {
+		char *err = exec_hook_add(sink->hook, out, strlen(out), monotonic_ns());
+		free(out);
+		return err;
+	} else if (sink->queue) {
+		// NB: The queue and writer take ownership of the string
+		output_queue_push(sink->queue, topic, out, strlen(out));
+		return NULL;
+	} else {
+		return output_writer_write(sink->writer, out, strlen(out), monotonic_ns());
+	}
+}
+
+/**
+ * Send on any values formatted by the pool (in the order they were received).
+ * If 'wait' is true, waits for all outstanding values to be formatted.
+ * Returns an error message (to be freed by the caller) or NULL on success.
+ */
+static char *watch_collect(watch_sink_t *sink, bool wait) {
+	char *topic;
+	char *out;
+	while (sink->pool && format_pool_next(sink->pool, wait, &topic, &out)) {
+		char *err = watch_emit(topic, out, sink);
+		free(topic);
+		if (err) {
+			return err;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Output a value received on 'topic', taking ownership of the value. The raw
+ * payload is used for verbatim output. Returns an error message (to be freed
+ * by the caller) or NULL on success.
+ */
+static char *watch_output(const char *topic, json_object *value,
+                          const char *raw, int raw_len,
+                          json_format_t json_format, expr_t *select,
+                          watch_sink_t *sink) {
+	if (sink->pool) {
+		// Wait for the oldest value to be formatted if there's no room
+		char *topic_out;
+		char *out;
+		if (format_pool_full(sink->pool) &&
+		    format_pool_next(sink->pool, true, &topic_out, &out)) {
+			char *err = watch_emit(topic_out, out, sink);
+			free(topic_out);
+			if (err) {
+				json_object_put(value);
+				return err;
+			}
+		}
+		format_pool_submit(sink->pool, topic, value, raw, raw_len);
+		return watch_collect(sink, false);
+	}
+	
+	// Format without making a copy (the string belongs to the value or is the
+	// payload itself): only the queue needs its own copy
+	const char *out;
+	size_t out_len;
+	if (select) {
+		out = json_object_to_format_borrowed(expr_eval(select, value), json_format,
+		                                     &out_len);
+	} else if (json_format == JSON_FORMAT_VERBATIM) {
+		out = raw;
+		out_len = raw_len;
+	} else {
+		out = json_object_to_format_borrowed(value, json_format, &out_len);
+	}
+	
+	char *err = NULL;
+	if (sink->hook) {
+		err = exec_hook_add(sink->hook, out, out_len, monotonic_ns());
+	} else if (sink->queue) {
+		output_queue_push(sink->queue, topic, alloced_copyn(out, out_len), out_len);
+	} else {
+		err = output_writer_write_copy(sink->writer, out, out_len, monotonic_ns());
+	}
+	json_object_put(value);
+	return err;
+}
+
+/**
+ * Output any coalesced values whose interval has elapsed, stopping early if
+ * 'count' values have been output (or on error, reported via 'err'). Returns
+ * the time at which the next pending value becomes due (or UINT64_MAX if none
+ * are pending).
+ */
+static uint64_t watch_flush(strmap_t *states, uint64_t now, uint64_t coalesce_ns,
+                            json_format_t json_format, expr_t *select,
+                            watch_sink_t *sink, int count, int *num_output,
+                            char **err) {
+	uint64_t next_flush_ns = UINT64_MAX;
+	size_t iter = 0;
+	const char *rx_topic;
+	void *state_void;
+	while (strmap_next(states, &iter, &rx_topic, &state_void)) {
+		watch_topic_state_t *state = state_void;
+		if (!state->has_pending) {
+			continue;
+		}
+		
+		uint64_t due_ns = state->last_output_ns + coalesce_ns;
+		if (due_ns <= now && !*err && !(count > 0 && *num_output >= count)) {
+			*err = watch_output(rx_topic, state->pending, state->pending_raw,
+			                    state->pending_raw_len, json_format, select,
+			                    sink);
+			(*num_output)++;
+			state->last_output_ns = now;
+			state->has_pending = false;
+			free(state->pending_raw);
+		} else if (due_ns < next_flush_ns) {
+			next_flush_ns = due_ns;
+		}
+	}
+	return next_flush_ns;
+}
+
+
 int cmd_get_or_watch(MQTTClient *client, const char *topic,
                      json_format_t json_format, bool is_registering,
                      bool is_property, bool strict, bool force,
-                     int count, int timeout, int meta_timeout) {
+                     int count, int timeout, int meta_timeout,
+                     const watch_opts_t *watch_opts,
+                     bool changed, int deadline, shard_set_t *shards) {
 	// Verify that the type is as expected
 	if (!force && !is_registering) {
 		char *desired_behaviour;
@@ -187,100 +412,418 @@ int cmd_get_or_watch(MQTTClient *client, const char *topic,
 		}
 	}
 	
-	// Subscribe
-	int err = MQTTClient_subscribe(client, topic, QTH_QOS);
-	if (err != MQTTCLIENT_SUCCESS) {
+	// Subscribe (when sharded, via the shards' own connections instead). With
+	// MQTT 5, retained values needn't even be sent when they'd be skipped.
+	int subscribe_flags = watch_opts->live ? QTH_SUBSCRIBE_NO_RETAINED : 0;
+	if (shards) {
+		char *shard_err = shard_set_start(shards, subscribe_flags);
+		if (shard_err) {
+			fprintf(stderr, "Error: %s\n", shard_err);
+			free(shard_err);
+			return 1;
+		}
+	} else if (qth_subscribe(client, topic, qth_qos(QOS_CLASS_WATCH),
+	                         subscribe_flags) != MQTTCLIENT_SUCCESS) {
 		fprintf(stderr, "Error: Could not subscribe to topic.\n");
 		return 1;
 	}
 	
+	// When waiting for a change, the first value received (and whether it has
+	// arrived yet: NULL is a valid JSON value)
+	json_object *initial = NULL;
+	bool have_initial = false;
+	
+	// State for each topic received, needed by --changes-only and --coalesce
+	// (NB: the topic may contain wildcards)
+	strmap_t *states = NULL;
+	if (watch_opts->changes_only || watch_opts->coalesce > 0) {
+		states = strmap_new();
+	}
+	uint64_t coalesce_ns = (uint64_t)watch_opts->coalesce * 1000000ull;
+	
+	// The earliest time at which a coalesced value is due to be output
+	uint64_t next_flush_ns = UINT64_MAX;
+	
+	// With --exec, values are passed to a command in batches rather than being
+	// printed. Otherwise they're written to stdout in batches (unless it is a
+	// terminal), with --queue, by another thread.
+	watch_sink_t sink = {NULL, NULL, NULL, NULL};
+	if (watch_opts->format_threads > 0) {
+		sink.pool = format_pool_new(watch_opts->format_threads, json_format,
+		                            watch_opts->select);
+	}
+	if (watch_opts->exec) {
+		sink.hook = exec_hook_new(watch_opts->exec, watch_opts->exec_batch_size,
+		                          watch_opts->exec_batch_delay,
+		                          watch_opts->exec_persistent);
+	} else {
+		sink.writer = output_writer_new(STDOUT_FILENO);
+		if (watch_opts->queue_size > 0) {
+			sink.queue = output_queue_new(sink.writer, watch_opts->queue_size,
+			                              watch_opts->queue_policy);
+		}
+	}
+	
+	// When output is buffered, stop cleanly when interrupted so that it can
+	// be written out (and, when durable, so that reconnection statistics can
+	// be reported)
+	bool buffered = sink.hook || sink.queue || watch_opts->durable ||
+	                !output_writer_is_interactive(sink.writer);
+	if (buffered) {
+		watch_stop = 0;
+		signal(SIGINT, watch_signal_handler);
+		signal(SIGTERM, watch_signal_handler);
+	}
+	
+	watch_recovery_t recovery = {0, 0, 0, 0, 0};
+	
+	// The times at which to give up: the overall deadline (if given) and the
+	// timeout for the next message to arrive (if given).
+	uint64_t now = monotonic_ns();
+	uint64_t deadline_ns = now + ((uint64_t)deadline * 1000000ull);
+	uint64_t timeout_ns = now + ((uint64_t)timeout * 1000000ull);
+	
 	// Watch the value over time (breaking out of the loop upon failure rather
 	// than returning)
 	int return_code = 0;
-	while (return_code == 0) {
+	int num_output = 0;
+	while (return_code == 0 && !watch_stop &&
+	       !(count > 0 && num_output >= count)) {
+		now = monotonic_ns();
+		
+		// Output any coalesced values which are due
+		if (now >= next_flush_ns) {
+			char *flush_err = NULL;
+			next_flush_ns = watch_flush(states, now, coalesce_ns, json_format,
+			                            watch_opts->select, &sink, count,
+			                            &num_output, &flush_err);
+			if (flush_err) {
+				fprintf(stderr, "Error: %s\n", flush_err);
+				free(flush_err);
+				return_code = 1;
+			}
+			continue;
+		}
+		
+		// Run the --exec command on the current batch or write out gathered
+		// output when due
+		char *sink_err = NULL;
+		if (sink.hook) {
+			sink_err = exec_hook_poll(sink.hook, now);
+		} else if (!sink.queue && now >= output_writer_deadline(sink.writer)) {
+			sink_err = output_writer_flush(sink.writer);
+		}
+		if (sink_err) {
+			fprintf(stderr, "Error: %s\n", sink_err);
+			free(sink_err);
+			return_code = 1;
+			break;
+		}
+		
 		// Receive the message, waiting for as long as necessary if the timeout is
-		// specified as zero.
+		// specified as zero (but waking up to output coalesced values and
+		// batches).
+		uint64_t wake_ns = next_flush_ns;
+		if (sink.hook) {
+			if (exec_hook_deadline(sink.hook) < wake_ns) {
+				wake_ns = exec_hook_deadline(sink.hook);
+			}
+		} else if (!sink.queue) {
+			if (output_writer_deadline(sink.writer) < wake_ns) {
+				wake_ns = output_writer_deadline(sink.writer);
+			}
+		}
+		if (timeout > 0 && timeout_ns < wake_ns) {
+			wake_ns = timeout_ns;
+		}
+		if (deadline > 0 && deadline_ns < wake_ns) {
+			wake_ns = deadline_ns;
+		}
+		unsigned long wait_time = 1000;
+		if (wake_ns != UINT64_MAX) {
+			wait_time = wake_ns > now ? (wake_ns - now + 999999) / 1000000 : 0;
+		}
+		
+		// While values are being formatted, only pick up messages which have
+		// already arrived (otherwise wait for the formatting to finish, below)
+		bool formatting = sink.pool && format_pool_busy(sink.pool);
+		if (formatting) {
+			wait_time = 0;
+		}
+		
 		char *rx_topic = NULL;
 		int rx_topic_len = 0;
 		MQTTClient_message *message = NULL;
-		while (message == NULL) {
-			int err = MQTTClient_receive(client, &rx_topic, &rx_topic_len, &message,
-			                             timeout ? timeout : 1000);
-			if (err != MQTTCLIENT_SUCCESS) {
-				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
-				return_code = 1;
-				break;
+		int err;
+		if (shards) {
+			err = shard_set_receive(shards, &rx_topic, &rx_topic_len, &message,
+			                        wait_time);
+		} else {
+			err = qth_receive(client, &rx_topic, &rx_topic_len, &message,
+			                  wait_time);
+		}
+		if (err != MQTTCLIENT_SUCCESS && watch_opts->durable && !watch_stop) {
+			// Write out what has been gathered before (possibly) waiting a while
+			if (sink.writer && !sink.queue) {
+				char *writer_err = output_writer_flush(sink.writer);
+				if (writer_err) {
+					fprintf(stderr, "Error: %s\n", writer_err);
+					free(writer_err);
+					return_code = 1;
+					break;
+				}
 			}
-			if (timeout > 0) {
-				break;
+			if (watch_reconnect(client, &recovery)) {
+				timeout_ns = monotonic_ns() + ((uint64_t)timeout * 1000000ull);
+				continue;
 			}
 		}
-		if (return_code != 0) {
+		if (err != MQTTCLIENT_SUCCESS) {
+			if (!watch_stop) {
+				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+				return_code = 1;
+			}
 			break;
 		}
 		
-		if (message == NULL) {
-			if (is_property) {
-				fprintf(stderr, "Error: Timeout (property may not have been set).\n");
-			} else {
-				fprintf(stderr, "Error: Timeout.\n");
+		now = monotonic_ns();
+		if (message == NULL && formatting) {
+			char *collect_err = watch_collect(&sink, true);
+			if (collect_err) {
+				fprintf(stderr, "Error: %s\n", collect_err);
+				free(collect_err);
+				return_code = 1;
 			}
-			return_code = 1;
-			break;
+			continue;
+		} else if (message == NULL) {
+			if ((timeout > 0 && now >= timeout_ns) ||
+			    (deadline > 0 && now >= deadline_ns)) {
+				if (is_property) {
+					fprintf(stderr, "Error: Timeout (property may not have been set).\n");
+				} else {
+					fprintf(stderr, "Error: Timeout.\n");
+				}
+				return_code = 1;
+			}
+			continue;
 		}
 		
-		// Verify the topic is what we asked for
-		if (strncmp(rx_topic, topic, rx_topic_len) != 0) {
-			fprintf(stderr, "Error: Received message from unexpected topic.\n");
+		if (message->dup) {
+			recovery.num_redelivered++;
+		}
+		
+		// Skip retained values (sent upon subscribing) when only live values
+		// are wanted
+		if (watch_opts->live && message->retained) {
 			MQTTClient_free(rx_topic);
 			MQTTClient_freeMessage(&message);
-			return_code = 1;
-			break;
+			continue;
 		}
+		timeout_ns = now + ((uint64_t)timeout * 1000000ull);
 		
-		// Get a null-terminated copy of the payload
-		char *payload = alloced_copyn(message->payload, message->payloadlen);
-		MQTTClient_free(rx_topic);
-		MQTTClient_freeMessage(&message);
+		// Ignore messages for topics other than the one asked for (e.g. for a
+		// subscription left over from an earlier --durable session)
+		if (!topic_matches_filter(topic, rx_topic)) {
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+			continue;
+		}
 		
-		if (strlen(payload) == 0) {
+		if (message->payloadlen == 0) {
 			if (is_property) {
 				fprintf(stderr, "Error: Property was deleted.\n");
 			} else {
 				fprintf(stderr, "Error: Empty (non-JSON) event payload received.\n");
 			}
-			free(payload);
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
 			return_code = 1;
 			break;
 		}
-		char *err = json_validate(payload, -1);
-		if (err) {
-			fprintf(stderr, "Error: Not a valid JSON value: %s\n", err);
-			free(err);
-			free(payload);
+		
+		watch_topic_state_t *state = NULL;
+		if (states) {
+			state = strmap_get(states, rx_topic);
+			if (!state) {
+				state = calloc(1, sizeof(watch_topic_state_t));
+				strmap_set(states, rx_topic, state);
+			}
+		}
+		
+		// When only outputting changes, payloads byte-for-byte identical to the
+		// last are dropped without even being parsed.
+		uint64_t raw_hash = 0;
+		if (watch_opts->changes_only) {
+			raw_hash = hash_bytes(message->payload, message->payloadlen);
+			if (state->have_hash && state->raw_hash == raw_hash) {
+				MQTTClient_free(rx_topic);
+				MQTTClient_freeMessage(&message);
+				continue;
+			}
+		}
+		
+		// Parse the payload just once: the filter, selection and formatting
+		// all operate on the parsed value. When only the raw payload is output,
+		// it is just validated (without allocating) and left unparsed.
+		json_object *value = NULL;
+		char *json_err;
+		if (json_format == JSON_FORMAT_VERBATIM && !watch_opts->select &&
+		    !watch_opts->filter && !watch_opts->changes_only && !changed) {
+			json_err = json_validate(message->payload, message->payloadlen);
+		} else {
+			json_err = json_parse(message->payload, message->payloadlen, &value);
+		}
+		if (json_err) {
+			fprintf(stderr, "Error: Not a valid JSON value: %s\n", json_err);
+			free(json_err);
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
 			return_code = 1;
 			break;
 		}
 		
-		// Output the received message
-		char *out = json_to_format(payload, json_format);
-		fprintf(stdout, "%s\n", out);
-		fflush(stdout);
-		free(out);
+		// Otherwise compare the canonical value (so that, e.g., differences in
+		// whitespace or key order aren't treated as changes)
+		if (watch_opts->changes_only) {
+			uint64_t value_hash = json_hash(value);
+			bool unchanged = state->have_hash && state->value_hash == value_hash;
+			state->have_hash = true;
+			state->raw_hash = raw_hash;
+			state->value_hash = value_hash;
+			if (unchanged) {
+				json_object_put(value);
+				MQTTClient_free(rx_topic);
+				MQTTClient_freeMessage(&message);
+				continue;
+			}
+		}
 		
-		// Clean up
-		free(payload);
+		// When waiting for a change, skip the initial value and any values equal
+		// to it
+		if (changed && !have_initial) {
+			initial = value;
+			have_initial = true;
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+			continue;
+		} else if (changed && json_object_equal(initial, value)) {
+			json_object_put(value);
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+			continue;
+		}
 		
-		// Repeat?
-		if (count > 0) {
-			if (--count == 0) {
-				break;
+		// Values not matching the filter are skipped entirely (and don't count
+		// towards the number of values to receive)
+		if (watch_opts->filter && !expr_test(watch_opts->filter, value)) {
+			json_object_put(value);
+			MQTTClient_free(rx_topic);
+			MQTTClient_freeMessage(&message);
+			continue;
+		}
+		
+		// When coalescing, values arriving too soon after the last one output
+		// replace the topic's pending value (to be output when due).
+		if (watch_opts->coalesce > 0) {
+			if (state->has_pending) {
+				json_object_put(state->pending);
+				free(state->pending_raw);
+				state->has_pending = false;
 			}
+			if (state->have_output && now - state->last_output_ns < coalesce_ns) {
+				state->has_pending = true;
+				state->pending = value;
+				state->pending_raw = alloced_copyn(message->payload, message->payloadlen);
+				state->pending_raw_len = message->payloadlen;
+				if (state->last_output_ns + coalesce_ns < next_flush_ns) {
+					next_flush_ns = state->last_output_ns + coalesce_ns;
+				}
+				MQTTClient_free(rx_topic);
+				MQTTClient_freeMessage(&message);
+				continue;
+			}
+			state->have_output = true;
+			state->last_output_ns = now;
+		}
+		
+		// Output the received message (which takes ownership of the value)
+		char *output_err = watch_output(rx_topic, value, message->payload,
+		                                message->payloadlen, json_format,
+		                                watch_opts->select, &sink);
+		if (output_err) {
+			fprintf(stderr, "Error: %s\n", output_err);
+			free(output_err);
+			return_code = 1;
 		}
+		num_output++;
+		
+		// Clean up
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	if (initial) {
+		json_object_put(initial);
+	}
+	if (states) {
+		strmap_free(states, watch_topic_state_free);
+	}
+	
+	// Write out anything still being formatted, queued or gathered, or run any
+	// values still waiting in the last batch (and wait for the command to
+	// finish)
+	char *sink_err = NULL;
+	if (sink.pool) {
+		if (return_code == 0) {
+			sink_err = watch_collect(&sink, true);
+		}
+		format_pool_free(sink.pool);
+	}
+	if (sink.queue) {
+		char *queue_err = output_queue_close(sink.queue);
+		if (!sink_err) {
+			sink_err = queue_err;
+		} else {
+			free(queue_err);
+		}
+	}
+	if (sink.writer) {
+		char *writer_err = output_writer_free(sink.writer);
+		if (!sink_err) {
+			sink_err = writer_err;
+		} else {
+			free(writer_err);
+		}
+	}
+	if (sink.hook) {
+		char *hook_err = exec_hook_close(sink.hook);
+		if (!sink_err) {
+			sink_err = hook_err;
+		} else {
+			free(hook_err);
+		}
+	}
+	if (sink_err) {
+		fprintf(stderr, "Error: %s\n", sink_err);
+		free(sink_err);
+		return_code = 1;
+	}
+	if (buffered) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+	}
+	if (recovery.num_reconnects > 0) {
+		fprintf(stderr,
+		        "Warning: Reconnected %d times (longest outage %.1f s, total %.1f s). "
+		        "The session was lost %d times and %llu values were redelivered.\n",
+		        recovery.num_reconnects,
+		        recovery.longest_outage_ns / 1e9, recovery.total_outage_ns / 1e9,
+		        recovery.num_sessions_lost,
+		        (unsigned long long)recovery.num_redelivered);
 	}
 	
 	// Unsubscribe again
-	if (MQTTClient_unsubscribe(client, topic) != MQTTCLIENT_SUCCESS) {
+	if (!shards && qth_unsubscribe(client, topic) != MQTTCLIENT_SUCCESS) {
 		fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
 	}
 	
@@ -289,14 +832,41 @@ int cmd_get_or_watch(MQTTClient *client, const char *topic,
 
 int cmd_get(MQTTClient *client, const char *topic,
             json_format_t json_format, bool is_registering,
-            bool strict, bool force, int count, int timeout, int meta_timeout) {
+            bool strict, bool force, int count, int timeout, int meta_timeout,
+            const watch_opts_t *watch_opts) {
 	return cmd_get_or_watch(client, topic, json_format, is_registering, true,
-	                        strict, force, count, timeout, meta_timeout);
+	                        strict, force, count, timeout, meta_timeout,
+	                        watch_opts, false, 0, NULL);
 }
 
 int cmd_watch(MQTTClient *client, const char *topic,
               json_format_t json_format, bool is_registering,
-              bool strict, bool force, int count, int timeout, int meta_timeout) {
+              bool strict, bool force, int count, int timeout, int meta_timeout,
+              const watch_opts_t *watch_opts, shard_set_t *shards) {
 	return cmd_get_or_watch(client, topic, json_format, is_registering, false,
-	                        strict, force, count, timeout, meta_timeout);
+	                        strict, force, count, timeout, meta_timeout,
+	                        watch_opts, false, 0, shards);
+}
+
+int cmd_wait(MQTTClient *client, const char *topic,
+             json_format_t json_format, bool force,
+             const watch_opts_t *watch_opts, bool changed,
+             int timeout, int meta_timeout) {
+	// Work out whether we're waiting on a property or an event (which only
+	// affects the error messages reported)
+	bool is_property = false;
+	if (!force) {
+		char *behaviour;
+		if (get_topic_behaviour(client, topic, meta_timeout, &behaviour)) {
+			return 1;
+		}
+		is_property = strncmp(behaviour, "PROPERTY", 8) == 0;
+		free(behaviour);
+	}
+	
+	// Wait for the first value satisfying the condition (the filter), then
+	// stop
+	return cmd_get_or_watch(client, topic, json_format, false, is_property,
+	                        false, true, 1, 0, meta_timeout,
+	                        watch_opts, changed, timeout, NULL);
 }
@@ -0,0 +1,257 @@
+/**
+ * Implementation of the log and query commands which record numeric values
+ * into (and read them back from) round-robin archive files.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The latest time accepted by query (leaving plenty of headroom for stepping
+// through rows without overflowing)
+#define QUERY_MAX_TIME ((double)(INT64_MAX / 2))
+
+
+/**
+ * Implements the 'log' command: records every numeric (or boolean) value
+ * received on a topic in a round-robin archive file.
+ */
+int cmd_log(MQTTClient *client,
+            const char *topic,
+            const char *rrd_file,
+            const char *rrd_spec,
+            bool force,
+            int count,
+            int timeout,
+            int meta_timeout) {
+	// Verify that the topic is a property or event
+	if (!force) {
+		char *behaviour;
+		if (get_topic_behaviour(client, topic, meta_timeout, &behaviour)) {
+			return 1;
+		}
+		bool is_loggable = strncmp(behaviour, "PROPERTY-", 9) == 0 ||
+		                   strncmp(behaviour, "EVENT-", 6) == 0;
+		if (!is_loggable) {
+			fprintf(stderr, "Error: Topic has unsupported behaviour '%s'.\n", behaviour);
+			free(behaviour);
+			return 1;
+		}
+		free(behaviour);
+	}
+	
+	rrd_t rrd;
+	char *err = rrd_open(rrd_file, rrd_spec, true, &rrd);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	// Subscribe
+	if (qth_subscribe(client, topic, qth_qos(QOS_CLASS_WATCH), 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to topic.\n");
+		rrd_close(&rrd);
+		return 1;
+	}
+	
+	int return_code = 0;
+	while (return_code == 0) {
+		// Receive the message, waiting for as long as necessary if the timeout is
+		// specified as zero.
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		while (message == NULL) {
+			int err = qth_receive(client, &rx_topic, &rx_topic_len, &message,
+			                      timeout ? timeout : 1000);
+			if (err != MQTTCLIENT_SUCCESS) {
+				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+				return_code = 1;
+				break;
+			}
+			if (timeout > 0) {
+				break;
+			}
+		}
+		if (return_code != 0) {
+			break;
+		}
+		if (message == NULL) {
+			fprintf(stderr, "Error: Timeout.\n");
+			return_code = 1;
+			break;
+		}
+		
+		// Non-numeric values (and deletions) are ignored since they cannot be
+		// consolidated.
+		json_object *obj = NULL;
+		char *json_err = NULL;
+		if (message->payloadlen > 0) {
+			json_err = json_parse(message->payload, message->payloadlen, &obj);
+		}
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+		
+		if (json_err) {
+			fprintf(stderr, "Warning: Ignoring invalid JSON value: %s\n", json_err);
+			free(json_err);
+		} else if (obj) {
+			switch (json_object_get_type(obj)) {
+				case json_type_int:
+				case json_type_double:
+				case json_type_boolean:
+					rrd_update(&rrd, time(NULL), json_object_get_double(obj));
+					break;
+				
+				default:
+					break;
+			}
+		}
+		if (obj) {
+			json_object_put(obj);
+		}
+		
+		// Repeat?
+		if (count > 0) {
+			if (--count == 0) {
+				break;
+			}
+		}
+	}
+	
+	// Unsubscribe again
+	if (qth_unsubscribe(client, topic) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Unable to unsubscribe from topic.\n");
+	}
+	
+	rrd_close(&rrd);
+	return return_code;
+}
+
+
+/**
+ * Parse a query time which may be 'now', an absolute time (seconds since the
+ * epoch) or a negative duration relative to now (e.g. '-1h'). Returns false
+ * if the time is not valid or lies before the epoch (or absurdly far beyond
+ * it).
+ */
+static bool parse_query_time(const char *str, int64_t now, int64_t *t) {
+	if (strcmp(str, "now") == 0) {
+		*t = now;
+		return true;
+	}
+	
+	double seconds;
+	if (!parse_duration(str, &seconds)) {
+		return false;
+	}
+	
+	if (str[0] == '-') {
+		seconds += now;
+	}
+	if (!isfinite(seconds) || seconds < 0 || seconds > QUERY_MAX_TIME) {
+		return false;
+	}
+	*t = (int64_t)seconds;
+	return true;
+}
+
+
+/**
+ * Implements the 'query' command: prints the consolidated rows of a
+ * round-robin archive file within a given time range. The archive is read
+ * directly from the mapped file and no MQTT connection is required.
+ */
+int cmd_query(const char *rrd_file,
+              const char *start,
+              const char *end,
+              const char *resolution,
+              bool json) {
+	rrd_t rrd;
+	char *err = rrd_open(rrd_file, NULL, false, &rrd);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	int64_t now = time(NULL);
+	int64_t start_time;
+	int64_t end_time;
+	if (!parse_query_time(start, now, &start_time)) {
+		fprintf(stderr, "Error: Invalid start time '%s'.\n", start);
+		rrd_close(&rrd);
+		return 1;
+	}
+	if (!parse_query_time(end, now, &end_time)) {
+		fprintf(stderr, "Error: Invalid end time '%s'.\n", end);
+		rrd_close(&rrd);
+		return 1;
+	}
+	
+	// Select the archive to read from
+	uint32_t archive;
+	if (resolution) {
+		double step;
+		if (!parse_duration(resolution, &step) || !isfinite(step) ||
+		    step < 1 || step > UINT32_MAX) {
+			fprintf(stderr, "Error: Invalid resolution '%s'.\n", resolution);
+			rrd_close(&rrd);
+			return 1;
+		}
+		for (archive = 0; archive < rrd.header->num_archives; archive++) {
+			if (rrd.archives[archive].step == (uint32_t)step) {
+				break;
+			}
+		}
+		if (archive == rrd.header->num_archives) {
+			fprintf(stderr, "Error: No archive with a resolution of %s.\n", resolution);
+			rrd_close(&rrd);
+			return 1;
+		}
+	} else {
+		archive = rrd_choose_archive(&rrd, start_time, now);
+	}
+	
+	// Don't look further back than the archive can hold (where all rows would
+	// have been overwritten anyway).
+	int64_t step = rrd.archives[archive].step;
+	int64_t retention = step * rrd.archives[archive].rows;
+	if (end_time - start_time > retention) {
+		start_time = end_time - retention;
+	}
+	if (start_time < 0) {
+		start_time = 0;
+	}
+	start_time -= start_time % step;
+	
+	for (int64_t t = start_time; t <= end_time; t += step) {
+		rrd_row_t *row = rrd_get_row(&rrd, archive, t);
+		if (row->start != t || row->count == 0) {
+			// No values recorded in this period
+			continue;
+		}
+		
+		double avg = row->sum / row->count;
+		if (json) {
+			printf("{\"time\": %lld, \"min\": %.15g, \"max\": %.15g, "
+			       "\"avg\": %.15g, \"count\": %u}\n",
+			       (long long)t, row->min, row->max, avg, row->count);
+		} else {
+			printf("%lld\t%.15g\t%.15g\t%.15g\n",
+			       (long long)t, row->min, row->max, avg);
+		}
+	}
+	
+	rrd_close(&rrd);
+	return 0;
+}
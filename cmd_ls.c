@@ -2,7 +2,10 @@
  * Implementation of the 'ls' subcommand.
  */
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "json.h"
@@ -65,8 +68,41 @@ void print_ls_json(const char *json, json_format_t json_format) {
 	free(formatted);
 }
 
+/**
+ * Print one single-line JSON object per entry in the listing of 'path', e.g.
+ * {"path":"foo/bar","behaviours":["PROPERTY-1:N"]}.
+ */
+void print_ls_ndjson(const char *path, json_object *obj) {
+	size_t path_len = strlen(path);
+	json_object_object_foreach(obj, topic, value) {
+		(void)value;
+		char *full_topic = malloc(path_len + strlen(topic) + 1);
+		strcpy(full_topic, path);
+		strcpy(full_topic + path_len, topic);
+		
+		json_object *record = json_object_new_object();
+		json_object_object_add(record, "path", json_object_new_string(full_topic));
+		json_object *behaviours_arr = json_object_new_array();
+		const char **behaviours = qth_subdirectory_get_behaviours(obj, topic);
+		for (const char **p = behaviours; *p; p++) {
+			json_object_array_add(behaviours_arr, json_object_new_string(*p));
+		}
+		free(behaviours);
+		json_object_object_add(record, "behaviours", behaviours_arr);
+		
+		printf("%s\n", json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN));
+		json_object_put(record);
+		free(full_topic);
+	}
+}
+
 /**
  * Implements the 'ls' command.
+ *
+ * Recursive listings are walked depth-first using an explicit stack of the
+ * directories still to be listed. Each listing is printed and discarded as
+ * soon as it arrives so memory use depends on the number of directories
+ * waiting on the stack, not on the size of the tree.
  */
 int cmd_ls(MQTTClient *mqtt_client,
            const char *path,
@@ -74,25 +110,45 @@ int cmd_ls(MQTTClient *mqtt_client,
            bool ls_recursive,
            ls_format_t ls_format,
            json_format_t json_format) {
-	if (ls_recursive) {
-		if (path[0] == '\0') {
-			printf("[root]:\n");
-		} else {
-			printf("%s:\n", path);
-		}
-	}
+	// The paths still to be listed, the next on top
+	size_t stack_len = 0;
+	size_t stack_size = 16;
+	char **stack = malloc(sizeof(char *) * stack_size);
+	stack[stack_len++] = alloced_copy(path);
 	
-	char *dir;
-	char *err = qth_get_directory(mqtt_client, path, &dir, meta_timeout);
-	if (err) {
-		fprintf(stderr, "Error: %s\n", err);
-		free(err);
-		return 1;
-	} else if (!dir) {
-		// Should not happen.
-		fprintf(stderr, "Error: Directory not found (dir is NULL)\n");
-		return 1;
-	} else {
+	int retval = 0;
+	bool first = true;
+	while (stack_len > 0) {
+		char *dir_path = stack[--stack_len];
+		
+		if (ls_recursive && ls_format != LS_FORMAT_NDJSON) {
+			if (!first) {
+				printf("\n");
+			}
+			if (dir_path[0] == '\0') {
+				printf("[root]:\n");
+			} else {
+				printf("%s:\n", dir_path);
+			}
+		}
+		first = false;
+		
+		char *dir;
+		char *err = qth_get_directory(mqtt_client, dir_path, &dir, meta_timeout);
+		if (err) {
+			fprintf(stderr, "Error: %s\n", err);
+			free(err);
+			free(dir_path);
+			retval = 1;
+			break;
+		} else if (!dir) {
+			// Should not happen.
+			fprintf(stderr, "Error: Directory not found (dir is NULL)\n");
+			free(dir_path);
+			retval = 1;
+			break;
+		}
+		
 		// NB: the JSON string has been verified as a valid directory listing by
 		// qth_get_directory.
 		json_object *obj = json_tokener_parse(dir);
@@ -110,37 +166,300 @@ int cmd_ls(MQTTClient *mqtt_client,
 			case LS_FORMAT_JSON:
 				print_ls_json(dir, json_format);
 				break;
+			
+			case LS_FORMAT_NDJSON:
+				print_ls_ndjson(dir_path, obj);
+				break;
 		}
 		
-		// Recurse
+		// Queue up subdirectories, pushed in reverse so that they're listed in
+		// the order they appear in this listing
 		if (ls_recursive) {
+			size_t num_subdirs = 0;
 			json_object_object_foreach(obj, part, value) {
 				(void)value;
 				if (qth_subdirectory_has_behaviour(obj, part, "DIRECTORY", true)) {
-					// Create subdir path
-					size_t path_len = strlen(path);
-					size_t part_len = strlen(part);
-					char *subpath = alloca(path_len + part_len + 1 + 1);
-					strcpy(subpath, path);
-					strcpy(subpath + path_len, part);
+					num_subdirs++;
+				}
+			}
+			
+			if (stack_len + num_subdirs > stack_size) {
+				while (stack_len + num_subdirs > stack_size) {
+					stack_size *= 2;
+				}
+				stack = realloc(stack, sizeof(char *) * stack_size);
+			}
+			
+			size_t path_len = strlen(dir_path);
+			size_t i = stack_len + num_subdirs;
+			json_object_object_foreach(obj, part2, value2) {
+				(void)value2;
+				if (qth_subdirectory_has_behaviour(obj, part2, "DIRECTORY", true)) {
+					size_t part_len = strlen(part2);
+					char *subpath = malloc(path_len + part_len + 1 + 1);
+					strcpy(subpath, dir_path);
+					strcpy(subpath + path_len, part2);
 					subpath[path_len + part_len] = '/';
 					subpath[path_len + part_len + 1] = '\0';
-					
-					// Recurse
-					printf("\n");
-					int state = cmd_ls(mqtt_client, subpath, meta_timeout, ls_recursive,
-					                   ls_format, json_format);
-					if (state != 0) {
-						return state;
-					}
+					stack[--i] = subpath;
 				}
 			}
+			stack_len += num_subdirs;
 		}
 		
 		json_object_put(obj);
+		free(dir);
+		free(dir_path);
 	}
 	
-	free(dir);
+	while (stack_len > 0) {
+		free(stack[--stack_len]);
+	}
+	free(stack);
+	
+	return retval;
+}
+
+
+// Set by a signal handler when ls --watch should stop
+static volatile sig_atomic_t ls_watch_stop = 0;
+
+static void ls_watch_signal_handler(int signum) {
+	(void)signum;
+	ls_watch_stop = 1;
+}
+
+static void ls_watch_free_listing(void *listing) {
+	json_object_put(listing);
+}
+
+/**
+ * Is 'behaviour' in a NULL-terminated array of behaviours (which may itself
+ * be NULL, meaning empty)?
+ */
+static bool behaviours_contain(const char **behaviours, const char *behaviour) {
+	for (const char **p = behaviours; p && *p; p++) {
+		if (strcmp(*p, behaviour) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Print the changes to the behaviours of a single topic for ls --watch.
+ * Either array of behaviours may be NULL (the topic wasn't, or is no longer,
+ * listed). Prints nothing if the behaviours are unchanged.
+ */
+static void print_ls_watch_change(const char *path, const char *topic,
+                                  const char **old_behaviours,
+                                  const char **new_behaviours,
+                                  ls_format_t ls_format) {
+	// Find the behaviours removed and added
+	size_t num_old = 0;
+	size_t num_new = 0;
+	for (const char **p = old_behaviours; p && *p; p++) {
+		num_old++;
+	}
+	for (const char **p = new_behaviours; p && *p; p++) {
+		num_new++;
+	}
+	const char *removed[num_old + 1];
+	const char *added[num_new + 1];
+	size_t num_removed = 0;
+	size_t num_added = 0;
+	for (size_t i = 0; i < num_old; i++) {
+		if (!behaviours_contain(new_behaviours, old_behaviours[i])) {
+			removed[num_removed++] = old_behaviours[i];
+		}
+	}
+	for (size_t i = 0; i < num_new; i++) {
+		if (!behaviours_contain(old_behaviours, new_behaviours[i])) {
+			added[num_added++] = new_behaviours[i];
+		}
+	}
+	removed[num_removed] = NULL;
+	added[num_added] = NULL;
+	if (num_removed == 0 && num_added == 0) {
+		return;
+	}
+	
+	switch (ls_format) {
+		case LS_FORMAT_SHORT: {
+			// Only show topics appearing or disappearing as a directory or
+			// non-directory (as listed by plain 'ls').
+			bool was_directory = behaviours_contain(old_behaviours, "DIRECTORY");
+			bool is_directory = behaviours_contain(new_behaviours, "DIRECTORY");
+			bool was_non_directory = num_old > (was_directory ? 1 : 0);
+			bool is_non_directory = num_new > (is_directory ? 1 : 0);
+			if (was_directory != is_directory) {
+				printf("%c %s%s/\n", is_directory ? '+' : '-', path, topic);
+			}
+			if (was_non_directory != is_non_directory) {
+				printf("%c %s%s\n", is_non_directory ? '+' : '-', path, topic);
+			}
+			break;
+		}
+		
+		case LS_FORMAT_LONG:
+			for (const char **p = removed; *p; p++) {
+				printf("- %s\t%s%s%s\n", *p, path, topic,
+				       strcmp(*p, "DIRECTORY") == 0 ? "/" : "");
+			}
+			for (const char **p = added; *p; p++) {
+				printf("+ %s\t%s%s%s\n", *p, path, topic,
+				       strcmp(*p, "DIRECTORY") == 0 ? "/" : "");
+			}
+			break;
+		
+		case LS_FORMAT_JSON:
+		case LS_FORMAT_NDJSON: {
+			// {"path": ..., "behaviours": [...], "added": [...], "removed": [...]}
+			size_t path_len = strlen(path);
+			char *full_topic = malloc(path_len + strlen(topic) + 1);
+			strcpy(full_topic, path);
+			strcpy(full_topic + path_len, topic);
+			
+			json_object *record = json_object_new_object();
+			json_object_object_add(record, "path", json_object_new_string(full_topic));
+			const char **arrays[3] = {new_behaviours, added, removed};
+			const char *names[3] = {"behaviours", "added", "removed"};
+			for (int i = 0; i < 3; i++) {
+				json_object *arr = json_object_new_array();
+				for (const char **p = arrays[i]; p && *p; p++) {
+					json_object_array_add(arr, json_object_new_string(*p));
+				}
+				json_object_object_add(record, names[i], arr);
+			}
+			
+			printf("%s\n", json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN));
+			json_object_put(record);
+			free(full_topic);
+			break;
+		}
+	}
+}
+
+/**
+ * Print the differences between two listings of the directory 'path' for ls
+ * --watch. Either listing may be NULL (i.e. empty).
+ */
+static void print_ls_watch_diff(const char *path, json_object *old_listing,
+                                json_object *new_listing,
+                                ls_format_t ls_format) {
+	// Topics added or changed
+	if (new_listing) {
+		json_object_object_foreach(new_listing, topic, value) {
+			(void)value;
+			const char **old_behaviours = old_listing
+				? qth_subdirectory_get_behaviours(old_listing, topic)
+				: NULL;
+			const char **new_behaviours = qth_subdirectory_get_behaviours(new_listing, topic);
+			print_ls_watch_change(path, topic, old_behaviours, new_behaviours,
+			                      ls_format);
+			free(old_behaviours);
+			free(new_behaviours);
+		}
+	}
+	
+	// Topics removed
+	if (old_listing) {
+		json_object_object_foreach(old_listing, topic, value) {
+			(void)value;
+			json_object *entries;
+			if (new_listing && json_object_object_get_ex(new_listing, topic, &entries)) {
+				continue;
+			}
+			const char **old_behaviours = qth_subdirectory_get_behaviours(old_listing, topic);
+			print_ls_watch_change(path, topic, old_behaviours, NULL, ls_format);
+			free(old_behaviours);
+		}
+	}
+}
+
+/**
+ * Implements 'ls --watch': prints the contents of a directory (and, if
+ * 'ls_recursive' is true, its subdirectories) and then the changes to them as
+ * updated listings arrive, until interrupted. Each line is prefixed with '+'
+ * or '-' (or, for JSON output, gives the behaviours 'added' and 'removed').
+ *
+ * The last listing received for each directory is kept and each new listing
+ * is compared against it, so only the topics which changed are printed.
+ */
+int cmd_ls_watch(MQTTClient *client,
+                 const char *path,
+                 bool ls_recursive,
+                 ls_format_t ls_format) {
+	size_t path_len = strlen(path);
+	if (path_len > 0 && path[path_len - 1] != '/') {
+		fprintf(stderr, "Error: Path is not a valid directory name "
+		                "(must end in '/' or be empty).\n");
+		return 1;
+	}
+	
+	signal(SIGINT, ls_watch_signal_handler);
+	signal(SIGTERM, ls_watch_signal_handler);
+	
+	// Subscribe to the directory's listing or, when recursive, every listing
+	// below it (which picks up new subdirectories as they appear).
+	char *ls_topic = malloc(8 + path_len + 1 + 1);
+	sprintf(ls_topic, ls_recursive ? "meta/ls/%s#" : "meta/ls/%s", path);
+	if (qth_subscribe(client, ls_topic, qth_qos(QOS_CLASS_META), 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to directory listings.\n");
+		free(ls_topic);
+		return 1;
+	}
+	
+	// The last listing received for each directory (NULL if empty/removed)
+	strmap_t *listings = strmap_new();
+	
+	int return_code = 0;
+	while (!ls_watch_stop) {
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+		                           &message, 1000);
+		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			if (!ls_watch_stop) {
+				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+				return_code = 1;
+			}
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		
+		// NB: An empty payload means the directory has been removed
+		const char *dir_path = rx_topic + 8;
+		json_object *listing = NULL;
+		char *err = NULL;
+		if (message->payloadlen > 0) {
+			err = json_parse(message->payload, message->payloadlen, &listing);
+			if (!err && !qth_is_directory_listing(listing)) {
+				json_object_put(listing);
+				listing = NULL;
+				err = alloced_copy("Malformed directory listing.");
+			}
+		}
+		
+		if (err) {
+			fprintf(stderr, "Warning: Ignoring listing of '%s': %s\n", dir_path, err);
+			free(err);
+		} else {
+			json_object *old_listing = strmap_set(listings, dir_path, listing);
+			print_ls_watch_diff(dir_path, old_listing, listing, ls_format);
+			json_object_put(old_listing);
+		}
+		
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
 	
-	return 0;
+	qth_unsubscribe(client, ls_topic);
+	free(ls_topic);
+	strmap_free(listings, ls_watch_free_listing);
+	return return_code;
 }
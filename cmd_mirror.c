@@ -0,0 +1,212 @@
+/**
+ * Implementation of the mirror command and of 'get --local' which reads
+ * values back from the mirror.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+#include "qth_mirror.h"
+
+
+// Set by a signal handler when the mirror should shut down
+static volatile sig_atomic_t mirror_stop = 0;
+
+static void mirror_signal_handler(int signum) {
+	(void)signum;
+	mirror_stop = 1;
+}
+
+
+/**
+ * Handle a directory listing received while mirroring: add any properties
+ * listed which are not yet in the mirror and subscribe to them. Returns an
+ * error message (to be freed by the caller) or NULL on success.
+ */
+static char *mirror_listing(MQTTClient *client, qth_mirror_t *mirror,
+                            const char *path, const char *payload,
+                            int payload_len) {
+	char **topics;
+	char *err = qth_listing_get_topics(path, payload, payload_len,
+	                                   "PROPERTY", &topics);
+	if (err) {
+		return err;
+	}
+	
+	// Collect the new properties so that they can be subscribed to at once
+	int num_new = 0;
+	for (char **topic = topics; *topic; topic++) {
+		if (qth_mirror_contains(mirror, *topic)) {
+			continue;
+		}
+		
+		// Add the property (with no value) until its value arrives
+		char *err = qth_mirror_set(mirror, *topic, NULL, 0);
+		if (err) {
+			fprintf(stderr, "Warning: Not mirroring '%s': %s\n", *topic, err);
+			free(err);
+			continue;
+		}
+		
+		// Move to the front of the array
+		char *new_topic = *topic;
+		*topic = topics[num_new];
+		topics[num_new++] = new_topic;
+	}
+	
+	if (num_new > 0) {
+		int qos[num_new];
+		for (int i = 0; i < num_new; i++) {
+			qos[i] = qth_qos(QOS_CLASS_WATCH);
+		}
+		if (qth_subscribe_many(client, num_new, topics, qos, 0) != MQTTCLIENT_SUCCESS) {
+			err = alloced_copy("Could not subscribe to properties.");
+		}
+	}
+	
+	free_string_array(topics);
+	return err;
+}
+
+
+/**
+ * Implements the 'mirror' command: keeps the current value of every property
+ * in (and below) a directory in a shared memory mirror.
+ */
+int cmd_mirror(MQTTClient *client,
+               const char *path,
+               const char *mirror_name,
+               int num_slots,
+               int value_size) {
+	size_t path_len = strlen(path);
+	if (path_len > 0 && path[path_len - 1] != '/') {
+		fprintf(stderr, "Error: Path is not a valid directory name "
+		                "(must end in '/' or be empty).\n");
+		return 1;
+	}
+	
+	qth_mirror_t *mirror;
+	char *err = qth_mirror_create(mirror_name, num_slots, value_size, &mirror);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	// Make sure the mirror is removed when we're interrupted
+	signal(SIGINT, mirror_signal_handler);
+	signal(SIGTERM, mirror_signal_handler);
+	
+	// Subscribe to every directory listing within the path. Properties are
+	// subscribed to as they're discovered in these listings.
+	char *ls_topic = malloc(8 + path_len + 1 + 1);
+	sprintf(ls_topic, "meta/ls/%s#", path);
+	if (qth_subscribe(client, ls_topic, qth_qos(QOS_CLASS_META), 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to directory listings.\n");
+		free(ls_topic);
+		qth_mirror_destroy(mirror, mirror_name);
+		return 1;
+	}
+	
+	int return_code = 0;
+	while (!mirror_stop) {
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+		                           &message, 1000);
+		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			if (!mirror_stop) {
+				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+				return_code = 1;
+			}
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		
+		char *err = NULL;
+		if (strncmp(rx_topic, "meta/ls/", 8) == 0) {
+			err = mirror_listing(client, mirror, rx_topic + 8,
+			                     message->payload, message->payloadlen);
+		} else if (message->payloadlen == 0) {
+			// Property deleted
+			err = qth_mirror_set(mirror, rx_topic, NULL, 0);
+		} else {
+			err = json_validate(message->payload, message->payloadlen);
+			if (!err) {
+				err = qth_mirror_set(mirror, rx_topic,
+				                     message->payload, message->payloadlen);
+			}
+		}
+		if (err) {
+			fprintf(stderr, "Warning: Ignoring value of '%s': %s\n", rx_topic, err);
+			free(err);
+		}
+		
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	qth_unsubscribe(client, ls_topic);
+	free(ls_topic);
+	qth_mirror_destroy(mirror, mirror_name);
+	return return_code;
+}
+
+
+/**
+ * Implements 'get --local': prints the value of a property from the shared
+ * memory mirror without contacting the broker.
+ */
+int cmd_get_local(const char *topic,
+                  const char *mirror_name,
+                  json_format_t json_format) {
+	qth_mirror_t *mirror;
+	char *err = qth_mirror_open(mirror_name, &mirror);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	size_t value_size = qth_mirror_value_size(mirror);
+	char *value = malloc(value_size);
+	qth_mirror_result_t result = qth_mirror_get(mirror, topic, value,
+	                                            value_size, NULL);
+	qth_mirror_close(mirror);
+	
+	int return_code = 1;
+	switch (result) {
+		case QTH_MIRROR_OK: {
+			char *out = json_to_format(value, json_format);
+			printf("%s\n", out);
+			free(out);
+			return_code = 0;
+			break;
+		}
+		
+		case QTH_MIRROR_NOT_FOUND:
+			fprintf(stderr, "Error: Topic is not a mirrored property.\n");
+			break;
+		
+		case QTH_MIRROR_NO_VALUE:
+			fprintf(stderr, "Error: Property has not been set (or was deleted).\n");
+			break;
+		
+		case QTH_MIRROR_TOO_LARGE:
+			fprintf(stderr, "Error: Property value too large to mirror.\n");
+			break;
+	}
+	
+	free(value);
+	return return_code;
+}
@@ -0,0 +1,349 @@
+/**
+ * Implementation of the ping command: measures the round-trip time of events
+ * sent via the broker.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The number of probes which may be outstanding at once. Older probes are
+// treated as lost when their slot is reused.
+#define PING_MAX_OUTSTANDING 4096
+
+// State of a probe which has been sent
+typedef struct {
+	uint64_t seq;
+	uint64_t sent_ns;  // (monotonic_ns)
+	bool received;
+	bool lost;
+} ping_probe_t;
+
+// Statistics accumulated while pinging
+typedef struct {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t lost;
+	
+	// Probes which arrived after an earlier-sent probe
+	uint64_t reordered;
+	
+	// Probes which arrived more than once
+	uint64_t duplicates;
+	
+	// Probes which arrived after being counted as lost
+	uint64_t late;
+	
+	// Highest sequence number received so far (+1, or 0 if none)
+	uint64_t next_expected;
+	
+	// Round-trip times of all received probes (ms)
+	double *rtts;
+	size_t num_rtts;
+	size_t rtts_capacity;
+} ping_stats_t;
+
+// Set by a signal handler when pinging should stop
+static volatile sig_atomic_t ping_stop = 0;
+
+static void ping_signal_handler(int signum) {
+	(void)signum;
+	ping_stop = 1;
+}
+
+
+/**
+ * Handle a received probe payload. Returns the round-trip time in ms or a
+ * negative value if the probe wasn't one of ours (or was a duplicate or late).
+ */
+static double ping_receive(ping_probe_t *probes, ping_stats_t *stats,
+                           const char *payload, int payload_len,
+                           uint64_t now, uint64_t *seq_out) {
+	json_object *obj;
+	char *err = json_parse(payload, payload_len, &obj);
+	if (err) {
+		free(err);
+		return -1.0;
+	}
+	
+	json_object *seq_obj;
+	json_object *sent_obj;
+	if (!json_object_is_type(obj, json_type_object) ||
+	    !json_object_object_get_ex(obj, "seq", &seq_obj) ||
+	    !json_object_object_get_ex(obj, "sent", &sent_obj)) {
+		json_object_put(obj);
+		return -1.0;
+	}
+	uint64_t seq = json_object_get_int64(seq_obj);
+	uint64_t sent_ns = json_object_get_int64(sent_obj);
+	json_object_put(obj);
+	
+	// Ignore probes from other instances (or from before the slot was reused)
+	ping_probe_t *probe = &probes[seq % PING_MAX_OUTSTANDING];
+	if (seq >= stats->sent || probe->seq != seq || probe->sent_ns != sent_ns) {
+		return -1.0;
+	}
+	
+	if (probe->received) {
+		stats->duplicates++;
+		return -1.0;
+	}
+	probe->received = true;
+	if (probe->lost) {
+		stats->late++;
+		return -1.0;
+	}
+	
+	stats->received++;
+	if (seq + 1 < stats->next_expected) {
+		stats->reordered++;
+	} else {
+		stats->next_expected = seq + 1;
+	}
+	
+	double rtt = (now - probe->sent_ns) / 1e6;
+	if (stats->num_rtts == stats->rtts_capacity) {
+		stats->rtts_capacity = stats->rtts_capacity ? stats->rtts_capacity * 2 : 64;
+		stats->rtts = realloc(stats->rtts, sizeof(double) * stats->rtts_capacity);
+	}
+	stats->rtts[stats->num_rtts++] = rtt;
+	
+	*seq_out = seq;
+	return rtt;
+}
+
+
+static int compare_double(const void *a, const void *b) {
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+
+/**
+ * Print the summary statistics, either in a human readable form or as a single
+ * JSON object.
+ */
+static void ping_print_summary(const char *topic, ping_stats_t *stats, bool json) {
+	double loss = stats->sent ? (100.0 * stats->lost) / stats->sent : 0.0;
+	
+	// Compute the RTT distribution (percentiles use the nearest-rank method)
+	double min = 0.0, avg = 0.0, max = 0.0, p50 = 0.0, p90 = 0.0, p99 = 0.0;
+	if (stats->num_rtts > 0) {
+		qsort(stats->rtts, stats->num_rtts, sizeof(double), compare_double);
+		double sum = 0.0;
+		for (size_t i = 0; i < stats->num_rtts; i++) {
+			sum += stats->rtts[i];
+		}
+		min = stats->rtts[0];
+		max = stats->rtts[stats->num_rtts - 1];
+		avg = sum / stats->num_rtts;
+		p50 = stats->rtts[((stats->num_rtts * 50) + 99) / 100 - 1];
+		p90 = stats->rtts[((stats->num_rtts * 90) + 99) / 100 - 1];
+		p99 = stats->rtts[((stats->num_rtts * 99) + 99) / 100 - 1];
+	}
+	
+	if (json) {
+		json_object *summary = json_object_new_object();
+		json_object_object_add(summary, "topic", json_object_new_string(topic));
+		json_object_object_add(summary, "sent", json_object_new_int64(stats->sent));
+		json_object_object_add(summary, "received", json_object_new_int64(stats->received));
+		json_object_object_add(summary, "lost", json_object_new_int64(stats->lost));
+		json_object_object_add(summary, "loss_percent", json_object_new_double(loss));
+		json_object_object_add(summary, "reordered", json_object_new_int64(stats->reordered));
+		json_object_object_add(summary, "duplicates", json_object_new_int64(stats->duplicates));
+		json_object_object_add(summary, "late", json_object_new_int64(stats->late));
+		if (stats->num_rtts > 0) {
+			json_object *rtt = json_object_new_object();
+			json_object_object_add(rtt, "min", json_object_new_double(min));
+			json_object_object_add(rtt, "avg", json_object_new_double(avg));
+			json_object_object_add(rtt, "max", json_object_new_double(max));
+			json_object_object_add(rtt, "p50", json_object_new_double(p50));
+			json_object_object_add(rtt, "p90", json_object_new_double(p90));
+			json_object_object_add(rtt, "p99", json_object_new_double(p99));
+			json_object_object_add(summary, "rtt_ms", rtt);
+		} else {
+			json_object_object_add(summary, "rtt_ms", NULL);
+		}
+		printf("%s\n", json_object_to_json_string_ext(summary, JSON_C_TO_STRING_PLAIN));
+		json_object_put(summary);
+	} else {
+		printf("\n--- %s ping statistics ---\n", topic);
+		printf("%llu probes sent, %llu received, %.1f%% loss, "
+		       "%llu reordered, %llu duplicates, %llu late\n",
+		       (unsigned long long)stats->sent,
+		       (unsigned long long)stats->received,
+		       loss,
+		       (unsigned long long)stats->reordered,
+		       (unsigned long long)stats->duplicates,
+		       (unsigned long long)stats->late);
+		if (stats->num_rtts > 0) {
+			printf("rtt min/avg/max/p50/p90/p99 = "
+			       "%.3f/%.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+			       min, avg, max, p50, p90, p99);
+		}
+	}
+}
+
+
+/**
+ * Implements the 'ping' command: repeatedly sends timestamped events to a
+ * (registered) topic and reports the time taken for each to be received back
+ * via the broker.
+ */
+int cmd_ping(MQTTClient *client,
+             const char *topic,
+             double interval,
+             bool json,
+             int count,
+             int timeout,
+             int send_timeout) {
+	if (qth_subscribe(client, topic, qth_qos(QOS_CLASS_WATCH), 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to '%s'.\n", topic);
+		return 1;
+	}
+	
+	// Print the statistics when interrupted
+	signal(SIGINT, ping_signal_handler);
+	signal(SIGTERM, ping_signal_handler);
+	
+	ping_probe_t *probes = calloc(PING_MAX_OUTSTANDING, sizeof(ping_probe_t));
+	ping_stats_t stats = {0};
+	
+	uint64_t interval_ns = interval * 1e9;
+	uint64_t timeout_ns = (uint64_t)timeout * 1000000ull;
+	uint64_t next_send = monotonic_ns();
+	
+	// The oldest probe which has neither been received nor declared lost
+	uint64_t oldest = 0;
+	
+	int return_code = 0;
+	while (!ping_stop) {
+		uint64_t now = monotonic_ns();
+		
+		// Send the next probe
+		if ((count == 0 || stats.sent < (uint64_t)count) && now >= next_send) {
+			ping_probe_t *probe = &probes[stats.sent % PING_MAX_OUTSTANDING];
+			if (stats.sent >= PING_MAX_OUTSTANDING && !probe->received && !probe->lost) {
+				// Slot about to be reused: too old to wait for
+				stats.lost++;
+			}
+			probe->seq = stats.sent;
+			probe->sent_ns = now;
+			probe->received = false;
+			probe->lost = false;
+			
+			char payload[64];
+			snprintf(payload, sizeof(payload), "{\"seq\": %llu, \"sent\": %llu}",
+			         (unsigned long long)probe->seq,
+			         (unsigned long long)probe->sent_ns);
+			stats.sent++;
+			
+			char *err = qth_send_event(client, topic, payload, send_timeout);
+			if (err) {
+				fprintf(stderr, "Error: %s\n", err);
+				free(err);
+				return_code = 1;
+				break;
+			}
+			
+			next_send += interval_ns;
+			if (next_send <= now) {
+				next_send = now + interval_ns;
+			}
+			continue;
+		}
+		
+		// Expire probes which haven't arrived within the timeout
+		while (oldest < stats.sent) {
+			ping_probe_t *probe = &probes[oldest % PING_MAX_OUTSTANDING];
+			if (probe->seq != oldest || probe->received) {
+				oldest++;
+			} else if (now - probe->sent_ns >= timeout_ns) {
+				probe->lost = true;
+				stats.lost++;
+				if (!json) {
+					printf("seq=%llu lost\n", (unsigned long long)oldest);
+				}
+				oldest++;
+			} else {
+				break;
+			}
+		}
+		
+		// Stop once the last probe has been accounted for
+		if (count != 0 && stats.sent >= (uint64_t)count && oldest >= stats.sent) {
+			break;
+		}
+		
+		// Wait for a probe to arrive until the next probe is due to be sent or
+		// the oldest outstanding probe times out.
+		uint64_t deadline = UINT64_MAX;
+		if (count == 0 || stats.sent < (uint64_t)count) {
+			deadline = next_send;
+		}
+		if (oldest < stats.sent) {
+			uint64_t expiry = probes[oldest % PING_MAX_OUTSTANDING].sent_ns + timeout_ns;
+			if (expiry < deadline) {
+				deadline = expiry;
+			}
+		}
+		unsigned long wait_ms = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+		if (wait_ms > 1000) {
+			wait_ms = 1000;
+		}
+		
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+		                           &message, wait_ms);
+		now = monotonic_ns();
+		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			if (!ping_stop) {
+				fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+				return_code = 1;
+			}
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		
+		if (strcmp(rx_topic, topic) == 0 && message->payloadlen > 0) {
+			uint64_t seq;
+			uint64_t reordered_before = stats.reordered;
+			double rtt = ping_receive(probes, &stats, message->payload,
+			                          message->payloadlen, now, &seq);
+			if (rtt >= 0.0 && !json) {
+				printf("seq=%llu time=%.3f ms%s\n",
+				       (unsigned long long)seq, rtt,
+				       stats.reordered != reordered_before ? " (reordered)" : "");
+			}
+		}
+		
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	qth_unsubscribe(client, topic);
+	
+	ping_print_summary(topic, &stats, json);
+	
+	free(probes);
+	free(stats.rtts);
+	
+	if (return_code == 0 && stats.received == 0) {
+		// Like ping(1), fail when nothing came back
+		return_code = 1;
+	}
+	return return_code;
+}
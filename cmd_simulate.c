@@ -0,0 +1,512 @@
+/**
+ * Implementation of the simulate command: registers many synthetic
+ * properties and events (as a single client) and publishes generated values
+ * to them at configured rates.
+ *
+ * The simulation is described by a JSON spec file:
+ *
+ *     {
+ *       "description": "Simulated sensors",
+ *       "topics": [
+ *         {"topic": "sim/room{}/temperature", "count": 100,
+ *          "behaviour": "PROPERTY-1:N", "rate": 0.2,
+ *          "generator": "sine", "min": 15, "max": 25, "period": 600},
+ *         {"topic": "sim/doorbell", "behaviour": "EVENT-1:N", "rate": 0.01}
+ *       ]
+ *     }
+ *
+ * Each entry is expanded into 'count' topics (default 1), with '{}' in the
+ * name replaced by the index. Each topic is published to at 'rate' messages
+ * per second, with at most 'burst' messages sent back-to-back when catching
+ * up (a token bucket per topic). Entries with a rate of zero are published
+ * once at the start.
+ *
+ * The generators are:
+ *
+ * * "constant" (the default): always 'value' (any JSON, default null)
+ * * "counter": 'start', 'start' + 'step', ... (defaults 0 and 1)
+ * * "random": uniformly distributed between 'min' and 'max' (defaults 0, 1)
+ * * "sine": a sine wave between 'min' and 'max' (defaults -1 and 1) with the
+ *   given 'period' (seconds, default 60) and a random phase per topic
+ * * "toggle": alternately true and false
+ *
+ * The topics due next are kept in a binary heap ordered by when their next
+ * token is due. Values are published without waiting for each to be
+ * acknowledged; when the client's in-flight window is full the scheduler
+ * processes acknowledgements until there is room.
+ */
+
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The longest value produced by a numeric generator
+#define SIM_MAX_VALUE_LEN 32
+
+// The most values sent before acknowledgements are processed
+#define SIM_MAX_BATCH 256
+
+typedef enum {
+	SIM_GENERATOR_CONSTANT = 0,
+	SIM_GENERATOR_COUNTER,
+	SIM_GENERATOR_RANDOM,
+	SIM_GENERATOR_SINE,
+	SIM_GENERATOR_TOGGLE,
+} sim_generator_t;
+
+// An entry in the spec (shared by each of the topics it expands into)
+typedef struct {
+	bool is_property;
+	double rate;  // Messages per second
+	double burst;  // Maximum tokens
+	
+	sim_generator_t generator;
+	char *constant;  // JSON value (for SIM_GENERATOR_CONSTANT)
+	double min;
+	double max;
+	double start;
+	double step;
+	double period;  // Seconds
+} sim_entry_t;
+
+// A simulated topic
+typedef struct {
+	char *topic;
+	sim_entry_t *entry;
+	
+	// Token bucket state
+	double tokens;
+	uint64_t refilled_ns;
+	uint64_t next_ns;
+	
+	uint64_t num_sent;
+	double phase;  // Seconds (for sine)
+} sim_topic_t;
+
+// Set by a signal handler when the simulation should stop
+static volatile sig_atomic_t simulate_stop = 0;
+
+static void simulate_signal_handler(int signum) {
+	(void)signum;
+	simulate_stop = 1;
+}
+
+
+/**
+ * Get a number from an object, or 'def' if it is absent.
+ */
+static double sim_get_double(json_object *obj, const char *key, double def) {
+	json_object *value;
+	if (json_object_object_get_ex(obj, key, &value)) {
+		return json_object_get_double(value);
+	}
+	return def;
+}
+
+
+/**
+ * Parse a spec entry into 'entry', returning the number of topics it expands
+ * into via 'count'. Returns an error message (to be freed by the caller) or
+ * NULL on success.
+ */
+static char *sim_parse_entry(json_object *obj, sim_entry_t *entry,
+                             const char **topic, const char **behaviour,
+                             const char **description, int *count) {
+	json_object *value;
+	if (!json_object_is_type(obj, json_type_object) ||
+	    !json_object_object_get_ex(obj, "topic", &value) ||
+	    !json_object_is_type(value, json_type_string)) {
+		return alloced_copy("Each entry must be an object with a 'topic'.");
+	}
+	*topic = json_object_get_string(value);
+	
+	*behaviour = "PROPERTY-1:N";
+	if (json_object_object_get_ex(obj, "behaviour", &value)) {
+		*behaviour = json_object_get_string(value);
+	}
+	if (strcmp(*behaviour, "PROPERTY-1:N") == 0) {
+		entry->is_property = true;
+	} else if (strcmp(*behaviour, "EVENT-1:N") == 0) {
+		entry->is_property = false;
+	} else {
+		return alloced_cat("Behaviour must be PROPERTY-1:N or EVENT-1:N, not ",
+		                   *behaviour);
+	}
+	
+	*description = "Simulated.";
+	if (json_object_object_get_ex(obj, "description", &value)) {
+		*description = json_object_get_string(value);
+	}
+	
+	*count = (int)sim_get_double(obj, "count", 1);
+	entry->rate = sim_get_double(obj, "rate", 1.0);
+	entry->burst = sim_get_double(obj, "burst", 1.0);
+	if (*count < 1 || entry->rate < 0.0 || entry->burst < 1.0) {
+		return alloced_cat("'count' and 'burst' must be at least 1 and 'rate' "
+		                   "not negative for ", *topic);
+	}
+	
+	const char *generator = "constant";
+	if (json_object_object_get_ex(obj, "generator", &value)) {
+		generator = json_object_get_string(value);
+	}
+	entry->constant = NULL;
+	if (strcmp(generator, "constant") == 0) {
+		entry->generator = SIM_GENERATOR_CONSTANT;
+		entry->constant = alloced_copy(
+			json_object_object_get_ex(obj, "value", &value)
+			? json_object_to_json_string_ext(value, JSON_C_TO_STRING_PLAIN)
+			: "null");
+	} else if (strcmp(generator, "counter") == 0) {
+		entry->generator = SIM_GENERATOR_COUNTER;
+	} else if (strcmp(generator, "random") == 0) {
+		entry->generator = SIM_GENERATOR_RANDOM;
+	} else if (strcmp(generator, "sine") == 0) {
+		entry->generator = SIM_GENERATOR_SINE;
+	} else if (strcmp(generator, "toggle") == 0) {
+		entry->generator = SIM_GENERATOR_TOGGLE;
+	} else {
+		return alloced_cat("Unknown generator: ", generator);
+	}
+	
+	bool is_sine = entry->generator == SIM_GENERATOR_SINE;
+	entry->min = sim_get_double(obj, "min", is_sine ? -1.0 : 0.0);
+	entry->max = sim_get_double(obj, "max", 1.0);
+	entry->start = sim_get_double(obj, "start", 0.0);
+	entry->step = sim_get_double(obj, "step", 1.0);
+	entry->period = sim_get_double(obj, "period", 60.0);
+	if (entry->period <= 0.0) {
+		return alloced_cat("'period' must be positive for ", *topic);
+	}
+	
+	return NULL;
+}
+
+
+/**
+ * Return the name of the index'th topic of an entry, i.e. the entry's name
+ * with '{}' replaced by the index (to be freed by the caller).
+ */
+static char *sim_topic_name(const char *name, int index) {
+	const char *placeholder = strstr(name, "{}");
+	if (!placeholder) {
+		return alloced_copy(name);
+	}
+	size_t prefix_len = placeholder - name;
+	size_t len = strlen(name) + 16;
+	char *topic = malloc(len);
+	snprintf(topic, len, "%.*s%d%s", (int)prefix_len, name, index, placeholder + 2);
+	return topic;
+}
+
+
+/**
+ * Load a spec file, returning the topics to simulate (via 'topics' and
+ * 'num_topics'), the entries they refer to (via 'entries' and
+ * 'num_entries') and the registration message (via 'registration', a JSON
+ * string). Returns an error message (to be freed by the caller) or NULL on
+ * success.
+ */
+static char *sim_load_spec(const char *filename,
+                           sim_topic_t **topics, size_t *num_topics,
+                           sim_entry_t **entries, size_t *num_entries,
+                           char **registration) {
+	*topics = NULL;
+	*num_topics = 0;
+	*entries = NULL;
+	*num_entries = 0;
+	*registration = NULL;
+	
+	json_object *spec = json_object_from_file(filename);
+	if (!spec) {
+		return alloced_cat("Couldn't read spec file: ", json_util_get_last_err());
+	}
+	
+	json_object *description;
+	json_object *entry_objs;
+	if (!json_object_object_get_ex(spec, "topics", &entry_objs) ||
+	    !json_object_is_type(entry_objs, json_type_array)) {
+		json_object_put(spec);
+		return alloced_copy("Spec must be an object with a 'topics' array.");
+	}
+	json_object *reg = registration_new(
+		json_object_object_get_ex(spec, "description", &description)
+		? json_object_get_string(description)
+		: "Simulated devices.");
+	
+	size_t capacity = 16;
+	*topics = malloc(sizeof(sim_topic_t) * capacity);
+	*num_entries = json_object_array_length(entry_objs);
+	*entries = calloc(*num_entries, sizeof(sim_entry_t));
+	char *err = NULL;
+	for (size_t i = 0; i < *num_entries && !err; i++) {
+		sim_entry_t *entry = &(*entries)[i];
+		const char *name = NULL;
+		const char *behaviour = NULL;
+		const char *topic_description = NULL;
+		int count = 0;
+		err = sim_parse_entry(json_object_array_get_idx(entry_objs, i), entry,
+		                      &name, &behaviour, &topic_description, &count);
+		for (int j = 0; !err && j < count; j++) {
+			if (*num_topics == capacity) {
+				capacity *= 2;
+				*topics = realloc(*topics, sizeof(sim_topic_t) * capacity);
+			}
+			sim_topic_t *topic = &(*topics)[(*num_topics)++];
+			memset(topic, 0, sizeof(sim_topic_t));
+			topic->topic = sim_topic_name(name, j);
+			topic->entry = entry;
+			topic->phase = entry->period * (rand() / (double)RAND_MAX);
+			
+			// Simulated properties are removed when the simulation stops
+			registration_add_topic(reg, topic->topic, behaviour,
+			                       topic_description, NULL, entry->is_property);
+		}
+	}
+	
+	*registration = alloced_copy(json_object_to_json_string_ext(reg, JSON_C_TO_STRING_PLAIN));
+	json_object_put(reg);
+	json_object_put(spec);
+	return err;
+}
+
+
+/**
+ * Generate the next value for a topic into 'buf', returning the value (which
+ * may not be 'buf').
+ */
+static const char *sim_generate(sim_topic_t *topic, double elapsed,
+                                char buf[SIM_MAX_VALUE_LEN]) {
+	sim_entry_t *entry = topic->entry;
+	switch (entry->generator) {
+		case SIM_GENERATOR_CONSTANT:
+			return entry->constant;
+		
+		case SIM_GENERATOR_COUNTER:
+			snprintf(buf, SIM_MAX_VALUE_LEN, "%.15g",
+			         entry->start + entry->step * topic->num_sent);
+			return buf;
+		
+		case SIM_GENERATOR_RANDOM:
+			snprintf(buf, SIM_MAX_VALUE_LEN, "%.6g",
+			         entry->min + (entry->max - entry->min) * (rand() / (double)RAND_MAX));
+			return buf;
+		
+		case SIM_GENERATOR_SINE: {
+			double x = sin(2.0 * M_PI * (elapsed + topic->phase) / entry->period);
+			snprintf(buf, SIM_MAX_VALUE_LEN, "%.6g",
+			         entry->min + (entry->max - entry->min) * (x + 1.0) / 2.0);
+			return buf;
+		}
+		
+		case SIM_GENERATOR_TOGGLE:
+			return (topic->num_sent % 2) ? "false" : "true";
+	}
+	return "null";
+}
+
+
+/**
+ * Restore the heap property (earliest next_ns at the root) after the root's
+ * next_ns has increased.
+ */
+static void sim_heap_sift_down(sim_topic_t **heap, size_t len) {
+	size_t i = 0;
+	while (true) {
+		size_t smallest = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+		if (left < len && heap[left]->next_ns < heap[smallest]->next_ns) {
+			smallest = left;
+		}
+		if (right < len && heap[right]->next_ns < heap[smallest]->next_ns) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			return;
+		}
+		sim_topic_t *tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+
+/**
+ * Process any acknowledgements (and discard any messages) received within
+ * 'timeout' ms. Returns an MQTTCLIENT_* status code.
+ */
+static int sim_pump(MQTTClient *client, unsigned long timeout) {
+	char *rx_topic = NULL;
+	int rx_topic_len = 0;
+	MQTTClient_message *message = NULL;
+	int status = qth_receive(client, &rx_topic, &rx_topic_len, &message, timeout);
+	if (message) {
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	return status;
+}
+
+
+/**
+ * Implements the 'simulate' command.
+ */
+int cmd_simulate(MQTTClient *client,
+                 const char *spec_file,
+                 const char *registration_url,
+                 int meta_timeout) {
+	sim_topic_t *topics;
+	size_t num_topics;
+	sim_entry_t *entries;
+	size_t num_entries;
+	char *registration;
+	char *err = sim_load_spec(spec_file, &topics, &num_topics,
+	                          &entries, &num_entries, &registration);
+	
+	// Register every topic at once
+	if (!err) {
+		err = qth_set_property(client, registration_url, registration,
+		                       meta_timeout);
+	}
+	free(registration);
+	
+	// Schedule each topic's first value at a random point within its first
+	// period so that they don't all arrive at once
+	uint64_t start_ns = monotonic_ns();
+	sim_topic_t **heap = malloc(sizeof(sim_topic_t *) * (num_topics ? num_topics : 1));
+	for (size_t i = 0; i < num_topics; i++) {
+		sim_topic_t *topic = &topics[i];
+		topic->tokens = 1.0;
+		topic->refilled_ns = start_ns;
+		topic->next_ns = start_ns;
+		if (topic->entry->rate > 0.0) {
+			topic->next_ns += (uint64_t)(1e9 / topic->entry->rate *
+			                             (rand() / (double)RAND_MAX));
+		}
+		heap[i] = topic;
+	}
+	// Arrange the topics into a heap
+	for (size_t i = 1; i < num_topics; i++) {
+		for (size_t j = i; j > 0 && heap[j]->next_ns < heap[(j - 1) / 2]->next_ns; j = (j - 1) / 2) {
+			sim_topic_t *tmp = heap[j];
+			heap[j] = heap[(j - 1) / 2];
+			heap[(j - 1) / 2] = tmp;
+		}
+	}
+	size_t heap_len = num_topics;
+	
+	signal(SIGINT, simulate_signal_handler);
+	signal(SIGTERM, simulate_signal_handler);
+	
+	uint64_t num_sent = 0;
+	uint64_t num_window_full = 0;
+	while (!err && !simulate_stop) {
+		uint64_t now = monotonic_ns();
+		
+		// Send the values which are due
+		int batch = 0;
+		while (heap_len > 0 && heap[0]->next_ns <= now && batch < SIM_MAX_BATCH &&
+		       !err) {
+			sim_topic_t *topic = heap[0];
+			sim_entry_t *entry = topic->entry;
+			
+			// Refill the bucket
+			topic->tokens += (now - topic->refilled_ns) * 1e-9 * entry->rate;
+			if (topic->tokens > entry->burst) {
+				topic->tokens = entry->burst;
+			}
+			topic->refilled_ns = now;
+			
+			if (topic->tokens >= 1.0 || entry->rate == 0.0) {
+				char buf[SIM_MAX_VALUE_LEN];
+				const char *value = sim_generate(topic, (now - start_ns) * 1e-9, buf);
+				MQTTClient_deliveryToken tok;
+				int status;
+				while ((status = qth_publish(client, topic->topic, strlen(value),
+				                             value,
+				                             qth_qos(entry->is_property
+				                                     ? QOS_CLASS_PROPERTY
+				                                     : QOS_CLASS_EVENT),
+				                             entry->is_property,
+				                             &tok)) == MQTTCLIENT_MAX_MESSAGES_INFLIGHT) {
+					// Wait for acknowledgements to make room
+					num_window_full++;
+					status = sim_pump(client, 10);
+					if (status != MQTTCLIENT_SUCCESS) {
+						break;
+					}
+				}
+				if (status != MQTTCLIENT_SUCCESS) {
+					err = alloced_cat("Couldn't publish to ", topic->topic);
+					break;
+				}
+				topic->tokens -= 1.0;
+				topic->num_sent++;
+				num_sent++;
+				batch++;
+			}
+			
+			// Schedule the next value for when the next token is due (topics
+			// with a rate of zero are only sent once)
+			if (entry->rate == 0.0) {
+				heap[0] = heap[--heap_len];
+			} else if (topic->tokens < 1.0) {
+				topic->next_ns = now + 1 + (uint64_t)((1.0 - topic->tokens) / entry->rate * 1e9);
+			}
+			sim_heap_sift_down(heap, heap_len);
+		}
+		if (err) {
+			break;
+		}
+		
+		// Process acknowledgements while waiting for the next value to be due
+		unsigned long timeout = 1000;
+		now = monotonic_ns();
+		if (heap_len > 0) {
+			timeout = heap[0]->next_ns > now ? (heap[0]->next_ns - now) / 1000000 : 0;
+			if (timeout > 1000) {
+				timeout = 1000;
+			}
+		}
+		if (sim_pump(client, timeout) != MQTTCLIENT_SUCCESS && !simulate_stop) {
+			err = alloced_copy("Unable to recieve MQTT message.");
+		}
+	}
+	
+	int return_code = 0;
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return_code = 1;
+	} else {
+		double elapsed = (monotonic_ns() - start_ns) * 1e-9;
+		fprintf(stderr,
+		        "Simulated %zu topics: sent %llu values in %.1f s (%.1f/s), "
+		        "waited for a full in-flight window %llu times.\n",
+		        num_topics, (unsigned long long)num_sent, elapsed,
+		        elapsed > 0.0 ? num_sent / elapsed : 0.0,
+		        (unsigned long long)num_window_full);
+	}
+	
+	for (size_t i = 0; i < num_topics; i++) {
+		free(topics[i].topic);
+	}
+	for (size_t i = 0; i < num_entries; i++) {
+		free(entries[i].constant);
+	}
+	free(heap);
+	free(topics);
+	free(entries);
+	return return_code;
+}
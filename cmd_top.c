@@ -0,0 +1,378 @@
+/**
+ * Implementation of the top command: a live view of the message rate of every
+ * topic within a subtree.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The known Qth behaviours (entries refer to these rather than holding a copy)
+static const char *top_behaviours[] = {
+	"PROPERTY-1:N",
+	"PROPERTY-N:1",
+	"EVENT-1:N",
+	"EVENT-N:1",
+	NULL,
+};
+
+// Counters for a single topic
+typedef struct {
+	// Owned copy of the topic name (NULL if the entry is unused)
+	char *topic;
+	uint64_t hash;
+	
+	// Totals since the command started
+	uint64_t messages;
+	uint64_t bytes;
+	
+	// Totals at the previous refresh (used to compute the rates)
+	uint64_t prev_messages;
+	uint64_t prev_bytes;
+	
+	// Rates over the most recent refresh interval (per second)
+	double message_rate;
+	double byte_rate;
+	
+	// Size of the most recently received payload
+	uint32_t last_size;
+	
+	// The topic's behaviour (from top_behaviours) or NULL if not known
+	const char *behaviour;
+} top_entry_t;
+
+// An open-addressed table of topic counters. Entries are stored inline (rather
+// than via pointers as in strmap_t) so that counting a message touches just
+// one cache line.
+typedef struct {
+	top_entry_t *entries;
+	size_t capacity;  // Always a power of two
+	size_t count;
+} top_table_t;
+
+
+/**
+ * Find the entry for a topic or the unused entry where it would be inserted.
+ */
+static top_entry_t *top_find(top_entry_t *entries, size_t capacity,
+                             const char *topic, uint64_t hash) {
+	size_t i = hash & (capacity - 1);
+	while (entries[i].topic &&
+	       !(entries[i].hash == hash && strcmp(entries[i].topic, topic) == 0)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &entries[i];
+}
+
+
+/**
+ * Get the entry for a topic, adding a new (zeroed) entry if necessary.
+ */
+static top_entry_t *top_get_entry(top_table_t *table, const char *topic) {
+	uint64_t hash = hash_string(topic);
+	top_entry_t *entry = top_find(table->entries, table->capacity, topic, hash);
+	if (entry->topic) {
+		return entry;
+	}
+	
+	// Grow when more than 3/4 full
+	if ((table->count + 1) * 4 > table->capacity * 3) {
+		size_t new_capacity = table->capacity * 2;
+		top_entry_t *new_entries = calloc(new_capacity, sizeof(top_entry_t));
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->entries[i].topic) {
+				*top_find(new_entries, new_capacity,
+				          table->entries[i].topic,
+				          table->entries[i].hash) = table->entries[i];
+			}
+		}
+		free(table->entries);
+		table->entries = new_entries;
+		table->capacity = new_capacity;
+		entry = top_find(table->entries, table->capacity, topic, hash);
+	}
+	
+	entry->topic = alloced_copy(topic);
+	entry->hash = hash;
+	table->count++;
+	return entry;
+}
+
+
+/**
+ * Record the behaviours of any topics in a directory listing which are being
+ * counted.
+ */
+static void top_listing(top_table_t *table, const char *filter,
+                        const char *path, const char *payload,
+                        int payload_len) {
+	if (payload_len == 0) {
+		// Directory removed
+		return;
+	}
+	
+	json_object *dir;
+	char *err = json_parse(payload, payload_len, &dir);
+	if (err) {
+		free(err);
+		return;
+	}
+	if (!qth_is_directory_listing(dir)) {
+		json_object_put(dir);
+		return;
+	}
+	
+	size_t path_len = strlen(path);
+	json_object_object_foreach(dir, name, value) {
+		(void)value;
+		char topic[path_len + strlen(name) + 1];
+		strcpy(topic, path);
+		strcpy(topic + path_len, name);
+		if (!topic_matches_filter(filter, topic)) {
+			continue;
+		}
+		
+		const char **behaviours = qth_subdirectory_get_behaviours(dir, name);
+		if (!behaviours) {
+			continue;
+		}
+		for (const char **behaviour = behaviours; *behaviour; behaviour++) {
+			for (const char **known = top_behaviours; *known; known++) {
+				if (strcmp(*behaviour, *known) == 0) {
+					top_get_entry(table, topic)->behaviour = *known;
+				}
+			}
+		}
+		free(behaviours);
+	}
+	
+	json_object_put(dir);
+}
+
+
+/**
+ * Sort entries by message rate, then byte rate (both descending) and then
+ * topic name.
+ */
+static int top_compare(const void *a, const void *b) {
+	const top_entry_t *ea = *(const top_entry_t * const *)a;
+	const top_entry_t *eb = *(const top_entry_t * const *)b;
+	if (ea->message_rate != eb->message_rate) {
+		return ea->message_rate < eb->message_rate ? 1 : -1;
+	}
+	if (ea->byte_rate != eb->byte_rate) {
+		return ea->byte_rate < eb->byte_rate ? 1 : -1;
+	}
+	return strcmp(ea->topic, eb->topic);
+}
+
+
+/**
+ * Print a snapshot of the counters as a table, or as a single line of JSON.
+ */
+static void top_print(top_entry_t **sorted, size_t num_sorted,
+                      size_t limit, double interval, bool json) {
+	double total_messages = 0.0;
+	double total_bytes = 0.0;
+	for (size_t i = 0; i < num_sorted; i++) {
+		total_messages += sorted[i]->message_rate;
+		total_bytes += sorted[i]->byte_rate;
+	}
+	
+	if (json) {
+		json_object *snapshot = json_object_new_object();
+		json_object_object_add(snapshot, "time", json_object_new_int64(time(NULL)));
+		json_object_object_add(snapshot, "interval", json_object_new_double(interval));
+		json_object_object_add(snapshot, "messages_per_second",
+		                       json_object_new_double(total_messages));
+		json_object_object_add(snapshot, "bytes_per_second",
+		                       json_object_new_double(total_bytes));
+		json_object *topics = json_object_new_array();
+		for (size_t i = 0; i < num_sorted && i < limit; i++) {
+			top_entry_t *entry = sorted[i];
+			json_object *obj = json_object_new_object();
+			json_object_object_add(obj, "topic", json_object_new_string(entry->topic));
+			json_object_object_add(obj, "behaviour",
+			                       entry->behaviour
+			                       ? json_object_new_string(entry->behaviour)
+			                       : NULL);
+			json_object_object_add(obj, "messages_per_second",
+			                       json_object_new_double(entry->message_rate));
+			json_object_object_add(obj, "bytes_per_second",
+			                       json_object_new_double(entry->byte_rate));
+			json_object_object_add(obj, "last_size",
+			                       json_object_new_int64(entry->last_size));
+			json_object_object_add(obj, "messages",
+			                       json_object_new_int64(entry->messages));
+			json_object_object_add(obj, "bytes",
+			                       json_object_new_int64(entry->bytes));
+			json_object_array_add(topics, obj);
+		}
+		json_object_object_add(snapshot, "topics", topics);
+		
+		printf("%s\n", json_object_to_json_string_ext(snapshot, JSON_C_TO_STRING_PLAIN));
+		json_object_put(snapshot);
+		return;
+	}
+	
+	printf("%zu topics, %.1f msg/s, %.1f B/s\n\n",
+	       num_sorted, total_messages, total_bytes);
+	printf("%10s %12s %8s %12s  %-12s  %s\n",
+	       "MSG/S", "B/S", "SIZE", "MESSAGES", "BEHAVIOUR", "TOPIC");
+	for (size_t i = 0; i < num_sorted && i < limit; i++) {
+		top_entry_t *entry = sorted[i];
+		printf("%10.1f %12.1f %8u %12llu  %-12s  %s\n",
+		       entry->message_rate,
+		       entry->byte_rate,
+		       entry->last_size,
+		       (unsigned long long)entry->messages,
+		       entry->behaviour ? entry->behaviour : "-",
+		       entry->topic);
+	}
+}
+
+
+/**
+ * Implements the 'top' command: counts the messages received on every topic
+ * matching a filter and periodically displays the busiest topics.
+ */
+int cmd_top(MQTTClient *client,
+            const char *filter,
+            double interval,
+            int limit,
+            bool json,
+            int count) {
+	// Don't add a second, overlapping subscription if the listings are already
+	// within the filter (otherwise the broker may deliver them twice).
+	bool subscribe_listings = !topic_matches_filter(filter, "meta/ls/");
+	
+	// NB: QoS 0 is used since the acknowledgement handshakes required by
+	// higher QoS levels would limit the rate at which messages can be counted.
+	if (qth_subscribe(client, filter, 0, 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to '%s'.\n", filter);
+		return 1;
+	}
+	if (subscribe_listings &&
+	    qth_subscribe(client, "meta/ls/#", 0, 0) != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Could not subscribe to directory listings.\n");
+		qth_unsubscribe(client, filter);
+		return 1;
+	}
+	
+	// When displaying on a terminal, redraw the screen on each refresh and
+	// show only as many topics as fit.
+	bool is_tty = !json && isatty(STDOUT_FILENO);
+	
+	top_table_t table;
+	table.capacity = 1024;
+	table.count = 0;
+	table.entries = calloc(table.capacity, sizeof(top_entry_t));
+	
+	uint64_t interval_ns = interval * 1e9;
+	uint64_t last_refresh = monotonic_ns();
+	uint64_t next_refresh = last_refresh + interval_ns;
+	
+	int return_code = 0;
+	int num_refreshes = 0;
+	while (count == 0 || num_refreshes < count) {
+		uint64_t now = monotonic_ns();
+		if (now >= next_refresh) {
+			double elapsed = (now - last_refresh) / 1e9;
+			last_refresh = now;
+			next_refresh += interval_ns;
+			if (next_refresh <= now) {
+				// Fell behind: don't try to catch up
+				next_refresh = now + interval_ns;
+			}
+			
+			// Update the rates and sort the topics which have been seen
+			top_entry_t **sorted = malloc(sizeof(top_entry_t *) * (table.count + 1));
+			size_t num_sorted = 0;
+			for (size_t i = 0; i < table.capacity; i++) {
+				top_entry_t *entry = &table.entries[i];
+				if (!entry->topic || entry->messages == 0) {
+					continue;
+				}
+				entry->message_rate = (entry->messages - entry->prev_messages) / elapsed;
+				entry->byte_rate = (entry->bytes - entry->prev_bytes) / elapsed;
+				entry->prev_messages = entry->messages;
+				entry->prev_bytes = entry->bytes;
+				sorted[num_sorted++] = entry;
+			}
+			qsort(sorted, num_sorted, sizeof(top_entry_t *), top_compare);
+			
+			size_t rows = limit > 0 ? (size_t)limit : num_sorted;
+			if (is_tty) {
+				struct winsize ws;
+				if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4) {
+					// Leave space for the headings
+					if (limit <= 0 || (size_t)limit > (size_t)(ws.ws_row - 4)) {
+						rows = ws.ws_row - 4;
+					}
+				}
+				
+				// Clear the screen
+				printf("\033[H\033[2J");
+			} else if (!json && num_refreshes > 0) {
+				printf("\n");
+			}
+			top_print(sorted, num_sorted, rows, elapsed, json);
+			fflush(stdout);
+			free(sorted);
+			
+			num_refreshes++;
+			continue;
+		}
+		
+		char *rx_topic = NULL;
+		int rx_topic_len = 0;
+		MQTTClient_message *message = NULL;
+		unsigned long timeout = (next_refresh - now + 999999) / 1000000;
+		int mqtt_err = qth_receive(client, &rx_topic, &rx_topic_len,
+		                           &message, timeout);
+		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			fprintf(stderr, "Error: Unable to recieve MQTT message.\n");
+			return_code = 1;
+			break;
+		}
+		if (message == NULL) {
+			// Timeout
+			continue;
+		}
+		
+		if (topic_matches_filter(filter, rx_topic)) {
+			top_entry_t *entry = top_get_entry(&table, rx_topic);
+			entry->messages++;
+			entry->bytes += message->payloadlen;
+			entry->last_size = message->payloadlen;
+		}
+		if (strncmp(rx_topic, "meta/ls/", 8) == 0) {
+			top_listing(&table, filter, rx_topic + 8,
+			            message->payload, message->payloadlen);
+		}
+		
+		MQTTClient_free(rx_topic);
+		MQTTClient_freeMessage(&message);
+	}
+	
+	qth_unsubscribe(client, filter);
+	if (subscribe_listings) {
+		qth_unsubscribe(client, "meta/ls/#");
+	}
+	
+	for (size_t i = 0; i < table.capacity; i++) {
+		free(table.entries[i].topic);
+	}
+	free(table.entries);
+	
+	return return_code;
+}
@@ -0,0 +1,347 @@
+/**
+ * Support for 'watch --exec': runs a command with batches of received values
+ * written to its stdin, one per line.
+ *
+ * Values are collected into a batch which is handed to the command once it
+ * holds the maximum number of values or once the batch delay has elapsed
+ * since its first value arrived. Only one instance of the command runs at a
+ * time and (unless a persistent process is used) instances are started at
+ * most once per batch delay, bounding the rate at which processes are forked
+ * regardless of the rate at which values arrive.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "qth_client.h"
+
+struct exec_hook {
+	const char *command;
+	int batch_size;
+	uint64_t batch_delay_ns;
+	bool persistent;
+	
+	// The values (each terminated with a newline) waiting to be run
+	char *batch;
+	size_t batch_len;
+	size_t batch_capacity;
+	int batch_count;
+	
+	// When the first value in the current batch arrived
+	uint64_t batch_start_ns;
+	
+	// The running command (or -1 if not running). For persistent commands,
+	// 'stdin_fd' is the pipe to its stdin (otherwise -1).
+	pid_t pid;
+	int stdin_fd;
+	
+	// When the command was last started
+	bool started;
+	uint64_t last_start_ns;
+};
+
+
+/**
+ * Create a new exec hook. The command is run with '/bin/sh -c'.
+ */
+exec_hook_t *exec_hook_new(const char *command, int batch_size,
+                           int batch_delay, bool persistent) {
+	exec_hook_t *hook = calloc(1, sizeof(exec_hook_t));
+	hook->command = command;
+	hook->batch_size = batch_size;
+	hook->batch_delay_ns = (uint64_t)batch_delay * 1000000ull;
+	hook->persistent = persistent;
+	hook->pid = -1;
+	hook->stdin_fd = -1;
+	return hook;
+}
+
+
+/**
+ * Report how the command exited (if unsuccessfully).
+ */
+static void exec_hook_report_status(exec_hook_t *hook, int status) {
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Warning: '%s' exited with status %d.\n",
+		        hook->command, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		fprintf(stderr, "Warning: '%s' was killed by signal %d.\n",
+		        hook->command, WTERMSIG(status));
+	}
+}
+
+
+/**
+ * Check whether the command has exited, waiting for it to do so if 'block' is
+ * true. Returns true if the command is no longer running.
+ */
+static bool exec_hook_reap(exec_hook_t *hook, bool block) {
+	if (hook->pid < 0) {
+		return true;
+	}
+	
+	int status;
+	pid_t pid;
+	do {
+		pid = waitpid(hook->pid, &status, block ? 0 : WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+	if (pid == 0) {
+		return false;
+	}
+	
+	if (pid == hook->pid) {
+		exec_hook_report_status(hook, status);
+	}
+	hook->pid = -1;
+	if (hook->stdin_fd >= 0) {
+		close(hook->stdin_fd);
+		hook->stdin_fd = -1;
+	}
+	return true;
+}
+
+
+/**
+ * Close every file descriptor from 'first' upwards (e.g. the MQTT connection
+ * and any output or archive files) so that they aren't inherited by the
+ * command. Only makes async-signal-safe calls, for use between fork and exec.
+ */
+static void close_fds_from(int first) {
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, first, ~0u, 0) == 0) {
+		return;
+	}
+#endif
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0) {
+		max_fd = 1024;
+	}
+	for (long fd = first; fd < max_fd; fd++) {
+		close(fd);
+	}
+}
+
+
+/**
+ * Start the command with a pipe connected to its stdin. Returns an error
+ * message (to be freed by the caller) or NULL on success.
+ */
+static char *exec_hook_start(exec_hook_t *hook, uint64_t now) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		return alloced_copy("Couldn't create pipe for '--exec' command.");
+	}
+	
+	// Make sure any buffered output isn't duplicated by the child
+	fflush(stdout);
+	
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return alloced_copy("Couldn't start '--exec' command.");
+	} else if (pid == 0) {
+		// Child
+		close(fds[1]);
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close_fds_from(STDERR_FILENO + 1);
+		// NB: SIGPIPE is ignored by qth (see main) but the command should get
+		// the default behaviour
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", hook->command, (char *)NULL);
+		_exit(127);
+	}
+	
+	close(fds[0]);
+	hook->pid = pid;
+	hook->stdin_fd = fds[1];
+	hook->started = true;
+	hook->last_start_ns = now;
+	return NULL;
+}
+
+
+/**
+ * Write a whole buffer to a file descriptor. Returns false on failure (e.g.
+ * if the reader has exited).
+ */
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+
+/**
+ * Hand the current batch to the command. Blocks until the batch can be run
+ * (i.e. until any previous, non-persistent, instance has exited). Returns an
+ * error message (to be freed by the caller) or NULL on success.
+ */
+static char *exec_hook_run(exec_hook_t *hook, uint64_t now) {
+	if (hook->batch_count == 0) {
+		return NULL;
+	}
+	
+	if (hook->persistent) {
+		// Start the command if it isn't running (or has exited). If the write
+		// fails the command exited meanwhile: restart it once and retry.
+		for (int attempt = 0; attempt < 2; attempt++) {
+			exec_hook_reap(hook, false);
+			if (hook->pid < 0) {
+				char *err = exec_hook_start(hook, now);
+				if (err) {
+					return err;
+				}
+			}
+			if (write_all(hook->stdin_fd, hook->batch, hook->batch_len)) {
+				break;
+			}
+			close(hook->stdin_fd);
+			hook->stdin_fd = -1;
+			exec_hook_reap(hook, true);
+		}
+	} else {
+		exec_hook_reap(hook, true);
+		char *err = exec_hook_start(hook, now);
+		if (err) {
+			return err;
+		}
+		
+		// NB: The command may exit without reading everything, which is fine.
+		write_all(hook->stdin_fd, hook->batch, hook->batch_len);
+		close(hook->stdin_fd);
+		hook->stdin_fd = -1;
+	}
+	
+	hook->batch_len = 0;
+	hook->batch_count = 0;
+	return NULL;
+}
+
+
+/**
+ * Is the current batch ready to run?
+ */
+static bool exec_hook_due(exec_hook_t *hook, uint64_t now) {
+	if (hook->batch_count == 0) {
+		return false;
+	}
+	if (hook->batch_count < hook->batch_size &&
+	    now < hook->batch_start_ns + hook->batch_delay_ns) {
+		return false;
+	}
+	if (!hook->persistent) {
+		// Don't start instances more often than once per batch delay, nor
+		// while the previous instance is still running.
+		if (hook->started && now < hook->last_start_ns + hook->batch_delay_ns) {
+			return false;
+		}
+		if (!exec_hook_reap(hook, false)) {
+			return hook->batch_count >= hook->batch_size;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Add a value (without a trailing newline) to the current batch, running the
+ * batch if it is now full (which may block until the previous batch's command
+ * exits). Returns an error message (to be freed by the caller) or NULL on
+ * success.
+ */
+char *exec_hook_add(exec_hook_t *hook, const char *value, size_t len,
+                    uint64_t now) {
+	if (hook->batch_count == 0) {
+		hook->batch_start_ns = now;
+	}
+	
+	if (hook->batch_len + len + 1 > hook->batch_capacity) {
+		hook->batch_capacity = (hook->batch_len + len + 1) * 2;
+		hook->batch = realloc(hook->batch, hook->batch_capacity);
+	}
+	memcpy(hook->batch + hook->batch_len, value, len);
+	hook->batch_len += len;
+	hook->batch[hook->batch_len++] = '\n';
+	hook->batch_count++;
+	
+	return exec_hook_poll(hook, now);
+}
+
+
+/**
+ * Run the current batch if it is due. Returns an error message (to be freed
+ * by the caller) or NULL on success.
+ */
+char *exec_hook_poll(exec_hook_t *hook, uint64_t now) {
+	if (hook->batch_count >= hook->batch_size) {
+		// Full batches are always run (blocking if necessary)
+		return exec_hook_run(hook, now);
+	} else if (exec_hook_due(hook, now)) {
+		return exec_hook_run(hook, now);
+	} else {
+		return NULL;
+	}
+}
+
+
+/**
+ * Return the time at which exec_hook_poll should next be called (or
+ * UINT64_MAX if there is nothing waiting to be run).
+ */
+uint64_t exec_hook_deadline(exec_hook_t *hook) {
+	if (hook->batch_count == 0) {
+		return UINT64_MAX;
+	}
+	
+	uint64_t deadline = hook->batch_start_ns + hook->batch_delay_ns;
+	if (!hook->persistent && hook->started &&
+	    hook->last_start_ns + hook->batch_delay_ns > deadline) {
+		deadline = hook->last_start_ns + hook->batch_delay_ns;
+	}
+	if (!hook->persistent && hook->pid >= 0) {
+		// Check back periodically for the previous instance to exit
+		uint64_t poll = monotonic_ns() + 10000000ull;
+		if (poll > deadline) {
+			deadline = poll;
+		}
+	}
+	return deadline;
+}
+
+
+/**
+ * Run any remaining values, wait for the command to exit and free the hook.
+ * Returns an error message (to be freed by the caller) or NULL on success.
+ */
+char *exec_hook_close(exec_hook_t *hook) {
+	char *err = exec_hook_run(hook, monotonic_ns());
+	
+	if (hook->stdin_fd >= 0) {
+		close(hook->stdin_fd);
+		hook->stdin_fd = -1;
+	}
+	exec_hook_reap(hook, true);
+	
+	free(hook->batch);
+	free(hook);
+	return err;
+}
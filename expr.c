@@ -0,0 +1,503 @@
+/**
+ * A small expression language used to filter and select values from JSON
+ * payloads (e.g. 'watch --filter' and 'watch --select').
+ *
+ * Expressions are made up of:
+ *
+ *   .                   the whole value
+ *   /a/b/0              a JSON pointer (RFC 6901) into the value (null if
+ *                       absent)
+ *   123, "abc", true,   JSON literals
+ *   false, null
+ *   ==, !=, <, <=, >, >=
+ *                       comparisons (numbers and strings are ordered, other
+ *                       types may only be compared for equality)
+ *   &&, ||, !           boolean logic (null and false are false, everything
+ *                       else is true)
+ *   ( ... )             grouping
+ *
+ * Expressions are compiled once into a tree of nodes which is then evaluated
+ * against each (already parsed) value without allocating any memory.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+#include "qth_client.h"
+
+typedef enum {
+	EXPR_ROOT = 0,
+	EXPR_POINTER,
+	EXPR_LITERAL,
+	EXPR_NOT,
+	EXPR_AND,
+	EXPR_OR,
+	EXPR_EQ,
+	EXPR_NE,
+	EXPR_LT,
+	EXPR_LE,
+	EXPR_GT,
+	EXPR_GE,
+} expr_node_type_t;
+
+typedef struct expr_node {
+	expr_node_type_t type;
+	
+	// Operands (NULL when unused)
+	struct expr_node *lhs;
+	struct expr_node *rhs;
+	
+	// EXPR_LITERAL only: the literal value (may be NULL, i.e. JSON null)
+	json_object *literal;
+	
+	// EXPR_POINTER only: the unescaped reference tokens and, for tokens which
+	// are valid array indices, the index (otherwise -1).
+	char **tokens;
+	long *indices;
+	size_t num_tokens;
+} expr_node_t;
+
+struct expr {
+	expr_node_t *root;
+	
+	// Results of boolean operators (so that evaluation need not allocate)
+	json_object *true_obj;
+	json_object *false_obj;
+};
+
+// Parser state
+typedef struct {
+	const char *str;
+	size_t pos;
+	char *err;
+} expr_parser_t;
+
+
+static void expr_node_free(expr_node_t *node) {
+	if (!node) {
+		return;
+	}
+	expr_node_free(node->lhs);
+	expr_node_free(node->rhs);
+	if (node->literal) {
+		json_object_put(node->literal);
+	}
+	for (size_t i = 0; i < node->num_tokens; i++) {
+		free(node->tokens[i]);
+	}
+	free(node->tokens);
+	free(node->indices);
+	free(node);
+}
+
+static expr_node_t *expr_node_new(expr_node_type_t type,
+                                  expr_node_t *lhs, expr_node_t *rhs) {
+	expr_node_t *node = calloc(1, sizeof(expr_node_t));
+	node->type = type;
+	node->lhs = lhs;
+	node->rhs = rhs;
+	return node;
+}
+
+/**
+ * Record a parse error at the current position (keeping only the first).
+ */
+static void expr_error(expr_parser_t *p, const char *message) {
+	if (!p->err) {
+		p->err = annotate_error(p->str, p->pos, message);
+	}
+}
+
+static void expr_skip_space(expr_parser_t *p) {
+	while (p->str[p->pos] == ' ' || p->str[p->pos] == '\t' ||
+	       p->str[p->pos] == '\n' || p->str[p->pos] == '\r') {
+		p->pos++;
+	}
+}
+
+/**
+ * If the next token is 'token', consume it and return true.
+ */
+static bool expr_accept(expr_parser_t *p, const char *token) {
+	expr_skip_space(p);
+	size_t len = strlen(token);
+	if (strncmp(p->str + p->pos, token, len) == 0) {
+		p->pos += len;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Is the character one which ends an unquoted JSON pointer or keyword?
+ */
+static bool expr_is_delimiter(char c) {
+	return c == '\0' || strchr(" \t\r\n()=!<>&|", c) != NULL;
+}
+
+static expr_node_t *expr_parse_or(expr_parser_t *p);
+
+/**
+ * Parse a JSON pointer (the leading '/' has not yet been consumed).
+ */
+static expr_node_t *expr_parse_pointer(expr_parser_t *p) {
+	expr_node_t *node = expr_node_new(EXPR_POINTER, NULL, NULL);
+	
+	// Count the tokens (one per '/')
+	size_t end = p->pos;
+	while (!expr_is_delimiter(p->str[end])) {
+		if (p->str[end] == '/') {
+			node->num_tokens++;
+		}
+		end++;
+	}
+	node->tokens = malloc(sizeof(char *) * node->num_tokens);
+	node->indices = malloc(sizeof(long) * node->num_tokens);
+	
+	for (size_t i = 0; i < node->num_tokens; i++) {
+		// Skip the '/'
+		p->pos++;
+		
+		// Unescape the token ('~1' is '/' and '~0' is '~')
+		char *token = malloc(end - p->pos + 1);
+		size_t len = 0;
+		while (p->pos < end && p->str[p->pos] != '/') {
+			char c = p->str[p->pos];
+			if (c == '~') {
+				char next = p->str[p->pos + 1];
+				if (next != '0' && next != '1') {
+					expr_error(p, "invalid escape in JSON pointer (expected '~0' or '~1')");
+				} else {
+					c = next == '0' ? '~' : '/';
+					p->pos++;
+				}
+			}
+			token[len++] = c;
+			p->pos++;
+		}
+		token[len] = '\0';
+		node->tokens[i] = token;
+		
+		// Tokens consisting only of digits (without a leading zero) may also
+		// index arrays
+		bool is_index = len > 0 && len <= 9 && !(len > 1 && token[0] == '0');
+		for (size_t j = 0; j < len && is_index; j++) {
+			is_index = token[j] >= '0' && token[j] <= '9';
+		}
+		node->indices[i] = is_index ? atol(token) : -1;
+	}
+	
+	return node;
+}
+
+/**
+ * Parse a JSON literal (number, string, true, false or null).
+ */
+static expr_node_t *expr_parse_literal(expr_parser_t *p) {
+	size_t start = p->pos;
+	size_t end = start;
+	if (p->str[start] == '"') {
+		// Find the closing quote
+		end++;
+		while (p->str[end] != '"') {
+			if (p->str[end] == '\0') {
+				expr_error(p, "unterminated string");
+				return NULL;
+			}
+			if (p->str[end] == '\\' && p->str[end + 1] != '\0') {
+				end++;
+			}
+			end++;
+		}
+		end++;
+	} else {
+		while (!expr_is_delimiter(p->str[end])) {
+			end++;
+		}
+	}
+	if (end == start) {
+		expr_error(p, "expected a value");
+		return NULL;
+	}
+	
+	json_object *literal;
+	char *err = json_parse(p->str + start, end - start, &literal);
+	if (err) {
+		free(err);
+		expr_error(p, "expected '.', a JSON pointer or a JSON literal");
+		return NULL;
+	}
+	if (json_object_is_type(literal, json_type_object) ||
+	    json_object_is_type(literal, json_type_array)) {
+		json_object_put(literal);
+		expr_error(p, "expected a number, string, true, false or null");
+		return NULL;
+	}
+	
+	p->pos = end;
+	expr_node_t *node = expr_node_new(EXPR_LITERAL, NULL, NULL);
+	node->literal = literal;
+	return node;
+}
+
+static expr_node_t *expr_parse_primary(expr_parser_t *p) {
+	expr_skip_space(p);
+	char c = p->str[p->pos];
+	if (c == '(') {
+		p->pos++;
+		expr_node_t *node = expr_parse_or(p);
+		if (node && !expr_accept(p, ")")) {
+			expr_error(p, "expected ')'");
+		}
+		return node;
+	} else if (c == '.' && expr_is_delimiter(p->str[p->pos + 1])) {
+		p->pos++;
+		return expr_node_new(EXPR_ROOT, NULL, NULL);
+	} else if (c == '/') {
+		return expr_parse_pointer(p);
+	} else {
+		return expr_parse_literal(p);
+	}
+}
+
+static expr_node_t *expr_parse_comparison(expr_parser_t *p) {
+	expr_node_t *lhs = expr_parse_primary(p);
+	if (!lhs) {
+		return NULL;
+	}
+	
+	// NB: Longer operators must be tried first
+	static const struct {
+		const char *token;
+		expr_node_type_t type;
+	} operators[] = {
+		{"==", EXPR_EQ},
+		{"!=", EXPR_NE},
+		{"<=", EXPR_LE},
+		{">=", EXPR_GE},
+		{"<", EXPR_LT},
+		{">", EXPR_GT},
+	};
+	for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+		if (expr_accept(p, operators[i].token)) {
+			expr_node_t *rhs = expr_parse_primary(p);
+			return expr_node_new(operators[i].type, lhs, rhs);
+		}
+	}
+	return lhs;
+}
+
+static expr_node_t *expr_parse_not(expr_parser_t *p) {
+	if (expr_accept(p, "!")) {
+		return expr_node_new(EXPR_NOT, expr_parse_not(p), NULL);
+	}
+	return expr_parse_comparison(p);
+}
+
+static expr_node_t *expr_parse_and(expr_parser_t *p) {
+	expr_node_t *node = expr_parse_not(p);
+	while (!p->err && expr_accept(p, "&&")) {
+		node = expr_node_new(EXPR_AND, node, expr_parse_not(p));
+	}
+	return node;
+}
+
+static expr_node_t *expr_parse_or(expr_parser_t *p) {
+	expr_node_t *node = expr_parse_and(p);
+	while (!p->err && expr_accept(p, "||")) {
+		node = expr_node_new(EXPR_OR, node, expr_parse_and(p));
+	}
+	return node;
+}
+
+
+/**
+ * Compile an expression. Returns a human-readable error message (to be freed
+ * by the caller) if the expression is not valid, or NULL on success in which
+ * case the compiled expression is returned via 'expr' and must be freed with
+ * expr_free.
+ */
+char *expr_compile(const char *str, expr_t **expr) {
+	*expr = NULL;
+	
+	expr_parser_t p = {str, 0, NULL};
+	expr_node_t *root = expr_parse_or(&p);
+	expr_skip_space(&p);
+	if (!p.err && p.str[p.pos] != '\0') {
+		expr_error(&p, "unexpected extra input");
+	}
+	if (p.err) {
+		expr_node_free(root);
+		return p.err;
+	}
+	
+	*expr = malloc(sizeof(expr_t));
+	(*expr)->root = root;
+	(*expr)->true_obj = json_object_new_boolean(true);
+	(*expr)->false_obj = json_object_new_boolean(false);
+	return NULL;
+}
+
+
+/**
+ * Free a compiled expression.
+ */
+void expr_free(expr_t *expr) {
+	if (expr) {
+		expr_node_free(expr->root);
+		json_object_put(expr->true_obj);
+		json_object_put(expr->false_obj);
+		free(expr);
+	}
+}
+
+
+static bool expr_truthy(json_object *value) {
+	if (value == NULL || json_object_is_type(value, json_type_null)) {
+		return false;
+	} else if (json_object_is_type(value, json_type_boolean)) {
+		return json_object_get_boolean(value);
+	} else {
+		return true;
+	}
+}
+
+static bool expr_is_number(json_object *value) {
+	return json_object_is_type(value, json_type_int) ||
+	       json_object_is_type(value, json_type_double);
+}
+
+/**
+ * Compare two values for an ordering comparison. Returns false if the values
+ * cannot be ordered (otherwise the sign of the comparison goes in 'cmp').
+ */
+static bool expr_order(json_object *a, json_object *b, int *cmp) {
+	if (expr_is_number(a) && expr_is_number(b)) {
+		if (json_object_is_type(a, json_type_int) &&
+		    json_object_is_type(b, json_type_int)) {
+			int64_t ia = json_object_get_int64(a);
+			int64_t ib = json_object_get_int64(b);
+			*cmp = (ia > ib) - (ia < ib);
+		} else {
+			double da = json_object_get_double(a);
+			double db = json_object_get_double(b);
+			if (da != da || db != db) {
+				return false;  // NaN
+			}
+			*cmp = (da > db) - (da < db);
+		}
+		return true;
+	} else if (json_object_is_type(a, json_type_string) &&
+	           json_object_is_type(b, json_type_string)) {
+		*cmp = strcmp(json_object_get_string(a), json_object_get_string(b));
+		return true;
+	} else {
+		return false;
+	}
+}
+
+static bool expr_equal(json_object *a, json_object *b) {
+	int cmp;
+	if (expr_is_number(a) && expr_is_number(b) && expr_order(a, b, &cmp)) {
+		// NB: So that 1 == 1.0
+		return cmp == 0;
+	}
+	return json_object_equal(a, b);
+}
+
+static json_object *expr_eval_node(expr_t *expr, expr_node_t *node,
+                                   json_object *value) {
+	switch (node->type) {
+		case EXPR_ROOT:
+			return value;
+		
+		case EXPR_POINTER:
+			for (size_t i = 0; i < node->num_tokens && value; i++) {
+				if (json_object_is_type(value, json_type_object)) {
+					if (!json_object_object_get_ex(value, node->tokens[i], &value)) {
+						value = NULL;
+					}
+				} else if (json_object_is_type(value, json_type_array) &&
+				           node->indices[i] >= 0 &&
+				           (size_t)node->indices[i] < json_object_array_length(value)) {
+					value = json_object_array_get_idx(value, node->indices[i]);
+				} else {
+					value = NULL;
+				}
+			}
+			return value;
+		
+		case EXPR_LITERAL:
+			return node->literal;
+		
+		default:
+			break;
+	}
+	
+	// Boolean-valued operators
+	bool result = false;
+	int cmp;
+	switch (node->type) {
+		case EXPR_NOT:
+			result = !expr_truthy(expr_eval_node(expr, node->lhs, value));
+			break;
+		
+		case EXPR_AND:
+			result = expr_truthy(expr_eval_node(expr, node->lhs, value)) &&
+			         expr_truthy(expr_eval_node(expr, node->rhs, value));
+			break;
+		
+		case EXPR_OR:
+			result = expr_truthy(expr_eval_node(expr, node->lhs, value)) ||
+			         expr_truthy(expr_eval_node(expr, node->rhs, value));
+			break;
+		
+		case EXPR_EQ:
+		case EXPR_NE:
+			result = expr_equal(expr_eval_node(expr, node->lhs, value),
+			                    expr_eval_node(expr, node->rhs, value));
+			if (node->type == EXPR_NE) {
+				result = !result;
+			}
+			break;
+		
+		case EXPR_LT:
+		case EXPR_LE:
+		case EXPR_GT:
+		case EXPR_GE:
+			if (expr_order(expr_eval_node(expr, node->lhs, value),
+			               expr_eval_node(expr, node->rhs, value), &cmp)) {
+				result = (node->type == EXPR_LT && cmp < 0) ||
+				         (node->type == EXPR_LE && cmp <= 0) ||
+				         (node->type == EXPR_GT && cmp > 0) ||
+				         (node->type == EXPR_GE && cmp >= 0);
+			}
+			break;
+		
+		default:
+			break;
+	}
+	return result ? expr->true_obj : expr->false_obj;
+}
+
+
+/**
+ * Evaluate an expression against a parsed JSON value. The result is borrowed
+ * from either the value or the expression (and so must not be freed) and may
+ * be NULL (JSON null).
+ */
+json_object *expr_eval(expr_t *expr, json_object *value) {
+	return expr_eval_node(expr, expr->root, value);
+}
+
+
+/**
+ * Evaluate an expression against a parsed JSON value and return whether the
+ * result is true (i.e. not null or false).
+ */
+bool expr_test(expr_t *expr, json_object *value) {
+	return expr_truthy(expr_eval(expr, value));
+}
@@ -0,0 +1,264 @@
+/**
+ * A pool of threads which format received values in parallel, for use when
+ * formatting (e.g. pretty-printing large values) can't keep up with the rate
+ * values arrive.
+ *
+ * Values are handed out through a ring of slots, each numbered in the order it
+ * was submitted. Workers claim slots with an atomic counter (no lock is taken
+ * to hand out work) and mark them done once formatted. The submitting thread
+ * collects the results from the ring in submission order, so output order is
+ * unaffected by which worker finishes first.
+ *
+ * The pool has a single producer and consumer of results (the receiving
+ * thread): only the workers run concurrently with it.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "json.h"
+
+#include "qth_client.h"
+
+// The number of slots in the ring per worker thread
+#define FORMAT_POOL_SLOTS_PER_THREAD 16
+
+typedef struct {
+	// The job (owned by the slot while the job is in progress)
+	char *topic;
+	json_object *value;
+	char *raw;  // Only for verbatim output
+	int raw_len;
+	
+	// The result, valid once 'done' is set
+	char *out;
+	atomic_bool done;
+} format_pool_slot_t;
+
+struct format_pool {
+	json_format_t json_format;
+	expr_t *select;
+	
+	// Ring of slots. 'head' and 'tail' count the results collected and jobs
+	// submitted (and are only used by the submitting thread). 'next_job' is
+	// the next job to be claimed by a worker.
+	format_pool_slot_t *slots;
+	size_t capacity;  // Always a power of two
+	uint64_t head;
+	uint64_t tail;
+	atomic_uint_fast64_t next_job;
+	
+	// Posted once for each job submitted (and to stop workers)
+	sem_t jobs;
+	atomic_bool stopping;
+	
+	// Used by the submitting thread to wait for a result
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	
+	// Taken while formatting values which may be shared between threads
+	// (i.e. those produced by the select expression itself)
+	pthread_mutex_t shared_lock;
+	
+	pthread_t *threads;
+	int num_threads;
+};
+
+
+/**
+ * Format a job's value (as watch would).
+ */
+static char *format_pool_format(format_pool_t *pool, format_pool_slot_t *slot) {
+	if (pool->select) {
+		json_object *result = expr_eval(pool->select, slot->value);
+		if (json_object_is_type(result, json_type_object) ||
+		    json_object_is_type(result, json_type_array)) {
+			// Part of the (unshared) value
+			return json_object_to_format(result, pool->json_format);
+		} else {
+			// Possibly a literal or boolean owned by the expression: json-c
+			// caches the formatted string in the object so this mustn't be done
+			// concurrently.
+			pthread_mutex_lock(&pool->shared_lock);
+			char *out = json_object_to_format(result, pool->json_format);
+			pthread_mutex_unlock(&pool->shared_lock);
+			return out;
+		}
+	} else if (pool->json_format == JSON_FORMAT_VERBATIM) {
+		return alloced_copyn(slot->raw, slot->raw_len);
+	} else {
+		return json_object_to_format(slot->value, pool->json_format);
+	}
+}
+
+
+static void *format_pool_thread(void *pool_void) {
+	format_pool_t *pool = pool_void;
+	
+	while (true) {
+		while (sem_wait(&pool->jobs) != 0) {
+			// Interrupted: retry
+		}
+		if (atomic_load(&pool->stopping)) {
+			break;
+		}
+		
+		uint64_t job = atomic_fetch_add(&pool->next_job, 1);
+		format_pool_slot_t *slot = &pool->slots[job & (pool->capacity - 1)];
+		
+		slot->out = format_pool_format(pool, slot);
+		json_object_put(slot->value);
+		slot->value = NULL;
+		free(slot->raw);
+		slot->raw = NULL;
+		
+		pthread_mutex_lock(&pool->done_lock);
+		atomic_store_explicit(&slot->done, true, memory_order_release);
+		pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->done_lock);
+	}
+	
+	return NULL;
+}
+
+
+/**
+ * Start a pool of worker threads formatting values in the given format (and
+ * applying the select expression, if not NULL). Must be freed with
+ * format_pool_free.
+ */
+format_pool_t *format_pool_new(int num_threads, json_format_t json_format,
+                               expr_t *select) {
+	format_pool_t *pool = calloc(1, sizeof(format_pool_t));
+	pool->json_format = json_format;
+	pool->select = select;
+	
+	pool->capacity = 1;
+	while (pool->capacity < (size_t)num_threads * FORMAT_POOL_SLOTS_PER_THREAD) {
+		pool->capacity *= 2;
+	}
+	pool->slots = calloc(pool->capacity, sizeof(format_pool_slot_t));
+	atomic_init(&pool->next_job, 0);
+	atomic_init(&pool->stopping, false);
+	for (size_t i = 0; i < pool->capacity; i++) {
+		atomic_init(&pool->slots[i].done, false);
+	}
+	
+	sem_init(&pool->jobs, 0, 0);
+	pthread_mutex_init(&pool->done_lock, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pthread_mutex_init(&pool->shared_lock, NULL);
+	
+	pool->num_threads = num_threads;
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	for (int i = 0; i < num_threads; i++) {
+		pthread_create(&pool->threads[i], NULL, format_pool_thread, pool);
+	}
+	
+	return pool;
+}
+
+
+/**
+ * Are all slots in use (i.e. must a result be collected before another value
+ * can be submitted)?
+ */
+bool format_pool_full(format_pool_t *pool) {
+	return pool->tail - pool->head == pool->capacity;
+}
+
+
+/**
+ * Are there any values submitted whose results haven't been collected?
+ */
+bool format_pool_busy(format_pool_t *pool) {
+	return pool->tail != pool->head;
+}
+
+
+/**
+ * Submit a value received on 'topic' to be formatted, taking ownership of the
+ * value (which must not be shared with anything else). The raw payload is
+ * only used for verbatim output. The pool must not be full.
+ */
+void format_pool_submit(format_pool_t *pool, const char *topic,
+                        json_object *value, const char *raw, int raw_len) {
+	format_pool_slot_t *slot = &pool->slots[pool->tail & (pool->capacity - 1)];
+	slot->topic = alloced_copy(topic);
+	slot->value = value;
+	if (pool->json_format == JSON_FORMAT_VERBATIM && !pool->select) {
+		slot->raw = alloced_copyn(raw, raw_len);
+		slot->raw_len = raw_len;
+	}
+	atomic_store_explicit(&slot->done, false, memory_order_relaxed);
+	pool->tail++;
+	
+	// NB: sem_post publishes the slot's contents to the worker
+	sem_post(&pool->jobs);
+}
+
+
+/**
+ * Collect the result of the oldest submitted value, if it has been formatted
+ * (or, if 'wait' is true, once it has been). Returns false if there is no
+ * result to collect. Otherwise, sets 'topic' and 'out' to strings which must
+ * be freed by the caller.
+ */
+bool format_pool_next(format_pool_t *pool, bool wait, char **topic, char **out) {
+	if (pool->head == pool->tail) {
+		return false;
+	}
+	
+	format_pool_slot_t *slot = &pool->slots[pool->head & (pool->capacity - 1)];
+	if (!atomic_load_explicit(&slot->done, memory_order_acquire)) {
+		if (!wait) {
+			return false;
+		}
+		pthread_mutex_lock(&pool->done_lock);
+		while (!atomic_load_explicit(&slot->done, memory_order_acquire)) {
+			pthread_cond_wait(&pool->done_cond, &pool->done_lock);
+		}
+		pthread_mutex_unlock(&pool->done_lock);
+	}
+	
+	*topic = slot->topic;
+	*out = slot->out;
+	slot->topic = NULL;
+	slot->out = NULL;
+	pool->head++;
+	return true;
+}
+
+
+/**
+ * Stop the worker threads and free the pool. Any results not collected are
+ * discarded.
+ */
+void format_pool_free(format_pool_t *pool) {
+	char *topic;
+	char *out;
+	while (format_pool_next(pool, true, &topic, &out)) {
+		free(topic);
+		free(out);
+	}
+	
+	atomic_store(&pool->stopping, true);
+	for (int i = 0; i < pool->num_threads; i++) {
+		sem_post(&pool->jobs);
+	}
+	for (int i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	
+	sem_destroy(&pool->jobs);
+	pthread_mutex_destroy(&pool->done_lock);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_mutex_destroy(&pool->shared_lock);
+	free(pool->threads);
+	free(pool->slots);
+	free(pool);
+}
@@ -0,0 +1,261 @@
+/**
+ * Reads a stream of JSON values from a file descriptor (e.g. values to be set
+ * or sent, read from stdin).
+ *
+ * Values may span several lines or follow one another on the same line and
+ * each is returned as soon as it is complete, as it appeared in the input.
+ * They are found using json-c's incremental tokener, which is fed only the
+ * bytes it hasn't yet seen each time more input arrives.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The initial size of the buffer values are read into (it grows to fit larger
+// values)
+#define JSON_READER_INITIAL_LEN (64 * 1024)
+
+struct json_reader {
+	int fd;
+	json_tokener *tokener;
+	
+	// Bytes read (with room for a null terminator after them)
+	char *buf;
+	size_t buf_size;
+	size_t len;
+	
+	// The start of the value being parsed, or (if in_value is false) the next
+	// byte to be examined
+	size_t start;
+	
+	// Number of bytes (from the start of buf) given to the tokener so far
+	size_t parsed;
+	
+	// Has the tokener been given the start of a value
+	bool in_value;
+	
+	// Is the next byte the first in its line (for spotting empty lines)
+	bool at_line_start;
+	
+	// Has a value spanning several lines been read (after which empty lines
+	// are taken to just separate pretty-printed values)
+	bool multi_line;
+	
+	// Has the input been closed
+	bool eof;
+};
+
+
+/**
+ * Create a reader for the values read from 'fd'. Must be freed with
+ * json_reader_free.
+ */
+json_reader_t *json_reader_new(int fd) {
+	json_reader_t *reader = calloc(1, sizeof(json_reader_t));
+	reader->fd = fd;
+	reader->tokener = json_tokener_new();
+	reader->buf_size = JSON_READER_INITIAL_LEN;
+	reader->buf = malloc(reader->buf_size);
+	reader->at_line_start = true;
+	return reader;
+}
+
+
+void json_reader_free(json_reader_t *reader) {
+	json_tokener_free(reader->tokener);
+	free(reader->buf);
+	free(reader);
+}
+
+
+/**
+ * Read more input into the reader's buffer, first discarding any bytes before
+ * the current value and growing the buffer if it is full. Keeps the
+ * MQTTClient alive while waiting. Returns an error message (to be freed by the
+ * caller) or NULL on success (including at the end of the stream).
+ */
+static char *json_reader_fill(json_reader_t *reader) {
+	if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start,
+		        reader->len - reader->start);
+		reader->len -= reader->start;
+		reader->parsed -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->len + 1 >= reader->buf_size) {
+		if (reader->buf_size > MQTT_MAX_PAYLOAD_LEN) {
+			return alloced_copy("Value is too large to send in an MQTT message.");
+		}
+		reader->buf_size *= 2;
+		reader->buf = realloc(reader->buf, reader->buf_size);
+	}
+	
+	while (true) {
+		// Watch the input
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(reader->fd, &rfds);
+		
+		// Timing out after 1ms (to allow frequent calls to MQTTClient_yield).
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 1000;
+		
+		int select_retval = select(reader->fd + 1, &rfds, NULL, NULL, &tv);
+		if (select_retval == -1 && errno != EINTR) {
+			return alloced_cat("Couldn't read stdin: ", strerror(errno));
+		} else if (select_retval <= 0) {
+			// Timeout
+			MQTTClient_yield();
+			continue;
+		}
+		
+		// Read ready! (Reading only what is available so that we return to
+		// keeping the client alive promptly)
+		ssize_t num_read = read(reader->fd, reader->buf + reader->len,
+		                        reader->buf_size - reader->len - 1);
+		if (num_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		} else if (num_read < 0) {
+			return alloced_cat("Couldn't read stdin: ", strerror(errno));
+		} else if (num_read == 0) {
+			reader->eof = true;
+		}
+		reader->len += num_read;
+		return NULL;
+	}
+}
+
+
+/**
+ * Annotate the value being read (and whatever follows it in the buffer) with
+ * an error at the given position in the buffer.
+ */
+static char *json_reader_error(json_reader_t *reader, size_t pos,
+                               enum json_tokener_error err) {
+	reader->buf[reader->len] = '\0';
+	return annotate_error(reader->buf + reader->start, pos - reader->start,
+	                      json_tokener_error_desc(err));
+}
+
+
+/**
+ * Return the value ending at 'end' in the buffer (less the trailing whitespace
+ * the tokener may have consumed after it, which is left to be scanned for
+ * empty lines) and move on past it.
+ */
+static void json_reader_take(json_reader_t *reader, size_t end,
+                             const char **value, size_t *len) {
+	while (end > reader->start &&
+	       (reader->buf[end - 1] == ' ' || reader->buf[end - 1] == '\t' ||
+	        reader->buf[end - 1] == '\r' || reader->buf[end - 1] == '\n')) {
+		end--;
+	}
+	*value = reader->buf + reader->start;
+	*len = end - reader->start;
+	if (memchr(*value, '\n', *len)) {
+		reader->multi_line = true;
+	}
+	reader->start = end;
+	reader->in_value = false;
+}
+
+
+/**
+ * Read the next JSON value. It is returned, as it appeared in the input, via
+ * 'value' and 'len' ('value' being NULL at the end of the stream) and remains
+ * valid until the next call.
+ *
+ * An empty line is read as 'null', as when values were read a line at a time,
+ * until a value spanning several lines has been read. From then on the input
+ * is taken to be pretty-printed and empty lines are ignored.
+ *
+ * Returns an error message (to be freed by the caller) if the input is not
+ * valid JSON or couldn't be read, or NULL otherwise.
+ */
+char *json_reader_next(json_reader_t *reader, const char **value, size_t *len) {
+	*value = NULL;
+	*len = 0;
+	
+	while (true) {
+		// Skip the whitespace between values (an empty line possibly standing
+		// for 'null')
+		while (!reader->in_value && reader->start < reader->len) {
+			char c = reader->buf[reader->start];
+			if (c == '\n') {
+				reader->start++;
+				if (reader->at_line_start && !reader->multi_line) {
+					*value = "null";
+					*len = strlen("null");
+					return NULL;
+				}
+				reader->at_line_start = true;
+			} else if (c == ' ' || c == '\t' || c == '\r') {
+				reader->start++;
+				reader->at_line_start = false;
+			} else {
+				json_tokener_reset(reader->tokener);
+				reader->parsed = reader->start;
+				reader->in_value = true;
+				reader->at_line_start = false;
+			}
+		}
+		
+		// Give the tokener anything it hasn't seen yet
+		if (reader->in_value && reader->parsed < reader->len) {
+			size_t chunk = reader->parsed;
+			json_object *obj = json_tokener_parse_ex(reader->tokener,
+			                                         reader->buf + chunk,
+			                                         reader->len - chunk);
+			enum json_tokener_error err = json_tokener_get_error(reader->tokener);
+			if (obj) {
+				json_object_put(obj);
+			}
+			if (err == json_tokener_continue) {
+				reader->parsed = reader->len;
+			} else if (err == json_tokener_success) {
+				// The value ends where the tokener stopped
+				json_reader_take(reader, chunk + reader->tokener->char_offset,
+				                 value, len);
+				return NULL;
+			} else {
+				return json_reader_error(reader, chunk + reader->tokener->char_offset,
+				                         err);
+			}
+		}
+		
+		if (reader->eof) {
+			if (!reader->in_value) {
+				return NULL;
+			}
+			
+			// A value ending at the very end of the input (e.g. a bare number) is
+			// only complete once the tokener has seen a terminator: its null
+			// terminator is passed as one.
+			json_object *obj = json_tokener_parse_ex(reader->tokener, "", 1);
+			enum json_tokener_error err = json_tokener_get_error(reader->tokener);
+			if (obj) {
+				json_object_put(obj);
+			}
+			if (err != json_tokener_success) {
+				return json_reader_error(reader, reader->len, err);
+			}
+			json_reader_take(reader, reader->len, value, len);
+			return NULL;
+		}
+		
+		char *err = json_reader_fill(reader);
+		if (err) {
+			return err;
+		}
+	}
+}
@@ -3,6 +3,9 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "json.h"
@@ -131,6 +134,10 @@ char *annotate_error(const char *str, size_t offset, const char *message) {
 // JSON utilities
 ////////////////////////////////////////////////////////////////////////////////
 
+// Each thread's tokener, reused by every call to json_parse (rather than
+// allocating a new tokener, with its stack and buffer, for every value)
+static _Thread_local json_tokener *json_parse_tokener = NULL;
+
 /**
  * Parse the supplied JSON string, returning a human-readable error message
  * if the string is not valid and NULL otherwise. The caller must free any
@@ -142,25 +149,37 @@ char *json_parse(const char *str, int len, json_object **obj) {
 	}
 	
 	// Parse the string and see what happens
-	json_tokener *tokener = json_tokener_new();
+	if (!json_parse_tokener) {
+		json_parse_tokener = json_tokener_new();
+	}
+	json_tokener *tokener = json_parse_tokener;
+	json_tokener_reset(tokener);
 	*obj = json_tokener_parse_ex(tokener, str, len);
 	enum json_tokener_error err = json_tokener_get_error(tokener);
+	size_t err_offset = tokener->char_offset;
 	
-	bool success = (err == json_tokener_success ||
-	                       (json_tokener_continue && obj != NULL));
+	// A value ending at the very end of the input (e.g. a bare number) is
+	// only complete once the tokener has seen a terminator.
+	if (err == json_tokener_continue) {
+		*obj = json_tokener_parse_ex(tokener, "", 1);
+		err = json_tokener_get_error(tokener);
+		err_offset = len;
+	}
 	
 	const char *err_message = json_tokener_error_desc(err);
-	size_t err_offset = tokener->char_offset;
 	
-	if (success && tokener->char_offset == len) {
+	if (err == json_tokener_success && err_offset == (size_t)len) {
 		// Parsed the whole string with success, JSON is valid!
-		json_tokener_free(tokener);
 		return NULL;
-	} else if (success) {
+	} else if (err == json_tokener_success) {
 		// Some of the end of the string was not parsed
 		err_message = "unexpected extra input";
 	}
-	json_tokener_free(tokener);
+	
+	if (*obj) {
+		json_object_put(*obj);
+		*obj = NULL;
+	}
 	
 	return annotate_error(str, err_offset, err_message);
 }
@@ -169,8 +188,21 @@ char *json_parse(const char *str, int len, json_object **obj) {
  * Validate the supplied JSON string, returning a human-readable error message
  * if the string is not valid and NULL otherwise. The caller must free any
  * string returned.
+ *
+ * Strict JSON is checked in place with json_check, without allocating. Only
+ * strings it rejects are parsed with json-c, which gives an annotated error
+ * message (and accepts json-c's extensions, as before).
  */
 char *json_validate(const char *str, int len) {
+	if (len < 0) {
+		len = strlen(str);
+	}
+	char *check_err = json_check(str, len);
+	if (!check_err) {
+		return NULL;
+	}
+	free(check_err);
+	
 	json_object *obj;
 	char *err = json_parse(str, len, &obj);
 	if (obj) {
@@ -180,42 +212,344 @@ char *json_validate(const char *str, int len) {
 }
 
 /**
- * Given a JSON string, return the same string formatted according to a JSON-C
- * formatting constant. The returned string is in malloc-managed memory and
- * must be freed by the caller.
+ * Skip any JSON whitespace starting at str[i], returning the index of the next
+ * non-whitespace character (or len).
  */
-char *json_reformat(const char *in_str, int format) {
-	json_object *json = json_tokener_parse(in_str);
-	const char *one_liner = json_object_to_json_string_ext(json, format);
+static size_t json_check_space(const char *str, size_t len, size_t i) {
+	while (i < len && (str[i] == ' ' || str[i] == '\t' ||
+	                   str[i] == '\n' || str[i] == '\r')) {
+		i++;
+	}
+	return i;
+}
+
+/**
+ * Check the string starting at str[*i] (which must be a '"'), advancing *i
+ * past it. Returns NULL if it is valid and a (static) error message otherwise.
+ */
+static const char *json_check_string(const char *str, size_t len, size_t *i) {
+	if (*i >= len || str[*i] != '"') {
+		return "expected a string";
+	}
+	(*i)++;
 	
-	// Copy into manually managed memory
-	char *out = malloc(strlen(one_liner) + 1);
-	strcpy(out, one_liner);
+	while (*i < len) {
+		unsigned char c = str[*i];
+		if (c == '"') {
+			(*i)++;
+			return NULL;
+		} else if (c < 0x20) {
+			return "control character in string";
+		} else if (c == '\\') {
+			(*i)++;
+			if (*i >= len) {
+				break;
+			} else if (str[*i] == 'u') {
+				for (int j = 0; j < 4; j++) {
+					(*i)++;
+					if (*i >= len) {
+						return "unterminated string";
+					} else if (!strchr("0123456789abcdefABCDEF", str[*i]) || str[*i] == '\0') {
+						return "invalid unicode escape";
+					}
+				}
+			} else if (!strchr("\"\\/bfnrt", str[*i]) || str[*i] == '\0') {
+				return "invalid escape sequence";
+			}
+		}
+		(*i)++;
+	}
 	
-	json_object_put(json);
+	return "unterminated string";
+}
+
+/**
+ * Check the number, 'true', 'false' or 'null' starting at str[*i], advancing
+ * *i past it. Returns NULL if it is valid and a (static) error message
+ * otherwise.
+ */
+static const char *json_check_scalar(const char *str, size_t len, size_t *i) {
+	static const char *literals[] = {"true", "false", "null"};
+	for (size_t l = 0; l < sizeof(literals) / sizeof(literals[0]); l++) {
+		size_t literal_len = strlen(literals[l]);
+		if (len - *i >= literal_len &&
+		    memcmp(str + *i, literals[l], literal_len) == 0) {
+			*i += literal_len;
+			return NULL;
+		}
+	}
+	
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	size_t start = *i;
+	if (*i < len && str[*i] == '-') {
+		(*i)++;
+	}
+	if (*i < len && str[*i] == '0') {
+		(*i)++;
+	} else if (*i < len && str[*i] >= '1' && str[*i] <= '9') {
+		while (*i < len && str[*i] >= '0' && str[*i] <= '9') {
+			(*i)++;
+		}
+	} else {
+		*i = start;
+		return "expected a value";
+	}
+	if (*i < len && str[*i] == '.') {
+		(*i)++;
+		if (!(*i < len && str[*i] >= '0' && str[*i] <= '9')) {
+			return "expected a digit after the decimal point";
+		}
+		while (*i < len && str[*i] >= '0' && str[*i] <= '9') {
+			(*i)++;
+		}
+	}
+	if (*i < len && (str[*i] == 'e' || str[*i] == 'E')) {
+		(*i)++;
+		if (*i < len && (str[*i] == '+' || str[*i] == '-')) {
+			(*i)++;
+		}
+		if (!(*i < len && str[*i] >= '0' && str[*i] <= '9')) {
+			return "expected a digit in the exponent";
+		}
+		while (*i < len && str[*i] >= '0' && str[*i] <= '9') {
+			(*i)++;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Validate a JSON string of 'len' bytes (which need not be null-terminated)
+ * in place, without allocating any memory unless it is invalid. Returns NULL
+ * if the string is valid and a human-readable error message (giving the line
+ * and column of the problem) otherwise, which the caller must free.
+ *
+ * Unlike json_validate, only strict JSON is accepted. Nesting is limited to
+ * the same depth as json-c's parser.
+ */
+char *json_check(const char *str, size_t len) {
+	// One bit per level of nesting: set for objects, clear for arrays
+	uint64_t stack[(JSON_TOKENER_DEFAULT_DEPTH + 63) / 64] = {0};
+	size_t depth = 0;
+	#define JSON_CHECK_IN_OBJECT() \
+		(depth > 0 && (stack[(depth - 1) / 64] >> ((depth - 1) % 64)) & 1)
+	
+	const char *err_message = NULL;
+	size_t i = json_check_space(str, len, 0);
+	while (true) {
+		// Within an object, each value is preceded by its key
+		if (JSON_CHECK_IN_OBJECT()) {
+			if ((err_message = json_check_string(str, len, &i))) {
+				break;
+			}
+			i = json_check_space(str, len, i);
+			if (i >= len || str[i] != ':') {
+				err_message = "expected ':'";
+				break;
+			}
+			i = json_check_space(str, len, i + 1);
+		}
+		
+		// The value itself
+		if (i < len && (str[i] == '{' || str[i] == '[')) {
+			if (depth == JSON_TOKENER_DEFAULT_DEPTH) {
+				err_message = "nesting too deep";
+				break;
+			}
+			uint64_t bit = 1ull << (depth % 64);
+			if (str[i] == '{') {
+				stack[depth / 64] |= bit;
+			} else {
+				stack[depth / 64] &= ~bit;
+			}
+			depth++;
+			
+			char close = str[i] == '{' ? '}' : ']';
+			i = json_check_space(str, len, i + 1);
+			if (i < len && str[i] == close) {
+				// Empty object or array
+				i++;
+				depth--;
+			} else {
+				continue;
+			}
+		} else if (i < len && str[i] == '"') {
+			if ((err_message = json_check_string(str, len, &i))) {
+				break;
+			}
+		} else if ((err_message = json_check_scalar(str, len, &i))) {
+			break;
+		}
+		
+		// Close any objects and arrays ending after this value and move on to
+		// the next value
+		while (true) {
+			i = json_check_space(str, len, i);
+			if (depth == 0) {
+				if (i != len) {
+					err_message = "unexpected extra input";
+				}
+				break;
+			} else if (i < len && str[i] == ',') {
+				i = json_check_space(str, len, i + 1);
+				break;
+			} else if (i < len && str[i] == (JSON_CHECK_IN_OBJECT() ? '}' : ']')) {
+				i++;
+				depth--;
+			} else {
+				err_message = JSON_CHECK_IN_OBJECT() ? "expected ',' or '}'"
+				                                     : "expected ',' or ']'";
+				break;
+			}
+		}
+		if (depth == 0 || err_message) {
+			break;
+		}
+	}
+	#undef JSON_CHECK_IN_OBJECT
+	
+	if (!err_message) {
+		return NULL;
+	}
 	
+	// Report where the error occurred (rather than quoting the string, which
+	// may be very large)
+	if (i >= len && strncmp(err_message, "expected", 8) == 0) {
+		err_message = "unexpected end of input";
+	}
+	size_t line = 1;
+	size_t line_start = 0;
+	for (size_t j = 0; j < i && j < len; j++) {
+		if (str[j] == '\n') {
+			line++;
+			line_start = j + 1;
+		}
+	}
+	size_t out_len = strlen(err_message) + 64;
+	char *out = malloc(out_len);
+	snprintf(out, out_len, "%s at line %zu, column %zu",
+	         err_message, line, i - line_start + 1);
 	return out;
 }
 
 /**
- * Given a JSON string, return the same string formatted in the relevant style.
- * The caller must free the allocated string with 'free' afterwards.
+ * Given a parsed JSON value, return it formatted in the relevant style. Since
+ * the original text is not available, JSON_FORMAT_VERBATIM is treated as
+ * JSON_FORMAT_SINGLE_LINE. The returned string (whose length is returned via
+ * 'len') belongs to the value and is only valid until the value is freed or
+ * formatted again.
  */
-char *json_to_format(const char *in_str, json_format_t json_format) {
+const char *json_object_to_format_borrowed(json_object *json,
+                                           json_format_t json_format,
+                                           size_t *len) {
 	switch (json_format) {
 		case JSON_FORMAT_SINGLE_LINE:
-			return json_reformat(in_str, JSON_C_TO_STRING_NOSLASHESCAPE | JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOZERO);
+		case JSON_FORMAT_VERBATIM:
+			return json_object_to_json_string_length(json, JSON_C_TO_STRING_NOSLASHESCAPE | JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOZERO, len);
 		
 		case JSON_FORMAT_PRETTY:
-			return json_reformat(in_str, JSON_C_TO_STRING_NOSLASHESCAPE | JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED | JSON_C_TO_STRING_NOZERO);
-		
-		case JSON_FORMAT_VERBATIM:
-			return alloced_copy(in_str);
+			return json_object_to_json_string_length(json, JSON_C_TO_STRING_NOSLASHESCAPE | JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED | JSON_C_TO_STRING_NOZERO, len);
 		
 		case JSON_FORMAT_QUIET:
-			return alloced_copy("");
+			*len = 0;
+			return "";
 	}
 	// Should not reach here!
+	*len = 0;
 	return NULL;
+}
+
+/**
+ * Given a parsed JSON value, return it formatted in the relevant style (see
+ * json_object_to_format_borrowed). The caller must free the allocated string
+ * with 'free' afterwards.
+ */
+char *json_object_to_format(json_object *json, json_format_t json_format) {
+	size_t len;
+	const char *out = json_object_to_format_borrowed(json, json_format, &len);
+	return alloced_copyn(out, len);
+}
+
+/**
+ * Given a JSON string, return the same string formatted in the relevant style.
+ * The caller must free the allocated string with 'free' afterwards.
+ */
+char *json_to_format(const char *in_str, json_format_t json_format) {
+	if (json_format == JSON_FORMAT_VERBATIM) {
+		return alloced_copy(in_str);
+	}
 	
+	json_object *json = json_tokener_parse(in_str);
+	char *out = json_object_to_format(json, json_format);
+	json_object_put(json);
+	return out;
+}
+
+/**
+ * Mix the bits of a hash (the splitmix64 finaliser). Used so that hashes can
+ * be combined by addition without structured values colliding.
+ */
+static uint64_t json_hash_mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h;
+}
+
+/**
+ * Compute a hash of a parsed JSON value which depends only on the value
+ * itself and not how it was written: object key order and whitespace are
+ * ignored and equal numbers hash equally (e.g. 1 and 1.0).
+ */
+uint64_t json_hash(json_object *obj) {
+	switch (json_object_get_type(obj)) {
+		case json_type_null:
+			return json_hash_mix(1);
+		
+		case json_type_boolean:
+			return json_hash_mix(json_object_get_boolean(obj) ? 3 : 2);
+		
+		case json_type_int:
+		case json_type_double: {
+			// Integral values are hashed as integers, otherwise the bits of the
+			// double are used.
+			double d = json_object_get_double(obj);
+			uint64_t bits;
+			if (json_object_is_type(obj, json_type_int)) {
+				bits = (uint64_t)json_object_get_int64(obj);
+			} else if (d >= -9.2e18 && d <= 9.2e18 && d == (double)(int64_t)d) {
+				bits = (uint64_t)(int64_t)d;
+			} else {
+				memcpy(&bits, &d, sizeof(bits));
+			}
+			return json_hash_mix(json_hash_mix(4) ^ bits);
+		}
+		
+		case json_type_string:
+			return json_hash_mix(5) ^ hash_bytes(json_object_get_string(obj),
+			                                     json_object_get_string_len(obj));
+		
+		case json_type_array: {
+			// Order matters
+			uint64_t h = json_hash_mix(6);
+			size_t len = json_object_array_length(obj);
+			for (size_t i = 0; i < len; i++) {
+				h = json_hash_mix(h ^ json_hash(json_object_array_get_idx(obj, i)));
+			}
+			return h;
+		}
+		
+		case json_type_object: {
+			// Order doesn't matter: combine members by addition
+			uint64_t h = json_hash_mix(7);
+			json_object_object_foreach(obj, key, value) {
+				h += json_hash_mix(hash_string(key) ^ json_hash(value));
+			}
+			return h;
+		}
+	}
+	// Should not reach here!
+	return 0;
 }
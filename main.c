@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
@@ -11,8 +12,6 @@
 #include "qth_client.h"
 
 MQTTClient mqtt_client;
-MQTTClient_connectOptions mqtt_opts = MQTTClient_connectOptions_initializer;
-MQTTClient_willOptions mqtt_will_opts = MQTTClient_willOptions_initializer;
 
 
 /**
@@ -97,6 +96,63 @@ char *get_registration_url(const char *client_id) {
 }
 
 
+/**
+ * Return the default topic used by ping (to be freed by the caller).
+ */
+char *get_ping_topic(const char *client_id) {
+	size_t topic_len = 5 +  // ping/
+	                   strlen(client_id) +  // client ID
+	                   1;  // null
+	char *topic = malloc(topic_len);
+	snprintf(topic, topic_len, "ping/%s", client_id);
+	return topic;
+}
+
+
+/**
+ * Create an empty registration message, to which topics can be added with
+ * registration_add_topic. Must be freed with json_object_put.
+ */
+json_object *registration_new(const char *description) {
+	json_object *reg = json_object_new_object();
+	json_object_object_add(reg, "description",
+		json_object_new_string(description));
+	json_object_object_add(reg, "topics", json_object_new_object());
+	return reg;
+}
+
+
+/**
+ * Add a topic to a registration message created by registration_new.
+ * 'on_unregister' is the JSON value to set or send when the client
+ * unregisters (or NULL).
+ */
+void registration_add_topic(json_object *reg, const char *topic,
+                            const char *behaviour, const char *description,
+                            const char *on_unregister,
+                            bool delete_on_unregister) {
+	json_object *topics;
+	json_object_object_get_ex(reg, "topics", &topics);
+	
+	json_object *topic_obj = json_object_new_object();
+	json_object_object_add(topics, topic, topic_obj);
+	
+	json_object_object_add(topic_obj, "behaviour",
+		json_object_new_string(behaviour));
+	json_object_object_add(topic_obj, "description",
+		json_object_new_string(description));
+	
+	if (on_unregister) {
+		json_object_object_add(topic_obj, "on_unregister",
+			json_tokener_parse(on_unregister));
+	}
+	if (delete_on_unregister) {
+		json_object_object_add(topic_obj, "delete_on_unregister",
+			json_object_new_boolean(true));
+	}
+}
+
+
 /**
  * Return a JSON formatted registration string (to be freed by the caller).
  */
@@ -109,33 +165,14 @@ char *get_registration_msg(const char *topic, const char *description,
 		case CMD_TYPE_SET: behaviour = "PROPERTY-1:N"; break;
 		case CMD_TYPE_WATCH: behaviour = "EVENT-N:1"; break;
 		case CMD_TYPE_SEND: behaviour = "EVENT-1:N"; break;
+		case CMD_TYPE_PING: behaviour = "EVENT-1:N"; break;
 		default: behaviour = NULL; break;
 	}
 	if (behaviour) {
 		// Create the registration message
-		json_object *reg = json_object_new_object();
-		json_object_object_add(reg, "description",
-			json_object_new_string("An instance of the Qth commandline tool."));
-		
-		json_object *topics = json_object_new_object();
-		json_object_object_add(reg, "topics", topics);
-		
-		json_object *topic_obj = json_object_new_object();
-		json_object_object_add(topics, topic, topic_obj);
-		
-		json_object_object_add(topic_obj, "behaviour",
-			json_object_new_string(behaviour));
-		json_object_object_add(topic_obj, "description",
-			json_object_new_string(description));
-		
-		if (on_unregister) {
-			json_object_object_add(topic_obj, "on_unregister",
-				json_tokener_parse(on_unregister));
-		}
-		if (delete_on_unregister) {
-			json_object_object_add(topic_obj, "delete_on_unregister",
-				json_object_new_boolean(true));
-		}
+		json_object *reg = registration_new("An instance of the Qth commandline tool.");
+		registration_add_topic(reg, topic, behaviour, description,
+		                       on_unregister, delete_on_unregister);
 		
 		char *out = alloced_copy(json_object_to_json_string(reg));
 		json_object_put(reg);
@@ -152,6 +189,18 @@ int main(int argc, char *argv[]) {
 	
 	options_t opts = argparse(argc, argv);
 	
+	// Commands which don't require a connection to the broker
+	if (opts.cmd_type == CMD_TYPE_QUERY) {
+		return cmd_query(opts.rrd_file,
+		                 opts.query_start,
+		                 opts.query_end,
+		                 opts.query_resolution,
+		                 opts.query_json);
+	}
+	if (opts.cmd_type == CMD_TYPE_GET && opts.get_local) {
+		return cmd_get_local(opts.topic, opts.mirror_name, opts.json_format);
+	}
+	
 	// Use a random client ID if required
 	srand(time(NULL));
 	char *random_client_id = get_random_client_id(argv[0]);
@@ -160,6 +209,13 @@ int main(int argc, char *argv[]) {
 	}
 	sanitise_client_id(opts.client_id);
 	
+	// Ping uses a private topic named after the client by default
+	char *ping_topic = NULL;
+	if (opts.cmd_type == CMD_TYPE_PING && !opts.topic) {
+		ping_topic = get_ping_topic(opts.client_id);
+		opts.topic = ping_topic;
+	}
+	
 	// Setup registration details
 	char *registration_url = get_registration_url(opts.client_id);
 	char *registration_msg = get_registration_msg(opts.topic,
@@ -168,38 +224,21 @@ int main(int argc, char *argv[]) {
 	                                              opts.on_unregister,
 	                                              opts.delete_on_unregister);
 	
-	// Create an MQTT connection
+	// Create an MQTT connection (with a will to unregister the client, if
+	// required)
 	char *mqtt_url = get_mqtt_url(opts.mqtt_host, opts.mqtt_port);
-	if (MQTTClient_create(&mqtt_client, mqtt_url, opts.client_id,
-	                      MQTTCLIENT_PERSISTENCE_NONE, NULL) != 0) {
-		printf("Couldn't create an MQTT connection object!\n");
-		return 1;
-	}
-	
-	// Setup connection options
-	mqtt_opts.keepAliveInterval = opts.mqtt_keep_alive;
-	mqtt_opts.reliable = 0;
-	mqtt_opts.cleansession = 1;
-	
-	// Setup a will to unregister the client, if required.
-	if (opts.register_topic) {
-		mqtt_opts.will = &mqtt_will_opts;
-		mqtt_will_opts.topicName = registration_url;
-		mqtt_will_opts.message = "";
-		mqtt_will_opts.retained = 1;
-	} else {
-		// No Will required if not registering
-		mqtt_opts.will = NULL;
-	}
-	
-	// Connect to MQTT
-	if (MQTTClient_connect(mqtt_client, &mqtt_opts) != 0) {
-		printf("Couldn't connect to MQTT broker!\n");
+	char *connect_err = qth_connect(&mqtt_client, mqtt_url, opts.client_id,
+	                                opts.mqtt_keep_alive,
+	                                opts.register_topic ? registration_url : NULL,
+	                                opts.mqtt5, opts.watch_opts.durable);
+	if (connect_err) {
+		printf("%s\n", connect_err);
+		free(connect_err);
 		return 1;
 	}
 	
-	// Register with the server
-	if (opts.register_topic) {
+	// Register with the server (NB: simulate registers its own topics)
+	if (opts.register_topic && registration_msg) {
 		char *err = qth_set_property(mqtt_client, registration_url,
 		                             registration_msg, opts.meta_timeout);
 		if (err) {
@@ -226,16 +265,30 @@ int main(int argc, char *argv[]) {
 		opts.force = true;
 	}
 	
+	// Report writes of get and watch output (or to watch's '--exec' commands)
+	// to a closed pipe (e.g. 'qth watch ... | head') as EPIPE errors, ending
+	// the command cleanly, rather than being killed by SIGPIPE
+	if (opts.cmd_type == CMD_TYPE_GET || opts.cmd_type == CMD_TYPE_WATCH) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+	
 	// Perform the requested operation.
 	int retval = 1;
 	switch (opts.cmd_type) {
 		case CMD_TYPE_LS:
-			retval = cmd_ls(mqtt_client,
-			                opts.topic,
-			                opts.meta_timeout,
-			                opts.ls_recursive,
-			                opts.ls_format,
-			                opts.json_format);
+			if (opts.ls_watch) {
+				retval = cmd_ls_watch(mqtt_client,
+				                      opts.topic,
+				                      opts.ls_recursive,
+				                      opts.ls_format);
+			} else {
+				retval = cmd_ls(mqtt_client,
+				                opts.topic,
+				                opts.meta_timeout,
+				                opts.ls_recursive,
+				                opts.ls_format,
+				                opts.json_format);
+			}
 			break;
 		
 		case CMD_TYPE_GET:
@@ -247,13 +300,15 @@ int main(int argc, char *argv[]) {
 			                 opts.force,
 			                 opts.get_count,
 			                 opts.get_timeout,
-			                 opts.meta_timeout);
+			                 opts.meta_timeout,
+			                 &opts.watch_opts);
 			break;
 		
 		case CMD_TYPE_SET:
 			retval = cmd_set(mqtt_client,
 			                 opts.topic,
 			                 opts.value,
+			                 opts.value_file,
 			                 opts.register_topic,
 			                 opts.strict,
 			                 opts.force,
@@ -272,7 +327,21 @@ int main(int argc, char *argv[]) {
 			                    opts.meta_timeout);
 			break;
 		
-		case CMD_TYPE_WATCH:
+		case CMD_TYPE_WATCH: {
+			// Connect the shards splitting the subscription between them
+			shard_set_t *shards = NULL;
+			if (opts.watch_shards > 0) {
+				char *err = shard_set_new(mqtt_client, opts.topic, opts.watch_shards,
+				                          mqtt_url, opts.client_id,
+				                          opts.mqtt_keep_alive, opts.mqtt5,
+				                          opts.meta_timeout, &shards);
+				if (err) {
+					fprintf(stderr, "Error: %s\n", err);
+					free(err);
+					break;
+				}
+			}
+			
 			retval = cmd_watch(mqtt_client,
 			                   opts.topic,
 			                   opts.json_format,
@@ -281,13 +350,21 @@ int main(int argc, char *argv[]) {
 			                   opts.force,
 			                   opts.watch_count,
 			                   opts.watch_timeout,
-			                   opts.meta_timeout);
+			                   opts.meta_timeout,
+			                   &opts.watch_opts,
+			                   shards);
+			
+			if (shards) {
+				shard_set_free(shards, true);
+			}
 			break;
+		}
 		
 		case CMD_TYPE_SEND:
 			retval = cmd_send(mqtt_client,
 			                  opts.topic,
 			                  opts.value,
+			                  opts.value_file,
 			                  opts.register_topic,
 			                  opts.strict,
 			                  opts.force,
@@ -296,6 +373,90 @@ int main(int argc, char *argv[]) {
 			                  opts.meta_timeout);
 			break;
 		
+		case CMD_TYPE_MIRROR:
+			retval = cmd_mirror(mqtt_client,
+			                    opts.topic,
+			                    opts.mirror_name,
+			                    opts.mirror_slots,
+			                    opts.mirror_value_size);
+			break;
+		
+		case CMD_TYPE_EXPORT:
+			retval = cmd_export(mqtt_client,
+			                    opts.paths,
+			                    opts.num_paths,
+			                    opts.export_listen);
+			break;
+		
+		case CMD_TYPE_TOP:
+			retval = cmd_top(mqtt_client,
+			                 opts.topic,
+			                 opts.top_interval,
+			                 opts.top_limit,
+			                 opts.top_json,
+			                 opts.watch_count);
+			break;
+		
+		case CMD_TYPE_WAIT:
+			retval = cmd_wait(mqtt_client,
+			                  opts.topic,
+			                  opts.json_format,
+			                  opts.force,
+			                  &opts.watch_opts,
+			                  opts.wait_changed,
+			                  opts.wait_timeout,
+			                  opts.meta_timeout);
+			break;
+		
+		case CMD_TYPE_CALL:
+			retval = cmd_call(mqtt_client,
+			                  opts.topic,
+			                  opts.reply_topic,
+			                  opts.value,
+			                  opts.json_format,
+			                  opts.force,
+			                  opts.call_correlate,
+			                  opts.watch_opts.select,
+			                  opts.call_timeout,
+			                  opts.meta_timeout);
+			break;
+		
+		case CMD_TYPE_FIND:
+			retval = cmd_find(mqtt_client,
+			                  opts.topic,
+			                  &opts.find_opts,
+			                  opts.ls_format,
+			                  opts.meta_timeout);
+			break;
+		
+		case CMD_TYPE_SIMULATE:
+			retval = cmd_simulate(mqtt_client,
+			                      opts.simulate_spec,
+			                      registration_url,
+			                      opts.meta_timeout);
+			break;
+		
+		case CMD_TYPE_PING:
+			retval = cmd_ping(mqtt_client,
+			                  opts.topic,
+			                  opts.ping_interval,
+			                  opts.ping_json,
+			                  opts.watch_count,
+			                  opts.ping_timeout,
+			                  opts.send_timeout);
+			break;
+		
+		case CMD_TYPE_LOG:
+			retval = cmd_log(mqtt_client,
+			                 opts.topic,
+			                 opts.rrd_file,
+			                 opts.rrd_spec,
+			                 opts.force,
+			                 opts.watch_count,
+			                 opts.watch_timeout,
+			                 opts.meta_timeout);
+			break;
+		
 		default:
 			fprintf(stderr, "Error: Not implemented!\n");
 			return 1;
@@ -313,16 +474,17 @@ int main(int argc, char *argv[]) {
 	}
 	
 	// Close the connection
-	if (cleanlyDisconnect) {
-		int status = MQTTClient_disconnect(mqtt_client, opts.meta_timeout);
-		if (status != MQTTCLIENT_SUCCESS) {
-			fprintf(stderr, "Error: Couldn't cleanly disconnect from MQTT broker.\n");
-		}
+	int status = qth_disconnect(&mqtt_client, cleanlyDisconnect, opts.meta_timeout);
+	if (status != MQTTCLIENT_SUCCESS) {
+		fprintf(stderr, "Error: Couldn't cleanly disconnect from MQTT broker.\n");
 	}
-	MQTTClient_destroy(&mqtt_client);
 	
 	free(mqtt_url);
 	free(random_client_id);
+	free(ping_topic);
+	expr_free(opts.watch_opts.filter);
+	expr_free(opts.watch_opts.select);
+	expr_free(opts.call_correlate);
 	free(registration_url);
 	free(registration_msg);
 	
@@ -0,0 +1,349 @@
+/**
+ * Shared-memory mirror of Qth property values (see qth_mirror.h).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qth_mirror.h"
+
+#define MIRROR_MAGIC 0x314d5451u  // "QTM1"
+
+// Slot flags
+#define SLOT_USED      (1u << 0)  // Slot holds a topic (never cleared)
+#define SLOT_HAS_VALUE (1u << 1)  // Slot holds a value for its topic
+#define SLOT_TRUNCATED (1u << 2)  // Value was too large for the slot
+
+typedef struct {
+	uint32_t magic;
+	uint32_t num_slots;
+	uint32_t value_size;
+	uint32_t slot_size;
+	
+	// Process ID of the writer (used by readers to detect a stale mirror)
+	int32_t writer_pid;
+	uint32_t reserved;
+} mirror_header_t;
+
+typedef struct {
+	// Sequence lock: odd while the writer is updating the value
+	uint32_t seq;
+	uint32_t flags;
+	
+	// The topic and its hash are written once, before SLOT_USED is set, and
+	// never change afterwards.
+	uint64_t hash;
+	char topic[QTH_MIRROR_TOPIC_SIZE];
+	
+	uint32_t value_len;
+	uint32_t reserved;
+	char value[];
+} mirror_slot_t;
+
+struct qth_mirror {
+	void *map;
+	size_t map_len;
+	mirror_header_t *header;
+};
+
+
+/**
+ * FNV-1a hash of a topic name.
+ */
+static uint64_t mirror_hash(const char *topic) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const char *c = topic; *c; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static mirror_slot_t *mirror_slot(qth_mirror_t *mirror, uint32_t i) {
+	return (mirror_slot_t *)((char *)(mirror->header + 1) +
+	                         ((size_t)i * mirror->header->slot_size));
+}
+
+static char *mirror_error(const char *message) {
+	return strdup(message);
+}
+
+
+/**
+ * Open an existing mirror for reading. Returns an error message (to be freed
+ * by the caller) or NULL on success.
+ */
+char *qth_mirror_open(const char *name, qth_mirror_t **mirror) {
+	*mirror = NULL;
+	
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return mirror_error("Mirror not found (is 'qth mirror' running?).");
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mirror_header_t)) {
+		close(fd);
+		return mirror_error("Mirror is not valid.");
+	}
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return mirror_error("Couldn't map mirror.");
+	}
+	
+	mirror_header_t *header = map;
+	bool valid = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == MIRROR_MAGIC &&
+	             header->num_slots > 0 &&
+	             sizeof(mirror_header_t) +
+	             ((size_t)header->num_slots * header->slot_size) <= (size_t)st.st_size;
+	if (!valid) {
+		munmap(map, st.st_size);
+		return mirror_error("Mirror is not valid.");
+	}
+	
+	// Check the writer is still alive (otherwise the values are stale)
+	if (kill(header->writer_pid, 0) != 0 && errno != EPERM) {
+		munmap(map, st.st_size);
+		return mirror_error("Mirror is stale (is 'qth mirror' running?).");
+	}
+	
+	*mirror = malloc(sizeof(qth_mirror_t));
+	(*mirror)->map = map;
+	(*mirror)->map_len = st.st_size;
+	(*mirror)->header = header;
+	return NULL;
+}
+
+
+/**
+ * Read the latest value of a property from the mirror into 'value' (which
+ * will be null terminated). The length of the value is returned via
+ * 'value_len' (if non-NULL).
+ */
+qth_mirror_result_t qth_mirror_get(qth_mirror_t *mirror, const char *topic,
+                                   char *value, size_t value_size,
+                                   size_t *value_len) {
+	uint64_t hash = mirror_hash(topic);
+	uint32_t num_slots = mirror->header->num_slots;
+	
+	for (uint32_t i = 0; i < num_slots; i++) {
+		mirror_slot_t *slot = mirror_slot(mirror, (hash + i) % num_slots);
+		uint32_t flags = __atomic_load_n(&slot->flags, __ATOMIC_ACQUIRE);
+		if (!(flags & SLOT_USED)) {
+			return QTH_MIRROR_NOT_FOUND;
+		}
+		if (slot->hash != hash || strcmp(slot->topic, topic) != 0) {
+			continue;
+		}
+		
+		// Found the topic, read its value, retrying if the writer modifies it
+		// while we're copying it.
+		qth_mirror_result_t result;
+		uint32_t seq_before;
+		uint32_t seq_after;
+		unsigned int attempts = 0;
+		do {
+			while ((seq_before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1) {
+				if (++attempts % 64 == 0) {
+					sched_yield();
+				}
+			}
+			
+			flags = __atomic_load_n(&slot->flags, __ATOMIC_RELAXED);
+			size_t len = slot->value_len;
+			if (!(flags & SLOT_HAS_VALUE)) {
+				result = QTH_MIRROR_NO_VALUE;
+			} else if ((flags & SLOT_TRUNCATED) || len + 1 > value_size) {
+				result = QTH_MIRROR_TOO_LARGE;
+			} else {
+				memcpy(value, slot->value, len);
+				value[len] = '\0';
+				if (value_len) {
+					*value_len = len;
+				}
+				result = QTH_MIRROR_OK;
+			}
+			
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			seq_after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		} while (seq_before != seq_after);
+		
+		return result;
+	}
+	
+	return QTH_MIRROR_NOT_FOUND;
+}
+
+
+/**
+ * Return the buffer size required to read any value from the mirror
+ * (including the null terminator).
+ */
+size_t qth_mirror_value_size(qth_mirror_t *mirror) {
+	return mirror->header->value_size + 1;
+}
+
+
+/**
+ * Close a mirror opened with qth_mirror_open.
+ */
+void qth_mirror_close(qth_mirror_t *mirror) {
+	munmap(mirror->map, mirror->map_len);
+	free(mirror);
+}
+
+
+/**
+ * Create a new, empty mirror, replacing any existing mirror with the same
+ * name whose writer has exited. Returns an error message (to be freed by the
+ * caller) or NULL on success.
+ */
+char *qth_mirror_create(const char *name, uint32_t num_slots,
+                        uint32_t value_size, qth_mirror_t **mirror) {
+	*mirror = NULL;
+	
+	// Round slots up to a whole number of cache lines
+	uint32_t slot_size = sizeof(mirror_slot_t) + value_size;
+	slot_size = (slot_size + 63) & ~63u;
+	size_t map_len = sizeof(mirror_header_t) + ((size_t)num_slots * slot_size);
+	
+	// Only replace an existing mirror if its writer has gone (or it isn't a
+	// valid mirror)
+	qth_mirror_t *existing;
+	char *err = qth_mirror_open(name, &existing);
+	if (!err) {
+		qth_mirror_close(existing);
+		return mirror_error("Mirror is already being written (is another 'qth mirror' running?).");
+	}
+	free(err);
+	shm_unlink(name);
+	
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		return mirror_error("Couldn't create shared memory object.");
+	}
+	
+	// NB: The newly extended object is zero-filled: all slots are unused.
+	if (ftruncate(fd, map_len) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return mirror_error("Couldn't allocate shared memory.");
+	}
+	
+	void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return mirror_error("Couldn't map shared memory.");
+	}
+	
+	mirror_header_t *header = map;
+	header->num_slots = num_slots;
+	header->value_size = value_size;
+	header->slot_size = slot_size;
+	header->writer_pid = getpid();
+	__atomic_store_n(&header->magic, MIRROR_MAGIC, __ATOMIC_RELEASE);
+	
+	*mirror = malloc(sizeof(qth_mirror_t));
+	(*mirror)->map = map;
+	(*mirror)->map_len = map_len;
+	(*mirror)->header = header;
+	return NULL;
+}
+
+
+/**
+ * Find the slot for a topic, or the unused slot where it would be inserted.
+ * Returns NULL if the topic is absent and the table is full. (Writer only.)
+ */
+static mirror_slot_t *mirror_find_slot(qth_mirror_t *mirror, const char *topic,
+                                       uint64_t hash) {
+	uint32_t num_slots = mirror->header->num_slots;
+	for (uint32_t i = 0; i < num_slots; i++) {
+		mirror_slot_t *slot = mirror_slot(mirror, (hash + i) % num_slots);
+		if (!(slot->flags & SLOT_USED) ||
+		    (slot->hash == hash && strcmp(slot->topic, topic) == 0)) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Check whether a topic has been added to the mirror. (Writer only.)
+ */
+bool qth_mirror_contains(qth_mirror_t *mirror, const char *topic) {
+	mirror_slot_t *slot = mirror_find_slot(mirror, topic, mirror_hash(topic));
+	return slot && (slot->flags & SLOT_USED);
+}
+
+
+/**
+ * Set the value of a topic in the mirror, adding the topic if necessary. If
+ * 'value' is NULL or empty, the topic is recorded as having no value. Returns
+ * an error message (to be freed by the caller) or NULL on success. (Writer
+ * only.)
+ */
+char *qth_mirror_set(qth_mirror_t *mirror, const char *topic,
+                     const char *value, size_t value_len) {
+	uint64_t hash = mirror_hash(topic);
+	mirror_slot_t *slot = mirror_find_slot(mirror, topic, hash);
+	if (!slot) {
+		return mirror_error("Mirror is full.");
+	}
+	
+	if (!(slot->flags & SLOT_USED)) {
+		size_t topic_len = strlen(topic);
+		if (topic_len >= QTH_MIRROR_TOPIC_SIZE) {
+			return mirror_error("Topic name too long to mirror.");
+		}
+		memcpy(slot->topic, topic, topic_len + 1);
+		slot->hash = hash;
+		__atomic_store_n(&slot->flags, SLOT_USED, __ATOMIC_RELEASE);
+	}
+	
+	uint32_t flags = SLOT_USED;
+	if (value && value_len > 0) {
+		flags |= SLOT_HAS_VALUE;
+		if (value_len > mirror->header->value_size) {
+			flags |= SLOT_TRUNCATED;
+		}
+	}
+	
+	// Update the value under the sequence lock
+	uint32_t seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	if ((flags & SLOT_HAS_VALUE) && !(flags & SLOT_TRUNCATED)) {
+		memcpy(slot->value, value, value_len);
+		slot->value_len = value_len;
+	} else {
+		slot->value_len = 0;
+	}
+	__atomic_store_n(&slot->flags, flags, __ATOMIC_RELAXED);
+	
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	
+	return NULL;
+}
+
+
+/**
+ * Unmap and remove a mirror created with qth_mirror_create.
+ */
+void qth_mirror_destroy(qth_mirror_t *mirror, const char *name) {
+	munmap(mirror->map, mirror->map_len);
+	shm_unlink(name);
+	free(mirror);
+}
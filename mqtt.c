@@ -0,0 +1,520 @@
+/**
+ * Thin wrappers around the Paho MQTT client which use either MQTT 3.1.1 or
+ * MQTT 5 depending on how the connection was made.
+ *
+ * Under MQTT 5:
+ *
+ * - Topic aliases are used in both directions. The first message published on
+ *   a topic assigns it an alias (while the broker permits more) and later
+ *   messages are sent with just the alias. Aliases used by the broker are
+ *   resolved by qth_receive.
+ * - Subscriptions may ask not to receive our own messages (No Local) or not
+ *   to be sent retained values (Retain Handling).
+ *
+ * Under MQTT 3.1.1 these options are silently ignored.
+ *
+ * Subscriptions are also recorded so that they can be restored when a lost
+ * connection is re-established with qth_reconnect.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The number of topic aliases the broker may use when sending to us
+#define QTH_TOPIC_ALIAS_MAX 256
+
+// How long an MQTT 5 broker keeps a durable session after disconnection (s)
+#define QTH_SESSION_EXPIRY (24 * 60 * 60)
+
+// Subscriptions are recorded as ((flags << 8) | qos) + 1 so that they are
+// never NULL (which marks topics since unsubscribed from)
+#define SUBSCRIPTION(qos, flags) ((void *)(uintptr_t)((((flags) << 8) | (qos)) + 1))
+#define SUBSCRIPTION_QOS(sub) ((int)(((uintptr_t)(sub) - 1) & 0xFF))
+#define SUBSCRIPTION_FLAGS(sub) ((int)(((uintptr_t)(sub) - 1) >> 8))
+
+// Per-connection protocol state
+typedef struct mqtt_connection {
+	MQTTClient client;
+	bool mqtt5;
+	
+	// Connection parameters (kept for reconnection)
+	bool durable;
+	int keep_alive;
+	char *will_topic;
+	
+	// Topics subscribed to (see SUBSCRIPTION)
+	strmap_t *subscriptions;
+	
+	// Aliases assigned to topics we publish to (topic -> alias) and the
+	// number the broker accepts
+	strmap_t *tx_aliases;
+	int num_tx_aliases;
+	int max_tx_aliases;
+	
+	// Topics the broker has assigned to each alias (or NULL)
+	char *rx_aliases[QTH_TOPIC_ALIAS_MAX + 1];
+	
+	struct mqtt_connection *next;
+} mqtt_connection_t;
+
+// All open connections (shards receive from several threads at once)
+static mqtt_connection_t *connections = NULL;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Find the state of a connection made with qth_connect (or NULL).
+ */
+static mqtt_connection_t *get_connection(MQTTClient *client) {
+	pthread_mutex_lock(&connections_lock);
+	mqtt_connection_t *conn = connections;
+	while (conn && conn->client != (MQTTClient)client) {
+		conn = conn->next;
+	}
+	pthread_mutex_unlock(&connections_lock);
+	return conn;
+}
+
+
+/**
+ * Free a connection's state.
+ */
+static void connection_free(mqtt_connection_t *conn) {
+	if (conn->tx_aliases) {
+		strmap_free(conn->tx_aliases, NULL);
+	}
+	for (size_t i = 0; i <= QTH_TOPIC_ALIAS_MAX; i++) {
+		free(conn->rx_aliases[i]);
+	}
+	strmap_free(conn->subscriptions, NULL);
+	free(conn->will_topic);
+	free(conn);
+}
+
+
+/**
+ * Convert an MQTT 5 response into an MQTTCLIENT_* status code, freeing it.
+ */
+static int response_status(MQTTResponse response) {
+	int status = MQTTCLIENT_SUCCESS;
+	if (response.reasonCode < 0) {
+		// A client library error
+		status = response.reasonCode;
+	} else if (response.reasonCode >= 0x80) {
+		status = MQTTCLIENT_FAILURE;
+	}
+	for (int i = 0; i < response.reasonCodeCount; i++) {
+		if (response.reasonCodes[i] >= 0x80) {
+			status = MQTTCLIENT_FAILURE;
+		}
+	}
+	MQTTResponse_free(response);
+	return status;
+}
+
+
+/**
+ * Subscribe a connection to several topics (see qth_subscribe_many).
+ */
+static int subscribe(mqtt_connection_t *conn, int count, char * const *topics,
+                     int *qos, int flags) {
+	if (!conn->mqtt5) {
+		return MQTTClient_subscribeMany(conn->client, count, topics, qos);
+	}
+	
+	MQTTSubscribe_options opts[count];
+	for (int i = 0; i < count; i++) {
+		MQTTSubscribe_options initial = MQTTSubscribe_options_initializer;
+		opts[i] = initial;
+		opts[i].noLocal = (flags & QTH_SUBSCRIBE_NO_LOCAL) ? 1 : 0;
+		opts[i].retainHandling = (flags & QTH_SUBSCRIBE_NO_RETAINED) ? 2 : 0;
+	}
+	
+	if (count == 1) {
+		return response_status(MQTTClient_subscribe5(conn->client, topics[0],
+		                                             qos[0], opts, NULL));
+	} else {
+		return response_status(MQTTClient_subscribeMany5(conn->client, count,
+		                                                 topics, qos, opts, NULL));
+	}
+}
+
+
+/**
+ * Connect (or reconnect) a connection's client to the broker, setting
+ * 'session_present' to whether the broker resumed an existing session.
+ * Returns an MQTTCLIENT_* status code.
+ */
+static int connect_client(mqtt_connection_t *conn, bool *session_present) {
+	// Setup connection options
+	MQTTClient_connectOptions mqtt_opts = MQTTClient_connectOptions_initializer;
+	MQTTClient_connectOptions mqtt5_opts = MQTTClient_connectOptions_initializer5;
+	if (conn->mqtt5) {
+		mqtt_opts = mqtt5_opts;
+		mqtt_opts.cleanstart = !conn->durable;
+	} else {
+		mqtt_opts.cleansession = !conn->durable;
+	}
+	mqtt_opts.keepAliveInterval = conn->keep_alive;
+	mqtt_opts.reliable = 0;
+	
+	MQTTClient_willOptions mqtt_will_opts = MQTTClient_willOptions_initializer;
+	if (conn->will_topic) {
+		mqtt_opts.will = &mqtt_will_opts;
+		mqtt_will_opts.topicName = conn->will_topic;
+		mqtt_will_opts.message = "";
+		mqtt_will_opts.retained = 1;
+	} else {
+		// No Will required
+		mqtt_opts.will = NULL;
+	}
+	
+	// Aliases don't survive reconnection
+	conn->num_tx_aliases = 0;
+	conn->max_tx_aliases = 0;
+	if (conn->tx_aliases) {
+		strmap_free(conn->tx_aliases, NULL);
+		conn->tx_aliases = NULL;
+	}
+	for (size_t i = 0; i <= QTH_TOPIC_ALIAS_MAX; i++) {
+		free(conn->rx_aliases[i]);
+		conn->rx_aliases[i] = NULL;
+	}
+	
+	int status;
+	if (conn->mqtt5) {
+		// Allow the broker to send us topic aliases
+		MQTTProperties props = MQTTProperties_initializer;
+		MQTTProperty alias_max;
+		alias_max.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM;
+		alias_max.value.integer2 = QTH_TOPIC_ALIAS_MAX;
+		MQTTProperties_add(&props, &alias_max);
+		
+		// Without an expiry interval, an MQTT 5 session ends with the
+		// connection
+		if (conn->durable) {
+			MQTTProperty expiry;
+			expiry.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+			expiry.value.integer4 = QTH_SESSION_EXPIRY;
+			MQTTProperties_add(&props, &expiry);
+		}
+		
+		MQTTResponse response = MQTTClient_connect5(conn->client, &mqtt_opts,
+		                                            &props, NULL);
+		MQTTProperties_free(&props);
+		
+		// Find how many aliases the broker lets us use (none if not given)
+		if (response.reasonCode == MQTTREASONCODE_SUCCESS && response.properties &&
+		    MQTTProperties_hasProperty(response.properties,
+		                               MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM)) {
+			conn->max_tx_aliases = MQTTProperties_getNumericValue(
+				response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+		}
+		conn->tx_aliases = strmap_new();
+		status = response_status(response);
+	} else {
+		status = MQTTClient_connect(conn->client, &mqtt_opts);
+	}
+	
+	*session_present = status == MQTTCLIENT_SUCCESS && mqtt_opts.returned.sessionPresent;
+	return status;
+}
+
+
+/**
+ * Find the directory Paho should keep durable sessions' in-flight messages in
+ * ($XDG_CACHE_HOME/qth or ~/.cache/qth), creating it if necessary. Returns a
+ * string to be freed by the caller.
+ */
+static char *get_persistence_dir(void) {
+	char *cache_dir;
+	if (getenv("XDG_CACHE_HOME")) {
+		cache_dir = alloced_copy(getenv("XDG_CACHE_HOME"));
+	} else {
+		cache_dir = alloced_cat(getenv("HOME") ? getenv("HOME") : ".", "/.cache");
+	}
+	mkdir(cache_dir, 0700);
+	char *dir = alloced_cat(cache_dir, "/qth");
+	mkdir(dir, 0700);
+	free(cache_dir);
+	return dir;
+}
+
+
+/**
+ * Create an MQTT client and connect it to the broker at the given URL using
+ * MQTT 5 (if 'mqtt5' is true) or MQTT 3.1.1. If 'will_topic' is not NULL, a
+ * will is set which clears that (retained) topic when the client disconnects
+ * unexpectedly (e.g. to unregister).
+ *
+ * If 'durable' is true, the broker keeps the client's session (and so its
+ * subscriptions and undelivered messages) while it is disconnected and
+ * in-flight messages are kept on disk, so that after qth_reconnect nothing is
+ * lost. The client ID must then be the same each time.
+ *
+ * Returns an error message if there is a problem (which must be freed by the
+ * caller), in which case the client need not be disconnected. Otherwise the
+ * client must be disconnected with qth_disconnect.
+ */
+char *qth_connect(MQTTClient *client, const char *url, const char *client_id,
+                  int keep_alive, const char *will_topic, bool mqtt5,
+                  bool durable) {
+	MQTTClient_createOptions create_opts = MQTTClient_createOptions_initializer;
+	create_opts.MQTTVersion = mqtt5 ? MQTTVERSION_5 : MQTTVERSION_DEFAULT;
+	char *persistence_dir = durable ? get_persistence_dir() : NULL;
+	int create_err = MQTTClient_createWithOptions(
+		client, url, client_id,
+		durable ? MQTTCLIENT_PERSISTENCE_DEFAULT : MQTTCLIENT_PERSISTENCE_NONE,
+		persistence_dir, &create_opts);
+	free(persistence_dir);
+	if (create_err != 0) {
+		return alloced_copy("Couldn't create an MQTT connection object!");
+	}
+	
+	mqtt_connection_t *conn = calloc(1, sizeof(mqtt_connection_t));
+	conn->client = *client;
+	conn->mqtt5 = mqtt5;
+	conn->durable = durable;
+	conn->keep_alive = keep_alive;
+	conn->will_topic = will_topic ? alloced_copy(will_topic) : NULL;
+	conn->subscriptions = strmap_new();
+	
+	bool session_present;
+	if (connect_client(conn, &session_present) != MQTTCLIENT_SUCCESS) {
+		connection_free(conn);
+		MQTTClient_destroy(client);
+		return alloced_copy("Couldn't connect to MQTT broker!");
+	}
+	
+	pthread_mutex_lock(&connections_lock);
+	conn->next = connections;
+	connections = conn;
+	pthread_mutex_unlock(&connections_lock);
+	
+	return NULL;
+}
+
+
+/**
+ * Make one attempt to reconnect a client connected with qth_connect after
+ * the connection was lost. If the broker didn't keep the session (or the
+ * connection isn't durable) everything subscribed to is subscribed to again.
+ * Sets 'session_present' to whether the session was resumed. Returns an
+ * MQTTCLIENT_* status code.
+ */
+int qth_reconnect(MQTTClient *client, bool *session_present) {
+	*session_present = false;
+	mqtt_connection_t *conn = get_connection(client);
+	if (!conn) {
+		return MQTTCLIENT_FAILURE;
+	}
+	
+	if (MQTTClient_isConnected(conn->client)) {
+		MQTTClient_disconnect(conn->client, 0);
+	}
+	int status = connect_client(conn, session_present);
+	if (status != MQTTCLIENT_SUCCESS || *session_present) {
+		return status;
+	}
+	
+	size_t iter = 0;
+	const char *topic;
+	void *sub;
+	while (status == MQTTCLIENT_SUCCESS &&
+	       strmap_next(conn->subscriptions, &iter, &topic, &sub)) {
+		if (sub) {
+			char *topics[] = {(char *)topic};
+			int qos = SUBSCRIPTION_QOS(sub);
+			status = subscribe(conn, 1, topics, &qos, SUBSCRIPTION_FLAGS(sub));
+		}
+	}
+	return status;
+}
+
+
+/**
+ * Disconnect (waiting up to 'timeout' ms for in-flight messages if
+ * 'cleanly' is true) and destroy a client connected with qth_connect. Returns
+ * an MQTTCLIENT_* status code for the disconnection.
+ */
+int qth_disconnect(MQTTClient *client, bool cleanly, int timeout) {
+	int status = MQTTCLIENT_SUCCESS;
+	if (cleanly) {
+		status = MQTTClient_disconnect(*client, timeout);
+	}
+	
+	pthread_mutex_lock(&connections_lock);
+	mqtt_connection_t **conn_ptr = &connections;
+	while (*conn_ptr && (*conn_ptr)->client != *client) {
+		conn_ptr = &(*conn_ptr)->next;
+	}
+	mqtt_connection_t *conn = *conn_ptr;
+	if (conn) {
+		*conn_ptr = conn->next;
+	}
+	pthread_mutex_unlock(&connections_lock);
+	
+	if (conn) {
+		connection_free(conn);
+	}
+	
+	MQTTClient_destroy(client);
+	return status;
+}
+
+
+/**
+ * Subscribe to several topics. The QTH_SUBSCRIBE_* flags choose MQTT 5
+ * subscription options (and are ignored under MQTT 3.1.1). The subscriptions
+ * are recorded so that they can be restored by qth_reconnect. Returns an
+ * MQTTCLIENT_* status code.
+ */
+int qth_subscribe_many(MQTTClient *client, int count, char * const *topics,
+                       int *qos, int flags) {
+	mqtt_connection_t *conn = get_connection(client);
+	if (!conn) {
+		return MQTTClient_subscribeMany(client, count, topics, qos);
+	}
+	
+	int status = subscribe(conn, count, topics, qos, flags);
+	if (status == MQTTCLIENT_SUCCESS) {
+		for (int i = 0; i < count; i++) {
+			strmap_set(conn->subscriptions, topics[i], SUBSCRIPTION(qos[i], flags));
+		}
+	}
+	return status;
+}
+
+
+/**
+ * Subscribe to a topic (see qth_subscribe_many).
+ */
+int qth_subscribe(MQTTClient *client, const char *topic, int qos, int flags) {
+	char *topics[] = {(char *)topic};
+	return qth_subscribe_many(client, 1, topics, &qos, flags);
+}
+
+
+/**
+ * Publish a message, using a topic alias under MQTT 5 where possible. Behaves
+ * like MQTTClient_publish.
+ */
+int qth_publish(MQTTClient *client, const char *topic, int len,
+                const void *payload, int qos, bool retained,
+                MQTTClient_deliveryToken *tok) {
+	mqtt_connection_t *conn = get_connection(client);
+	if (!conn || !conn->mqtt5) {
+		return MQTTClient_publish(client, topic, len, payload, qos, retained, tok);
+	}
+	
+	// Use the topic's existing alias (sending an empty topic name), or assign
+	// it the next (sending both)
+	MQTTProperties props = MQTTProperties_initializer;
+	const char *tx_topic = topic;
+	uintptr_t alias = (uintptr_t)strmap_get(conn->tx_aliases, topic);
+	if (alias) {
+		tx_topic = "";
+	} else if (conn->num_tx_aliases < conn->max_tx_aliases) {
+		alias = ++conn->num_tx_aliases;
+		strmap_set(conn->tx_aliases, topic, (void *)alias);
+	}
+	if (alias) {
+		MQTTProperty alias_prop;
+		alias_prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+		alias_prop.value.integer2 = alias;
+		MQTTProperties_add(&props, &alias_prop);
+	}
+	
+	int status = response_status(MQTTClient_publish5(client, tx_topic, len,
+	                                                 payload, qos, retained,
+	                                                 &props, tok));
+	MQTTProperties_free(&props);
+	return status;
+}
+
+
+/**
+ * Receive a message, behaving like MQTTClient_receive except that, under MQTT
+ * 5, topic aliases used by the broker are resolved into topic names.
+ */
+int qth_receive(MQTTClient *client, char **topic, int *topic_len,
+                MQTTClient_message **message, unsigned long timeout) {
+	int status = MQTTClient_receive(client, topic, topic_len, message, timeout);
+	if (status != MQTTCLIENT_SUCCESS || *message == NULL) {
+		return status;
+	}
+	
+	mqtt_connection_t *conn = get_connection(client);
+	if (!conn || !conn->mqtt5 ||
+	    !MQTTProperties_hasProperty(&(*message)->properties,
+	                                MQTTPROPERTY_CODE_TOPIC_ALIAS)) {
+		return status;
+	}
+	
+	int alias = MQTTProperties_getNumericValue(&(*message)->properties,
+	                                           MQTTPROPERTY_CODE_TOPIC_ALIAS);
+	if (alias <= 0 || alias > QTH_TOPIC_ALIAS_MAX) {
+		// The broker shouldn't use aliases beyond the limit we gave it
+		MQTTClient_free(*topic);
+		MQTTClient_freeMessage(message);
+		*topic = NULL;
+		return MQTTCLIENT_FAILURE;
+	}
+	
+	if ((*topic)[0] != '\0') {
+		// Alias (re)assigned
+		free(conn->rx_aliases[alias]);
+		conn->rx_aliases[alias] = alloced_copy(*topic);
+	} else if (conn->rx_aliases[alias]) {
+		// NB: MQTTClient_free is just free, so callers may free this copy with it
+		MQTTClient_free(*topic);
+		*topic = alloced_copy(conn->rx_aliases[alias]);
+		*topic_len = 0;
+	} else {
+		// Alias not assigned
+		MQTTClient_free(*topic);
+		MQTTClient_freeMessage(message);
+		*topic = NULL;
+		return MQTTCLIENT_FAILURE;
+	}
+	
+	return status;
+}
+
+
+/**
+ * Unsubscribe from several topics. Returns an MQTTCLIENT_* status code.
+ */
+int qth_unsubscribe_many(MQTTClient *client, int count, char * const *topics) {
+	mqtt_connection_t *conn = get_connection(client);
+	if (conn) {
+		for (int i = 0; i < count; i++) {
+			if (strmap_get(conn->subscriptions, topics[i])) {
+				strmap_set(conn->subscriptions, topics[i], NULL);
+			}
+		}
+	}
+	if (!conn || !conn->mqtt5) {
+		return MQTTClient_unsubscribeMany(client, count, topics);
+	} else {
+		return response_status(MQTTClient_unsubscribeMany5(client, count, topics,
+		                                                   NULL));
+	}
+}
+
+
+/**
+ * Unsubscribe from a topic. Returns an MQTTCLIENT_* status code.
+ */
+int qth_unsubscribe(MQTTClient *client, const char *topic) {
+	char *topics[] = {(char *)topic};
+	return qth_unsubscribe_many(client, 1, topics);
+}
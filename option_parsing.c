@@ -9,17 +9,30 @@
 #include <string.h>
 
 #include "qth_client.h"
+#include "qth_mirror.h"
 
 void print_usage(FILE *stream, const char *appname) {
 	fprintf(stream,
 		"usage: %s [various options] TOPIC [VALUE]\n"
 		"   or: %s get [various options] TOPIC\n"
-		"   or: %s set [various options] TOPIC [VALUE]\n"
+		"   or: %s set [various options] TOPIC [VALUE | --file FILE]\n"
 		"   or: %s delete [various options] TOPIC\n"
 		"   or: %s watch [various options] TOPIC\n"
-		"   or: %s send [various options] TOPIC [VALUE]\n"
-		"   or: %s ls [various options] [TOPIC]\n",
-		appname, appname, appname, appname, appname, appname, appname
+		"   or: %s send [various options] TOPIC [VALUE | --file FILE]\n"
+		"   or: %s ls [various options] [TOPIC]\n"
+		"   or: %s log [various options] TOPIC FILE\n"
+		"   or: %s query [various options] FILE\n"
+		"   or: %s mirror [various options] [PATH]\n"
+		"   or: %s export [various options] [PATH ...]\n"
+		"   or: %s top [various options] [TOPIC]\n"
+		"   or: %s ping [various options] [TOPIC]\n"
+		"   or: %s wait [various options] TOPIC [CONDITION]\n"
+		"   or: %s call [various options] TOPIC REPLY_TOPIC [VALUE]\n"
+		"   or: %s find [various options] [PATH]\n"
+		"   or: %s simulate [various options] SPEC\n",
+		appname, appname, appname, appname, appname, appname, appname,
+		appname, appname, appname, appname, appname, appname, appname,
+		appname, appname, appname
 	);
 }
 
@@ -36,8 +49,21 @@ void print_help(FILE *stream, const char *appname) {
 		"\n"
 		"If a subcommand expects an optional VALUE, it will default to 'null'\n"
 		"unless the command is used with --register in which case values will\n"
-		"be read, one-per-line, from STDIN. To read values from STDIN for other\n"
-		"commands, use '-' for the topic on the commandline.\n"
+		"be read from STDIN. To read values from STDIN for other commands, use\n"
+		"'-' for the topic on the commandline. Values read from STDIN may span\n"
+		"several lines or follow one another on the same line and each is sent\n"
+		"as soon as it is complete. An empty line is read as 'null' until a\n"
+		"value spanning several lines is read, after which empty lines are\n"
+		"ignored (as between pretty-printed values).\n"
+		"\n"
+		"The simulate command registers and publishes generated values to the\n"
+		"topics described by a JSON SPEC file of the form {\"topics\": [{\"topic\":\n"
+		"\"sim/dev{}/temp\", \"count\": 100, \"behaviour\": \"PROPERTY-1:N\",\n"
+		"\"rate\": 0.5, \"burst\": 1, \"generator\": \"sine\", \"min\": 15,\n"
+		"\"max\": 25, \"period\": 600}, ...]} where '{}' is replaced by 0 to\n"
+		"count-1. The generators are constant (with a 'value'), counter ('start'\n"
+		"and 'step'), random ('min' and 'max'), sine ('min', 'max' and 'period')\n"
+		"and toggle.\n"
 		"\n"
 		"optional arguments:\n"
 		"  -h --help             show this help message and exit\n"
@@ -50,6 +76,21 @@ void print_help(FILE *stream, const char *appname) {
 		"                        environment variable, or 1883 if not defined).\n"
 		"  -K SECONDS --keep-alive SECONDS\n"
 		"                        set the MQTT keepalive interval\n"
+		"  --qos QOS             override the MQTT QoS used: either a single QoS\n"
+		"                        (0, 1 or 2) for everything or a comma-separated\n"
+		"                        list of CLASS=QOS overrides, e.g. 'property=1'.\n"
+		"                        The classes are 'meta' (directory listings),\n"
+		"                        'property' (setting and deleting properties),\n"
+		"                        'event' (sending events) and 'watch'\n"
+		"                        (subscribing to properties and events). This\n"
+		"                        is only an override: without it every class\n"
+		"                        uses QoS 2, as before. Defaults to the value of\n"
+		"                        the QTH_QOS environment variable, if defined.\n"
+		"  -5 --mqtt5            connect using MQTT 5 rather than MQTT 3.1.1.\n"
+		"                        Topic aliases are then used to avoid resending\n"
+		"                        topic names, replies to 'call' never include\n"
+		"                        our own request and 'watch --live' doesn't\n"
+		"                        have retained values sent at all.\n"
 		"  -C CLIENT_ID --client-id CLIENT_ID\n"
 		"                        Specifies the client ID to use. If not given, a\n"
 		"                        client ID will be randomly generated.\n"
@@ -115,10 +156,214 @@ void print_help(FILE *stream, const char *appname) {
 		"                        When -r is given, deletes the property when the\n"
 		"                        command exists.\n"
 		"\n"
+		"optional arguments when used with set or send:\n"
+		"  --file FILE           send the JSON value in FILE (which may be many\n"
+		"                        megabytes) instead of a VALUE argument. The\n"
+		"                        file is mapped into memory and sent as-is. An\n"
+		"                        empty (or whitespace-only) file sends null.\n"
+		"                        FILE must be a regular file (not a pipe).\n"
+		"\n"
 		"optional arguments when used with ls:\n"
 		"  -R --recursive        list subdirectories recursively\n"
 		"  -l --long             show listing in long format\n"
 		"  -j --json             show listing in JSON format\n"
+		"  --ndjson              show one JSON object per line for every topic\n"
+		"                        listed, giving its 'path' and 'behaviours'. With\n"
+		"                        -R, each directory's entries are printed as soon\n"
+		"                        as its listing arrives.\n"
+		"  --watch               keep printing changes to the listing (with -R,\n"
+		"                        including subdirectories) as lines starting with\n"
+		"                        '+' or '-', or JSON objects giving the behaviours\n"
+		"                        'added' and 'removed'. Topics already listed are\n"
+		"                        printed as added.\n"
+		"\n"
+		"optional arguments when used with find:\n"
+		"  --name GLOB           only list topics whose last part matches GLOB.\n"
+		"  --path GLOB           only list topics matching GLOB ('*' also matches\n"
+		"                        '/'). Subdirectories which can't contain a match\n"
+		"                        aren't fetched.\n"
+		"  --regex REGEX         only list topics matching the extended regular\n"
+		"                        expression REGEX. If anchored with '^',\n"
+		"                        subdirectories which can't contain a match aren't\n"
+		"                        fetched.\n"
+		"  --behaviour BEHAVIOUR only list topics with the given behaviour, e.g.\n"
+		"                        'EVENT-1:N', 'PROPERTY' (either variant) or\n"
+		"                        'DIRECTORY'.\n"
+		"  -d REGEX --description REGEX\n"
+		"                        only list topics with a description matching the\n"
+		"                        extended regular expression REGEX (ignoring case).\n"
+		"  -l --long             show matches in long format\n"
+		"  --ndjson              show matches as one JSON object per line\n"
+		"\n"
+		"optional arguments when used with log:\n"
+		"  -a SPEC --archives SPEC\n"
+		"                        When FILE does not exist, create it with the\n"
+		"                        comma-separated list of STEP:RETENTION archives\n"
+		"                        given (default '1s:1h,1m:1d,1h:1y'). Each archive\n"
+		"                        keeps the min, max and average of the values\n"
+		"                        received in each STEP for RETENTION. If FILE\n"
+		"                        already exists, its archives must match SPEC.\n"
+		"\n"
+		"optional arguments when used with query:\n"
+		"  -S TIME --start TIME  the start of the period to output. Either a\n"
+		"                        time in seconds since the epoch, 'now' or a\n"
+		"                        negative duration relative to now, e.g. '-10m'\n"
+		"                        (default '-1h').\n"
+		"  -E TIME --end TIME    the end of the period to output (default 'now').\n"
+		"  --resolution STEP     read from the archive with the given step (by\n"
+		"                        default the finest archive covering the period\n"
+		"                        is used).\n"
+		"  -j --json             output one JSON object per line\n"
+		"\n"
+		"optional arguments when used with wait:\n"
+		"  -t SECONDS --timeout SECONDS\n"
+		"                        the number of seconds to wait for a value\n"
+		"                        satisfying CONDITION (an expression, see\n"
+		"                        --filter) before failing (default 0 = wait\n"
+		"                        forever). The first such value is printed.\n"
+		"  --changed             only accept values which differ from the first\n"
+		"                        value received (for properties, the value when\n"
+		"                        the command starts).\n"
+		"  -f --force            wait on the topic regardless of how (or\n"
+		"                        whether) it has been registered.\n"
+		"\n"
+		"optional arguments when used with call:\n"
+		"  -t SECONDS --timeout SECONDS\n"
+		"                        the number of seconds to wait for the request\n"
+		"                        to be sent and the reply to arrive (default 5,\n"
+		"                        0 = wait forever). The reply is printed.\n"
+		"                        REPLY_TOPIC may contain wildcards.\n"
+		"  --correlate EXPR      only accept replies for which the expression\n"
+		"                        EXPR (see --filter) has the same value as for\n"
+		"                        VALUE, e.g. '--correlate /id'.\n"
+		"  --select EXPR         output the result of EXPR rather than the whole\n"
+		"                        reply.\n"
+		"  -f --force            send to the topic regardless of how (or\n"
+		"                        whether) it has been registered.\n"
+		"\n"
+		"optional arguments when used with no subcommand or the get or watch\n"
+		"subcommands:\n"
+		"  --filter EXPR         only output (and count) values for which EXPR\n"
+		"                        is true.\n"
+		"  --select EXPR         output the result of EXPR rather than the whole\n"
+		"                        value (may also be used with wait or call).\n"
+		"                        Expressions may contain '.' (the whole value),\n"
+		"                        JSON pointers (e.g. '/sensors/0/temp', null if\n"
+		"                        absent), JSON numbers, strings, true, false and\n"
+		"                        null, the comparisons ==, !=, <, <=, > and >=,\n"
+		"                        the operators &&, || and ! and parentheses. For\n"
+		"                        example: --filter '/temp > 20 && /room == \"a\"'\n"
+		"  --changes-only        only output values which differ from the last\n"
+		"                        value received on the same topic (ignoring\n"
+		"                        formatting differences).\n"
+		"  --coalesce MS         output at most one value per topic every MS\n"
+		"                        milliseconds: values arriving sooner are held\n"
+		"                        back and only the latest is output when the\n"
+		"                        period ends.\n"
+		"  --queue N             hold up to N values waiting to be written to\n"
+		"                        stdout, writing them from a separate thread, so\n"
+		"                        that a slow reader can't cause an unbounded\n"
+		"                        backlog of messages.\n"
+		"  --queue-policy POLICY what to do when the queue is full: 'block'\n"
+		"                        (stop receiving until there is space, the\n"
+		"                        default), 'drop-oldest', 'drop-newest' or\n"
+		"                        'keep-latest' (replace the topic's queued value,\n"
+		"                        otherwise drop the oldest). The number of values\n"
+		"                        dropped is reported on exit.\n"
+		"  --format-threads N    format values (e.g. when pretty-printing large\n"
+		"                        values) using N threads in parallel. Values are\n"
+		"                        still output in the order received (default 0 =\n"
+		"                        format values as they are received).\n"
+		"\n"
+		"optional arguments when used with no subcommand or the watch\n"
+		"subcommand:\n"
+		"  --exec CMD            run CMD (using /bin/sh) with batches of values\n"
+		"                        written to its stdin, one per line, rather\n"
+		"                        than printing them. Only one instance of CMD\n"
+		"                        runs at a time and instances are started at\n"
+		"                        most once per batch delay.\n"
+		"  --batch-size N        run CMD once N values are waiting (default\n"
+		"                        %d).\n"
+		"  --batch-delay MS      run CMD at most MS milliseconds after the first\n"
+		"                        value in a batch arrived (default %d).\n"
+		"  --persistent          start CMD once and keep it running, writing each\n"
+		"                        batch to its stdin (restarting it if it exits).\n"
+		"  --live                only output values sent after the command\n"
+		"                        starts, skipping the retained value of each\n"
+		"                        property.\n"
+		"  --durable             keep a persistent session with the broker\n"
+		"                        (requires --client-id) and, when the connection\n"
+		"                        is lost, reconnect (with backoff) and resume it\n"
+		"                        so that events sent meanwhile are still\n"
+		"                        received. In-flight messages are kept in\n"
+		"                        $XDG_CACHE_HOME/qth (or ~/.cache/qth). Outages\n"
+		"                        are reported on stderr.\n"
+		"\n"
+		"optional arguments when used with watch:\n"
+		"  --shards N            split the subscription (which must be of the\n"
+		"                        form 'PATH/#' or '#') between N connections,\n"
+		"                        each receiving a share of the subtrees listed\n"
+		"                        in the directory PATH/ (balanced by their\n"
+		"                        number of entries), and merge what they\n"
+		"                        receive. Values on each topic are still output\n"
+		"                        in order. Topics outside the subtrees listed\n"
+		"                        when the command starts are not received. The\n"
+		"                        number of values received by each connection\n"
+		"                        is reported on exit.\n"
+		"\n"
+		"optional arguments when used with get:\n"
+		"  -L --local            read the property's value from the shared\n"
+		"                        memory mirror maintained by 'mirror' rather\n"
+		"                        than from the broker.\n"
+		"\n"
+		"optional arguments when used with get or mirror:\n"
+		"  -M NAME --mirror NAME the name of the shared memory mirror (defaults\n"
+		"                        to the value of the QTH_MIRROR environment\n"
+		"                        variable, or '" QTH_MIRROR_DEFAULT_NAME "' if not defined).\n"
+		"\n"
+		"optional arguments when used with mirror:\n"
+		"  --slots N             the maximum number of properties which may be\n"
+		"                        mirrored (default %d).\n"
+		"  --value-size BYTES    the largest property value which may be\n"
+		"                        mirrored (default %d).\n"
+		"\n"
+		"optional arguments when used with export:\n"
+		"  --listen [HOST:]PORT  serve OpenMetrics-formatted values of all\n"
+		"                        numeric and boolean properties within each\n"
+		"                        PATH via HTTP on the given address (default\n"
+		"                        '127.0.0.1:9650').\n"
+		"\n"
+		"optional arguments when used with top:\n"
+		"  -i DURATION --interval DURATION\n"
+		"                        how often to refresh the view of the topics\n"
+		"                        matching TOPIC (an MQTT topic filter, default\n"
+		"                        '#'), e.g. '500ms' (default 1 second).\n"
+		"  -n N --limit N        show at most N topics (by default, as many as\n"
+		"                        fit on the terminal).\n"
+		"  -j --json             output a JSON snapshot of every topic on each\n"
+		"                        refresh, one per line.\n"
+		"  -c COUNT --count COUNT\n"
+		"                        the number of refreshes before exiting (default\n"
+		"                        0 = run until interrupted).\n"
+		"\n"
+		"optional arguments when used with ping:\n"
+		"  -i DURATION --interval DURATION\n"
+		"                        how often to send an event to TOPIC (which is\n"
+		"                        registered for the duration of the command and\n"
+		"                        defaults to 'ping/CLIENT_ID'), e.g. '100ms'\n"
+		"                        (default 1 second).\n"
+		"  -t SECONDS --timeout SECONDS\n"
+		"                        the number of seconds to wait for each event to\n"
+		"                        return before counting it as lost (default 2).\n"
+		"  -j --json             output only the final statistics, as a JSON\n"
+		"                        object.\n"
+		"  -c COUNT --count COUNT\n"
+		"                        the number of events to send before exiting\n"
+		"                        (default 0 = run until interrupted).\n"
+		"  -d DESCRIPTION --description DESCRIPTION\n"
+		"                        the description of the registered topic.\n",
+		EXEC_DEFAULT_BATCH_SIZE, EXEC_DEFAULT_BATCH_DELAY,
+		QTH_MIRROR_DEFAULT_SLOTS, QTH_MIRROR_DEFAULT_VALUE_SIZE
 	);
 }
 
@@ -127,6 +372,38 @@ void print_version(FILE *stream, const char *appname) {
 }
 
 
+// Option codes for long options without a single-letter equivalent
+enum {
+	OPT_RESOLUTION = 256,
+	OPT_SLOTS,
+	OPT_VALUE_SIZE,
+	OPT_LISTEN,
+	OPT_FILTER,
+	OPT_SELECT,
+	OPT_CHANGED,
+	OPT_CHANGES_ONLY,
+	OPT_COALESCE,
+	OPT_EXEC,
+	OPT_BATCH_SIZE,
+	OPT_BATCH_DELAY,
+	OPT_PERSISTENT,
+	OPT_CORRELATE,
+	OPT_QUEUE,
+	OPT_QUEUE_POLICY,
+	OPT_FORMAT_THREADS,
+	OPT_SHARDS,
+	OPT_LIVE,
+	OPT_DURABLE,
+	OPT_QOS,
+	OPT_NDJSON,
+	OPT_LS_WATCH,
+	OPT_NAME,
+	OPT_PATH,
+	OPT_REGEX,
+	OPT_BEHAVIOUR,
+	OPT_FILE,
+};
+
 #define ARGPARSE_ERRORF(message, ...) do { \
 	fprintf(stderr, "%s: " message "\n", argv[0], __VA_ARGS__); \
 	exit(1); \
@@ -147,6 +424,17 @@ options_t argparse(int argc, char *argv[]) {
 		default_mqtt_port_str = "1883";
 	}
 	int default_mqtt_port = atoi(default_mqtt_port_str);
+	if (getenv("QTH_QOS")) {
+		char *err = qth_set_qos_policy(getenv("QTH_QOS"));
+		if (err) {
+			ARGPARSE_ERRORF("QTH_QOS %s", err);
+			free(err);  // XXX: Not reached since ARGPARSE_ERROR* calls exit()...
+		}
+	}
+	char *default_mirror_name = getenv("QTH_MIRROR");
+	if (!default_mirror_name) {
+		default_mirror_name = QTH_MIRROR_DEFAULT_NAME;
+	}
 	
 	// The options to use, initially set to defaults
 	options_t opts = {
@@ -154,6 +442,7 @@ options_t argparse(int argc, char *argv[]) {
 		default_mqtt_host,  // mqtt_host
 		default_mqtt_port,  // mqtt_port
 		10,  // mqtt_keep_alive
+		false,  // mqtt5
 		NULL,  // client_id
 		1000,  // meta_timeout
 		1000,  // get_timeout
@@ -174,9 +463,41 @@ options_t argparse(int argc, char *argv[]) {
 		false,  // delete_on_unregister
 		false,  // ls_recursive
 		LS_FORMAT_SHORT,  // ls_format
+		false,  // ls_watch
 		NULL,  // topic
 		VALUE_SOURCE_NONE,  // value_source
 		NULL,  // value
+		NULL,  // value_file
+		NULL,  // rrd_file
+		NULL,  // rrd_spec
+		"-1h",  // query_start
+		"now",  // query_end
+		NULL,  // query_resolution
+		false,  // query_json
+		false,  // get_local
+		default_mirror_name,  // mirror_name
+		QTH_MIRROR_DEFAULT_SLOTS,  // mirror_slots
+		QTH_MIRROR_DEFAULT_VALUE_SIZE,  // mirror_value_size
+		NULL,  // paths
+		0,  // num_paths
+		"127.0.0.1:9650",  // export_listen
+		1.0,  // top_interval
+		0,  // top_limit
+		false,  // top_json
+		1.0,  // ping_interval
+		2000,  // ping_timeout
+		false,  // ping_json
+		{NULL, NULL, false, 0,
+		 NULL, EXEC_DEFAULT_BATCH_SIZE, EXEC_DEFAULT_BATCH_DELAY, false,
+		 0, QUEUE_POLICY_BLOCK, 0, false, false},  // watch_opts
+		0,  // wait_timeout
+		false,  // wait_changed
+		NULL,  // reply_topic
+		NULL,  // call_correlate
+		5000,  // call_timeout
+		0,  // watch_shards
+		{NULL, NULL, NULL, NULL, NULL},  // find_opts
+		NULL,  // simulate_spec
 	};
 	
 	// The default timeout for 'get' varies depending on whether registration
@@ -207,12 +528,22 @@ options_t argparse(int argc, char *argv[]) {
 	else if (strcmp(argv[1], "watch") == 0) opts.cmd_type = CMD_TYPE_WATCH;
 	else if (strcmp(argv[1], "send") == 0) opts.cmd_type = CMD_TYPE_SEND;
 	else if (strcmp(argv[1], "ls") == 0) opts.cmd_type = CMD_TYPE_LS;
+	else if (strcmp(argv[1], "log") == 0) opts.cmd_type = CMD_TYPE_LOG;
+	else if (strcmp(argv[1], "query") == 0) opts.cmd_type = CMD_TYPE_QUERY;
+	else if (strcmp(argv[1], "mirror") == 0) opts.cmd_type = CMD_TYPE_MIRROR;
+	else if (strcmp(argv[1], "export") == 0) opts.cmd_type = CMD_TYPE_EXPORT;
+	else if (strcmp(argv[1], "top") == 0) opts.cmd_type = CMD_TYPE_TOP;
+	else if (strcmp(argv[1], "ping") == 0) opts.cmd_type = CMD_TYPE_PING;
+	else if (strcmp(argv[1], "wait") == 0) opts.cmd_type = CMD_TYPE_WAIT;
+	else if (strcmp(argv[1], "call") == 0) opts.cmd_type = CMD_TYPE_CALL;
+	else if (strcmp(argv[1], "find") == 0) opts.cmd_type = CMD_TYPE_FIND;
+	else if (strcmp(argv[1], "simulate") == 0) opts.cmd_type = CMD_TYPE_SIMULATE;
 	else opts.cmd_type = CMD_TYPE_AUTO;
 	
 	// Skip command type and process remaining arguments with getopt
 	optind = opts.cmd_type == CMD_TYPE_AUTO ? 1 : 2;
 	
-	const char *optstring = "hVH:P:K:T:t:c:01pvqsfrC:d:U:DRlj";
+	const char *optstring = "hVH:P:K:5T:t:c:01pvqsfrC:d:U:DRlja:S:E:LM:i:n:";
 	
 	struct option longopts[] = {
 		{"help", no_argument, NULL, 'h'},
@@ -220,6 +551,8 @@ options_t argparse(int argc, char *argv[]) {
 		{"host", required_argument, NULL, 'H'},
 		{"port", required_argument, NULL, 'P'},
 		{"keep-alive", required_argument, NULL, 'K'},
+		{"qos", required_argument, NULL, OPT_QOS},
+		{"mqtt5", no_argument, NULL, '5'},
 		{"meta-timeout", required_argument, NULL, 'T'},
 		{"timeout", required_argument, NULL, 't'},
 		{"count", required_argument, NULL, 'c'},
@@ -236,6 +569,40 @@ options_t argparse(int argc, char *argv[]) {
 		{"long", no_argument, NULL, 'l'},
 		{"json", no_argument, NULL, 'j'},
 		{"client-id", required_argument, NULL, 'C'},
+		{"archives", required_argument, NULL, 'a'},
+		{"start", required_argument, NULL, 'S'},
+		{"end", required_argument, NULL, 'E'},
+		{"resolution", required_argument, NULL, OPT_RESOLUTION},
+		{"local", no_argument, NULL, 'L'},
+		{"mirror", required_argument, NULL, 'M'},
+		{"slots", required_argument, NULL, OPT_SLOTS},
+		{"value-size", required_argument, NULL, OPT_VALUE_SIZE},
+		{"listen", required_argument, NULL, OPT_LISTEN},
+		{"interval", required_argument, NULL, 'i'},
+		{"limit", required_argument, NULL, 'n'},
+		{"filter", required_argument, NULL, OPT_FILTER},
+		{"select", required_argument, NULL, OPT_SELECT},
+		{"changed", no_argument, NULL, OPT_CHANGED},
+		{"changes-only", no_argument, NULL, OPT_CHANGES_ONLY},
+		{"coalesce", required_argument, NULL, OPT_COALESCE},
+		{"exec", required_argument, NULL, OPT_EXEC},
+		{"batch-size", required_argument, NULL, OPT_BATCH_SIZE},
+		{"batch-delay", required_argument, NULL, OPT_BATCH_DELAY},
+		{"persistent", no_argument, NULL, OPT_PERSISTENT},
+		{"correlate", required_argument, NULL, OPT_CORRELATE},
+		{"queue", required_argument, NULL, OPT_QUEUE},
+		{"queue-policy", required_argument, NULL, OPT_QUEUE_POLICY},
+		{"format-threads", required_argument, NULL, OPT_FORMAT_THREADS},
+		{"shards", required_argument, NULL, OPT_SHARDS},
+		{"live", no_argument, NULL, OPT_LIVE},
+		{"durable", no_argument, NULL, OPT_DURABLE},
+		{"ndjson", no_argument, NULL, OPT_NDJSON},
+		{"watch", no_argument, NULL, OPT_LS_WATCH},
+		{"name", required_argument, NULL, OPT_NAME},
+		{"path", required_argument, NULL, OPT_PATH},
+		{"regex", required_argument, NULL, OPT_REGEX},
+		{"behaviour", required_argument, NULL, OPT_BEHAVIOUR},
+		{"file", required_argument, NULL, OPT_FILE},
 		{NULL, 0, 0, 0},
 	};
 	
@@ -266,6 +633,19 @@ options_t argparse(int argc, char *argv[]) {
 				opts.mqtt_keep_alive = atoi(optarg);
 				break;
 			
+			case OPT_QOS: {  // --qos
+				char *err = qth_set_qos_policy(optarg);
+				if (err) {
+					ARGPARSE_ERRORF("'--qos' %s", err);
+					free(err);  // XXX: Not reached since ARGPARSE_ERROR* calls exit()...
+				}
+				break;
+			}
+			
+			case '5':  // --mqtt5
+				opts.mqtt5 = true;
+				break;
+			
 			case 'C':  // --client-id
 				opts.client_id = optarg;
 				break;
@@ -281,6 +661,9 @@ options_t argparse(int argc, char *argv[]) {
 					= opts.send_timeout
 					= get_unregistered_timeout
 					= get_registered_timeout
+					= opts.ping_timeout
+					= opts.wait_timeout
+					= opts.call_timeout
 					= 1000 * atof(optarg);
 				break;
 			
@@ -289,9 +672,12 @@ options_t argparse(int argc, char *argv[]) {
 				      opts.cmd_type == CMD_TYPE_SET ||
 				      opts.cmd_type == CMD_TYPE_GET ||
 				      opts.cmd_type == CMD_TYPE_WATCH ||
-				      opts.cmd_type == CMD_TYPE_SEND)) {
+				      opts.cmd_type == CMD_TYPE_SEND ||
+				      opts.cmd_type == CMD_TYPE_LOG ||
+				      opts.cmd_type == CMD_TYPE_TOP ||
+				      opts.cmd_type == CMD_TYPE_PING)) {
 					ARGPARSE_ERROR("'--count' can only be used with "
-					               "get, set, watch or send.");
+					               "get, set, watch, send, log, top or ping.");
 				}
 				opts.watch_count
 					= get_unregistered_count
@@ -316,9 +702,12 @@ options_t argparse(int argc, char *argv[]) {
 				      opts.cmd_type == CMD_TYPE_SET ||
 				      opts.cmd_type == CMD_TYPE_GET ||
 				      opts.cmd_type == CMD_TYPE_WATCH ||
-				      opts.cmd_type == CMD_TYPE_SEND)) {
+				      opts.cmd_type == CMD_TYPE_SEND ||
+				      opts.cmd_type == CMD_TYPE_LOG ||
+				      opts.cmd_type == CMD_TYPE_TOP ||
+				      opts.cmd_type == CMD_TYPE_PING)) {
 					ARGPARSE_ERROR("'-0' can only be used with "
-					               "get, set, watch or send.");
+					               "get, set, watch, send, log, top or ping.");
 				}
 				opts.watch_count
 					= get_unregistered_count
@@ -339,9 +728,12 @@ options_t argparse(int argc, char *argv[]) {
 				      opts.cmd_type == CMD_TYPE_SET ||
 				      opts.cmd_type == CMD_TYPE_GET ||
 				      opts.cmd_type == CMD_TYPE_WATCH ||
-				      opts.cmd_type == CMD_TYPE_SEND)) {
+				      opts.cmd_type == CMD_TYPE_SEND ||
+				      opts.cmd_type == CMD_TYPE_LOG ||
+				      opts.cmd_type == CMD_TYPE_TOP ||
+				      opts.cmd_type == CMD_TYPE_PING)) {
 					ARGPARSE_ERROR("'-1' can only be used with "
-					               "get, set, watch or send.");
+					               "get, set, watch, send, log, top or ping.");
 				}
 				opts.watch_count
 					= get_unregistered_count
@@ -386,9 +778,12 @@ options_t argparse(int argc, char *argv[]) {
 				      opts.cmd_type == CMD_TYPE_SET ||
 				      opts.cmd_type == CMD_TYPE_DELETE ||
 				      opts.cmd_type == CMD_TYPE_WATCH ||
-				      opts.cmd_type == CMD_TYPE_SEND)) {
+				      opts.cmd_type == CMD_TYPE_SEND ||
+				      opts.cmd_type == CMD_TYPE_LOG ||
+				      opts.cmd_type == CMD_TYPE_WAIT ||
+				      opts.cmd_type == CMD_TYPE_CALL)) {
 					ARGPARSE_ERROR("'--force' can only be used with "
-					               "get, set, delete, watch or send.");
+					               "get, set, delete, watch, send, log, wait or call.");
 				}
 				if (opts.strict) {
 					ARGPARSE_ERROR("'--force' may not be used with '--strict'");
@@ -411,11 +806,17 @@ options_t argparse(int argc, char *argv[]) {
 				if (!(opts.cmd_type == CMD_TYPE_GET ||
 				      opts.cmd_type == CMD_TYPE_SET ||
 				      opts.cmd_type == CMD_TYPE_WATCH ||
-				      opts.cmd_type == CMD_TYPE_SEND)) {
+				      opts.cmd_type == CMD_TYPE_SEND ||
+				      opts.cmd_type == CMD_TYPE_PING ||
+				      opts.cmd_type == CMD_TYPE_FIND)) {
 					ARGPARSE_ERROR("'--description' can only be used with "
-					               "get, set, watch or send.");
+					               "get, set, watch, send, ping or find.");
+				}
+				if (opts.cmd_type == CMD_TYPE_FIND) {
+					opts.find_opts.description = optarg;
+				} else {
+					opts.description = optarg;
 				}
-				opts.description = optarg;
 				break;
 			
 			case 'U':  // --on-unregister
@@ -451,21 +852,319 @@ options_t argparse(int argc, char *argv[]) {
 				break;
 			
 			case 'l':  // --long
-				if (opts.cmd_type != CMD_TYPE_LS) {
-					ARGPARSE_ERROR("'--long' can only be used with ls.");
+				if (opts.cmd_type != CMD_TYPE_LS && opts.cmd_type != CMD_TYPE_FIND) {
+					ARGPARSE_ERROR("'--long' can only be used with ls or find.");
 				}
 				opts.ls_format = LS_FORMAT_LONG;
 				break;
 			
 			case 'j':  // --json
-				if (opts.cmd_type != CMD_TYPE_LS) {
-					ARGPARSE_ERROR("'--long' can only be used with ls.");
+				if (opts.cmd_type != CMD_TYPE_LS &&
+				    opts.cmd_type != CMD_TYPE_QUERY &&
+				    opts.cmd_type != CMD_TYPE_TOP &&
+				    opts.cmd_type != CMD_TYPE_PING) {
+					ARGPARSE_ERROR("'--json' can only be used with ls, query, top or ping.");
 				}
 				opts.ls_format = LS_FORMAT_JSON;
+				opts.query_json = true;
+				opts.top_json = true;
+				opts.ping_json = true;
+				break;
+			
+			case OPT_NDJSON:  // --ndjson
+				if (opts.cmd_type != CMD_TYPE_LS && opts.cmd_type != CMD_TYPE_FIND) {
+					ARGPARSE_ERROR("'--ndjson' can only be used with ls or find.");
+				}
+				opts.ls_format = LS_FORMAT_NDJSON;
+				break;
+			
+			case OPT_LS_WATCH:  // --watch
+				if (opts.cmd_type != CMD_TYPE_LS) {
+					ARGPARSE_ERROR("'--watch' can only be used with ls.");
+				}
+				opts.ls_watch = true;
+				break;
+			
+			case OPT_NAME:  // --name
+			case OPT_PATH:  // --path
+			case OPT_REGEX:  // --regex
+			case OPT_BEHAVIOUR: {  // --behaviour
+				const char *name;
+				char **value;
+				if (option == OPT_NAME) {
+					name = "--name";
+					value = &opts.find_opts.name;
+				} else if (option == OPT_PATH) {
+					name = "--path";
+					value = &opts.find_opts.path;
+				} else if (option == OPT_REGEX) {
+					name = "--regex";
+					value = &opts.find_opts.regex;
+				} else {
+					name = "--behaviour";
+					value = &opts.find_opts.behaviour;
+				}
+				if (opts.cmd_type != CMD_TYPE_FIND) {
+					ARGPARSE_ERRORF("'%s' can only be used with find.", name);
+				}
+				*value = optarg;
+				break;
+			}
+			
+			case OPT_FILE:  // --file
+				if (opts.cmd_type != CMD_TYPE_SET && opts.cmd_type != CMD_TYPE_SEND) {
+					ARGPARSE_ERROR("'--file' can only be used with set or send.");
+				}
+				opts.value_file = optarg;
+				break;
+			
+			case 'a':  // --archives
+				if (opts.cmd_type != CMD_TYPE_LOG) {
+					ARGPARSE_ERROR("'--archives' can only be used with log.");
+				}
+				opts.rrd_spec = optarg;
+				break;
+			
+			case 'S':  // --start
+				if (opts.cmd_type != CMD_TYPE_QUERY) {
+					ARGPARSE_ERROR("'--start' can only be used with query.");
+				}
+				opts.query_start = optarg;
+				break;
+			
+			case 'E':  // --end
+				if (opts.cmd_type != CMD_TYPE_QUERY) {
+					ARGPARSE_ERROR("'--end' can only be used with query.");
+				}
+				opts.query_end = optarg;
+				break;
+			
+			case OPT_RESOLUTION:  // --resolution
+				if (opts.cmd_type != CMD_TYPE_QUERY) {
+					ARGPARSE_ERROR("'--resolution' can only be used with query.");
+				}
+				opts.query_resolution = optarg;
+				break;
+			
+			case 'L':  // --local
+				if (opts.cmd_type != CMD_TYPE_GET) {
+					ARGPARSE_ERROR("'--local' can only be used with get.");
+				}
+				opts.get_local = true;
+				break;
+			
+			case 'M':  // --mirror
+				if (opts.cmd_type != CMD_TYPE_GET &&
+				    opts.cmd_type != CMD_TYPE_MIRROR) {
+					ARGPARSE_ERROR("'--mirror' can only be used with get or mirror.");
+				}
+				opts.mirror_name = optarg;
+				break;
+			
+			case OPT_SLOTS:  // --slots
+				if (opts.cmd_type != CMD_TYPE_MIRROR) {
+					ARGPARSE_ERROR("'--slots' can only be used with mirror.");
+				}
+				opts.mirror_slots = atoi(optarg);
+				if (opts.mirror_slots <= 0) {
+					ARGPARSE_ERROR("'--slots' must be at least 1.");
+				}
+				break;
+			
+			case OPT_VALUE_SIZE:  // --value-size
+				if (opts.cmd_type != CMD_TYPE_MIRROR) {
+					ARGPARSE_ERROR("'--value-size' can only be used with mirror.");
+				}
+				opts.mirror_value_size = atoi(optarg);
+				if (opts.mirror_value_size <= 0) {
+					ARGPARSE_ERROR("'--value-size' must be at least 1.");
+				}
+				break;
+			
+			case OPT_LISTEN:  // --listen
+				if (opts.cmd_type != CMD_TYPE_EXPORT) {
+					ARGPARSE_ERROR("'--listen' can only be used with export.");
+				}
+				opts.export_listen = optarg;
+				break;
+			
+			case 'i':  // --interval
+				if (opts.cmd_type != CMD_TYPE_TOP &&
+				    opts.cmd_type != CMD_TYPE_PING) {
+					ARGPARSE_ERROR("'--interval' can only be used with top or ping.");
+				}
+				if (!parse_duration(optarg, &opts.top_interval) ||
+				    opts.top_interval <= 0.0) {
+					ARGPARSE_ERROR("'--interval' must be a positive duration.");
+				}
+				opts.ping_interval = opts.top_interval;
+				break;
+			
+			case OPT_FILTER:  // --filter
+			case OPT_SELECT: {  // --select
+				const char *name = option == OPT_FILTER ? "--filter" : "--select";
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_GET ||
+				      opts.cmd_type == CMD_TYPE_WATCH ||
+				      (opts.cmd_type == CMD_TYPE_WAIT && option == OPT_SELECT) ||
+				      (opts.cmd_type == CMD_TYPE_CALL && option == OPT_SELECT))) {
+					ARGPARSE_ERRORF("'%s' can only be used with %s.", name,
+					                option == OPT_FILTER ? "get or watch"
+					                                     : "get, watch, wait or call");
+				}
+				expr_t **expr = option == OPT_FILTER ? &opts.watch_opts.filter : &opts.watch_opts.select;
+				expr_free(*expr);
+				char *err = expr_compile(optarg, expr);
+				if (err) {
+					ARGPARSE_ERRORF("'%s' must be a valid expression: %s", name, err);
+					free(err);  // XXX: Not reached since ARGPARSE_ERROR* calls exit()...
+				}
+				break;
+			}
+			
+			case OPT_CHANGES_ONLY:  // --changes-only
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_GET ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--changes-only' can only be used with get or watch.");
+				}
+				opts.watch_opts.changes_only = true;
+				break;
+			
+			case OPT_COALESCE:  // --coalesce
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_GET ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--coalesce' can only be used with get or watch.");
+				}
+				opts.watch_opts.coalesce = atoi(optarg);
+				if (opts.watch_opts.coalesce <= 0) {
+					ARGPARSE_ERROR("'--coalesce' must be at least 1.");
+				}
+				break;
+			
+			case OPT_EXEC:  // --exec
+			case OPT_BATCH_SIZE:  // --batch-size
+			case OPT_BATCH_DELAY:  // --batch-delay
+			case OPT_PERSISTENT:  // --persistent
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--exec', '--batch-size', '--batch-delay' and "
+					               "'--persistent' can only be used with watch.");
+				}
+				if (option == OPT_EXEC) {
+					opts.watch_opts.exec = optarg;
+				} else if (option == OPT_BATCH_SIZE) {
+					opts.watch_opts.exec_batch_size = atoi(optarg);
+					if (opts.watch_opts.exec_batch_size <= 0) {
+						ARGPARSE_ERROR("'--batch-size' must be at least 1.");
+					}
+				} else if (option == OPT_BATCH_DELAY) {
+					opts.watch_opts.exec_batch_delay = atoi(optarg);
+					if (opts.watch_opts.exec_batch_delay < 0) {
+						ARGPARSE_ERROR("'--batch-delay' must not be negative.");
+					}
+				} else {
+					opts.watch_opts.exec_persistent = true;
+				}
+				break;
+			
+			case OPT_QUEUE:  // --queue
+			case OPT_QUEUE_POLICY:  // --queue-policy
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_GET ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--queue' and '--queue-policy' can only be used "
+					               "with get or watch.");
+				}
+				if (option == OPT_QUEUE) {
+					opts.watch_opts.queue_size = atoi(optarg);
+					if (opts.watch_opts.queue_size <= 0) {
+						ARGPARSE_ERROR("'--queue' must be at least 1.");
+					}
+				} else if (!parse_queue_policy(optarg, &opts.watch_opts.queue_policy)) {
+					ARGPARSE_ERROR("'--queue-policy' must be one of 'block', "
+					               "'drop-oldest', 'drop-newest' or 'keep-latest'.");
+				}
+				break;
+			
+			case OPT_FORMAT_THREADS:  // --format-threads
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_GET ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--format-threads' can only be used with get or watch.");
+				}
+				opts.watch_opts.format_threads = atoi(optarg);
+				if (opts.watch_opts.format_threads < 0) {
+					ARGPARSE_ERROR("'--format-threads' must not be negative.");
+				}
+				break;
+			
+			case OPT_LIVE:  // --live
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--live' can only be used with watch.");
+				}
+				opts.watch_opts.live = true;
+				break;
+			
+			case OPT_DURABLE:  // --durable
+				if (!(opts.cmd_type == CMD_TYPE_AUTO ||
+				      opts.cmd_type == CMD_TYPE_WATCH)) {
+					ARGPARSE_ERROR("'--durable' can only be used with watch.");
+				}
+				opts.watch_opts.durable = true;
+				break;
+			
+			case OPT_SHARDS:  // --shards
+				if (opts.cmd_type != CMD_TYPE_WATCH) {
+					ARGPARSE_ERROR("'--shards' can only be used with watch.");
+				}
+				opts.watch_shards = atoi(optarg);
+				if (opts.watch_shards <= 0) {
+					ARGPARSE_ERROR("'--shards' must be at least 1.");
+				}
+				break;
+			
+			case OPT_CORRELATE: {  // --correlate
+				if (opts.cmd_type != CMD_TYPE_CALL) {
+					ARGPARSE_ERROR("'--correlate' can only be used with call.");
+				}
+				expr_free(opts.call_correlate);
+				char *err = expr_compile(optarg, &opts.call_correlate);
+				if (err) {
+					ARGPARSE_ERRORF("'--correlate' must be a valid expression: %s", err);
+					free(err);  // XXX: Not reached since ARGPARSE_ERROR* calls exit()...
+				}
+				break;
+			}
+			
+			case OPT_CHANGED:  // --changed
+				if (opts.cmd_type != CMD_TYPE_WAIT) {
+					ARGPARSE_ERROR("'--changed' can only be used with wait.");
+				}
+				opts.wait_changed = true;
+				break;
+			
+			case 'n':  // --limit
+				if (opts.cmd_type != CMD_TYPE_TOP) {
+					ARGPARSE_ERROR("'--limit' can only be used with top.");
+				}
+				opts.top_limit = atoi(optarg);
+				if (opts.top_limit <= 0) {
+					ARGPARSE_ERROR("'--limit' must be at least 1.");
+				}
 				break;
 		}
 	}
 	
+	// Ping always registers the topic it sends events to (and simulate the
+	// topics in its spec)
+	if (opts.cmd_type == CMD_TYPE_PING ||
+	    opts.cmd_type == CMD_TYPE_SIMULATE) {
+		opts.register_topic = true;
+	}
+	
 	// Check for conflicting arguments
 	if (!opts.register_topic && opts.on_unregister) {
 		ARGPARSE_ERROR("'--on-unregister' cannot be used without '--register'.");
@@ -473,15 +1172,66 @@ options_t argparse(int argc, char *argv[]) {
 	if (!opts.register_topic && opts.delete_on_unregister) {
 		ARGPARSE_ERROR("'--delete-on-unregister' cannot be used without '--register'.");
 	}
+	if (opts.get_local && opts.register_topic) {
+		ARGPARSE_ERROR("'--local' cannot be used with '--register'.");
+	}
+	if (opts.get_local && (opts.watch_opts.filter || opts.watch_opts.select)) {
+		ARGPARSE_ERROR("'--local' cannot be used with '--filter' or '--select'.");
+	}
+	if (!opts.watch_opts.exec &&
+	    (opts.watch_opts.exec_batch_size != EXEC_DEFAULT_BATCH_SIZE ||
+	     opts.watch_opts.exec_batch_delay != EXEC_DEFAULT_BATCH_DELAY ||
+	     opts.watch_opts.exec_persistent)) {
+		ARGPARSE_ERROR("'--batch-size', '--batch-delay' and '--persistent' "
+		               "cannot be used without '--exec'.");
+	}
+	if (opts.watch_opts.queue_policy != QUEUE_POLICY_BLOCK &&
+	    opts.watch_opts.queue_size == 0) {
+		ARGPARSE_ERROR("'--queue-policy' cannot be used without '--queue'.");
+	}
+	if (opts.watch_opts.durable && !opts.client_id) {
+		ARGPARSE_ERROR("'--durable' requires a fixed '--client-id'.");
+	}
+	if (opts.watch_opts.durable && opts.watch_shards > 0) {
+		ARGPARSE_ERROR("'--durable' cannot be used with '--shards'.");
+	}
+	if (opts.watch_opts.queue_size > 0 && opts.watch_opts.exec) {
+		ARGPARSE_ERROR("'--queue' cannot be used with '--exec'.");
+	}
 	if (opts.on_unregister && opts.delete_on_unregister) {
 		ARGPARSE_ERROR("'--delete-on-unregister' and '--delete-on-unregister' "
 		               "cannot be used at the same time.");
 	}
 	
 	// Check that the topic was supplied
-	if (opts.cmd_type == CMD_TYPE_LS) {
-		// Special case: for the 'ls' command, the topic may be omitted to list the
-		// root.
+	if (opts.cmd_type == CMD_TYPE_EXPORT) {
+		// Special case: export takes any number of paths (defaulting to the
+		// root)
+		opts.paths = argv + optind;
+		opts.num_paths = argc - optind;
+		opts.topic = opts.num_paths > 0 ? argv[optind] : "";
+		optind = argc;
+	} else if (opts.cmd_type == CMD_TYPE_QUERY) {
+		// Special case: query reads an archive file and takes no topic.
+		if (optind >= argc) {
+			ARGPARSE_ERROR("expected an archive file");
+		} else {
+			opts.rrd_file = argv[optind];
+			optind++;
+		}
+	} else if (opts.cmd_type == CMD_TYPE_SIMULATE) {
+		// Special case: simulate reads a spec file and takes no topic.
+		if (optind >= argc) {
+			ARGPARSE_ERROR("expected a spec file");
+		} else {
+			opts.simulate_spec = argv[optind];
+			optind++;
+		}
+	} else if (opts.cmd_type == CMD_TYPE_LS ||
+	           opts.cmd_type == CMD_TYPE_MIRROR ||
+	           opts.cmd_type == CMD_TYPE_FIND) {
+		// Special case: for the 'ls', 'mirror' and 'find' commands, the topic
+		// may be omitted to use the root.
 		if (optind >= argc) {
 			// No ls path provided, list the root
 			opts.topic = "";
@@ -489,6 +1239,21 @@ options_t argparse(int argc, char *argv[]) {
 			opts.topic = argv[optind];
 			optind++;
 		}
+	} else if (opts.cmd_type == CMD_TYPE_PING) {
+		// Special case: ping picks a private topic (based on the client ID)
+		// when none is given.
+		if (optind < argc) {
+			opts.topic = argv[optind];
+			optind++;
+		}
+	} else if (opts.cmd_type == CMD_TYPE_TOP) {
+		// Special case: top watches everything by default
+		if (optind >= argc) {
+			opts.topic = "#";
+		} else {
+			opts.topic = argv[optind];
+			optind++;
+		}
 	} else {
 		// General case
 		if (optind >= argc) {
@@ -499,6 +1264,17 @@ options_t argparse(int argc, char *argv[]) {
 		}
 	}
 	
+	// Sharding splits a subscription to a whole subtree
+	if (opts.watch_shards > 0) {
+		size_t topic_len = strlen(opts.topic);
+		if (!(topic_len >= 1 && opts.topic[topic_len - 1] == '#' &&
+		      (topic_len == 1 || opts.topic[topic_len - 2] == '/') &&
+		      !strchr(opts.topic, '+'))) {
+			ARGPARSE_ERROR("'--shards' can only be used with topics of the form "
+			               "'PATH/#' or '#'.");
+		}
+	}
+	
 	// Depending on the type of command, work out any associated value which
 	// might be required.
 	switch (opts.cmd_type) {
@@ -517,7 +1293,11 @@ options_t argparse(int argc, char *argv[]) {
 		
 		case CMD_TYPE_SET:
 		case CMD_TYPE_SEND:
-			if (optind >= argc) {
+			if (opts.value_file) {
+				// The value comes from the file instead of an argument (and
+				// any VALUE given is rejected as an unexpected argument below)
+				opts.value_source = VALUE_SOURCE_FILE;
+			} else if (optind >= argc) {
 				if (opts.register_topic) {
 					// If registering default to stdin since the command makes more sense
 					// to be long-running
@@ -536,6 +1316,49 @@ options_t argparse(int argc, char *argv[]) {
 			}
 			break;
 		
+		case CMD_TYPE_WAIT:
+			// Wait takes an optional condition (used as the filter) instead of
+			// a value
+			if (optind < argc) {
+				char *err = expr_compile(argv[optind], &opts.watch_opts.filter);
+				if (err) {
+					ARGPARSE_ERRORF("CONDITION must be a valid expression: %s", err);
+					free(err);  // XXX: Not reached since ARGPARSE_ERROR* calls exit()...
+				}
+				optind++;
+			}
+			opts.value_source = VALUE_SOURCE_NONE;
+			break;
+		
+		case CMD_TYPE_CALL:
+			// Call takes the reply topic and then an optional value
+			if (optind >= argc) {
+				ARGPARSE_ERROR("expected a reply topic");
+			} else {
+				opts.reply_topic = argv[optind];
+				optind++;
+			}
+			if (optind >= argc) {
+				opts.value_source = VALUE_SOURCE_NULL;
+				opts.value = "null";
+			} else {
+				opts.value_source = VALUE_SOURCE_ARG;
+				opts.value = argv[optind];
+				optind++;
+			}
+			break;
+		
+		case CMD_TYPE_LOG:
+			// Log takes the archive file after the topic instead of a value
+			if (optind >= argc) {
+				ARGPARSE_ERROR("expected an archive file");
+			} else {
+				opts.rrd_file = argv[optind];
+				optind++;
+			}
+			opts.value_source = VALUE_SOURCE_NONE;
+			break;
+		
 		default:
 			// Other commands don't expect a value argument
 			opts.value_source = VALUE_SOURCE_NONE;
@@ -0,0 +1,240 @@
+/**
+ * A bounded queue of output lines, written by a separate thread.
+ *
+ * This decouples receiving messages from writing them so that a slow reader
+ * (e.g. a pipe) can't cause an unbounded backlog of messages to build up.
+ * When the queue is full, the configured policy decides whether the receiver
+ * blocks or which values are dropped.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qth_client.h"
+
+typedef struct {
+	char *topic;
+	char *line;  // Without trailing newline
+	size_t len;
+} output_queue_entry_t;
+
+struct output_queue {
+	output_writer_t *writer;
+	queue_policy_t policy;
+	
+	// Ring buffer of entries. 'head' and 'tail' count entries ever popped and
+	// pushed respectively.
+	output_queue_entry_t *entries;
+	size_t capacity;
+	uint64_t head;
+	uint64_t tail;
+	
+	// For the keep-latest policy, maps each topic to one more than the index
+	// of its last pushed entry (which is still queued if greater than 'head').
+	strmap_t *latest;
+	
+	// Drop accounting
+	uint64_t num_pushed;
+	uint64_t num_dropped;
+	size_t max_depth;
+	
+	// The first error encountered while writing (or NULL)
+	char *err;
+	
+	bool closing;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_t thread;
+};
+
+
+static void *output_queue_thread(void *queue_void) {
+	output_queue_t *queue = queue_void;
+	
+	pthread_mutex_lock(&queue->lock);
+	while (true) {
+		while (queue->head == queue->tail && !queue->closing) {
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+		}
+		if (queue->head == queue->tail) {
+			break;
+		}
+		
+		output_queue_entry_t entry = queue->entries[queue->head % queue->capacity];
+		queue->head++;
+		bool empty = queue->head == queue->tail;
+		pthread_cond_signal(&queue->not_full);
+		pthread_mutex_unlock(&queue->lock);
+		
+		// Write without holding the lock (this may block for a long time). The
+		// writer is only flushed once the queue has been drained (or once it
+		// has gathered enough).
+		char *err = output_writer_write(queue->writer, entry.line, entry.len,
+		                                monotonic_ns());
+		if (!err && empty) {
+			err = output_writer_flush(queue->writer);
+		}
+		free(entry.topic);
+		
+		pthread_mutex_lock(&queue->lock);
+		if (err && !queue->err) {
+			queue->err = err;
+		} else {
+			free(err);
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+	
+	return NULL;
+}
+
+
+/**
+ * Parse a queue policy name. Returns false if the name is not recognised.
+ */
+bool parse_queue_policy(const char *name, queue_policy_t *policy) {
+	if (strcmp(name, "block") == 0) {
+		*policy = QUEUE_POLICY_BLOCK;
+	} else if (strcmp(name, "drop-oldest") == 0) {
+		*policy = QUEUE_POLICY_DROP_OLDEST;
+	} else if (strcmp(name, "drop-newest") == 0) {
+		*policy = QUEUE_POLICY_DROP_NEWEST;
+	} else if (strcmp(name, "keep-latest") == 0) {
+		*policy = QUEUE_POLICY_KEEP_LATEST;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Create a queue holding up to 'capacity' lines and start the thread writing
+ * them using 'writer' (which must not be used by anything else until the
+ * queue is closed). Must be freed with output_queue_close.
+ */
+output_queue_t *output_queue_new(output_writer_t *writer, int capacity,
+                                 queue_policy_t policy) {
+	output_queue_t *queue = calloc(1, sizeof(output_queue_t));
+	queue->writer = writer;
+	queue->policy = policy;
+	queue->capacity = capacity;
+	queue->entries = calloc(capacity, sizeof(output_queue_entry_t));
+	if (policy == QUEUE_POLICY_KEEP_LATEST) {
+		queue->latest = strmap_new();
+	}
+	
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	pthread_create(&queue->thread, NULL, output_queue_thread, queue);
+	return queue;
+}
+
+
+/**
+ * Queue a line (without trailing newline) received on the given topic for
+ * output. Takes ownership of 'line'. Depending on the policy, may block until
+ * there is space in the queue.
+ */
+void output_queue_push(output_queue_t *queue, const char *topic, char *line,
+                       size_t len) {
+	pthread_mutex_lock(&queue->lock);
+	queue->num_pushed++;
+	
+	// Replace the topic's queued value (if it hasn't been written yet)
+	if (queue->policy == QUEUE_POLICY_KEEP_LATEST) {
+		uint64_t seq = (uintptr_t)strmap_get(queue->latest, topic);
+		if (seq > queue->head) {
+			output_queue_entry_t *entry = &queue->entries[(seq - 1) % queue->capacity];
+			free(entry->line);
+			entry->line = line;
+			entry->len = len;
+			queue->num_dropped++;
+			pthread_mutex_unlock(&queue->lock);
+			return;
+		}
+	}
+	
+	if (queue->tail - queue->head == queue->capacity) {
+		switch (queue->policy) {
+			case QUEUE_POLICY_BLOCK:
+				while (queue->tail - queue->head == queue->capacity) {
+					pthread_cond_wait(&queue->not_full, &queue->lock);
+				}
+				break;
+			
+			case QUEUE_POLICY_DROP_NEWEST:
+				queue->num_dropped++;
+				pthread_mutex_unlock(&queue->lock);
+				free(line);
+				return;
+			
+			case QUEUE_POLICY_DROP_OLDEST:
+			case QUEUE_POLICY_KEEP_LATEST: {
+				output_queue_entry_t *oldest = &queue->entries[queue->head % queue->capacity];
+				free(oldest->topic);
+				free(oldest->line);
+				queue->head++;
+				queue->num_dropped++;
+				break;
+			}
+		}
+	}
+	
+	output_queue_entry_t *entry = &queue->entries[queue->tail % queue->capacity];
+	entry->topic = alloced_copy(topic);
+	entry->line = line;
+	entry->len = len;
+	queue->tail++;
+	if (queue->latest) {
+		strmap_set(queue->latest, topic, (void *)(uintptr_t)queue->tail);
+	}
+	
+	if (queue->tail - queue->head > queue->max_depth) {
+		queue->max_depth = queue->tail - queue->head;
+	}
+	
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+
+/**
+ * Write out everything remaining in the queue, stop the writer thread and
+ * free the queue. If any values were dropped, a summary is printed to stderr.
+ * Returns the first error encountered while writing (to be freed by the
+ * caller) or NULL on success.
+ */
+char *output_queue_close(output_queue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	queue->closing = true;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->thread, NULL);
+	
+	if (queue->num_dropped > 0) {
+		fprintf(stderr,
+		        "Warning: %llu of %llu values dropped by the output queue "
+		        "(maximum depth %zu of %zu).\n",
+		        (unsigned long long)queue->num_dropped,
+		        (unsigned long long)queue->num_pushed,
+		        queue->max_depth, queue->capacity);
+	}
+	
+	if (queue->latest) {
+		strmap_free(queue->latest, NULL);
+	}
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	char *err = queue->err;
+	free(queue->entries);
+	free(queue);
+	return err;
+}
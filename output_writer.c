@@ -0,0 +1,193 @@
+/**
+ * Batched output of lines to a file descriptor.
+ *
+ * Rather than writing (and flushing) every value individually, lines are
+ * gathered into an array of iovecs and written with a single writev call once
+ * enough data has been gathered or the oldest line has waited long enough.
+ * When the output is interactive (a terminal) every line is written
+ * immediately.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "qth_client.h"
+
+// Write once this many bytes have been gathered...
+#define OUTPUT_WRITER_MAX_BYTES (64 * 1024)
+
+// ...or this many lines (each line uses two iovecs: the line and its newline)
+#ifdef IOV_MAX
+#define OUTPUT_WRITER_MAX_LINES (IOV_MAX / 2)
+#else
+#define OUTPUT_WRITER_MAX_LINES 512
+#endif
+
+// ...or once the oldest line has waited this long (ns)
+#define OUTPUT_WRITER_MAX_DELAY_NS (100ull * 1000000ull)
+
+struct output_writer {
+	int fd;
+	bool interactive;
+	
+	// Gathered lines (owned, or NULL for lines copied into the arena) and the
+	// iovecs pointing at them and their newlines
+	char *lines[OUTPUT_WRITER_MAX_LINES];
+	arena_t *arena;
+	struct iovec iov[OUTPUT_WRITER_MAX_LINES * 2];
+	int num_lines;
+	size_t num_bytes;
+	
+	// When the oldest gathered line was written
+	uint64_t oldest_ns;
+};
+
+
+/**
+ * Create a writer for the given file descriptor. Must be freed with
+ * output_writer_free.
+ */
+output_writer_t *output_writer_new(int fd) {
+	// Anything written previously via stdio must come first
+	fflush(stdout);
+	
+	output_writer_t *writer = calloc(1, sizeof(output_writer_t));
+	writer->fd = fd;
+	writer->interactive = isatty(fd);
+	writer->arena = arena_new(OUTPUT_WRITER_MAX_BYTES);
+	return writer;
+}
+
+
+/**
+ * Is output written immediately (rather than gathered)?
+ */
+bool output_writer_is_interactive(output_writer_t *writer) {
+	return writer->interactive;
+}
+
+
+/**
+ * Write out all gathered lines. Returns an error message (to be freed by the
+ * caller) or NULL on success.
+ */
+char *output_writer_flush(output_writer_t *writer) {
+	struct iovec *iov = writer->iov;
+	int iovcnt = writer->num_lines * 2;
+	char *err = NULL;
+	while (iovcnt > 0) {
+		ssize_t written = writev(writer->fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = alloced_cat("Couldn't write output: ", strerror(errno));
+			break;
+		}
+		
+		// Skip whatever was written (which may end part-way through an iovec)
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	
+	for (int i = 0; i < writer->num_lines; i++) {
+		free(writer->lines[i]);
+	}
+	arena_reset(writer->arena);
+	writer->num_lines = 0;
+	writer->num_bytes = 0;
+	return err;
+}
+
+
+/**
+ * Gather a line, which is freed after being written if 'owned' is true (and
+ * otherwise must remain valid until then).
+ */
+static char *output_writer_add(output_writer_t *writer, char *line, bool owned,
+                               size_t len, uint64_t now) {
+	if (writer->num_lines == 0) {
+		writer->oldest_ns = now;
+	}
+	
+	writer->lines[writer->num_lines] = owned ? line : NULL;
+	writer->iov[writer->num_lines * 2].iov_base = line;
+	writer->iov[writer->num_lines * 2].iov_len = len;
+	writer->iov[writer->num_lines * 2 + 1].iov_base = "\n";
+	writer->iov[writer->num_lines * 2 + 1].iov_len = 1;
+	writer->num_lines++;
+	writer->num_bytes += len + 1;
+	
+	if (writer->interactive ||
+	    writer->num_lines == OUTPUT_WRITER_MAX_LINES ||
+	    writer->num_bytes >= OUTPUT_WRITER_MAX_BYTES ||
+	    now >= writer->oldest_ns + OUTPUT_WRITER_MAX_DELAY_NS) {
+		return output_writer_flush(writer);
+	} else {
+		return NULL;
+	}
+}
+
+
+/**
+ * Write a line (without trailing newline), taking ownership of it. The line
+ * may not be written until output_writer_flush is called, at the latest by
+ * the time returned by output_writer_deadline. Returns an error message (to
+ * be freed by the caller) or NULL on success.
+ */
+char *output_writer_write(output_writer_t *writer, char *line, size_t len,
+                          uint64_t now) {
+	return output_writer_add(writer, line, true, len, now);
+}
+
+
+/**
+ * Write a line (see output_writer_write), copying it rather than taking
+ * ownership of it. The copy is made into memory reused after each flush so,
+ * unlike allocating a copy to pass to output_writer_write, this doesn't
+ * allocate anything once the writer has warmed up.
+ */
+char *output_writer_write_copy(output_writer_t *writer, const char *line,
+                               size_t len, uint64_t now) {
+	return output_writer_add(writer, arena_copyn(writer->arena, line, len),
+	                         false, len, now);
+}
+
+
+/**
+ * Return the time by which output_writer_flush should be called (or
+ * UINT64_MAX if nothing is waiting to be written).
+ */
+uint64_t output_writer_deadline(output_writer_t *writer) {
+	if (writer->num_lines == 0) {
+		return UINT64_MAX;
+	} else {
+		return writer->oldest_ns + OUTPUT_WRITER_MAX_DELAY_NS;
+	}
+}
+
+
+/**
+ * Write out any remaining lines and free the writer. Returns an error message
+ * (to be freed by the caller) or NULL on success.
+ */
+char *output_writer_free(output_writer_t *writer) {
+	char *err = output_writer_flush(writer);
+	arena_free(writer->arena);
+	free(writer);
+	return err;
+}
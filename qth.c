@@ -5,6 +5,8 @@
 #include <alloca.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "MQTTClient.h"
 
@@ -199,9 +201,9 @@ char *qth_get_directory(MQTTClient *client, const char *path, char **dir, int me
 	// (and isn't a stale property).
 	int qos[depth];
 	for (size_t i = 0; i < depth; i++) {
-		qos[i] = QTH_QOS;
+		qos[i] = qth_qos(QOS_CLASS_META);
 	}
-	int mqtt_err = MQTTClient_subscribeMany(client, depth, ls_paths, qos);
+	int mqtt_err = qth_subscribe_many(client, depth, ls_paths, qos, 0);
 	if (mqtt_err != MQTTCLIENT_SUCCESS) {
 		char *err = "Could not subscribe to directory listings.";
 		char *err_out = malloc(strlen(err));
@@ -209,6 +211,12 @@ char *qth_get_directory(MQTTClient *client, const char *path, char **dir, int me
 		return err_out;
 	}
 	
+	// Maps each listing's topic to its index (plus one) in ls_paths
+	topic_trie_t *ls_trie = topic_trie_new();
+	for (size_t i = 0; i < depth; i++) {
+		topic_trie_add(ls_trie, ls_paths[i], (void *)(uintptr_t)(i + 1));
+	}
+	
 	bool verified_parts[depth+1];
 	size_t num_verified_parts = 0;
 	for (size_t i = 0; i < depth; i++) {
@@ -221,65 +229,69 @@ char *qth_get_directory(MQTTClient *client, const char *path, char **dir, int me
 	int topic_len;
 	MQTTClient_message *message;
 	while (num_verified_parts < depth) {
-		int mqtt_err = MQTTClient_receive(client, &topic, &topic_len, &message, meta_timeout);
+		int mqtt_err = qth_receive(client, &topic, &topic_len, &message, meta_timeout);
 		if (mqtt_err != MQTTCLIENT_SUCCESS) {
+			topic_trie_free(ls_trie, NULL);
 			return alloced_copy("MQTT error while fetching directory listing.");
 		} else if (topic == NULL) {
+			topic_trie_free(ls_trie, NULL);
 			return alloced_copy("Timeout while fetching directory listing. ");
 		}
 		
 		// Check to see if the directory exists
-		for (size_t i = 0; i < depth; i++) {
-			if (strncmp(topic, ls_paths[i], topic_len) == 0) {
-				// Parse the listing
-				json_object *obj;
-				char *json_err = json_parse(message->payload, message->payloadlen, &obj);
-				if (json_err) {
-					MQTTClient_unsubscribeMany(client, depth, ls_paths);
-					
-					char *err_out = alloced_cat("Couldn't parse directory listing: ", json_err);
-					free(json_err);
-					if (leaf_dir) {
-						free(leaf_dir);
-					}
-					MQTTClient_free(topic);
-					MQTTClient_freeMessage(&message);
-					return err_out;
-				}
+		void *found = NULL;
+		topic_trie_match(ls_trie, topic, topic_trie_get_value, &found);
+		if (found) {
+			size_t i = (uintptr_t)found - 1;
+			
+			// Parse the listing
+			json_object *obj;
+			char *json_err = json_parse(message->payload, message->payloadlen, &obj);
+			if (json_err) {
+				qth_unsubscribe_many(client, depth, ls_paths);
 				
-				bool is_valid = false;
-				if (i == depth-1) {
-					// Leaf directory, ensure this is a directory listing
-					is_valid = qth_is_directory_listing(obj);
-					if (is_valid) {
-						if (leaf_dir) {
-							free(leaf_dir);
-						}
-						leaf_dir = alloced_copyn(message->payload, message->payloadlen);
-					}
-				} else {
-					// Branch directory, make sure next subdirectory is listed
-					is_valid = qth_subdirectory_has_behaviour(obj, parts[i], "DIRECTORY", true);
+				char *err_out = alloced_cat("Couldn't parse directory listing: ", json_err);
+				free(json_err);
+				if (leaf_dir) {
+					free(leaf_dir);
 				}
-				
-				json_object_put(obj);
-				
-				// Flag this part of the path as verified
+				MQTTClient_free(topic);
+				MQTTClient_freeMessage(&message);
+				topic_trie_free(ls_trie, NULL);
+				return err_out;
+			}
+			
+			bool is_valid = false;
+			if (i == depth-1) {
+				// Leaf directory, ensure this is a directory listing
+				is_valid = qth_is_directory_listing(obj);
 				if (is_valid) {
-					if (!verified_parts[i]) {
-						num_verified_parts++;
-					}
-					verified_parts[i] = true;
-				} else {
 					if (leaf_dir) {
 						free(leaf_dir);
 					}
-					MQTTClient_free(topic);
-					MQTTClient_freeMessage(&message);
-					return alloced_copy("Directory not found.");
+					leaf_dir = alloced_copyn(message->payload, message->payloadlen);
 				}
-				
-				break;
+			} else {
+				// Branch directory, make sure next subdirectory is listed
+				is_valid = qth_subdirectory_has_behaviour(obj, parts[i], "DIRECTORY", true);
+			}
+			
+			json_object_put(obj);
+			
+			// Flag this part of the path as verified
+			if (is_valid) {
+				if (!verified_parts[i]) {
+					num_verified_parts++;
+				}
+				verified_parts[i] = true;
+			} else {
+				if (leaf_dir) {
+					free(leaf_dir);
+				}
+				MQTTClient_free(topic);
+				MQTTClient_freeMessage(&message);
+				topic_trie_free(ls_trie, NULL);
+				return alloced_copy("Directory not found.");
 			}
 		}
 		
@@ -288,24 +300,126 @@ char *qth_get_directory(MQTTClient *client, const char *path, char **dir, int me
 	}
 	
 	// Unsubscribe again
-	MQTTClient_unsubscribeMany(client, depth, ls_paths);
+	qth_unsubscribe_many(client, depth, ls_paths);
+	topic_trie_free(ls_trie, NULL);
 	*dir = leaf_dir;
 	return NULL;
 }
 
 
+// The QoS used for each class of operation. Every class defaults to QoS 2
+// (as with the old compile-time QTH_QOS): no per-class default has been
+// measured to be better, so --qos is only an override. The meta and property
+// classes can usually be lowered (e.g. 'meta=0,property=1'):
+//
+// * Directory listings are retained and idempotent: if one is lost, the
+//   next refetch gets it.
+// * Properties are retained and only their latest value matters, so a
+//   duplicated set is harmless and QoS 1 avoids QoS 2's extra round trip.
+// * Events aren't idempotent and may be lost or duplicated.
+// * Messages are delivered at the lower of the publisher's and
+//   subscriber's QoS, so subscriptions ask for QoS 2 and get whatever the
+//   publisher used.
+static int qos_policy[QOS_CLASS_COUNT] = {
+	2,  // QOS_CLASS_META
+	2,  // QOS_CLASS_PROPERTY
+	2,  // QOS_CLASS_EVENT
+	2,  // QOS_CLASS_WATCH
+};
+
+static const char *qos_class_names[QOS_CLASS_COUNT] = {
+	"meta",
+	"property",
+	"event",
+	"watch",
+};
+
+
+/**
+ * The QoS to use for a class of operation.
+ */
+int qth_qos(qos_class_t qos_class) {
+	return qos_policy[qos_class];
+}
+
+
+/**
+ * Override the QoS used for some or all classes of operation. 'spec' is
+ * either a single QoS (0, 1 or 2) used for everything, or a comma-separated
+ * list of CLASS=QOS pairs where CLASS is meta, property, event or watch.
+ * Returns an error message (to be freed by the caller) or NULL on success.
+ */
+char *qth_set_qos_policy(const char *spec) {
+	int policy[QOS_CLASS_COUNT];
+	memcpy(policy, qos_policy, sizeof(policy));
+	
+	if (strlen(spec) == 1 && spec[0] >= '0' && spec[0] <= '2') {
+		for (size_t i = 0; i < QOS_CLASS_COUNT; i++) {
+			policy[i] = spec[0] - '0';
+		}
+	} else {
+		const char *item = spec;
+		while (*item) {
+			size_t item_len = strcspn(item, ",");
+			const char *equals = memchr(item, '=', item_len);
+			if (!equals || item + item_len != equals + 2 ||
+			    equals[1] < '0' || equals[1] > '2') {
+				return alloced_cat("expected CLASS=QOS (QOS being 0, 1 or 2) in ",
+				                   spec);
+			}
+			
+			size_t name_len = equals - item;
+			size_t i;
+			for (i = 0; i < QOS_CLASS_COUNT; i++) {
+				if (strlen(qos_class_names[i]) == name_len &&
+				    strncmp(qos_class_names[i], item, name_len) == 0) {
+					break;
+				}
+			}
+			if (i == QOS_CLASS_COUNT) {
+				char *name = alloced_copyn(item, name_len);
+				char *err = alloced_cat("unknown class (expected meta, property, "
+				                        "event or watch): ", name);
+				free(name);
+				return err;
+			}
+			policy[i] = equals[1] - '0';
+			
+			item += item_len;
+			if (*item == ',') {
+				item++;
+			}
+		}
+	}
+	
+	memcpy(qos_policy, policy, sizeof(policy));
+	return NULL;
+}
+
+
 /**
  * Set a Qth property or send a Qth event. Returns an error message if there is
  * a problem (which must be freed by the caller).
  */
 char *qth_set_delete_or_send(MQTTClient *client, const char *topic, char *value,  bool is_property, int timeout) {
+	return qth_set_delete_or_sendn(client, topic, value, strlen(value), is_property, timeout);
+}
+
+/**
+ * Like qth_set_delete_or_send but for a value of 'len' bytes which need not be
+ * null-terminated. The value is passed straight to the MQTT client library.
+ */
+char *qth_set_delete_or_sendn(MQTTClient *client, const char *topic,
+                              const char *value, size_t len,
+                              bool is_property, int timeout) {
 	MQTTClient_deliveryToken tok;
-	int status = MQTTClient_publish(client,
-	                                topic,
-	                                strlen(value), value,
-	                                QTH_QOS,  // QoS
-	                                is_property,  // Retain
-	                                &tok);
+	int status = qth_publish(client,
+	                         topic,
+	                         len, value,
+	                         qth_qos(is_property ? QOS_CLASS_PROPERTY
+	                                             : QOS_CLASS_EVENT),
+	                         is_property,  // Retain
+	                         &tok);
 	if (status == MQTTCLIENT_SUCCESS) {
 		status = MQTTClient_waitForCompletion(client, tok, timeout);
 		if (status == MQTTCLIENT_SUCCESS) {
@@ -483,3 +597,96 @@ int get_topic_behaviour(MQTTClient *client, const char *topic,
 		return 0;
 	}
 }
+
+
+/**
+ * Given the payload of a directory listing received on 'meta/ls/<path>',
+ * return (via 'topics') a NULL-terminated array of the full topic names of
+ * every entry with the specified behaviour (only checking behaviour names up
+ * to the '-', as in qth_subdirectory_has_behaviour with strict = false). An
+ * empty payload (i.e. a removed directory) yields an empty array. The array
+ * should be freed by the caller using free_string_array. Returns an error
+ * message (which must be freed by the caller) or NULL on success.
+ */
+char *qth_listing_get_topics(const char *path, const char *payload,
+                             int payload_len, const char *behaviour,
+                             char ***topics) {
+	*topics = NULL;
+	
+	json_object *obj = NULL;
+	if (payload_len > 0) {
+		char *err = json_parse(payload, payload_len, &obj);
+		if (err) {
+			char *err_out = alloced_cat("Couldn't parse directory listing: ", err);
+			free(err);
+			return err_out;
+		}
+		if (!qth_is_directory_listing(obj)) {
+			json_object_put(obj);
+			return alloced_copy("Malformed directory listing.");
+		}
+	}
+	
+	size_t path_len = strlen(path);
+	size_t num_topics = 0;
+	*topics = malloc(sizeof(char *) * ((obj ? json_object_object_length(obj) : 0) + 1));
+	if (obj) {
+		json_object_object_foreach(obj, name, value) {
+			(void)value;
+			if (qth_subdirectory_has_behaviour(obj, name, behaviour, false)) {
+				char *topic = malloc(path_len + strlen(name) + 1);
+				strcpy(topic, path);
+				strcpy(topic + path_len, name);
+				(*topics)[num_topics++] = topic;
+			}
+		}
+		json_object_put(obj);
+	}
+	(*topics)[num_topics] = NULL;
+	
+	return NULL;
+}
+
+
+/**
+ * Check whether a topic name matches an MQTT topic filter (which may contain
+ * '+' and '#' wildcards).
+ */
+bool topic_matches_filter(const char *filter, const char *topic) {
+	while (true) {
+		if (filter[0] == '#' && filter[1] == '\0') {
+			// Multi-level wildcard matches everything remaining (including the
+			// parent level, e.g. 'a/#' matches 'a').
+			return true;
+		} else if (filter[0] == '+') {
+			// Single-level wildcard matches up to the next '/'
+			filter++;
+			while (*topic != '\0' && *topic != '/') {
+				topic++;
+			}
+		} else {
+			// Literal level
+			while (*filter != '\0' && *filter != '/') {
+				if (*filter != *topic) {
+					return false;
+				}
+				filter++;
+				topic++;
+			}
+			if (*topic != '\0' && *topic != '/') {
+				return false;
+			}
+		}
+		
+		// At the end of a level in both the filter and topic
+		if (*filter == '\0') {
+			return *topic == '\0';
+		} else if (*topic == '\0') {
+			// Topic ended: only matches if the filter's remainder is '/#'
+			return strcmp(filter, "/#") == 0;
+		}
+		
+		filter++;
+		topic++;
+	}
+}
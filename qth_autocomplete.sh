@@ -31,7 +31,7 @@ _qth_help_to_options() {
 				}
 			}
 		}
-		/^  (-[a-zA-Z0-9]) ([a-zA-Z_]+ )?(--[-a-zA-Z0-9_]+)? .*/ {
+		/^  (-[a-zA-Z0-9]) ([a-zA-Z_]+ )?(--[-a-zA-Z0-9_]+)? .*/ || /^  --[-a-zA-Z0-9_]+( |$)/ {
 			if (relevant) {
 				for (i = 1; i <= NF; i++) {
 					if ($i ~ /^--?[-a-zA-Z0-9]+$/) {
@@ -2,14 +2,34 @@
 #define QTH_CLIENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "json.h"
 #include "MQTTClient.h"
 
 #define VERSION_STRING "v0.3.4"
 
-// QoS value to use for all commands
-#define QTH_QOS 2
+// The classes of operation for which the QoS is chosen separately (see
+// qth_qos)
+typedef enum {
+	QOS_CLASS_META = 0,  // Fetching directory listings (and other meta topics)
+	QOS_CLASS_PROPERTY,  // Setting or deleting properties
+	QOS_CLASS_EVENT,     // Sending events
+	QOS_CLASS_WATCH,     // Subscribing to properties and events
+	QOS_CLASS_COUNT,
+} qos_class_t;
+
+// Subscription options for qth_subscribe (only honoured with MQTT 5)
+#define QTH_SUBSCRIBE_NO_LOCAL 1     // Don't receive our own messages
+#define QTH_SUBSCRIBE_NO_RETAINED 2  // Don't receive retained values when subscribing
+
+// The largest 'remaining length' of an MQTT packet (and so an upper bound on
+// the size of a payload)
+#define MQTT_MAX_PAYLOAD_LEN 268435455
+
+// Defaults for 'watch --exec' batching (values, ms)
+#define EXEC_DEFAULT_BATCH_SIZE 100
+#define EXEC_DEFAULT_BATCH_DELAY 100
 
 // The type of command entered on the command line.
 typedef enum {
@@ -20,6 +40,16 @@ typedef enum {
 	CMD_TYPE_WATCH,
 	CMD_TYPE_SEND,
 	CMD_TYPE_LS,
+	CMD_TYPE_LOG,
+	CMD_TYPE_QUERY,
+	CMD_TYPE_MIRROR,
+	CMD_TYPE_EXPORT,
+	CMD_TYPE_TOP,
+	CMD_TYPE_PING,
+	CMD_TYPE_WAIT,
+	CMD_TYPE_CALL,
+	CMD_TYPE_FIND,
+	CMD_TYPE_SIMULATE,
 } cmd_type_t;
 
 // The type formatting to use when displaying JSON
@@ -35,6 +65,7 @@ typedef enum {
 	LS_FORMAT_SHORT = 0,
 	LS_FORMAT_LONG,
 	LS_FORMAT_JSON,
+	LS_FORMAT_NDJSON,
 } ls_format_t;
 
 // Where the value to be sent or set should be fetched from
@@ -43,8 +74,110 @@ typedef enum {
 	VALUE_SOURCE_NULL,     // Just the JSON constant 'null'
 	VALUE_SOURCE_ARG,      // Value in argument
 	VALUE_SOURCE_STDIN,    // Read from stdin
+	VALUE_SOURCE_FILE,     // Memory-mapped from a file
 } value_source_t;
 
+// A resettable allocator for per-iteration temporaries (see arena.c)
+typedef struct arena arena_t;
+
+// A compiled filter/select expression (see expr.c)
+typedef struct expr expr_t;
+
+// A command run with batches of values by 'watch --exec' (see exec_hook.c)
+typedef struct exec_hook exec_hook_t;
+
+// Gathers output lines to be written with writev (see output_writer.c)
+typedef struct output_writer output_writer_t;
+
+// A bounded queue of lines written out by a thread (see output_queue.c)
+typedef struct output_queue output_queue_t;
+
+// A pool of threads formatting values in parallel (see format_pool.c)
+typedef struct format_pool format_pool_t;
+
+// Reads a stream of JSON values from a file descriptor (see json_reader.c)
+typedef struct json_reader json_reader_t;
+
+// Several connections jointly receiving a wildcard subscription (see shard.c)
+typedef struct shard_set shard_set_t;
+
+// What to do when a value is output while the output queue is full
+typedef enum {
+	QUEUE_POLICY_BLOCK = 0,    // Wait for space (stop receiving)
+	QUEUE_POLICY_DROP_OLDEST,  // Discard the oldest queued value
+	QUEUE_POLICY_DROP_NEWEST,  // Discard the new value
+	QUEUE_POLICY_KEEP_LATEST,  // Replace the topic's queued value (if any),
+	                           // otherwise discard the oldest
+} queue_policy_t;
+
+// Options controlling which of the values received by get, watch and wait are
+// output (and how)
+typedef struct {
+	// Only output values for which this expression is true (or NULL)
+	expr_t *filter;
+	
+	// Output the result of this expression rather than the whole value (or
+	// NULL)
+	expr_t *select;
+	
+	// Only output values which differ from the last received on their topic
+	bool changes_only;
+	
+	// Output at most one value per topic in this period, always the latest
+	// (ms, 0 = disabled)
+	int coalesce;
+	
+	// Command to run with batches of values on its stdin (or NULL to print
+	// values)
+	char *exec;
+	
+	// Maximum number of values per batch and the longest a value may wait
+	// before its batch is run (ms)
+	int exec_batch_size;
+	int exec_batch_delay;
+	
+	// Keep a single instance of the command running, feeding it each batch
+	bool exec_persistent;
+	
+	// Maximum number of values waiting to be written to stdout (0 = write
+	// values directly, blocking while stdout is blocked) and what to do when
+	// the queue is full
+	int queue_size;
+	queue_policy_t queue_policy;
+	
+	// Number of threads formatting values in parallel (0 = format values as
+	// they are received)
+	int format_threads;
+	
+	// Only output values sent after subscribing (i.e. skip retained values)
+	bool live;
+	
+	// Connect with a durable session and reconnect (resuming it) when the
+	// connection is lost
+	bool durable;
+} watch_opts_t;
+
+// The criteria a topic must meet (all of them, ignoring those which are NULL)
+// to be output by find
+typedef struct {
+	// Glob matched against the last part of the topic
+	char *name;
+	
+	// Glob matched against the whole topic
+	char *path;
+	
+	// Extended regular expression matched against the whole topic
+	char *regex;
+	
+	// Behaviour the topic must have, e.g. 'PROPERTY-1:N' or 'EVENT' (either
+	// variant)
+	char *behaviour;
+	
+	// Extended regular expression matched (ignoring case) against the
+	// topic's descriptions
+	char *description;
+} find_opts_t;
+
 // Struct defining the options specified on the commandline
 typedef struct {
 	// Which command was used?
@@ -54,6 +187,7 @@ typedef struct {
 	char *mqtt_host;
 	int mqtt_port;
 	int mqtt_keep_alive;  // (seconds)
+	bool mqtt5;  // Use MQTT 5 (rather than 3.1.1)
 	
 	// Client ID to use.
 	char *client_id;
@@ -102,6 +236,9 @@ typedef struct {
 	// ls listing format
 	ls_format_t ls_format;
 	
+	// Should ls keep printing changes to the listing
+	bool ls_watch;
+	
 	// The topic specified
 	char *topic;
 	
@@ -111,32 +248,294 @@ typedef struct {
 	// If value_source is VALUE_SOURCE_ARG, a pointer to the value used as an
 	// argument, otherwise NULL.
 	char *value;
+	
+	// If value_source is VALUE_SOURCE_FILE, the file the value is read from,
+	// otherwise NULL.
+	char *value_file;
+	
+	// The round-robin archive file used by log and query
+	char *rrd_file;
+	
+	// Archive layout given to log (or NULL). New archive files are created
+	// with this layout (or a default one) and existing ones must match it.
+	char *rrd_spec;
+	
+	// The time range to be queried (as given on the command line)
+	char *query_start;
+	char *query_end;
+	
+	// The resolution (step) of the archive to query (or NULL to choose
+	// automatically)
+	char *query_resolution;
+	
+	// Should query results be output as JSON
+	bool query_json;
+	
+	// Should 'get' read from the shared memory mirror instead of the broker
+	bool get_local;
+	
+	// The name of the shared memory mirror used by mirror and get --local
+	char *mirror_name;
+	
+	// Dimensions of the mirror created by the mirror command
+	int mirror_slots;
+	int mirror_value_size;
+	
+	// The directory paths given to export (num_paths may be zero)
+	char **paths;
+	int num_paths;
+	
+	// The [HOST:]PORT the export command should serve metrics on
+	char *export_listen;
+	
+	// How often top should refresh its view (seconds)
+	double top_interval;
+	
+	// The maximum number of topics top should show (0 = no limit)
+	int top_limit;
+	
+	// Should top output JSON snapshots
+	bool top_json;
+	
+	// How often ping should send a probe (seconds)
+	double ping_interval;
+	
+	// How long ping waits for a probe before counting it as lost (ms)
+	int ping_timeout;
+	
+	// Should ping output its statistics as JSON
+	bool ping_json;
+	
+	// Options for the values output by get, watch and wait
+	watch_opts_t watch_opts;
+	
+	// Overall deadline for wait (ms, 0 = wait forever)
+	int wait_timeout;
+	
+	// Should wait wait for the value to change from its initial value
+	bool wait_changed;
+	
+	// The topic call waits for its reply on
+	char *reply_topic;
+	
+	// Replies to call must give the same result for this expression as the
+	// request (or NULL to accept any reply)
+	expr_t *call_correlate;
+	
+	// Overall deadline for call, covering both the request and reply (ms, 0 =
+	// wait forever)
+	int call_timeout;
+	
+	// Number of connections watch splits a wildcard subscription between (0 =
+	// use the main connection)
+	int watch_shards;
+	
+	// Criteria for topics output by find
+	find_opts_t find_opts;
+	
+	// The file describing the topics for simulate to drive
+	char *simulate_spec;
 } options_t;
 
 
+// The header at the start of a round-robin archive file
+typedef struct {
+	char magic[8];
+	uint32_t num_archives;
+	uint32_t reserved;
+	
+	// The time of the most recent update (seconds since the epoch)
+	int64_t last_update;
+} rrd_header_t;
+
+// Describes the layout of one archive within a round-robin archive file
+typedef struct {
+	// The period of time consolidated into a single row (seconds)
+	uint32_t step;
+	
+	// The number of rows in the archive
+	uint32_t rows;
+	
+	// Byte offset of the first row from the start of the file
+	uint64_t offset;
+} rrd_archive_t;
+
+// A single consolidated row of a round-robin archive
+typedef struct {
+	// The start of the period this row holds (seconds since the epoch) or 0 if
+	// the row has never been written.
+	int64_t start;
+	
+	// The number of values consolidated into this row
+	uint32_t count;
+	uint32_t reserved;
+	
+	double min;
+	double max;
+	double sum;
+} rrd_row_t;
+
+// A memory-mapped round-robin archive file
+typedef struct {
+	void *map;
+	size_t map_len;
+	
+	rrd_header_t *header;
+	rrd_archive_t *archives;
+} rrd_t;
+
+// A hash map from strings to pointers
+typedef struct strmap strmap_t;
+typedef struct topic_trie topic_trie_t;
+
+
 options_t argparse(int argc, char *argv[]);
 
 char *json_parse(const char *str, int len, json_object **obj);
 char *json_validate(const char *str, int len);
+char *json_check(const char *str, size_t len);
 char *json_to_format(const char *in_str, json_format_t json_format);
+char *json_object_to_format(json_object *json, json_format_t json_format);
+const char *json_object_to_format_borrowed(json_object *json,
+                                           json_format_t json_format,
+                                           size_t *len);
+uint64_t json_hash(json_object *obj);
+char *annotate_error(const char *str, size_t offset, const char *message);
+
+json_reader_t *json_reader_new(int fd);
+void json_reader_free(json_reader_t *reader);
+char *json_reader_next(json_reader_t *reader, const char **value, size_t *len);
+
+char *expr_compile(const char *str, expr_t **expr);
+void expr_free(expr_t *expr);
+json_object *expr_eval(expr_t *expr, json_object *value);
+bool expr_test(expr_t *expr, json_object *value);
+
+exec_hook_t *exec_hook_new(const char *command, int batch_size,
+                           int batch_delay, bool persistent);
+char *exec_hook_add(exec_hook_t *hook, const char *value, size_t len,
+                    uint64_t now);
+char *exec_hook_poll(exec_hook_t *hook, uint64_t now);
+uint64_t exec_hook_deadline(exec_hook_t *hook);
+char *exec_hook_close(exec_hook_t *hook);
+
+output_writer_t *output_writer_new(int fd);
+bool output_writer_is_interactive(output_writer_t *writer);
+char *output_writer_write(output_writer_t *writer, char *line, size_t len,
+                          uint64_t now);
+char *output_writer_write_copy(output_writer_t *writer, const char *line,
+                               size_t len, uint64_t now);
+char *output_writer_flush(output_writer_t *writer);
+uint64_t output_writer_deadline(output_writer_t *writer);
+char *output_writer_free(output_writer_t *writer);
+
+format_pool_t *format_pool_new(int num_threads, json_format_t json_format,
+                               expr_t *select);
+bool format_pool_full(format_pool_t *pool);
+bool format_pool_busy(format_pool_t *pool);
+void format_pool_submit(format_pool_t *pool, const char *topic,
+                        json_object *value, const char *raw, int raw_len);
+bool format_pool_next(format_pool_t *pool, bool wait, char **topic, char **out);
+void format_pool_free(format_pool_t *pool);
+
+bool parse_queue_policy(const char *name, queue_policy_t *policy);
+output_queue_t *output_queue_new(output_writer_t *writer, int capacity,
+                                 queue_policy_t policy);
+void output_queue_push(output_queue_t *queue, const char *topic, char *line,
+                       size_t len);
+char *output_queue_close(output_queue_t *queue);
+
+char *qth_connect(MQTTClient *client, const char *url, const char *client_id,
+                  int keep_alive, const char *will_topic, bool mqtt5,
+                  bool durable);
+int qth_reconnect(MQTTClient *client, bool *session_present);
+int qth_disconnect(MQTTClient *client, bool cleanly, int timeout);
+int qth_subscribe(MQTTClient *client, const char *topic, int qos, int flags);
+int qth_subscribe_many(MQTTClient *client, int count, char * const *topics,
+                       int *qos, int flags);
+int qth_unsubscribe(MQTTClient *client, const char *topic);
+int qth_unsubscribe_many(MQTTClient *client, int count, char * const *topics);
+int qth_publish(MQTTClient *client, const char *topic, int len,
+                const void *payload, int qos, bool retained,
+                MQTTClient_deliveryToken *tok);
+int qth_receive(MQTTClient *client, char **topic, int *topic_len,
+                MQTTClient_message **message, unsigned long timeout);
+
+char *shard_set_new(MQTTClient *client, const char *topic, int num_shards,
+                    const char *url, const char *client_id, int keep_alive,
+                    bool mqtt5, int meta_timeout, shard_set_t **set);
+char *shard_set_start(shard_set_t *set, int flags);
+int shard_set_receive(shard_set_t *set, char **topic, int *topic_len,
+                      MQTTClient_message **message, unsigned long timeout);
+void shard_set_free(shard_set_t *set, bool print_stats);
+
+arena_t *arena_new(size_t block_size);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_copyn(arena_t *arena, const char *str, size_t len);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
 
 char *alloced_copy(const char *str);
 char *alloced_copyn(const char *str, size_t len);
 char *alloced_cat(const char *a, const char *b);
+bool parse_duration(const char *str, double *seconds);
+void free_string_array(char **strings);
+uint64_t monotonic_ns(void);
+char *map_file(const char *filename, const char **data, size_t *len);
+void unmap_file(const char *data, size_t len);
+
+uint64_t hash_string(const char *str);
+uint64_t hash_bytes(const void *data, size_t len);
+strmap_t *strmap_new(void);
+void strmap_free(strmap_t *map, void (*free_value)(void *));
+void *strmap_get(strmap_t *map, const char *key);
+void *strmap_set(strmap_t *map, const char *key, void *value);
+size_t strmap_count(strmap_t *map);
+bool strmap_next(strmap_t *map, size_t *iter, const char **key, void **value);
+
+topic_trie_t *topic_trie_new(void);
+void topic_trie_free(topic_trie_t *trie, void (*free_value)(void *));
+void *topic_trie_add(topic_trie_t *trie, const char *filter, void *value);
+void *topic_trie_remove(topic_trie_t *trie, const char *filter);
+size_t topic_trie_count(topic_trie_t *trie);
+size_t topic_trie_match(topic_trie_t *trie, const char *topic,
+                        void (*callback)(void *value, void *arg), void *arg);
+void topic_trie_get_value(void *value, void *arg);
+
+char *rrd_open(const char *filename, const char *spec, bool writable, rrd_t *rrd);
+void rrd_close(rrd_t *rrd);
+rrd_row_t *rrd_get_row(rrd_t *rrd, uint32_t archive, int64_t t);
+void rrd_update(rrd_t *rrd, int64_t t, double value);
+uint32_t rrd_choose_archive(rrd_t *rrd, int64_t start, int64_t now);
 
 bool qth_is_directory_listing(json_object *dir);
 const char **qth_subdirectory_get_behaviours(json_object *dir, const char *subpath);
 bool qth_subdirectory_has_behaviour(json_object *dir, const char *subpath, const char *behaviour, bool strict);
 char *qth_get_directory(MQTTClient *client, const char *path, char **dir, int meta_timeout);
+int qth_qos(qos_class_t qos_class);
+char *qth_set_qos_policy(const char *spec);
 char *qth_set_delete_or_send(MQTTClient *client, const char *topic, char *value,  bool is_property, int timeout);
+char *qth_set_delete_or_sendn(MQTTClient *client, const char *topic,
+                              const char *value, size_t len,
+                              bool is_property, int timeout);
 char *qth_set_property(MQTTClient *client, const char *topic, char *value, int timeout);
 char *qth_send_event(MQTTClient *client, const char *topic, char *value, int timeout);
+json_object *registration_new(const char *description);
+void registration_add_topic(json_object *reg, const char *topic,
+                            const char *behaviour, const char *description,
+                            const char *on_unregister,
+                            bool delete_on_unregister);
+
 char *get_topic_path(const char *topic);
 const char *get_topic_name(const char *topic);
 int verify_topic(MQTTClient *client, const char *topic,
                  const char *desired_behaviour, bool strict, int meta_timeout);
 int get_topic_behaviour(MQTTClient *client, const char *topic,
                         int meta_timeout, char **behaviour);
+bool topic_matches_filter(const char *filter, const char *topic);
+char *qth_listing_get_topics(const char *path, const char *payload,
+                             int payload_len, const char *behaviour,
+                             char ***topics);
 
 int cmd_ls(MQTTClient *mqtt_client,
            const char *path,
@@ -144,10 +543,26 @@ int cmd_ls(MQTTClient *mqtt_client,
            bool ls_recursive,
            ls_format_t ls_format,
            json_format_t json_format);
+int cmd_ls_watch(MQTTClient *client,
+                 const char *path,
+                 bool ls_recursive,
+                 ls_format_t ls_format);
+
+int cmd_simulate(MQTTClient *client,
+                 const char *spec_file,
+                 const char *registration_url,
+                 int meta_timeout);
+
+int cmd_find(MQTTClient *client,
+             const char *path,
+             const find_opts_t *find_opts,
+             ls_format_t ls_format,
+             int meta_timeout);
 
 int cmd_set(MQTTClient *client,
             const char *topic,
             const char *value,
+            const char *value_file,
             bool is_registering,
             bool strict,
             bool force,
@@ -166,6 +581,7 @@ int cmd_delete(MQTTClient *client,
 int cmd_send(MQTTClient *client,
              const char *topic,
              const char *value,
+             const char *value_file,
              bool is_registering,
              bool strict,
              bool force,
@@ -181,7 +597,8 @@ int cmd_get(MQTTClient *client,
             bool force,
             int count,
             int timeout,
-            int meta_timeout);
+            int meta_timeout,
+            const watch_opts_t *watch_opts);
 
 int cmd_watch(MQTTClient *client,
               const char *topic,
@@ -191,7 +608,74 @@ int cmd_watch(MQTTClient *client,
               bool force,
               int count,
               int timeout,
-              int meta_timeout);
+              int meta_timeout,
+              const watch_opts_t *watch_opts,
+              shard_set_t *shards);
+
+int cmd_wait(MQTTClient *client,
+             const char *topic,
+             json_format_t json_format,
+             bool force,
+             const watch_opts_t *watch_opts,
+             bool changed,
+             int timeout,
+             int meta_timeout);
+
+int cmd_log(MQTTClient *client,
+            const char *topic,
+            const char *rrd_file,
+            const char *rrd_spec,
+            bool force,
+            int count,
+            int timeout,
+            int meta_timeout);
+
+int cmd_query(const char *rrd_file,
+              const char *start,
+              const char *end,
+              const char *resolution,
+              bool json);
+
+int cmd_mirror(MQTTClient *client,
+               const char *path,
+               const char *mirror_name,
+               int num_slots,
+               int value_size);
+
+int cmd_get_local(const char *topic,
+                  const char *mirror_name,
+                  json_format_t json_format);
+
+int cmd_export(MQTTClient *client,
+               char **paths,
+               int num_paths,
+               const char *listen_address);
+
+int cmd_top(MQTTClient *client,
+            const char *filter,
+            double interval,
+            int limit,
+            bool json,
+            int count);
+
+int cmd_call(MQTTClient *client,
+             const char *topic,
+             const char *reply_topic,
+             char *value,
+             json_format_t json_format,
+             bool force,
+             expr_t *correlate,
+             expr_t *select,
+             int timeout,
+             int meta_timeout);
+
+int cmd_ping(MQTTClient *client,
+             const char *topic,
+             double interval,
+             bool json,
+             int count,
+             int timeout,
+             int send_timeout);
 
 int cmd_auto(MQTTClient *client,
              bool strict,
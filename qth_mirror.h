@@ -0,0 +1,58 @@
+/**
+ * Access to the shared-memory mirror of Qth property values maintained by
+ * 'qth mirror'.
+ *
+ * The mirror is a fixed-size, open-addressed hash table of topics held in a
+ * POSIX shared memory object. It has exactly one writer (the 'qth mirror'
+ * process) and any number of readers. Each slot is protected by a sequence
+ * lock so readers never block the writer or each other.
+ *
+ * This header (and mirror.c) deliberately avoid depending on the rest of the
+ * Qth client so that other programs may read the mirror by compiling in just
+ * these two files.
+ */
+
+#ifndef QTH_MIRROR_H
+#define QTH_MIRROR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The shared memory object name used when none is specified
+#define QTH_MIRROR_DEFAULT_NAME "/qth-mirror"
+
+// Default table dimensions used by 'qth mirror'
+#define QTH_MIRROR_DEFAULT_SLOTS 4096
+#define QTH_MIRROR_DEFAULT_VALUE_SIZE 1024
+
+// The longest topic name which may be mirrored (including the null)
+#define QTH_MIRROR_TOPIC_SIZE 256
+
+// Result codes from qth_mirror_get
+typedef enum {
+	QTH_MIRROR_OK = 0,
+	QTH_MIRROR_NOT_FOUND,  // Topic is not a (mirrored) property
+	QTH_MIRROR_NO_VALUE,   // Property is known but not set (or was deleted)
+	QTH_MIRROR_TOO_LARGE,  // Value too large for the buffer (or the mirror)
+} qth_mirror_result_t;
+
+typedef struct qth_mirror qth_mirror_t;
+
+// Reader API
+char *qth_mirror_open(const char *name, qth_mirror_t **mirror);
+qth_mirror_result_t qth_mirror_get(qth_mirror_t *mirror, const char *topic,
+                                   char *value, size_t value_size,
+                                   size_t *value_len);
+size_t qth_mirror_value_size(qth_mirror_t *mirror);
+void qth_mirror_close(qth_mirror_t *mirror);
+
+// Writer API (for use by a single writer only)
+char *qth_mirror_create(const char *name, uint32_t num_slots,
+                        uint32_t value_size, qth_mirror_t **mirror);
+bool qth_mirror_contains(qth_mirror_t *mirror, const char *topic);
+char *qth_mirror_set(qth_mirror_t *mirror, const char *topic,
+                     const char *value, size_t value_len);
+void qth_mirror_destroy(qth_mirror_t *mirror, const char *name);
+
+#endif
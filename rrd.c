@@ -0,0 +1,294 @@
+/**
+ * Fixed-size, memory-mapped round-robin archives of numeric values.
+ *
+ * An archive file contains a header followed by one or more archives, each
+ * of which holds a fixed number of rows. Each row consolidates (min, max,
+ * sum and count) all values which arrived during one 'step' of time. The row
+ * used for a given time is chosen by (time / step) % rows and so the file
+ * never grows and each update touches exactly one row per archive.
+ *
+ * Files are stored in the host's native byte order.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qth_client.h"
+
+#define RRD_MAGIC "QTHRRD01"
+
+// The largest number of archives a single file may contain
+#define RRD_MAX_ARCHIVES 16
+
+// The layout of newly created files when no specification is given
+#define RRD_DEFAULT_SPEC "1s:1h,1m:1d,1h:1y"
+
+/**
+ * Parse an archive specification of the form 'STEP:RETENTION[,...]' (e.g.
+ * '1s:1h,1m:1d,1h:1y') into the supplied arrays. Returns an error message
+ * (to be freed by the caller) or NULL on success.
+ */
+static char *rrd_parse_spec(const char *spec, uint32_t *steps, uint32_t *rows,
+                            uint32_t *num_archives) {
+	*num_archives = 0;
+	
+	char *spec_copy = alloced_copy(spec);
+	char *saveptr = NULL;
+	for (char *archive = strtok_r(spec_copy, ",", &saveptr);
+	     archive != NULL;
+	     archive = strtok_r(NULL, ",", &saveptr)) {
+		char *colon = strchr(archive, ':');
+		if (!colon) {
+			free(spec_copy);
+			return alloced_copy("Archive specification must be of the form STEP:RETENTION.");
+		}
+		*colon = '\0';
+		
+		double step, retention;
+		if (!parse_duration(archive, &step) ||
+		    !parse_duration(colon + 1, &retention) ||
+		    !isfinite(step) || !isfinite(retention) ||
+		    step < 1.0 || retention < step) {
+			free(spec_copy);
+			return alloced_copy("Archive step must be at least 1s and no "
+			                    "longer than its retention period.");
+		}
+		if (step > UINT32_MAX ||
+		    ceil(retention / (uint32_t)step) > UINT32_MAX) {
+			free(spec_copy);
+			return alloced_copy("Archive step or retention period too long.");
+		}
+		
+		if (*num_archives == RRD_MAX_ARCHIVES) {
+			free(spec_copy);
+			return alloced_copy("Too many archives specified.");
+		}
+		steps[*num_archives] = (uint32_t)step;
+		rows[*num_archives] = (uint32_t)ceil(retention / (uint32_t)step);
+		(*num_archives)++;
+	}
+	free(spec_copy);
+	
+	if (*num_archives == 0) {
+		return alloced_copy("No archives specified.");
+	}
+	return NULL;
+}
+
+/**
+ * Create a new, empty archive file with the specified layout, leaving it open
+ * as fd. Returns an error message (to be freed by the caller) or NULL on
+ * success.
+ */
+static char *rrd_create(int fd, const char *spec) {
+	uint32_t steps[RRD_MAX_ARCHIVES];
+	uint32_t rows[RRD_MAX_ARCHIVES];
+	uint32_t num_archives;
+	char *err = rrd_parse_spec(spec, steps, rows, &num_archives);
+	if (err) {
+		return err;
+	}
+	
+	rrd_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RRD_MAGIC, sizeof(header.magic));
+	header.num_archives = num_archives;
+	
+	rrd_archive_t archives[RRD_MAX_ARCHIVES];
+	memset(archives, 0, sizeof(archives));
+	uint64_t offset = sizeof(rrd_header_t) + (sizeof(rrd_archive_t) * num_archives);
+	for (uint32_t i = 0; i < num_archives; i++) {
+		archives[i].step = steps[i];
+		archives[i].rows = rows[i];
+		archives[i].offset = offset;
+		offset += sizeof(rrd_row_t) * rows[i];
+	}
+	
+	// NB: Rows are zero-filled by ftruncate which marks them as unused
+	// (start = 0).
+	if (ftruncate(fd, offset) != 0 ||
+	    pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    pwrite(fd, archives, sizeof(rrd_archive_t) * num_archives,
+	           sizeof(header)) != (ssize_t)(sizeof(rrd_archive_t) * num_archives)) {
+		return alloced_cat("Couldn't initialise archive file: ", strerror(errno));
+	}
+	
+	return NULL;
+}
+
+/**
+ * Open (and map) an archive file. If 'writable' is true and the file does not
+ * exist, it will be created with the layout given in 'spec' (see
+ * rrd_parse_spec) or a default layout if 'spec' is NULL. If the file exists
+ * and 'spec' is non-NULL, the file's layout must match it. If 'writable' is
+ * false, the file is mapped read-only. Returns an error message (to be freed
+ * by the caller) or NULL on success.
+ */
+char *rrd_open(const char *filename, const char *spec, bool writable, rrd_t *rrd) {
+	rrd->map = NULL;
+	rrd->map_len = 0;
+	
+	// Check the spec up-front (even if it won't be used to create the file)
+	uint32_t spec_steps[RRD_MAX_ARCHIVES];
+	uint32_t spec_rows[RRD_MAX_ARCHIVES];
+	uint32_t spec_num_archives = 0;
+	if (spec) {
+		char *err = rrd_parse_spec(spec, spec_steps, spec_rows, &spec_num_archives);
+		if (err) {
+			return err;
+		}
+	}
+	
+	int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0 && errno == ENOENT && writable) {
+		fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd >= 0) {
+			char *err = rrd_create(fd, spec ? spec : RRD_DEFAULT_SPEC);
+			if (err) {
+				close(fd);
+				unlink(filename);
+				return err;
+			}
+		}
+	}
+	if (fd < 0) {
+		return alloced_cat("Couldn't open archive file: ", strerror(errno));
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return alloced_cat("Couldn't open archive file: ", strerror(errno));
+	}
+	if ((size_t)st.st_size < sizeof(rrd_header_t)) {
+		close(fd);
+		return alloced_copy("Not a valid archive file (too short).");
+	}
+	
+	void *map = mmap(NULL, st.st_size,
+	                 writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	                 MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return alloced_cat("Couldn't map archive file: ", strerror(errno));
+	}
+	
+	// Sanity check the header and archive table
+	rrd_header_t *header = map;
+	bool valid = memcmp(header->magic, RRD_MAGIC, sizeof(header->magic)) == 0 &&
+	             header->num_archives > 0 &&
+	             header->num_archives <= RRD_MAX_ARCHIVES &&
+	             sizeof(rrd_header_t) + (sizeof(rrd_archive_t) *
+	                                     header->num_archives) <= (size_t)st.st_size;
+	rrd_archive_t *archives = (rrd_archive_t *)(header + 1);
+	for (uint32_t i = 0; valid && i < header->num_archives; i++) {
+		valid = archives[i].step > 0 &&
+		        archives[i].rows > 0 &&
+		        archives[i].offset +
+		        ((uint64_t)archives[i].rows * sizeof(rrd_row_t)) <= (uint64_t)st.st_size;
+	}
+	if (!valid) {
+		munmap(map, st.st_size);
+		return alloced_copy("Not a valid archive file (bad header).");
+	}
+	
+	// An existing file must have the layout asked for
+	bool matches = !spec || header->num_archives == spec_num_archives;
+	for (uint32_t i = 0; spec && matches && i < header->num_archives; i++) {
+		matches = archives[i].step == spec_steps[i] &&
+		          archives[i].rows == spec_rows[i];
+	}
+	if (!matches) {
+		munmap(map, st.st_size);
+		return alloced_copy("Archive file already exists with a different "
+		                    "layout to the one specified.");
+	}
+	
+	rrd->map = map;
+	rrd->map_len = st.st_size;
+	rrd->header = header;
+	rrd->archives = archives;
+	return NULL;
+}
+
+/**
+ * Unmap an archive file previously opened with rrd_open.
+ */
+void rrd_close(rrd_t *rrd) {
+	if (rrd->map) {
+		munmap(rrd->map, rrd->map_len);
+		rrd->map = NULL;
+	}
+}
+
+/**
+ * Get a pointer to the row of an archive which holds the given (non-negative)
+ * time.
+ */
+rrd_row_t *rrd_get_row(rrd_t *rrd, uint32_t archive, int64_t t) {
+	rrd_archive_t *a = &rrd->archives[archive];
+	rrd_row_t *rows = (rrd_row_t *)((char *)rrd->map + a->offset);
+	return &rows[(t / a->step) % a->rows];
+}
+
+/**
+ * Record a value which arrived at time 't' (seconds since the epoch) in
+ * every archive.
+ */
+void rrd_update(rrd_t *rrd, int64_t t, double value) {
+	for (uint32_t i = 0; i < rrd->header->num_archives; i++) {
+		int64_t start = t - (t % rrd->archives[i].step);
+		rrd_row_t *row = rrd_get_row(rrd, i, t);
+		
+		if (row->start != start) {
+			// Row last held an older bucket, start afresh
+			row->start = start;
+			row->count = 1;
+			row->min = value;
+			row->max = value;
+			row->sum = value;
+		} else {
+			row->count++;
+			row->min = fmin(row->min, value);
+			row->max = fmax(row->max, value);
+			row->sum += value;
+		}
+	}
+	
+	rrd->header->last_update = t;
+}
+
+/**
+ * Select the archive best suited to answer a query over the period starting
+ * at 'start' given that the current time is 'now': the finest resolution
+ * archive whose retention period still covers 'start'. If no archive reaches
+ * back that far, the longest-retention archive is chosen.
+ */
+uint32_t rrd_choose_archive(rrd_t *rrd, int64_t start, int64_t now) {
+	uint32_t best = 0;
+	uint64_t best_retention = 0;
+	bool best_covers = false;
+	for (uint32_t i = 0; i < rrd->header->num_archives; i++) {
+		uint64_t retention = (uint64_t)rrd->archives[i].step * rrd->archives[i].rows;
+		bool covers = now - start <= (int64_t)retention;
+		if (covers) {
+			if (!best_covers || rrd->archives[i].step < rrd->archives[best].step) {
+				best = i;
+				best_covers = true;
+			}
+		} else if (!best_covers && retention > best_retention) {
+			best = i;
+			best_retention = retention;
+		}
+	}
+	return best;
+}
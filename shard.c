@@ -0,0 +1,461 @@
+/**
+ * Sharded receiving for 'watch --shards': a wildcard subscription ('PREFIX#')
+ * is split across several MQTT connections, each subscribed to a subset of the
+ * subtrees listed in the Qth directory PREFIX and read by its own thread. The
+ * messages received by all connections are merged into a single stream.
+ *
+ * Subtrees are assigned to connections to balance the number of entries in
+ * each (as listed in their directory listings when the watch starts). Since
+ * every topic belongs to exactly one subtree, and so one connection, messages
+ * on each topic are still received in order.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+#include "MQTTClient.h"
+
+#include "qth_client.h"
+
+// The number of received messages which may wait to be merged, per shard.
+// When full, receiving threads stop reading until there is space.
+#define SHARD_QUEUE_PER_SHARD 1024
+
+// How often receiving threads check for the watch stopping (ms)
+#define SHARD_RECEIVE_INTERVAL 100
+
+typedef struct {
+	shard_set_t *set;
+	int index;
+	
+	MQTTClient client;
+	bool connected;
+	
+	// The topic filters subscribed to by this shard
+	char **filters;
+	size_t num_filters;
+	
+	// The total weight (number of directory entries) of the subtrees assigned
+	uint64_t weight;
+	
+	// Messages and bytes received (written only by the shard's thread while
+	// it runs)
+	uint64_t num_messages;
+	uint64_t num_bytes;
+	
+	pthread_t thread;
+	bool started;
+} shard_t;
+
+// A received message waiting to be merged
+typedef struct {
+	char *topic;
+	int topic_len;
+	MQTTClient_message *message;
+} shard_message_t;
+
+struct shard_set {
+	shard_t *shards;
+	int num_shards;
+	
+	// Keeps the main connection (which the shards receive instead of) alive
+	pthread_t keep_alive_thread;
+	bool keep_alive_started;
+	
+	// Merged queue of received messages
+	shard_message_t *queue;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	
+	// Set when the receiving threads should stop or a receive failed
+	bool stopping;
+	bool failed;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+// A subtree of the directory (and its weight) while planning shards
+typedef struct {
+	char *filter;
+	uint64_t weight;
+} shard_subtree_t;
+
+
+static void *shard_thread(void *shard_void) {
+	shard_t *shard = shard_void;
+	shard_set_t *set = shard->set;
+	
+	while (true) {
+		char *topic = NULL;
+		int topic_len = 0;
+		MQTTClient_message *message = NULL;
+		int err = qth_receive(shard->client, &topic, &topic_len, &message,
+		                      SHARD_RECEIVE_INTERVAL);
+		
+		pthread_mutex_lock(&set->lock);
+		if (err != MQTTCLIENT_SUCCESS) {
+			set->failed = true;
+			pthread_cond_broadcast(&set->not_empty);
+		}
+		if (set->stopping || set->failed) {
+			pthread_mutex_unlock(&set->lock);
+			if (message) {
+				MQTTClient_free(topic);
+				MQTTClient_freeMessage(&message);
+			}
+			break;
+		}
+		if (message) {
+			while (set->count == set->capacity && !set->stopping) {
+				pthread_cond_wait(&set->not_full, &set->lock);
+			}
+			if (set->stopping) {
+				pthread_mutex_unlock(&set->lock);
+				MQTTClient_free(topic);
+				MQTTClient_freeMessage(&message);
+				break;
+			}
+			
+			shard->num_messages++;
+			shard->num_bytes += message->payloadlen;
+			
+			shard_message_t *entry = &set->queue[(set->head + set->count) % set->capacity];
+			entry->topic = topic;
+			entry->topic_len = topic_len;
+			entry->message = message;
+			set->count++;
+			pthread_cond_signal(&set->not_empty);
+		}
+		pthread_mutex_unlock(&set->lock);
+	}
+	
+	return NULL;
+}
+
+
+/**
+ * Keep the main connection alive while the shards receive. Being a
+ * synchronous client without callbacks, it only sends keepalive pings (and so
+ * avoids being disconnected, losing any registration) while it is being read
+ * from or yielded to.
+ */
+static void *shard_keep_alive_thread(void *set_void) {
+	shard_set_t *set = set_void;
+	
+	pthread_mutex_lock(&set->lock);
+	while (!set->stopping) {
+		pthread_mutex_unlock(&set->lock);
+		MQTTClient_yield();
+		pthread_mutex_lock(&set->lock);
+	}
+	pthread_mutex_unlock(&set->lock);
+	
+	return NULL;
+}
+
+
+static int compare_subtree_weight(const void *a, const void *b) {
+	const shard_subtree_t *sa = a;
+	const shard_subtree_t *sb = b;
+	return (sa->weight < sb->weight) - (sa->weight > sb->weight);
+}
+
+
+/**
+ * Work out the subtrees of the directory 'prefix' (which must be empty or end
+ * with a '/') and how many entries each contains. Returns an error message (to
+ * be freed by the caller) or NULL on success, in which case 'subtrees' must be
+ * freed by the caller (along with each filter).
+ */
+static char *shard_get_subtrees(MQTTClient *client, const char *prefix,
+                                int meta_timeout, shard_subtree_t **subtrees,
+                                size_t *num_subtrees) {
+	*subtrees = NULL;
+	*num_subtrees = 0;
+	
+	char *dir_str;
+	char *err = qth_get_directory(client, prefix, &dir_str, meta_timeout);
+	if (err) {
+		return err;
+	}
+	json_object *dir;
+	err = json_parse(dir_str, -1, &dir);
+	free(dir_str);
+	if (err) {
+		return err;
+	}
+	if (!qth_is_directory_listing(dir)) {
+		json_object_put(dir);
+		return alloced_copy("Malformed directory listing.");
+	}
+	
+	*subtrees = malloc(sizeof(shard_subtree_t) * (json_object_object_length(dir) + 1));
+	size_t prefix_len = strlen(prefix);
+	json_object_object_foreach(dir, name, entries) {
+		(void)entries;
+		
+		// NB: 'name/#' also matches 'name' itself
+		shard_subtree_t *subtree = &(*subtrees)[(*num_subtrees)++];
+		subtree->filter = malloc(prefix_len + strlen(name) + 3);
+		sprintf(subtree->filter, "%s%s/#", prefix, name);
+		subtree->weight = 1;
+		
+		// Weight subdirectories by the number of entries they contain
+		if (qth_subdirectory_has_behaviour(dir, name, "DIRECTORY", true)) {
+			char *subdir_path = malloc(prefix_len + strlen(name) + 2);
+			sprintf(subdir_path, "%s%s/", prefix, name);
+			char *subdir_str;
+			char *subdir_err = qth_get_directory(client, subdir_path, &subdir_str,
+			                                     meta_timeout);
+			free(subdir_path);
+			if (subdir_err) {
+				// The directory may have just been removed: just guess
+				free(subdir_err);
+				continue;
+			}
+			json_object *subdir;
+			subdir_err = json_parse(subdir_str, -1, &subdir);
+			free(subdir_str);
+			if (subdir_err) {
+				free(subdir_err);
+				continue;
+			}
+			if (!qth_is_directory_listing(subdir)) {
+				// Malformed: just guess
+				json_object_put(subdir);
+				continue;
+			}
+			subtree->weight += json_object_object_length(subdir);
+			json_object_put(subdir);
+		}
+	}
+	json_object_put(dir);
+	
+	return NULL;
+}
+
+
+/**
+ * Plan and connect a set of (up to) 'num_shards' connections which together
+ * receive everything matched by 'topic' (which must be of the form 'PREFIX#'
+ * where PREFIX is empty or ends with '/'). The directory listing for PREFIX is
+ * fetched using 'client'. The shard connections use the client ID with
+ * '-shard-N' appended (and the same protocol version as 'client'). Returns an
+ * error message (to be freed by the caller) or NULL on success, in which case
+ * the set must be freed with shard_set_free.
+ */
+char *shard_set_new(MQTTClient *client, const char *topic, int num_shards,
+                    const char *url, const char *client_id, int keep_alive,
+                    bool mqtt5, int meta_timeout, shard_set_t **set_out) {
+	*set_out = NULL;
+	
+	// Work out the subtrees to be split between the shards
+	char *prefix = alloced_copyn(topic, strlen(topic) - 1);
+	shard_subtree_t *subtrees;
+	size_t num_subtrees;
+	char *err = shard_get_subtrees(client, prefix, meta_timeout,
+	                               &subtrees, &num_subtrees);
+	free(prefix);
+	if (err) {
+		char *err_out = alloced_cat("Couldn't list subtrees to shard: ", err);
+		free(err);
+		return err_out;
+	}
+	if (num_subtrees == 0) {
+		// Nothing listed: a single shard receives everything
+		subtrees[0].filter = alloced_copy(topic);
+		subtrees[0].weight = 1;
+		num_subtrees = 1;
+	}
+	if ((size_t)num_shards > num_subtrees) {
+		num_shards = num_subtrees;
+	}
+	
+	shard_set_t *set = calloc(1, sizeof(shard_set_t));
+	set->num_shards = num_shards;
+	set->shards = calloc(num_shards, sizeof(shard_t));
+	set->capacity = num_shards * SHARD_QUEUE_PER_SHARD;
+	set->queue = calloc(set->capacity, sizeof(shard_message_t));
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->not_empty, NULL);
+	pthread_cond_init(&set->not_full, NULL);
+	
+	// Assign the heaviest subtrees first, each to the least loaded shard
+	qsort(subtrees, num_subtrees, sizeof(shard_subtree_t), compare_subtree_weight);
+	for (int i = 0; i < num_shards; i++) {
+		set->shards[i].set = set;
+		set->shards[i].index = i;
+		set->shards[i].filters = malloc(sizeof(char *) * num_subtrees);
+	}
+	for (size_t i = 0; i < num_subtrees; i++) {
+		shard_t *lightest = &set->shards[0];
+		for (int j = 1; j < num_shards; j++) {
+			if (set->shards[j].weight < lightest->weight) {
+				lightest = &set->shards[j];
+			}
+		}
+		lightest->filters[lightest->num_filters++] = subtrees[i].filter;
+		lightest->weight += subtrees[i].weight;
+	}
+	free(subtrees);
+	
+	// Connect
+	for (int i = 0; i < num_shards; i++) {
+		char *shard_client_id = malloc(strlen(client_id) + 32);
+		sprintf(shard_client_id, "%s-shard-%d", client_id, i);
+		err = qth_connect(&set->shards[i].client, url, shard_client_id,
+		                  keep_alive, NULL, mqtt5, false);
+		free(shard_client_id);
+		if (err) {
+			shard_set_free(set, false);
+			return err;
+		}
+		set->shards[i].connected = true;
+	}
+	
+	*set_out = set;
+	return NULL;
+}
+
+
+/**
+ * Subscribe each shard to its subtrees (with the given QTH_SUBSCRIBE_* flags)
+ * and start receiving. Returns an error message (to be freed by the caller) or
+ * NULL on success.
+ */
+char *shard_set_start(shard_set_t *set, int flags) {
+	for (int i = 0; i < set->num_shards; i++) {
+		shard_t *shard = &set->shards[i];
+		int qos[shard->num_filters];
+		for (size_t j = 0; j < shard->num_filters; j++) {
+			qos[j] = qth_qos(QOS_CLASS_WATCH);
+		}
+		if (qth_subscribe_many(shard->client, shard->num_filters, shard->filters,
+		                       qos, flags) != MQTTCLIENT_SUCCESS) {
+			return alloced_copy("Could not subscribe to topic.");
+		}
+	}
+	
+	for (int i = 0; i < set->num_shards; i++) {
+		pthread_create(&set->shards[i].thread, NULL, shard_thread, &set->shards[i]);
+		set->shards[i].started = true;
+	}
+	pthread_create(&set->keep_alive_thread, NULL, shard_keep_alive_thread, set);
+	set->keep_alive_started = true;
+	return NULL;
+}
+
+
+/**
+ * Receive the next message from any shard, waiting up to 'timeout' ms. Behaves
+ * like MQTTClient_receive (including 'message' being NULL on timeout).
+ */
+int shard_set_receive(shard_set_t *set, char **topic, int *topic_len,
+                      MQTTClient_message **message, unsigned long timeout) {
+	*topic = NULL;
+	*topic_len = 0;
+	*message = NULL;
+	
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	
+	pthread_mutex_lock(&set->lock);
+	while (set->count == 0 && !set->failed) {
+		if (pthread_cond_timedwait(&set->not_empty, &set->lock, &deadline) != 0) {
+			break;
+		}
+	}
+	int err = MQTTCLIENT_SUCCESS;
+	if (set->count > 0) {
+		// NB: Messages already received are delivered even if a shard failed
+		shard_message_t *entry = &set->queue[set->head];
+		*topic = entry->topic;
+		*topic_len = entry->topic_len;
+		*message = entry->message;
+		set->head = (set->head + 1) % set->capacity;
+		set->count--;
+		pthread_cond_signal(&set->not_full);
+	} else if (set->failed) {
+		err = MQTTCLIENT_FAILURE;
+	}
+	pthread_mutex_unlock(&set->lock);
+	
+	return err;
+}
+
+
+/**
+ * Stop receiving, disconnect and free a set of shards. If 'print_stats' is
+ * true, the number of messages received by each shard is printed to stderr.
+ */
+void shard_set_free(shard_set_t *set, bool print_stats) {
+	pthread_mutex_lock(&set->lock);
+	set->stopping = true;
+	pthread_cond_broadcast(&set->not_full);
+	pthread_mutex_unlock(&set->lock);
+	
+	if (set->keep_alive_started) {
+		pthread_join(set->keep_alive_thread, NULL);
+	}
+	
+	uint64_t total_messages = 0;
+	for (int i = 0; i < set->num_shards; i++) {
+		if (set->shards[i].started) {
+			pthread_join(set->shards[i].thread, NULL);
+		}
+		total_messages += set->shards[i].num_messages;
+	}
+	
+	for (int i = 0; i < set->num_shards; i++) {
+		shard_t *shard = &set->shards[i];
+		if (print_stats) {
+			fprintf(stderr,
+			        "Shard %d: %zu subtrees (weight %llu), %llu messages (%.1f%%), "
+			        "%llu bytes\n",
+			        i, shard->num_filters,
+			        (unsigned long long)shard->weight,
+			        (unsigned long long)shard->num_messages,
+			        total_messages ? (100.0 * shard->num_messages) / total_messages : 0.0,
+			        (unsigned long long)shard->num_bytes);
+		}
+		
+		if (shard->connected) {
+			qth_disconnect(&shard->client, true, 1000);
+		}
+		for (size_t j = 0; j < shard->num_filters; j++) {
+			free(shard->filters[j]);
+		}
+		free(shard->filters);
+	}
+	
+	// Discard anything not received
+	while (set->count > 0) {
+		shard_message_t *entry = &set->queue[set->head];
+		MQTTClient_free(entry->topic);
+		MQTTClient_freeMessage(&entry->message);
+		set->head = (set->head + 1) % set->capacity;
+		set->count--;
+	}
+	
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->not_empty);
+	pthread_cond_destroy(&set->not_full);
+	free(set->queue);
+	free(set->shards);
+	free(set);
+}
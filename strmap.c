@@ -0,0 +1,164 @@
+/**
+ * A simple open-addressed hash map from strings to pointers.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qth_client.h"
+
+typedef struct {
+	// Owned copy of the key (NULL if the entry is unused)
+	char *key;
+	uint64_t hash;
+	void *value;
+} strmap_entry_t;
+
+struct strmap {
+	strmap_entry_t *entries;
+	size_t capacity;  // Always a power of two
+	size_t count;
+};
+
+
+/**
+ * FNV-1a hash of a string.
+ */
+uint64_t hash_string(const char *str) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const char *c = str; *c; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+
+/**
+ * FNV-1a hash of a buffer.
+ */
+uint64_t hash_bytes(const void *data, size_t len) {
+	const unsigned char *c = data;
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= c[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+
+/**
+ * Create a new, empty map. Must be freed with strmap_free.
+ */
+strmap_t *strmap_new(void) {
+	strmap_t *map = malloc(sizeof(strmap_t));
+	map->capacity = 16;
+	map->count = 0;
+	map->entries = calloc(map->capacity, sizeof(strmap_entry_t));
+	return map;
+}
+
+
+/**
+ * Free a map and its keys. If 'free_value' is non-NULL it is called on every
+ * value in the map.
+ */
+void strmap_free(strmap_t *map, void (*free_value)(void *)) {
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->entries[i].key) {
+			free(map->entries[i].key);
+			if (free_value) {
+				free_value(map->entries[i].value);
+			}
+		}
+	}
+	free(map->entries);
+	free(map);
+}
+
+
+/**
+ * Find the entry for a key or the unused entry where it would be inserted.
+ */
+static strmap_entry_t *strmap_find(strmap_entry_t *entries, size_t capacity,
+                                   const char *key, uint64_t hash) {
+	size_t i = hash & (capacity - 1);
+	while (entries[i].key &&
+	       !(entries[i].hash == hash && strcmp(entries[i].key, key) == 0)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &entries[i];
+}
+
+
+/**
+ * Get the value associated with a key, or NULL if the key is not present.
+ */
+void *strmap_get(strmap_t *map, const char *key) {
+	strmap_entry_t *entry = strmap_find(map->entries, map->capacity,
+	                                    key, hash_string(key));
+	return entry->key ? entry->value : NULL;
+}
+
+
+/**
+ * Associate a value with a key, replacing any existing value (which is
+ * returned, or NULL if the key was not already present).
+ */
+void *strmap_set(strmap_t *map, const char *key, void *value) {
+	// Grow when more than 3/4 full
+	if ((map->count + 1) * 4 > map->capacity * 3) {
+		size_t new_capacity = map->capacity * 2;
+		strmap_entry_t *new_entries = calloc(new_capacity, sizeof(strmap_entry_t));
+		for (size_t i = 0; i < map->capacity; i++) {
+			if (map->entries[i].key) {
+				*strmap_find(new_entries, new_capacity,
+				             map->entries[i].key, map->entries[i].hash) = map->entries[i];
+			}
+		}
+		free(map->entries);
+		map->entries = new_entries;
+		map->capacity = new_capacity;
+	}
+	
+	uint64_t hash = hash_string(key);
+	strmap_entry_t *entry = strmap_find(map->entries, map->capacity, key, hash);
+	if (entry->key) {
+		void *old_value = entry->value;
+		entry->value = value;
+		return old_value;
+	}
+	
+	entry->key = alloced_copy(key);
+	entry->hash = hash;
+	entry->value = value;
+	map->count++;
+	return NULL;
+}
+
+
+/**
+ * Return the number of entries in the map.
+ */
+size_t strmap_count(strmap_t *map) {
+	return map->count;
+}
+
+
+/**
+ * Iterate over the entries in a map. 'iter' should be initialised to zero
+ * before the first call. Returns false when there are no more entries.
+ */
+bool strmap_next(strmap_t *map, size_t *iter, const char **key, void **value) {
+	while (*iter < map->capacity) {
+		strmap_entry_t *entry = &map->entries[(*iter)++];
+		if (entry->key) {
+			*key = entry->key;
+			*value = entry->value;
+			return true;
+		}
+	}
+	return false;
+}
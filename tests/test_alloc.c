@@ -0,0 +1,229 @@
+/**
+ * Counts the heap allocations made per message (once warmed up) by the
+ * per-message paths of watch and set, by interposing malloc.
+ *
+ * Only verbatim output ('watch -v' without --filter, --select or
+ * --changes-only) is meant to be allocation-free: each message is validated
+ * in place and written out through an output writer. The test fails if that
+ * path allocates.
+ *
+ * The other paths parse each value with json-c, which allocates a tree for
+ * every value (and offers no way to supply an allocator). Their counts are
+ * only reported:
+ *
+ * * Default output: parsed, formatted and written out as watch does.
+ * * Values read by set/send from stdin (with json_reader).
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qth_client.h"
+
+// The number of messages processed to warm up and then while counting
+#define TEST_NUM_MESSAGES 100000
+
+// glibc's allocator, called by the interposed versions below
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting = false;
+static size_t num_allocations = 0;
+
+void *malloc(size_t size) {
+	if (counting) {
+		num_allocations++;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	if (counting) {
+		num_allocations++;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (counting) {
+		num_allocations++;
+	}
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+
+static const char *test_payloads[] = {
+	"null",
+	"12.5",
+	"\"on\"",
+	"{\"temperature\": 21.5, \"humidity\": 40, \"ok\": true}",
+	"[1, 2, 3, {\"nested\": [\"a\", \"b\", {\"c\": null}]}, -1e-3]",
+	"{\"description\": \"A \\\"quoted\\\" \\u00e9 value\", \"tags\": []}",
+};
+#define TEST_NUM_PAYLOADS (sizeof(test_payloads) / sizeof(test_payloads[0]))
+
+
+/**
+ * Validate and write out 'n' messages verbatim, returning false on any error.
+ */
+static bool test_verbatim(output_writer_t *writer, int n) {
+	for (int i = 0; i < n; i++) {
+		const char *payload = test_payloads[i % TEST_NUM_PAYLOADS];
+		size_t len = strlen(payload);
+		
+		char *err = json_validate(payload, len);
+		if (!err) {
+			err = output_writer_write_copy(writer, payload, len, monotonic_ns());
+		}
+		if (err) {
+			fprintf(stderr, "Error: %s\n", err);
+			free(err);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Parse, format and write out 'n' messages, returning false on any error.
+ */
+static bool test_formatted(output_writer_t *writer, int n) {
+	for (int i = 0; i < n; i++) {
+		const char *payload = test_payloads[i % TEST_NUM_PAYLOADS];
+		
+		json_object *value;
+		char *err = json_parse(payload, strlen(payload), &value);
+		if (!err) {
+			size_t len;
+			const char *out = json_object_to_format_borrowed(value,
+			                                                 JSON_FORMAT_SINGLE_LINE,
+			                                                 &len);
+			err = output_writer_write_copy(writer, out, len, monotonic_ns());
+			json_object_put(value);
+		}
+		if (err) {
+			fprintf(stderr, "Error: %s\n", err);
+			free(err);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static void *test_stdin_writer_thread(void *fd_void) {
+	int fd = (int)(intptr_t)fd_void;
+	for (int i = 0; i < 2 * TEST_NUM_MESSAGES; i++) {
+		const char *payload = test_payloads[i % TEST_NUM_PAYLOADS];
+		if (write(fd, payload, strlen(payload)) < 0 || write(fd, "\n", 1) < 0) {
+			perror("write");
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+
+/**
+ * Read 'n' values with a json_reader, returning false on any error.
+ */
+static bool test_stdin(json_reader_t *reader, int n) {
+	for (int i = 0; i < n; i++) {
+		const char *value;
+		size_t len;
+		char *err = json_reader_next(reader, &value, &len);
+		if (err || !value) {
+			fprintf(stderr, "Error: %s\n", err ? err : "Stream ended early.");
+			free(err);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static void test_start_counting(void) {
+	num_allocations = 0;
+	counting = true;
+}
+
+static size_t test_stop_counting(void) {
+	counting = false;
+	return num_allocations;
+}
+
+
+int main(void) {
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+	output_writer_t *writer = output_writer_new(fd);
+	
+	// Each path is warmed up (e.g. growing the writer's arena) before counting
+	bool ok = test_verbatim(writer, TEST_NUM_MESSAGES);
+	test_start_counting();
+	ok = ok && test_verbatim(writer, TEST_NUM_MESSAGES);
+	size_t verbatim_allocations = test_stop_counting();
+	
+	ok = ok && test_formatted(writer, TEST_NUM_MESSAGES);
+	test_start_counting();
+	ok = ok && test_formatted(writer, TEST_NUM_MESSAGES);
+	size_t formatted_allocations = test_stop_counting();
+	
+	char *err = output_writer_free(writer);
+	close(fd);
+	if (err) {
+		fprintf(stderr, "Error: %s\n", err);
+		free(err);
+		return 1;
+	}
+	
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, test_stdin_writer_thread, (void *)(intptr_t)fds[1]);
+	json_reader_t *reader = json_reader_new(fds[0]);
+	ok = ok && test_stdin(reader, TEST_NUM_MESSAGES);
+	test_start_counting();
+	ok = ok && test_stdin(reader, TEST_NUM_MESSAGES);
+	size_t stdin_allocations = test_stop_counting();
+	json_reader_free(reader);
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	if (!ok) {
+		return 1;
+	}
+	
+	printf("allocations per message:\n");
+	printf("  verbatim output:   %.2f\n",
+	       (double)verbatim_allocations / TEST_NUM_MESSAGES);
+	printf("  default output:    %.2f (not checked)\n",
+	       (double)formatted_allocations / TEST_NUM_MESSAGES);
+	printf("  values from stdin: %.2f (not checked)\n",
+	       (double)stdin_allocations / TEST_NUM_MESSAGES);
+	if (verbatim_allocations != 0) {
+		fprintf(stderr, "FAIL: expected no allocations for verbatim output\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * Checks that json_reader splits a stream into the expected values, however
+ * the input is divided between reads.
+ *
+ * Each case's input is written to a pipe in chunks by a separate thread,
+ * pausing between them so that each is read on its own (and so that values,
+ * including numbers, are split across reads at the chunk boundaries).
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qth_client.h"
+
+// The pause between writing chunks (ms)
+#define TEST_CHUNK_DELAY 20
+
+// The most chunks or values in a case
+#define TEST_MAX_ITEMS 8
+
+// Read in place of a value when the reader returns an error
+#define TEST_ERROR "<error>"
+
+typedef struct {
+	const char *name;
+	
+	// The input, as written in separate chunks (NULL terminated)
+	const char *chunks[TEST_MAX_ITEMS];
+	
+	// The values expected (NULL terminated, ending with TEST_ERROR if the
+	// input is invalid)
+	const char *values[TEST_MAX_ITEMS];
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+	{"values on separate lines",
+	 {"1\n\"two\"\n[3]\n", NULL},
+	 {"1", "\"two\"", "[3]", NULL}},
+	{"back-to-back values",
+	 {"[1][2]{\"a\": 3}\"s\"true 4 5\n", NULL},
+	 {"[1]", "[2]", "{\"a\": 3}", "\"s\"", "true", "4", "5", NULL}},
+	{"numbers split between reads",
+	 {"12", "34 5", "6.", "5\n-", "1e", "3\n", NULL},
+	 {"1234", "56.5", "-1e3", NULL}},
+	{"strings and containers split between reads",
+	 {"[\"ab", "cd\", {\"e", "\": nu", "ll}", "]\n", NULL},
+	 {"[\"abcd\", {\"e\": null}]", NULL}},
+	{"number at the end of the input",
+	 {"1 ", "42", NULL},
+	 {"1", "42", NULL}},
+	{"literal at the end of the input",
+	 {"false", NULL},
+	 {"false", NULL}},
+	{"incomplete value at the end of the input",
+	 {"[1, 2", NULL},
+	 {TEST_ERROR, NULL}},
+	{"invalid value",
+	 {"1\n{oops}\n", NULL},
+	 {"1", TEST_ERROR, NULL}},
+	{"empty lines between single-line values",
+	 {"1\n\n", "\n2\n", NULL},
+	 {"1", "null", "null", "2", NULL}},
+	{"empty lines between pretty-printed values",
+	 {"{\n  \"a\": 1\n}\n\n", "{\n  \"b\": [\n    2\n  ]\n}\n\n\n3\n", NULL},
+	 {"{\n  \"a\": 1\n}", "{\n  \"b\": [\n    2\n  ]\n}", "3", NULL}},
+	{"whitespace only",
+	 {"  \t", "\r\n  ", NULL},
+	 {NULL}},
+};
+#define TEST_NUM_CASES (sizeof(test_cases) / sizeof(test_cases[0]))
+
+typedef struct {
+	const test_case_t *test_case;
+	int fd;
+} test_writer_t;
+
+
+static void *test_writer_thread(void *writer_void) {
+	test_writer_t *writer = writer_void;
+	for (const char *const *chunk = writer->test_case->chunks; *chunk; chunk++) {
+		if (write(writer->fd, *chunk, strlen(*chunk)) < 0) {
+			perror("write");
+		}
+		struct timespec ts = {0, TEST_CHUNK_DELAY * 1000000l};
+		nanosleep(&ts, NULL);
+	}
+	close(writer->fd);
+	return NULL;
+}
+
+
+/**
+ * Read the values of a test case, returning true if they were as expected.
+ */
+static bool test_run_case(const test_case_t *test_case) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return false;
+	}
+	test_writer_t writer = {test_case, fds[1]};
+	pthread_t thread;
+	pthread_create(&thread, NULL, test_writer_thread, &writer);
+	
+	json_reader_t *reader = json_reader_new(fds[0]);
+	bool ok = true;
+	size_t i = 0;
+	while (true) {
+		const char *expected = test_case->values[i];
+		const char *value;
+		size_t len;
+		char *err = json_reader_next(reader, &value, &len);
+		if (err) {
+			if (!expected || strcmp(expected, TEST_ERROR) != 0) {
+				fprintf(stderr, "FAIL: %s: value %zu: unexpected error: %s\n",
+				        test_case->name, i, err);
+				ok = false;
+			}
+			free(err);
+			break;
+		} else if (!value) {
+			if (expected) {
+				fprintf(stderr, "FAIL: %s: expected '%s' but the stream ended\n",
+				        test_case->name, expected);
+				ok = false;
+			}
+			break;
+		} else if (!expected || strlen(expected) != len ||
+		           memcmp(expected, value, len) != 0) {
+			fprintf(stderr, "FAIL: %s: value %zu: expected '%s' but read '%.*s'\n",
+			        test_case->name, i, expected ? expected : "(end)",
+			        (int)len, value);
+			ok = false;
+			break;
+		}
+		i++;
+	}
+	
+	// NB: The reader stops at the first error (or mismatch) so the rest of the
+	// input is drained for the writer to finish
+	char buf[256];
+	while (read(fds[0], buf, sizeof(buf)) > 0) {
+	}
+	pthread_join(thread, NULL);
+	json_reader_free(reader);
+	close(fds[0]);
+	return ok;
+}
+
+
+int main(void) {
+	int num_failed = 0;
+	for (size_t i = 0; i < TEST_NUM_CASES; i++) {
+		if (!test_run_case(&test_cases[i])) {
+			num_failed++;
+		}
+	}
+	
+	if (num_failed) {
+		fprintf(stderr, "FAIL: %d of %zu cases failed\n", num_failed, TEST_NUM_CASES);
+		return 1;
+	}
+	printf("PASS: %zu cases\n", TEST_NUM_CASES);
+	return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * A trie of MQTT topic filters for matching a topic against many filters at
+ * once.
+ *
+ * Each node represents one level of a filter. Besides its literal children
+ * (held in a strmap), a node may have a '+' child and a '#' child. Matching a
+ * topic descends one level at a time, following the literal child for that
+ * level and the '+' child, and collecting the '#' children passed on the way,
+ * so the cost depends on the depth of the topic (and the number of wildcard
+ * branches followed) rather than on the number of filters.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qth_client.h"
+
+typedef struct topic_trie_node {
+	// Children for literal levels (NULL until the first is added)
+	strmap_t *children;
+	
+	// Children for '+' and '#' levels (or NULL)
+	struct topic_trie_node *plus;
+	struct topic_trie_node *hash;
+	
+	// The value of the filter ending at this node (if has_value is true)
+	bool has_value;
+	void *value;
+} topic_trie_node_t;
+
+struct topic_trie {
+	topic_trie_node_t root;
+	size_t count;
+};
+
+
+/**
+ * Create an empty trie. Must be freed with topic_trie_free.
+ */
+topic_trie_t *topic_trie_new(void) {
+	return calloc(1, sizeof(topic_trie_t));
+}
+
+
+/**
+ * Free a node, its children and (if 'free_value' is non-NULL) their values.
+ */
+static void topic_trie_node_free(topic_trie_node_t *node,
+                                 void (*free_value)(void *), bool is_root) {
+	if (node->children) {
+		size_t iter = 0;
+		const char *level;
+		void *child;
+		while (strmap_next(node->children, &iter, &level, &child)) {
+			topic_trie_node_free(child, free_value, false);
+		}
+		strmap_free(node->children, NULL);
+	}
+	if (node->plus) {
+		topic_trie_node_free(node->plus, free_value, false);
+	}
+	if (node->hash) {
+		topic_trie_node_free(node->hash, free_value, false);
+	}
+	if (node->has_value && free_value) {
+		free_value(node->value);
+	}
+	if (!is_root) {
+		free(node);
+	}
+}
+
+
+/**
+ * Free a trie. If 'free_value' is non-NULL it is called on every value in
+ * the trie.
+ */
+void topic_trie_free(topic_trie_t *trie, void (*free_value)(void *)) {
+	topic_trie_node_free(&trie->root, free_value, true);
+	free(trie);
+}
+
+
+/**
+ * Find the node for a filter, creating it (and its parents) if 'create' is
+ * true. Returns NULL if the node doesn't exist and 'create' is false.
+ */
+static topic_trie_node_t *topic_trie_find(topic_trie_t *trie,
+                                          const char *filter, bool create) {
+	topic_trie_node_t *node = &trie->root;
+	while (true) {
+		size_t level_len = strcspn(filter, "/");
+		
+		topic_trie_node_t **wildcard = NULL;
+		if (level_len == 1 && filter[0] == '+') {
+			wildcard = &node->plus;
+		} else if (level_len == 1 && filter[0] == '#') {
+			wildcard = &node->hash;
+		}
+		
+		topic_trie_node_t *child;
+		if (wildcard) {
+			if (!*wildcard && create) {
+				*wildcard = calloc(1, sizeof(topic_trie_node_t));
+			}
+			child = *wildcard;
+		} else {
+			char level[level_len + 1];
+			memcpy(level, filter, level_len);
+			level[level_len] = '\0';
+			
+			child = node->children ? strmap_get(node->children, level) : NULL;
+			if (!child && create) {
+				if (!node->children) {
+					node->children = strmap_new();
+				}
+				child = calloc(1, sizeof(topic_trie_node_t));
+				strmap_set(node->children, level, child);
+			}
+		}
+		
+		if (!child) {
+			return NULL;
+		}
+		node = child;
+		
+		if (filter[level_len] == '\0') {
+			return node;
+		}
+		filter += level_len + 1;
+	}
+}
+
+
+/**
+ * Add a filter (which may contain '+' and '#' wildcards) to the trie,
+ * replacing any existing value for the same filter (which is returned, or
+ * NULL if the filter was not already present).
+ */
+void *topic_trie_add(topic_trie_t *trie, const char *filter, void *value) {
+	topic_trie_node_t *node = topic_trie_find(trie, filter, true);
+	void *old_value = node->has_value ? node->value : NULL;
+	if (!node->has_value) {
+		trie->count++;
+	}
+	node->has_value = true;
+	node->value = value;
+	return old_value;
+}
+
+
+/**
+ * Remove a filter from the trie, returning its value (or NULL if the filter
+ * was not present). The (now empty) nodes are kept for reuse.
+ */
+void *topic_trie_remove(topic_trie_t *trie, const char *filter) {
+	topic_trie_node_t *node = topic_trie_find(trie, filter, false);
+	if (!node || !node->has_value) {
+		return NULL;
+	}
+	void *value = node->value;
+	node->has_value = false;
+	node->value = NULL;
+	trie->count--;
+	return value;
+}
+
+
+/**
+ * Return the number of filters in the trie.
+ */
+size_t topic_trie_count(topic_trie_t *trie) {
+	return trie->count;
+}
+
+
+static size_t topic_trie_node_match(topic_trie_node_t *node,
+                                    char **levels, size_t num_levels,
+                                    void (*callback)(void *value, void *arg),
+                                    void *arg) {
+	size_t num_matches = 0;
+	
+	// '#' matches everything remaining, including the parent level (e.g.
+	// 'a/#' matches 'a')
+	if (node->hash && node->hash->has_value) {
+		if (callback) {
+			callback(node->hash->value, arg);
+		}
+		num_matches++;
+	}
+	
+	if (num_levels == 0) {
+		if (node->has_value) {
+			if (callback) {
+				callback(node->value, arg);
+			}
+			num_matches++;
+		}
+		return num_matches;
+	}
+	
+	topic_trie_node_t *child = node->children ? strmap_get(node->children, levels[0]) : NULL;
+	if (child) {
+		num_matches += topic_trie_node_match(child, levels + 1, num_levels - 1,
+		                                     callback, arg);
+	}
+	if (node->plus) {
+		num_matches += topic_trie_node_match(node->plus, levels + 1, num_levels - 1,
+		                                     callback, arg);
+	}
+	return num_matches;
+}
+
+
+/**
+ * Call 'callback' (if non-NULL) with the value of every filter matching
+ * 'topic' (in no particular order) and return the number of matches.
+ */
+size_t topic_trie_match(topic_trie_t *trie, const char *topic,
+                        void (*callback)(void *value, void *arg), void *arg) {
+	// Split the topic into its levels
+	size_t num_levels = 1;
+	for (const char *c = topic; *c; c++) {
+		if (*c == '/') {
+			num_levels++;
+		}
+	}
+	char buf[strlen(topic) + 1];
+	strcpy(buf, topic);
+	char *levels[num_levels];
+	levels[0] = buf;
+	size_t level = 1;
+	for (char *c = buf; *c; c++) {
+		if (*c == '/') {
+			*c = '\0';
+			levels[level++] = c + 1;
+		}
+	}
+	
+	return topic_trie_node_match(&trie->root, levels, num_levels, callback, arg);
+}
+
+
+/**
+ * A callback for topic_trie_match which stores the value matched in the
+ * 'void *' pointed to by 'arg' (the last one, if several filters match).
+ */
+void topic_trie_get_value(void *value, void *arg) {
+	*(void **)arg = value;
+}
@@ -1,4 +1,11 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "qth_client.h"
 
@@ -35,3 +42,127 @@ char *alloced_cat(const char *a, const char *b) {
 	return str_out;
 }
 
+
+
+/**
+ * Parse a duration such as '1.5', '10s', '5m', '2h', '1d', '1w' or '1y' into
+ * a number of seconds (no suffix means seconds). Returns false if the string
+ * is not a valid duration.
+ */
+bool parse_duration(const char *str, double *seconds) {
+	char *end;
+	double value = strtod(str, &end);
+	if (end == str) {
+		return false;
+	}
+	
+	double multiplier;
+	if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+		multiplier = 1;
+	} else if (strcmp(end, "ms") == 0) {
+		multiplier = 0.001;
+	} else if (strcmp(end, "m") == 0) {
+		multiplier = 60;
+	} else if (strcmp(end, "h") == 0) {
+		multiplier = 60 * 60;
+	} else if (strcmp(end, "d") == 0) {
+		multiplier = 60 * 60 * 24;
+	} else if (strcmp(end, "w") == 0) {
+		multiplier = 60 * 60 * 24 * 7;
+	} else if (strcmp(end, "y") == 0) {
+		multiplier = 60 * 60 * 24 * 365;
+	} else {
+		return false;
+	}
+	
+	*seconds = value * multiplier;
+	return true;
+}
+
+
+/**
+ * Free a NULL-terminated array of (malloced) strings and the array itself.
+ */
+void free_string_array(char **strings) {
+	if (strings) {
+		for (char **s = strings; *s; s++) {
+			free(*s);
+		}
+		free(strings);
+	}
+}
+
+
+/**
+ * Return the current time from a monotonic clock in nanoseconds.
+ */
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+
+/**
+ * Map the whole of a regular file read-only, returning the mapping and its
+ * length via 'data' and 'len' (NULL and 0 for an empty file). Returns an error
+ * message (to be freed by the caller) or NULL on success. The mapping must be
+ * released with unmap_file.
+ */
+char *map_file(const char *filename, const char **data, size_t *len) {
+	*data = NULL;
+	*len = 0;
+	
+	// NB: Non-blocking so that opening a FIFO with no writer fails below
+	// rather than hanging (this has no effect on regular files)
+	int fd = open(filename, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		return alloced_cat("Couldn't open file: ", strerror(errno));
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int fstat_errno = errno;
+		close(fd);
+		return alloced_cat("Couldn't open file: ", strerror(fstat_errno));
+	}
+	if (!S_ISREG(st.st_mode)) {
+		// NB: Pipes, devices and the like can't be mapped
+		close(fd);
+		return alloced_copy("Not a regular file.");
+	}
+	if (st.st_size == 0) {
+		// Zero-length mappings are not allowed. Some files (e.g. in /proc)
+		// report a size of zero but aren't empty.
+		char c;
+		ssize_t num_read = read(fd, &c, 1);
+		close(fd);
+		if (num_read != 0) {
+			return alloced_copy("Not a regular file (it reports a size of zero but isn't empty).");
+		}
+		return NULL;
+	}
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int mmap_errno = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		return alloced_cat("Couldn't map file: ", strerror(mmap_errno));
+	}
+	
+	// The file is read from start to end (when validated and again when sent)
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	
+	*data = map;
+	*len = st.st_size;
+	return NULL;
+}
+
+/**
+ * Release a mapping created by map_file.
+ */
+void unmap_file(const char *data, size_t len) {
+	if (data) {
+		munmap((void *)data, len);
+	}
+}